@@ -0,0 +1,497 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Measures latencies of accessing hidden pages against unhidden ones.
+///
+/// On Windows, it allocates pages of its own, hides half of them with
+/// IOCTL_HIDE_ADD_BULK, and lets threads read, execute and write both kinds
+/// of pages in a given mix for a given duration. Throughput and percentiles of
+/// latencies are printed as text, CSV or JSON. The statistics and reporting
+/// code can be self-tested on any platform, e.g.:
+///
+///   g++ -std=c++11 -O2 -o hide_bench HideBench.cpp
+///   ./hide_bench -selftest
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <winioctl.h>
+#include <intrin.h>
+#endif
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "bench_report.h"
+
+#if defined(_WIN32)
+#include "../VTxRing3/IOCTL.h"
+#endif
+
+namespace {
+
+// Parses a name of an output format
+bool ParseFormat(const char *name, BenchFormat *format) {
+  if (std::strcmp(name, "text") == 0) {
+    *format = kBenchText;
+  } else if (std::strcmp(name, "csv") == 0) {
+    *format = kBenchCsv;
+  } else if (std::strcmp(name, "json") == 0) {
+    *format = kBenchJson;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Parses weights of accesses given as "read,execute,write", e.g. "60,30,10"
+bool ParseMix(const char *text, PerfHistogramU32 *mix) {
+  unsigned int read = 0, execute = 0, write = 0;
+  char extra = 0;
+  if (std::sscanf(text, "%u,%u,%u%c", &read, &execute, &write, &extra) != 3) {
+    return false;
+  }
+  if (!read && !execute && !write) {
+    return false;
+  }
+  mix[kBenchRead] = read;
+  mix[kBenchExecute] = execute;
+  mix[kBenchWrite] = write;
+  return true;
+}
+
+// Picks a kind of an access from random in proportion to the weights
+PerfHistogramU32 PickAccess(const PerfHistogramU32 *mix,
+                            PerfHistogramU32 random) {
+  const auto total = mix[kBenchRead] + mix[kBenchExecute] + mix[kBenchWrite];
+  auto value = random % total;
+  for (PerfHistogramU32 access = 0; access < kBenchNumberOfAccesses;
+       ++access) {
+    if (value < mix[access]) {
+      return access;
+    }
+    value -= mix[access];
+  }
+  return kBenchRead;
+}
+
+// Returns a next value of a xorshift generator; state must not be 0
+PerfHistogramU32 GetNextRandom(PerfHistogramU32 *state) {
+  auto x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+// Prints the message and returns false when the condition does not hold
+bool Expect(bool condition, const char *message) {
+  if (!condition) {
+    std::fprintf(stderr, "FAILED: %s\n", message);
+  }
+  return condition;
+}
+
+// Captures what BenchPrint() writes in the format
+std::string PrintToString(const BenchReport *report, BenchFormat format) {
+  std::string text;
+  const auto file = std::tmpfile();
+  if (!file) {
+    return text;
+  }
+  BenchPrint(file, report, format);
+  std::rewind(file);
+  char buffer[512];
+  size_t read_bytes = 0;
+  while ((read_bytes = std::fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    text.append(buffer, read_bytes);
+  }
+  std::fclose(file);
+  return text;
+}
+
+// Tests statistics and reporting without the driver
+int SelfTest() {
+  auto report = new BenchReport();
+  report->threads = 2;
+  report->pages = 4;
+  report->mix[kBenchRead] = 1;
+  report->seconds = 2.0;
+  report->nanoseconds_per_tick = 1.0;
+
+  // 1..1000 split into two threads and merged
+  BenchCase halves[2] = {};
+  for (PerfHistogramU64 i = 1; i <= 1000; ++i) {
+    BenchRecord(&halves[i % 2], i);
+  }
+  auto &bench_case = report->cases[kBenchRead][kBenchHidden];
+  BenchMerge(&bench_case, &halves[0]);
+  BenchMerge(&bench_case, &halves[1]);
+  BenchMerge(&bench_case, &report->cases[kBenchWrite][kBenchHidden]);
+
+  auto ok = true;
+  ok &= Expect(bench_case.count == 1000, "count");
+  ok &= Expect(bench_case.minimum_ticks == 1, "minimum");
+  ok &= Expect(bench_case.maximum_ticks == 1000, "maximum");
+
+  // Percentiles are bounds of buckets, within 1/8 above the exact values
+  const auto s = BenchSummarize(report, kBenchRead, kBenchHidden);
+  ok &= Expect(s.operations_per_second == 500.0, "throughput");
+  ok &= Expect(s.average == 500.5, "average");
+  ok &= Expect(s.p50 >= 500 && s.p50 <= 500 * 9 / 8, "p50");
+  ok &= Expect(s.p90 >= 900 && s.p90 <= 900 * 9 / 8, "p90");
+  ok &= Expect(s.p99 >= 990 && s.p99 <= 1000, "p99");
+  ok &= Expect(s.p999 == 1000, "p99.9 clamped with maximum");
+
+  // A single large value is reported as is rather than as a bucket bound
+  BenchRecord(&report->cases[kBenchExecute][kBenchUnhidden], 1234567);
+  const auto single = BenchSummarize(report, kBenchExecute, kBenchUnhidden);
+  ok &= Expect(single.p50 == 1234567 && single.maximum == 1234567, "single");
+
+  const auto empty = BenchSummarize(report, kBenchWrite, kBenchHidden);
+  ok &= Expect(empty.count == 0 && empty.p50 == 0, "empty");
+
+  // Empty cases are omitted from all formats
+  const auto csv = PrintToString(report, kBenchCsv);
+  ok &= Expect(csv.find("access,pages,threads") == 0, "CSV header");
+  ok &= Expect(csv.find("\nread,hidden,2,4,2.000,1000,500.0,500.5,1.0,") !=
+                   std::string::npos,
+               "CSV row");
+  ok &= Expect(csv.find("\nexecute,unhidden,") != std::string::npos,
+               "CSV second row");
+  ok &= Expect(csv.find("write") == std::string::npos, "CSV empty row");
+
+  const auto json = PrintToString(report, kBenchJson);
+  ok &= Expect(json.find("{\"threads\":2,\"pages\":4,") == 0, "JSON header");
+  ok &= Expect(json.find("{\"access\":\"read\",\"pages\":\"hidden\","
+                         "\"count\":1000,") != std::string::npos,
+               "JSON case");
+  ok &= Expect(json.find("},{\"access\":\"execute\"") != std::string::npos,
+               "JSON separator");
+  ok &= Expect(json.find("]}\n") == json.size() - 3, "JSON end");
+
+  const auto text = PrintToString(report, kBenchText);
+  ok &= Expect(text.find("2 thread(s), 4 page(s) each") == 0, "text header");
+
+  auto format = kBenchText;
+  ok &= Expect(ParseFormat("json", &format) && format == kBenchJson &&
+                   !ParseFormat("xml", &format),
+               "format");
+
+  // The mix is followed in proportion
+  PerfHistogramU32 mix[kBenchNumberOfAccesses] = {};
+  ok &= Expect(ParseMix("60,30,10", mix), "mix");
+  ok &= Expect(!ParseMix("0,0,0", mix) && !ParseMix("1,2", mix), "bad mix");
+  PerfHistogramU32 picked[kBenchNumberOfAccesses] = {};
+  PerfHistogramU32 state = 1;
+  for (auto i = 0; i < 100000; ++i) {
+    picked[PickAccess(mix, GetNextRandom(&state))]++;
+  }
+  ok &= Expect(picked[kBenchRead] > 59000 && picked[kBenchRead] < 61000 &&
+                   picked[kBenchWrite] > 9500 && picked[kBenchWrite] < 10500,
+               "picked mix");
+
+  delete report;
+  std::printf("%s\n", ok ? "PASSED" : "FAILED");
+  return ok ? 0 : 1;
+}
+
+#if defined(_WIN32)
+
+// Offsets in a page used for each kind of access. Code is placed at the top
+// of the page, and read and write areas are kept apart from it.
+const SIZE_T kPageSize = 0x1000;
+const SIZE_T kReadOffset = 64;
+const SIZE_T kWriteOffset = 2048;
+
+// Parameters of a run
+struct BenchOptions {
+  PerfHistogramU32 threads;
+  PerfHistogramU32 pages;
+  PerfHistogramU32 seconds;
+  PerfHistogramU32 mix[kBenchNumberOfAccesses];
+  BenchFormat format;
+  bool hide;
+};
+
+// State of a single thread. Each thread records into its own cases so that
+// recording does not contend.
+struct BenchThread {
+  const BenchOptions *options;
+  PUCHAR pages[kBenchNumberOfPages];
+  const std::atomic<bool> *stopping;
+  PerfHistogramU32 seed;
+  BenchCase cases[kBenchNumberOfAccesses][kBenchNumberOfPages];
+};
+
+typedef int(__cdecl *PageFunction)();
+
+// Returns the current TSC after all preceding instructions completed
+PerfHistogramU64 ReadTscBegin() {
+  _mm_lfence();
+  const auto tsc = __rdtsc();
+  _mm_lfence();
+  return tsc;
+}
+
+// Returns the current TSC after the measured instructions completed
+PerfHistogramU64 ReadTscEnd() {
+  unsigned int aux = 0;
+  const auto tsc = __rdtscp(&aux);
+  _mm_lfence();
+  return tsc;
+}
+
+// Returns nanoseconds per TSC tick measured against QueryPerformanceCounter
+double CalibrateTsc() {
+  LARGE_INTEGER frequency = {}, begin = {}, end = {};
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&begin);
+  const auto tsc_begin = ReadTscBegin();
+  Sleep(200);
+  const auto tsc_end = ReadTscEnd();
+  QueryPerformanceCounter(&end);
+  const auto nanoseconds = static_cast<double>(end.QuadPart - begin.QuadPart) *
+                           1e9 / frequency.QuadPart;
+  return nanoseconds / static_cast<double>(tsc_end - tsc_begin);
+}
+
+// Accesses the page once and returns elapsed ticks
+PerfHistogramU64 Access(PUCHAR page, PerfHistogramU32 access) {
+  const auto begin = ReadTscBegin();
+  switch (access) {
+    case kBenchRead:
+      *reinterpret_cast<volatile ULONG *>(page + kReadOffset);
+      break;
+    case kBenchExecute:
+      reinterpret_cast<PageFunction>(page)();
+      break;
+    default:
+      *reinterpret_cast<volatile ULONG *>(page + kWriteOffset) += 1;
+      break;
+  }
+  return ReadTscEnd() - begin;
+}
+
+// Accesses both kinds of pages in the mix until stopped. The order of the two
+// kinds alternates so that neither always runs with a warmer cache.
+DWORD WINAPI BenchThreadRoutine(void *context) {
+  const auto thread = static_cast<BenchThread *>(context);
+  const auto options = thread->options;
+  auto state = thread->seed;
+  for (PerfHistogramU32 i = 0;
+       !thread->stopping->load(std::memory_order_relaxed); ++i) {
+    const auto random = GetNextRandom(&state);
+    const auto access = PickAccess(options->mix, random);
+    const auto index = (random >> 8) % options->pages;
+    for (PerfHistogramU32 j = 0; j < kBenchNumberOfPages; ++j) {
+      const auto pages = (i + j) % kBenchNumberOfPages;
+      const auto page = thread->pages[pages] + index * kPageSize;
+      BenchRecord(&thread->cases[access][pages], Access(page, access));
+    }
+  }
+  return 0;
+}
+
+// Hides pages with a single IOCTL_HIDE_ADD_BULK and starts hiding
+bool HidePages(PUCHAR pages, PerfHistogramU32 count) {
+  const auto device =
+      CreateFileA("\\\\.\\NoTruth", GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (device == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "Cannot open the device (%lu)\n", GetLastError());
+    return false;
+  }
+
+  // Pages allocated by VirtualAlloc() are private already
+  HIDE_BULK_ENTRY entry = {GetCurrentProcessId(),
+                           reinterpret_cast<ULONG_PTR>(pages),
+                           count * kPageSize, HIDE_FLAG_SKIP_PRIVATE};
+  NTSTATUS status = -1;
+  DWORD returned = 0;
+  auto succeeded =
+      DeviceIoControl(device, IOCTL_HIDE_ADD_BULK, &entry, sizeof(entry),
+                      &status, sizeof(status), &returned, nullptr) &&
+      returned == sizeof(status) && status >= 0;
+  if (!succeeded) {
+    std::fprintf(stderr, "IOCTL_HIDE_ADD_BULK failed (%lu, %08lx)\n",
+                 GetLastError(), static_cast<unsigned long>(status));
+  } else {
+    succeeded = DeviceIoControl(device, IOCTL_HIDE_START, nullptr, 0, nullptr,
+                                0, &returned, nullptr) != FALSE;
+    if (!succeeded) {
+      std::fprintf(stderr, "IOCTL_HIDE_START failed (%lu)\n", GetLastError());
+    }
+  }
+  CloseHandle(device);
+  return succeeded;
+}
+
+// Fills each page with a function returning its index, and data to access
+void InitializePages(PUCHAR pages, PerfHistogramU32 count) {
+  for (PerfHistogramU32 i = 0; i < count; ++i) {
+    const auto page = pages + i * kPageSize;
+    page[0] = 0xb8;  // mov eax, i
+    std::memcpy(page + 1, &i, sizeof(i));
+    page[5] = 0xc3;  // ret
+    std::memcpy(page + kReadOffset, &i, sizeof(i));
+  }
+}
+
+// Runs threads for the duration and prints the result
+int Run(const BenchOptions &options) {
+  // The first half of pages is hidden, and the other half is a baseline
+  const auto pages = static_cast<PUCHAR>(
+      VirtualAlloc(nullptr, options.pages * kPageSize * kBenchNumberOfPages,
+                   MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE));
+  if (!pages) {
+    std::fprintf(stderr, "VirtualAlloc failed (%lu)\n", GetLastError());
+    return 1;
+  }
+  InitializePages(pages, options.pages * kBenchNumberOfPages);
+  const auto hidden_pages = pages;
+  const auto unhidden_pages = pages + options.pages * kPageSize;
+  if (options.hide && !HidePages(hidden_pages, options.pages)) {
+    VirtualFree(pages, 0, MEM_RELEASE);
+    return 1;
+  }
+
+  auto report = new BenchReport();
+  report->threads = options.threads;
+  report->pages = options.pages;
+  std::memcpy(report->mix, options.mix, sizeof(report->mix));
+  report->nanoseconds_per_tick = CalibrateTsc();
+
+  std::atomic<bool> stopping(false);
+  std::vector<BenchThread *> threads;
+  std::vector<HANDLE> handles;
+  for (PerfHistogramU32 i = 0; i < options.threads; ++i) {
+    auto thread = new BenchThread();
+    thread->options = &options;
+    thread->pages[kBenchHidden] = hidden_pages;
+    thread->pages[kBenchUnhidden] = unhidden_pages;
+    thread->stopping = &stopping;
+    thread->seed = 0x9e3779b9u * (i + 1);
+    const auto handle = CreateThread(nullptr, 0, BenchThreadRoutine, thread,
+                                     CREATE_SUSPENDED, nullptr);
+    if (!handle) {
+      std::fprintf(stderr, "CreateThread failed (%lu)\n", GetLastError());
+      delete thread;
+      break;
+    }
+    threads.push_back(thread);
+    handles.push_back(handle);
+  }
+
+  LARGE_INTEGER frequency = {}, begin = {}, end = {};
+  QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&begin);
+  for (const auto handle : handles) {
+    ResumeThread(handle);
+  }
+  Sleep(options.seconds * 1000);
+  stopping.store(true);
+  for (const auto handle : handles) {
+    WaitForSingleObject(handle, INFINITE);
+    CloseHandle(handle);
+  }
+  QueryPerformanceCounter(&end);
+  report->seconds =
+      static_cast<double>(end.QuadPart - begin.QuadPart) / frequency.QuadPart;
+
+  for (const auto thread : threads) {
+    for (PerfHistogramU32 access = 0; access < kBenchNumberOfAccesses;
+         ++access) {
+      for (PerfHistogramU32 kind = 0; kind < kBenchNumberOfPages; ++kind) {
+        BenchMerge(&report->cases[access][kind], &thread->cases[access][kind]);
+      }
+    }
+    delete thread;
+  }
+
+  const auto succeeded = (threads.size() == options.threads);
+  if (succeeded) {
+    BenchPrint(stdout, report, options.format);
+  }
+  delete report;
+
+  // Hidden pages are released with the process; the driver keeps them hidden
+  // until then
+  if (!options.hide) {
+    VirtualFree(pages, 0, MEM_RELEASE);
+  }
+  return succeeded ? 0 : 1;
+}
+
+// Parses command line options
+bool ParseOptions(int argc, char *argv[], BenchOptions *options) {
+  options->threads = 4;
+  options->pages = 16;
+  options->seconds = 5;
+  options->mix[kBenchRead] = 1;
+  options->mix[kBenchExecute] = 1;
+  options->mix[kBenchWrite] = 1;
+  options->format = kBenchText;
+  options->hide = true;
+  for (auto i = 1; i < argc; ++i) {
+    const auto has_value = (i + 1 < argc);
+    if (std::strcmp(argv[i], "-n") == 0) {
+      options->hide = false;
+    } else if (has_value && std::strcmp(argv[i], "-t") == 0) {
+      options->threads = std::strtoul(argv[++i], nullptr, 10);
+    } else if (has_value && std::strcmp(argv[i], "-p") == 0) {
+      options->pages = std::strtoul(argv[++i], nullptr, 10);
+    } else if (has_value && std::strcmp(argv[i], "-d") == 0) {
+      options->seconds = std::strtoul(argv[++i], nullptr, 10);
+    } else if (has_value && std::strcmp(argv[i], "-m") == 0) {
+      if (!ParseMix(argv[++i], options->mix)) {
+        return false;
+      }
+    } else if (has_value && std::strcmp(argv[i], "-f") == 0) {
+      if (!ParseFormat(argv[++i], &options->format)) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return options->threads && options->pages && options->seconds;
+}
+
+#endif
+
+// Prints how to use this program
+void PrintUsage(const char *program) {
+#if defined(_WIN32)
+  std::fprintf(stderr,
+               "Usage: %s [-t threads] [-p pages] [-d seconds]\n"
+               "          [-m read,execute,write] [-f text|csv|json] [-n]\n"
+               "       %s -selftest\n"
+               "  -n  does not hide pages, to compare with a run hiding them\n",
+               program, program);
+#else
+  std::fprintf(stderr, "Usage: %s -selftest\n", program);
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc == 2 && std::strcmp(argv[1], "-selftest") == 0) {
+    return SelfTest();
+  }
+
+#if defined(_WIN32)
+  BenchOptions options = {};
+  if (ParseOptions(argc, argv, &options)) {
+    return Run(options);
+  }
+#endif
+
+  PrintUsage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,281 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines statistics and reporting of the hidden page access benchmark.
+///
+/// Each thread records latencies of its accesses into BenchCase, one per kind
+/// of access on hidden and unhidden pages, and they are merged into BenchReport
+/// at the end of a run. Latencies are recorded in ticks of whatever clock the
+/// caller uses and converted with BenchReport::nanoseconds_per_tick when
+/// reported.
+///
+/// This file does not depend on any Windows header so that it can be built
+/// and self-tested on other platforms.
+
+#ifndef HIDEBENCH_BENCH_REPORT_H_
+#define HIDEBENCH_BENCH_REPORT_H_
+
+#include <stdio.h>
+#include "../HyperPlatform/HyperPlatform/perf_histogram.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// Kinds of an access measured
+enum BenchAccess : PerfHistogramU32 {
+  kBenchRead,
+  kBenchExecute,
+  kBenchWrite,
+  kBenchNumberOfAccesses,
+};
+
+/// Whether accessed pages are hidden
+enum BenchPages : PerfHistogramU32 {
+  kBenchUnhidden,
+  kBenchHidden,
+  kBenchNumberOfPages,
+};
+
+/// Output formats of a report
+enum BenchFormat {
+  kBenchText,
+  kBenchCsv,
+  kBenchJson,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Represents latencies of a single kind of access
+struct BenchCase {
+  PerfHistogramU64 count;
+  PerfHistogramU64 total_ticks;
+  PerfHistogramU64 minimum_ticks;  //!< 0 when count is 0
+  PerfHistogramU64 maximum_ticks;
+  PerfHistogram histogram;
+};
+
+/// Represents a result of a run
+struct BenchReport {
+  PerfHistogramU32 threads;
+  PerfHistogramU32 pages;  //!< A number of pages of each kind
+  PerfHistogramU32 mix[kBenchNumberOfAccesses];  //!< Weights of accesses
+  double seconds;
+  double nanoseconds_per_tick;
+  BenchCase cases[kBenchNumberOfAccesses][kBenchNumberOfPages];
+};
+
+/// Represents numbers reported for BenchCase, in nanoseconds
+struct BenchSummary {
+  PerfHistogramU64 count;
+  double operations_per_second;
+  double average;
+  double minimum;
+  double p50;
+  double p90;
+  double p99;
+  double p999;
+  double maximum;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns a name of the kind of access
+inline const char *BenchGetAccessName(PerfHistogramU32 access) {
+  static const char *const kNames[] = {"read", "execute", "write"};
+  return (access < kBenchNumberOfAccesses) ? kNames[access] : "unknown";
+}
+
+/// Returns a name of the kind of pages
+inline const char *BenchGetPagesName(PerfHistogramU32 pages) {
+  return (pages == kBenchHidden) ? "hidden" : "unhidden";
+}
+
+/// Records latency of a single access
+/// @param bench_case  A case to update
+/// @param ticks  Latency of the access
+///
+/// Not atomic; each thread should record into its own BenchCase.
+inline void BenchRecord(BenchCase *bench_case, PerfHistogramU64 ticks) {
+  if (!bench_case->count || ticks < bench_case->minimum_ticks) {
+    bench_case->minimum_ticks = ticks;
+  }
+  if (ticks > bench_case->maximum_ticks) {
+    bench_case->maximum_ticks = ticks;
+  }
+  bench_case->count++;
+  bench_case->total_ticks += ticks;
+  PerfHistogramRecord(&bench_case->histogram, ticks);
+}
+
+/// Adds one case to another
+/// @param bench_case  A case to update
+/// @param other  A case to add
+inline void BenchMerge(BenchCase *bench_case, const BenchCase *other) {
+  if (!other->count) {
+    return;
+  }
+  if (!bench_case->count || other->minimum_ticks < bench_case->minimum_ticks) {
+    bench_case->minimum_ticks = other->minimum_ticks;
+  }
+  if (other->maximum_ticks > bench_case->maximum_ticks) {
+    bench_case->maximum_ticks = other->maximum_ticks;
+  }
+  bench_case->count += other->count;
+  bench_case->total_ticks += other->total_ticks;
+  PerfHistogramMerge(&bench_case->histogram, &other->histogram);
+}
+
+/// Returns numbers reported for the case
+/// @param report  A report containing the case
+/// @param access  A kind of access
+/// @param pages  A kind of pages
+/// @return Throughput and latencies in nanoseconds
+inline BenchSummary BenchSummarize(const BenchReport *report,
+                                   PerfHistogramU32 access,
+                                   PerfHistogramU32 pages) {
+  const auto &bench_case = report->cases[access][pages];
+  const auto scale = report->nanoseconds_per_tick;
+
+  // A bound of a bucket may exceed any values actually observed
+  const auto get_percentile = [&](PerfHistogramU32 per_mille) {
+    const auto value =
+        PerfHistogramGetPercentile(&bench_case.histogram, per_mille);
+    return ((value < bench_case.maximum_ticks) ? value
+                                               : bench_case.maximum_ticks) *
+           scale;
+  };
+
+  BenchSummary summary = {};
+  summary.count = bench_case.count;
+  if (!bench_case.count) {
+    return summary;
+  }
+  summary.operations_per_second =
+      (report->seconds > 0) ? bench_case.count / report->seconds : 0.0;
+  summary.average =
+      static_cast<double>(bench_case.total_ticks) / bench_case.count * scale;
+  summary.minimum = bench_case.minimum_ticks * scale;
+  summary.p50 = get_percentile(500);
+  summary.p90 = get_percentile(900);
+  summary.p99 = get_percentile(990);
+  summary.p999 = get_percentile(999);
+  summary.maximum = bench_case.maximum_ticks * scale;
+  return summary;
+}
+
+/// Prints the report as a table
+inline void BenchPrintText(FILE *file, const BenchReport *report) {
+  fprintf(file,
+          "%u thread(s), %u page(s) each, mix r/x/w %u/%u/%u, %.3f s\n",
+          report->threads, report->pages, report->mix[kBenchRead],
+          report->mix[kBenchExecute], report->mix[kBenchWrite],
+          report->seconds);
+  fprintf(file, "%-8s %-9s %12s %12s %10s %10s %10s %10s %10s %10s\n",
+          "access", "pages", "count", "ops/s", "avg(ns)", "p50", "p90",
+          "p99", "p99.9", "max");
+  for (PerfHistogramU32 access = 0; access < kBenchNumberOfAccesses;
+       ++access) {
+    for (PerfHistogramU32 pages = 0; pages < kBenchNumberOfPages; ++pages) {
+      const auto s = BenchSummarize(report, access, pages);
+      if (!s.count) {
+        continue;
+      }
+      fprintf(file,
+              "%-8s %-9s %12llu %12.0f %10.1f %10.1f %10.1f %10.1f %10.1f "
+              "%10.1f\n",
+              BenchGetAccessName(access), BenchGetPagesName(pages),
+              static_cast<unsigned long long>(s.count),
+              s.operations_per_second, s.average, s.p50, s.p90, s.p99,
+              s.p999, s.maximum);
+    }
+  }
+}
+
+/// Prints the report as CSV with a header line. Cases without any access are
+/// omitted.
+inline void BenchPrintCsv(FILE *file, const BenchReport *report) {
+  fprintf(file,
+          "access,pages,threads,page_count,seconds,count,ops_per_second,"
+          "avg_ns,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+  for (PerfHistogramU32 access = 0; access < kBenchNumberOfAccesses;
+       ++access) {
+    for (PerfHistogramU32 pages = 0; pages < kBenchNumberOfPages; ++pages) {
+      const auto s = BenchSummarize(report, access, pages);
+      if (!s.count) {
+        continue;
+      }
+      fprintf(file, "%s,%s,%u,%u,%.3f,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,"
+                    "%.1f\n",
+              BenchGetAccessName(access), BenchGetPagesName(pages),
+              report->threads, report->pages, report->seconds,
+              static_cast<unsigned long long>(s.count),
+              s.operations_per_second, s.average, s.minimum, s.p50, s.p90,
+              s.p99, s.p999, s.maximum);
+    }
+  }
+}
+
+/// Prints the report as a JSON object. Cases without any access are omitted.
+inline void BenchPrintJson(FILE *file, const BenchReport *report) {
+  fprintf(file,
+          "{\"threads\":%u,\"pages\":%u,\"mix\":{\"read\":%u,\"execute\":%u,"
+          "\"write\":%u},\"seconds\":%.3f,\"cases\":[",
+          report->threads, report->pages, report->mix[kBenchRead],
+          report->mix[kBenchExecute], report->mix[kBenchWrite],
+          report->seconds);
+  auto first = true;
+  for (PerfHistogramU32 access = 0; access < kBenchNumberOfAccesses;
+       ++access) {
+    for (PerfHistogramU32 pages = 0; pages < kBenchNumberOfPages; ++pages) {
+      const auto s = BenchSummarize(report, access, pages);
+      if (!s.count) {
+        continue;
+      }
+      fprintf(file,
+              "%s{\"access\":\"%s\",\"pages\":\"%s\",\"count\":%llu,"
+              "\"ops_per_second\":%.1f,\"avg_ns\":%.1f,\"min_ns\":%.1f,"
+              "\"p50_ns\":%.1f,\"p90_ns\":%.1f,\"p99_ns\":%.1f,"
+              "\"p999_ns\":%.1f,\"max_ns\":%.1f}",
+              first ? "" : ",", BenchGetAccessName(access),
+              BenchGetPagesName(pages),
+              static_cast<unsigned long long>(s.count),
+              s.operations_per_second, s.average, s.minimum, s.p50, s.p90,
+              s.p99, s.p999, s.maximum);
+      first = false;
+    }
+  }
+  fprintf(file, "]}\n");
+}
+
+/// Prints the report in the format
+inline void BenchPrint(FILE *file, const BenchReport *report,
+                       BenchFormat format) {
+  switch (format) {
+    case kBenchCsv:
+      BenchPrintCsv(file, report);
+      break;
+    case kBenchJson:
+      BenchPrintJson(file, report);
+      break;
+    default:
+      BenchPrintText(file, report);
+      break;
+  }
+}
+
+#endif  // HIDEBENCH_BENCH_REPORT_H_
@@ -86,6 +86,15 @@
 /// negative performance impact.
 #define HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER 1
 
+/// Enable or disable sampling of hardware performance counters
+///
+/// When set to non 0, #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE() also
+/// counts retired instructions, unhalted core cycles, DTLB misses and LLC
+/// misses of the scope if it runs with interrupts disabled, as in the VMM.
+/// This takes over IA32_FIXED_CTR0-1 and IA32_PMC0-1 while the driver is
+/// loaded, and is not enabled when any of them is already in use.
+#define HYPERPLATFORM_PERFORMANCE_ENABLE_PMU 0
+
 /// A pool tag
 static const ULONG kHyperPlatformCommonPoolTag = 'PpyH';
 
@@ -10,7 +10,10 @@
 #endif
 #include "driver.h"
 #include "common.h"
+#include "exit_trace.h"
+#include "kernel_pool.h"
 #include "log.h"
+#include "stats.h"
 #include "util.h"
 #include "vm.h"
 #ifndef HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
@@ -18,6 +21,7 @@
 #endif  // HYPERPLATFORM_PERFORMANCE_ENABLE_PERFCOUNTER
 #include "performance.h"
 #include "../../NoTruth/NoTruth.h"
+#include "../../NoTruth/HidePolicy.h"
 struct Page1 {
 	UCHAR* page;
 	Page1();
@@ -92,14 +96,9 @@ extern "C" {
 		IN PVOID OutputBuffer,
 		IN ULONG OutputBufferLength,
 		IN ULONG IoControlCode,
+		IN PFILE_OBJECT FileObject,
 		IN PIO_STATUS_BLOCK pIoStatus)
 	{
-		UNREFERENCED_PARAMETER(InputBufferLength);
-		UNREFERENCED_PARAMETER(OutputBufferLength);
-		UNREFERENCED_PARAMETER(OutputBuffer);
-		UNREFERENCED_PARAMETER(pIoStatus);
-
-
 		PEPROCESS		  hiddenProc = NULL;
 		PTRANSFERIOCTL	  data = NULL;
 		NTSTATUS		  status = STATUS_UNSUCCESSFUL;
@@ -111,10 +110,60 @@ extern "C" {
 				if (data)
 				{
 					HYPERPLATFORM_LOG_DEBUG("Proc ID: %I64X Address : %I64X", data->ProcID, data->Address);
-					PsLookupProcessByProcessId((HANDLE)data->ProcID, &hiddenProc);
-					AddMemoryHide(hiddenProc, data->Address);
-					status = STATUS_SUCCESS;
+					status = PsLookupProcessByProcessId((HANDLE)data->ProcID, &hiddenProc);
+					if (!NT_SUCCESS(status))
+					{
+						break;
+					}
+					// HiddenType carries HIDE_FLAG_*
+					status = AddMemoryHide(hiddenProc, data->Address,
+						static_cast<ULONG>(data->HiddenType));
+					ObDereferenceObject(hiddenProc);
+				}
+				break;
+
+			case IOCTL_HIDE_ADD_BULK:
+			{
+				// Entries are copied since statuses overwrite the same system buffer
+				const auto count = InputBufferLength / sizeof(HIDE_BULK_ENTRY);
+				if (!InputBuffer || !count || count > MAXULONG / sizeof(NTSTATUS))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+				if (!OutputBuffer || OutputBufferLength < count * sizeof(NTSTATUS))
+				{
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+				const auto entries_size = count * sizeof(HIDE_BULK_ENTRY);
+				const auto entries = reinterpret_cast<HIDE_BULK_ENTRY*>(
+					ExAllocatePoolWithTag(PagedPool, entries_size, kHyperPlatformCommonPoolTag));
+				if (!entries)
+				{
+					status = STATUS_INSUFFICIENT_RESOURCES;
+					break;
+				}
+				RtlCopyMemory(entries, InputBuffer, entries_size);
+				status = AddMemoryHideBulk(entries, static_cast<ULONG>(count),
+					reinterpret_cast<NTSTATUS*>(OutputBuffer));
+				ExFreePoolWithTag(entries, kHyperPlatformCommonPoolTag);
+				if (NT_SUCCESS(status))
+				{
+					pIoStatus->Information = count * sizeof(NTSTATUS);
 				}
+			}
+			break;
+
+			case IOCTL_HIDE_POLICY_LOAD:
+				if (InputBufferLength % sizeof(HIDE_POLICY_ENTRY) ||
+					(InputBufferLength && !InputBuffer))
+				{
+					status = STATUS_INVALID_PARAMETER;
+					break;
+				}
+				status = HidePolicyLoad(reinterpret_cast<HIDE_POLICY_ENTRY*>(InputBuffer),
+					InputBufferLength / sizeof(HIDE_POLICY_ENTRY));
 				break;
 
 			case IOCTL_HIDE_START:
@@ -129,6 +178,44 @@ extern "C" {
 			}
 			break;
 
+			case IOCTL_TRACE_MAP:
+			{
+				void* user_address = nullptr;
+				if (!OutputBuffer || OutputBufferLength < sizeof(ULONG64))
+				{
+					status = STATUS_BUFFER_TOO_SMALL;
+					break;
+				}
+				status = ExitTraceMapToCurrentProcess(FileObject, &user_address);
+				if (NT_SUCCESS(status))
+				{
+					*reinterpret_cast<ULONG64*>(OutputBuffer) = reinterpret_cast<ULONG_PTR>(user_address);
+					pIoStatus->Information = sizeof(ULONG64);
+				}
+			}
+			break;
+
+			case IOCTL_TRACE_UNMAP:
+			{
+				status = ExitTraceUnmap(FileObject);
+			}
+			break;
+
+			case IOCTL_STATS_SNAPSHOT:
+			{
+				ULONG snapshot_size = 0;
+				status = StatsTakeSnapshot(OutputBuffer, OutputBufferLength, &snapshot_size);
+				if (NT_SUCCESS(status))
+				{
+					pIoStatus->Information = snapshot_size;
+				}
+			}
+			break;
+
+			case IOCTL_PING:
+				status = STATUS_SUCCESS;
+				break;
+
 			default:
 				break;
 		}
@@ -179,6 +266,11 @@ extern "C" {
 				DbgPrint("[$ARK] IRP_MJ_SHUTDOWN.\n");
 				break;
 
+			case IRP_MJ_CLEANUP:
+				// Mappings into a process must be gone before the process exits
+				ExitTraceUnmap(pIrpStack->FileObject);
+				break;
+
 			case IRP_MJ_DEVICE_CONTROL:
 				if (IOCTL_TRANSFER_TYPE(ioControlCode) == METHOD_NEITHER)
 				{
@@ -189,11 +281,12 @@ extern "C" {
 				//
 				DbgPrint("[$XTR] IRP_MJ_DEVICE_CONTROL->IrpMjXTRdevCtrlRoutine(DeviceObject=0x%08x, Irp=0x%08x)->ARKioControl().\n", DeviceObject, Irp);
 
-				DispatchNoTruthCore(inputBuffer,
+				ioStatus->Status = DispatchNoTruthCore(inputBuffer,
 					inputBufferLength,
 					outputBuffer,
 					outputBufferLength,
 					ioControlCode,
+					pIrpStack->FileObject,
 					ioStatus);
 				break;
 		}
@@ -236,6 +329,12 @@ extern "C" {
 		// Request NX Non-Paged Pool when available
 		ExInitializeDriverRuntime(DrvRtPoolNxOptIn);
 
+		// Initialize pools before anything allocates nodes from them
+		status = KernelPoolInitialization();
+		if (!NT_SUCCESS(status)) {
+			return status;
+		}
+
 		// Initialize log functions
 		bool need_reinitialization = false;
 		status = LogInitialization(kLogLevel, kLogFilePath);
@@ -243,11 +342,13 @@ extern "C" {
 			need_reinitialization = true;
 		}
 		else if (!NT_SUCCESS(status)) {
+			KernelPoolTermination();
 			return status;
 		}
 
 		// Test if the system is supported
 		if (!DriverpIsSuppoetedOS()) {
+			KernelPoolTermination();
 			LogTermination();
 			return STATUS_CANCELLED;
 		}
@@ -255,6 +356,7 @@ extern "C" {
 		// Initialize perf functions
 		status = PerfInitialization();
 		if (!NT_SUCCESS(status)) {
+			KernelPoolTermination();
 			LogTermination();
 			return status;
 		}
@@ -263,6 +365,17 @@ extern "C" {
 		status = UtilInitialization(driver_object);
 		if (!NT_SUCCESS(status)) {
 			PerfTermination();
+			KernelPoolTermination();
+			LogTermination();
+			return status;
+		}
+
+		// Initialize VM-exit trace functions
+		status = ExitTraceInitialization();
+		if (!NT_SUCCESS(status)) {
+			UtilTermination();
+			PerfTermination();
+			KernelPoolTermination();
 			LogTermination();
 			return status;
 		}
@@ -270,8 +383,10 @@ extern "C" {
 		// Virtualize all processors
 		status = VmInitialization();
 		if (!NT_SUCCESS(status)) {
+			ExitTraceTermination();
 			UtilTermination();
 			PerfTermination();
+			KernelPoolTermination();
 			LogTermination();
 			return status;
 		}
@@ -289,7 +404,7 @@ extern "C" {
 			&ntDeviceName,					// DeviceName
 			FILE_DEVICE_UNKNOWN,			// DeviceType
 			0,								// DeviceCharacteristics
-			TRUE,							// Exclusive
+			FALSE,							// Exclusive; sessions of cDrvCtrl stay open
 			&deviceObject					// [OUT]
 		);
 
@@ -315,6 +430,7 @@ extern "C" {
 
 		driver_object->MajorFunction[IRP_MJ_CREATE] =
 			driver_object->MajorFunction[IRP_MJ_CLOSE] =
+			driver_object->MajorFunction[IRP_MJ_CLEANUP] =
 			driver_object->MajorFunction[IRP_MJ_DEVICE_CONTROL] = NoTruthDeviceCtrlRoutine;
 
 		HYPERPLATFORM_LOG_INFO("The VMM has been installed.");
@@ -335,8 +451,10 @@ extern "C" {
 		IoDeleteSymbolicLink(&dosDeviceName);
 
 		VmTermination();
+		ExitTraceTermination();
 		UtilTermination();
 		PerfTermination();
+		KernelPoolTermination();
 		LogTermination();
 	}
 	//-------------------------------------------------------------//
@@ -47,6 +47,9 @@ static const auto kEptpPtiShift = 12ull;
 // Use 9 bits; 0b0000_0000_0000_0000_0000_0000_0001_1111_1111
 static const auto kEptpPtxMask = 0x1ffull;
 
+// How many entries an EPT table has
+static const auto kEptpEntriesPerTable = kEptpPtxMask + 1;
+
 // How many EPT entries are preallocated. When the number exceeds it, the
 // hypervisor issues a bugcheck.
 static const auto kEptpNumberOfPreallocatedEntries = 50;
@@ -430,22 +433,32 @@ _Use_decl_annotations_ EptData *EptInitialization() {
   ept_poiner->fields.page_walk_length = kEptPageWalkLevel - 1;
   ept_poiner->fields.pml4_address = UtilPfnFromPa(UtilPaFromVa(ept_pml4));
 
-  // Initialize all EPT entries for all physical memory pages
-  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
-  for (auto run_index = 0ul; run_index < pm_ranges->number_of_runs;
-       ++run_index) {
-    const auto run = &pm_ranges->run[run_index];
-    const auto base_addr = run->base_page * PAGE_SIZE;
-    for (auto page_index = 0ull; page_index < run->page_count; ++page_index) {
-      const auto indexed_addr = base_addr + page_index * PAGE_SIZE;
+  // Initialize all EPT entries for all physical memory pages. Pages stay 4KB
+  // so that any of them can be hidden, but a chunk of 2MB or larger fills
+  // whole EPT page tables; only the first entry of each table is walked from
+  // PML4, and the rest are initialized in place.
+  PhysicalMemoryChunkIterator chunk_iterator = {};
+  ULONG64 chunk_base = 0;
+  ULONG64 chunk_size = 0;
+  while (UtilGetNextPhysicalMemoryChunk(&chunk_iterator, &chunk_base,
+                                        &chunk_size)) {
+    const auto table_size = min(chunk_size, kEptpEntriesPerTable * PAGE_SIZE);
+    for (auto table_addr = chunk_base; table_addr < chunk_base + chunk_size;
+         table_addr += table_size) {
       const auto ept_pt_entry =
-          EptpConstructTables(ept_pml4, 4, indexed_addr, nullptr);
+          EptpConstructTables(ept_pml4, 4, table_addr, nullptr);
       if (!ept_pt_entry) {
         EptpDestructTables(ept_pml4, 4);
         ExFreePoolWithTag(ept_poiner, kHyperPlatformCommonPoolTag);
         ExFreePoolWithTag(ept_data, kHyperPlatformCommonPoolTag);
         return nullptr;
       }
+      for (auto page_index = 1ull; page_index < table_size / PAGE_SIZE;
+           ++page_index) {
+        NT_ASSERT(!ept_pt_entry[page_index].all);
+        EptpInitTableEntry(&ept_pt_entry[page_index], 1,
+                           table_addr + page_index * PAGE_SIZE);
+      }
     }
   }
 
@@ -721,17 +734,7 @@ _Use_decl_annotations_ void EptHandleEptViolation(EptData *ept_data, _In_ Hidden
 // corresponding PFN entry)
 _Use_decl_annotations_ static bool EptpIsDeviceMemory(
     ULONG64 physical_address) {
-  const auto pm_ranges = UtilGetPhysicalMemoryRanges();
-  for (auto i = 0ul; i < pm_ranges->number_of_runs; ++i) {
-    const auto current_run = &pm_ranges->run[i];
-    const auto base_addr =
-        static_cast<ULONG64>(current_run->base_page) * PAGE_SIZE;
-    const auto endAddr = base_addr + current_run->page_count * PAGE_SIZE - 1;
-    if (UtilIsInBounds(physical_address, base_addr, endAddr)) {
-      return false;
-    }
-  }
-  return true;
+  return !UtilFindPhysicalMemoryRun(physical_address);
 }
 
 // Returns an EPT entry corresponds to the physical_address
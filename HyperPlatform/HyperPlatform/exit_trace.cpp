@@ -0,0 +1,379 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements VM-exit trace functions.
+
+#include "exit_trace.h"
+#include <intrin.h>
+#include "common.h"
+#include "exit_trace_format.h"
+#include "log.h"
+#include "util.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// How many records each ring holds. Must be a power of two.
+static const ULONG kExitTracepRecordsPerRing = 8192;
+static_assert((kExitTracepRecordsPerRing & (kExitTracepRecordsPerRing - 1)) ==
+                  0,
+              "Must be a power of two");
+
+// How many basic exit reasons are counted. Larger reasons are not defined.
+static const ULONG kExitTracepNumberOfExitReasons = 65;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Represents the rings and their mapping state. Geometry of the rings is kept
+// here as well as in ExitTraceHeader, as the producer must not trust what a
+// consumer can see.
+struct ExitTracepContext {
+  PMDL mdl;                 // Describes pages holding the rings
+  ExitTraceHeader *header;  // A system address of the rings
+  SIZE_T ring_offset;       // An offset of the first ring from header
+  SIZE_T ring_stride;       // A distance between rings in bytes
+  FAST_MUTEX mapping_lock;  // Protects the following fields
+  PEPROCESS mapped_process;  // A referenced process mapping the rings
+  void *mapping_owner;       // A file object that mapped the rings
+  void *user_address;        // An address mapped into mapped_process
+};
+
+// Counts VM-exits of a single processor and holds a producer cursor of its
+// ring. ExitTraceRing::head and last_tsc are only copies published to a
+// consumer. Padded to avoid false sharing.
+struct ExitTracepExitCounts {
+  ULONG64 counts[kExitTracepNumberOfExitReasons];
+  ULONG64 head;      // A number of records ever written to the ring
+  ULONG64 last_tsc;  // TSC when the last record was written
+  ULONG64 padding[5];
+};
+static_assert(sizeof(ExitTracepExitCounts) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0,
+              "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+static ExitTraceRing *ExitTracepGetRing(_In_ ULONG processor);
+
+_IRQL_requires_max_(APC_LEVEL) static void ExitTracepUnmap();
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, ExitTraceInitialization)
+#pragma alloc_text(PAGE, ExitTraceTermination)
+#pragma alloc_text(PAGE, ExitTraceMapToCurrentProcess)
+#pragma alloc_text(PAGE, ExitTraceUnmap)
+#pragma alloc_text(PAGE, ExitTraceUnmapFromExitingProcess)
+#pragma alloc_text(PAGE, ExitTracepUnmap)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+static ExitTracepContext g_exit_tracep_context;
+
+// Whether VM-exits are recorded. Read at VMX root without a lock.
+static volatile LONG g_exit_tracep_enabled;
+
+// VM-exit counts of each processor, which are always updated
+static ExitTracepExitCounts *g_exit_tracep_exit_counts;
+static ULONG g_exit_tracep_number_of_exit_counts;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Allocates non-paged pages for all rings. Pages are taken with
+// MmAllocatePagesForMdlEx() rather than from a pagefile-backed section so that
+// they are always resident when written at VMX root.
+_Use_decl_annotations_ NTSTATUS ExitTraceInitialization() {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  ExInitializeFastMutex(&context.mapping_lock);
+
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto exit_counts = reinterpret_cast<ExitTracepExitCounts *>(
+      ExAllocatePoolWithTag(NonPagedPool,
+                            sizeof(ExitTracepExitCounts) * number_of_processors,
+                            kHyperPlatformCommonPoolTag));
+  if (!exit_counts) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(exit_counts,
+                sizeof(ExitTracepExitCounts) * number_of_processors);
+  const auto ring_stride =
+      ROUND_TO_PAGES(sizeof(ExitTraceRing) +
+                     sizeof(ExitTraceRecord) * kExitTracepRecordsPerRing);
+  const auto ring_offset = PAGE_SIZE;
+  const auto total_size =
+      ring_offset + static_cast<SIZE_T>(ring_stride) * number_of_processors;
+
+  PHYSICAL_ADDRESS low_address = {};
+  PHYSICAL_ADDRESS high_address = {};
+  high_address.QuadPart = -1;
+  PHYSICAL_ADDRESS skip_bytes = {};
+  context.mdl = MmAllocatePagesForMdlEx(low_address, high_address, skip_bytes,
+                                        total_size, MmCached,
+                                        MM_ALLOCATE_FULLY_REQUIRED);
+  if (!context.mdl) {
+    ExFreePoolWithTag(exit_counts, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+
+  context.header = reinterpret_cast<ExitTraceHeader *>(
+      MmMapLockedPagesSpecifyCache(context.mdl, KernelMode, MmCached, nullptr,
+                                   FALSE, NormalPagePriority));
+  if (!context.header) {
+    MmFreePagesFromMdl(context.mdl);
+    ExFreePool(context.mdl);
+    context.mdl = nullptr;
+    ExFreePoolWithTag(exit_counts, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(context.header, total_size);
+  context.ring_offset = ring_offset;
+  context.ring_stride = ring_stride;
+  g_exit_tracep_exit_counts = exit_counts;
+  g_exit_tracep_number_of_exit_counts = number_of_processors;
+
+  const auto header = context.header;
+  header->magic = kExitTraceMagic;
+  header->version = kExitTraceVersion;
+  header->number_of_processors = number_of_processors;
+  header->records_per_ring = kExitTracepRecordsPerRing;
+  header->ring_offset = ring_offset;
+  header->ring_stride = ring_stride;
+  header->total_size = total_size;
+  for (ULONG i = 0; i < number_of_processors; ++i) {
+    ExitTracepGetRing(i)->processor = i;
+  }
+
+  HYPERPLATFORM_LOG_DEBUG("Exit trace rings = %p (%Iu bytes)", header,
+                          total_size);
+  return STATUS_SUCCESS;
+}
+
+// Frees all rings
+_Use_decl_annotations_ void ExitTraceTermination() {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  InterlockedExchange(&g_exit_tracep_enabled, false);
+
+  // Never leave a user view of the pages being freed
+  ExAcquireFastMutex(&context.mapping_lock);
+  if (context.mapped_process) {
+    ExitTracepUnmap();
+  }
+  ExReleaseFastMutex(&context.mapping_lock);
+  if (g_exit_tracep_exit_counts) {
+    ExFreePoolWithTag(g_exit_tracep_exit_counts, kHyperPlatformCommonPoolTag);
+    g_exit_tracep_exit_counts = nullptr;
+    g_exit_tracep_number_of_exit_counts = 0;
+  }
+  if (!context.mdl) {
+    return;
+  }
+  MmUnmapLockedPages(context.header, context.mdl);
+  MmFreePagesFromMdl(context.mdl);
+  ExFreePool(context.mdl);
+  context.header = nullptr;
+  context.mdl = nullptr;
+}
+
+// Returns a ring of the processor, located with the kernel's copy of geometry
+_Use_decl_annotations_ static ExitTraceRing *ExitTracepGetRing(
+    ULONG processor) {
+  const auto &context = g_exit_tracep_context;
+  return reinterpret_cast<ExitTraceRing *>(
+      reinterpret_cast<UCHAR *>(context.header) + context.ring_offset +
+      context.ring_stride * processor);
+}
+
+// Appends a record to the ring of the current processor. The ring has only one
+// producer, which is the current processor at VMX root, so no lock is needed.
+// The sequence field is cleared first and set last so that a consumer can
+// detect a record being overwritten while it is copied. Nothing is read from
+// the shared region; the cursor and geometry are kernel-private.
+_Use_decl_annotations_ void ExitTraceRecordVmExit(USHORT exit_reason,
+                                                  ULONG_PTR guest_ip) {
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor < g_exit_tracep_number_of_exit_counts &&
+      exit_reason < kExitTracepNumberOfExitReasons) {
+    g_exit_tracep_exit_counts[processor].counts[exit_reason]++;
+  }
+
+  if (!g_exit_tracep_enabled) {
+    return;
+  }
+
+  if (processor >= g_exit_tracep_number_of_exit_counts) {
+    return;  // A processor added after the initialization
+  }
+
+  auto &cursor = g_exit_tracep_exit_counts[processor];
+  const auto ring = ExitTracepGetRing(processor);
+  const auto records =
+      const_cast<ExitTraceRecord *>(ExitTraceGetRecords(ring));
+  const auto position = cursor.head;
+  auto &record = records[position & (kExitTracepRecordsPerRing - 1)];
+
+  const auto tsc = __rdtsc();
+  const auto tsc_delta = tsc - cursor.last_tsc;
+  cursor.last_tsc = tsc;
+  ring->last_tsc = tsc;
+
+  record.sequence = 0;
+  HYPERPLATFORM_EXIT_TRACE_BARRIER();
+  record.tsc_delta =
+      (tsc_delta > MAXULONG) ? MAXULONG : static_cast<ULONG>(tsc_delta);
+  record.exit_reason = exit_reason;
+  record.guest_ip = guest_ip;
+  record.exit_qualification = UtilVmRead(VmcsField::kExitQualification);
+  if (exit_reason == static_cast<USHORT>(VmxExitReason::kEptViolation) ||
+      exit_reason == static_cast<USHORT>(VmxExitReason::kEptMisconfig)) {
+    record.flags = kExitTraceFlagGpaValid;
+    record.guest_physical_address =
+        UtilVmRead64(VmcsField::kGuestPhysicalAddress);
+  } else {
+    record.flags = 0;
+    record.guest_physical_address = 0;
+  }
+  HYPERPLATFORM_EXIT_TRACE_BARRIER();
+  record.sequence = position + 1;
+  HYPERPLATFORM_EXIT_TRACE_BARRIER();
+  cursor.head = position + 1;
+  ring->head = position + 1;
+}
+
+// Copies VM-exit counts of the current processor. Called at IPI_LEVEL while
+// other processors are not in VMX root.
+_Use_decl_annotations_ void ExitTraceCopyExitCounts(ULONG64 *counts,
+                                                    ULONG number_of_counts) {
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  for (ULONG i = 0; i < number_of_counts; ++i) {
+    counts[i] = (processor < g_exit_tracep_number_of_exit_counts &&
+                 i < kExitTracepNumberOfExitReasons)
+                    ? g_exit_tracep_exit_counts[processor].counts[i]
+                    : 0;
+  }
+}
+
+// Maps the rings into the current process without write access and enables
+// tracing
+_Use_decl_annotations_ NTSTATUS
+ExitTraceMapToCurrentProcess(void *owner, void **user_address) {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  *user_address = nullptr;
+  if (!context.mdl) {
+    return STATUS_DEVICE_NOT_READY;
+  }
+
+  // MdlMappingNoWrite is only honored on Windows 8 and later. The rings are
+  // not mapped writable even though the producer does not trust them.
+  if (!RtlIsNtDdiVersionAvailable(NTDDI_WIN8)) {
+    return STATUS_NOT_SUPPORTED;
+  }
+  const ULONG priority =
+      NormalPagePriority | MdlMappingNoWrite | MdlMappingNoExecute;
+
+  auto status = STATUS_SUCCESS;
+  ExAcquireFastMutex(&context.mapping_lock);
+  if (context.mapped_process) {
+    status = STATUS_DEVICE_BUSY;
+  } else {
+    __try {
+      context.user_address = MmMapLockedPagesSpecifyCache(
+          context.mdl, UserMode, MmCached, nullptr, FALSE, priority);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+      context.user_address = nullptr;
+    }
+    if (context.user_address) {
+      context.mapped_process = PsGetCurrentProcess();
+      ObReferenceObject(context.mapped_process);
+      context.mapping_owner = owner;
+      *user_address = context.user_address;
+      InterlockedExchange(&g_exit_tracep_enabled, true);
+    } else {
+      status = STATUS_INSUFFICIENT_RESOURCES;
+    }
+  }
+  ExReleaseFastMutex(&context.mapping_lock);
+  return status;
+}
+
+// Disables tracing and unmaps the rings if the owner mapped them
+_Use_decl_annotations_ NTSTATUS ExitTraceUnmap(void *owner) {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  auto status = STATUS_SUCCESS;
+  ExAcquireFastMutex(&context.mapping_lock);
+  if (!context.mapped_process || context.mapping_owner != owner) {
+    status = STATUS_NOT_FOUND;
+  } else {
+    ExitTracepUnmap();
+  }
+  ExReleaseFastMutex(&context.mapping_lock);
+  return status;
+}
+
+// Disables tracing and unmaps the rings if the process is mapping them
+_Use_decl_annotations_ void ExitTraceUnmapFromExitingProcess(
+    PEPROCESS process) {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  // Only the process itself maps the rings into it, and it no longer can
+  if (context.mapped_process != process) {
+    return;
+  }
+  ExAcquireFastMutex(&context.mapping_lock);
+  if (context.mapped_process == process) {
+    HYPERPLATFORM_LOG_DEBUG("Unmapping exit trace rings from an exiting process");
+    ExitTracepUnmap();
+  }
+  ExReleaseFastMutex(&context.mapping_lock);
+}
+
+// Disables tracing and unmaps the rings from the mapping process, which may
+// not be the current one. context.mapping_lock must be held.
+_Use_decl_annotations_ static void ExitTracepUnmap() {
+  PAGED_CODE();
+
+  auto &context = g_exit_tracep_context;
+  InterlockedExchange(&g_exit_tracep_enabled, false);
+
+  KAPC_STATE apc_state = {};
+  KeStackAttachProcess(context.mapped_process, &apc_state);
+  MmUnmapLockedPages(context.user_address, context.mdl);
+  KeUnstackDetachProcess(&apc_state);
+
+  ObDereferenceObject(context.mapped_process);
+  context.user_address = nullptr;
+  context.mapped_process = nullptr;
+  context.mapping_owner = nullptr;
+}
+
+}  // extern "C"
@@ -0,0 +1,103 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to VM-exit trace functions.
+
+#ifndef HYPERPLATFORM_EXIT_TRACE_H_
+#define HYPERPLATFORM_EXIT_TRACE_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Allocates per-processor trace rings
+/// @return STATUS_SUCCESS on success
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS ExitTraceInitialization();
+
+/// Frees trace rings
+///
+/// A consumer should have unmapped the rings already, as the driver cannot be
+/// unloaded while a handle to the device is open. A mapping left is removed.
+_IRQL_requires_max_(PASSIVE_LEVEL) void ExitTraceTermination();
+
+/// Counts the current VM-exit and records it when a consumer is mapping the
+/// rings
+/// @param exit_reason  A basic exit reason
+/// @param guest_ip   A guest instruction pointer caused the VM-exit
+///
+/// Called at VMX root. It reads the exit qualification and the guest physical
+/// address from the current VMCS only when tracing is enabled.
+void ExitTraceRecordVmExit(_In_ USHORT exit_reason, _In_ ULONG_PTR guest_ip);
+
+/// Copies a number of VM-exits of the current processor for each exit reason
+/// @param counts   Receives a number of VM-exits indexed by a basic exit reason
+/// @param number_of_counts   A number of elements of \a counts
+///
+/// VM-exits are counted whether or not tracing is enabled.
+void ExitTraceCopyExitCounts(
+    _Out_writes_(number_of_counts) ULONG64 *counts,
+    _In_ ULONG number_of_counts);
+
+/// Maps the rings into the current process as read-only and starts tracing
+/// @param owner          A file object the request was made through
+/// @param user_address   Receives a base address of the mapped region
+/// @return STATUS_SUCCESS on success
+///
+/// Only one process can map the rings at a time. The region begins with
+/// ExitTraceHeader defined in exit_trace_format.h. Fails with
+/// STATUS_NOT_SUPPORTED before Windows 8, where a user mapping cannot be made
+/// read-only.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    ExitTraceMapToCurrentProcess(_In_ void *owner, _Out_ void **user_address);
+
+/// Stops tracing and unmaps the rings if the owner mapped them
+/// @param owner  A file object given to ExitTraceMapToCurrentProcess()
+/// @return STATUS_SUCCESS when the rings were unmapped
+///
+/// Called on IRP_MJ_CLEANUP as well as on an explicit request. It may be
+/// called in any process, e.g. when the handle was inherited. Other handles
+/// to the device do not unmap the rings.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS ExitTraceUnmap(_In_ void *owner);
+
+/// Stops tracing and unmaps the rings if the process is mapping them
+/// @param process  A process exiting
+///
+/// Called on process exit, so that a mapping never outlives its process even
+/// when a handle to the device is still open in another process.
+_IRQL_requires_max_(PASSIVE_LEVEL) void ExitTraceUnmapFromExitingProcess(
+    _In_ PEPROCESS process);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_EXIT_TRACE_H_
@@ -0,0 +1,225 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines a binary layout of VM-exit trace rings and capture files.
+///
+/// This file is shared by the driver, the user-mode consumer and the portable
+/// decoder, and so must not depend on any Windows header.
+
+#ifndef HYPERPLATFORM_EXIT_TRACE_FORMAT_H_
+#define HYPERPLATFORM_EXIT_TRACE_FORMAT_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <stdint.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+/// Prevents a compiler from reordering memory accesses across it
+#if defined(_MSC_VER)
+#define HYPERPLATFORM_EXIT_TRACE_BARRIER() _ReadWriteBarrier()
+#else
+#define HYPERPLATFORM_EXIT_TRACE_BARRIER() \
+  __asm__ __volatile__("" ::: "memory")
+#endif
+
+// Fixed width integers usable with and without the CRT
+#if defined(_MSC_VER)
+typedef unsigned __int16 ExitTraceU16;
+typedef unsigned __int32 ExitTraceU32;
+typedef unsigned __int64 ExitTraceU64;
+#else
+typedef uint16_t ExitTraceU16;
+typedef uint32_t ExitTraceU32;
+typedef uint64_t ExitTraceU64;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// ExitTraceHeader::magic ('HPXT')
+static const ExitTraceU32 kExitTraceMagic = 0x54585048;
+
+/// ExitTraceCaptureHeader::magic ('HPXC')
+static const ExitTraceU32 kExitTraceCaptureMagic = 0x43585048;
+
+/// A version of the layout defined in this file
+static const ExitTraceU32 kExitTraceVersion = 1;
+
+/// ExitTraceRecord::guest_physical_address is valid
+static const ExitTraceU16 kExitTraceFlagGpaValid = 0x1;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Represents a single VM-exit
+struct ExitTraceRecord {
+  ExitTraceU64 sequence;     //!< 1-based position in a ring; written last
+  ExitTraceU32 tsc_delta;    //!< TSC since the previous record (saturated)
+  ExitTraceU16 exit_reason;  //!< A basic exit reason
+  ExitTraceU16 flags;        //!< kExitTraceFlag*
+  ExitTraceU64 guest_ip;
+  ExitTraceU64 exit_qualification;
+  ExitTraceU64 guest_physical_address;  //!< Valid with kExitTraceFlagGpaValid
+};
+static_assert(sizeof(ExitTraceRecord) == 40, "Size check");
+
+/// Represents a ring of a single processor. ExitTraceRecord[records_per_ring]
+/// immediately follows this structure.
+struct ExitTraceRing {
+  volatile ExitTraceU64 head;  //!< A number of records ever written
+  ExitTraceU64 last_tsc;       //!< TSC when the last record was written
+  ExitTraceU32 processor;      //!< A processor index owning this ring
+  ExitTraceU32 reserved[11];   //!< Keeps records cache line aligned
+};
+static_assert(sizeof(ExitTraceRing) == 64, "Size check");
+
+/// Represents the beginning of the region shared with a consumer
+struct ExitTraceHeader {
+  ExitTraceU32 magic;                 //!< kExitTraceMagic
+  ExitTraceU32 version;               //!< kExitTraceVersion
+  ExitTraceU32 number_of_processors;  //!< A number of rings
+  ExitTraceU32 records_per_ring;      //!< Always a power of two
+  ExitTraceU64 ring_offset;           //!< An offset of the first ring
+  ExitTraceU64 ring_stride;           //!< A distance between rings in bytes
+  ExitTraceU64 total_size;            //!< A size of the region in bytes
+  ExitTraceU64 reserved[3];
+};
+static_assert(sizeof(ExitTraceHeader) == 64, "Size check");
+
+/// Represents the beginning of a capture file. ExitTraceCaptureEntry follows.
+struct ExitTraceCaptureHeader {
+  ExitTraceU32 magic;    //!< kExitTraceCaptureMagic
+  ExitTraceU32 version;  //!< kExitTraceVersion
+  ExitTraceU32 number_of_processors;
+  ExitTraceU32 reserved;
+};
+static_assert(sizeof(ExitTraceCaptureHeader) == 16, "Size check");
+
+/// Represents a record saved in a capture file
+struct ExitTraceCaptureEntry {
+  ExitTraceU32 processor;  //!< A processor index that recorded \a record
+  ExitTraceU32 lost;       //!< Records overwritten before \a record was read
+  ExitTraceRecord record;
+};
+static_assert(sizeof(ExitTraceCaptureEntry) == 48, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns a ring of the processor
+/// @param header   A head of the shared region
+/// @param processor  A processor index
+/// @return A ring of \a processor
+inline const ExitTraceRing *ExitTraceGetRing(const ExitTraceHeader *header,
+                                             ExitTraceU32 processor) {
+  return reinterpret_cast<const ExitTraceRing *>(
+      reinterpret_cast<const unsigned char *>(header) + header->ring_offset +
+      header->ring_stride * processor);
+}
+
+/// Returns records of the ring
+/// @param ring   A ring to get records
+/// @return The first element of records of \a ring
+inline const ExitTraceRecord *ExitTraceGetRecords(const ExitTraceRing *ring) {
+  return reinterpret_cast<const ExitTraceRecord *>(ring + 1);
+}
+
+/// Copies records written since the last call
+/// @param header   A head of the shared region
+/// @param ring   A ring to read
+/// @param cursor   A position to start to read. Updated to the next position
+/// @param records  A buffer to receive copied records
+/// @param max_records  A number of elements of \a records
+/// @param lost   Incremented by a number of records overwritten before read
+/// @return A number of copied records
+///
+/// A consumer only has read-only access to the ring, so the producer never
+/// waits for it; records are overwritten when the consumer falls behind. A
+/// record is validated with ExitTraceRecord::sequence before and after it is
+/// copied, as the producer clears it before it overwrites the record.
+inline ExitTraceU32 ExitTraceReadRing(const ExitTraceHeader *header,
+                                      const ExitTraceRing *ring,
+                                      ExitTraceU64 *cursor,
+                                      ExitTraceRecord *records,
+                                      ExitTraceU32 max_records,
+                                      ExitTraceU64 *lost) {
+  const auto ring_records = ExitTraceGetRecords(ring);
+  const auto mask = static_cast<ExitTraceU64>(header->records_per_ring - 1);
+  const ExitTraceU64 head = ring->head;
+  HYPERPLATFORM_EXIT_TRACE_BARRIER();
+
+  auto position = *cursor;
+  if (head - position > header->records_per_ring) {
+    *lost += head - header->records_per_ring - position;
+    position = head - header->records_per_ring;
+  }
+
+  ExitTraceU32 count = 0;
+  for (; position < head && count < max_records; ++position) {
+    const volatile ExitTraceRecord &source = ring_records[position & mask];
+    const ExitTraceU64 sequence_before = source.sequence;
+    HYPERPLATFORM_EXIT_TRACE_BARRIER();
+    auto &record = records[count];
+    record.tsc_delta = source.tsc_delta;
+    record.exit_reason = source.exit_reason;
+    record.flags = source.flags;
+    record.guest_ip = source.guest_ip;
+    record.exit_qualification = source.exit_qualification;
+    record.guest_physical_address = source.guest_physical_address;
+    HYPERPLATFORM_EXIT_TRACE_BARRIER();
+    const ExitTraceU64 sequence_after = source.sequence;
+    if (sequence_before != position + 1 || sequence_after != position + 1) {
+      ++*lost;
+      continue;
+    }
+    record.sequence = sequence_after;
+    ++count;
+  }
+  *cursor = position;
+  return count;
+}
+
+/// Returns a name of the basic exit reason
+/// @param exit_reason  A basic exit reason
+/// @return A name of \a exit_reason, or "Unknown"
+inline const char *ExitTraceGetReasonName(ExitTraceU16 exit_reason) {
+  static const char *const kNames[] = {
+      "ExceptionOrNmi", "ExternalInterrupt", "TripleFault", "Init",
+      "Sipi", "IoSmi", "OtherSmi", "PendingInterrupt",
+      "NmiWindow", "TaskSwitch", "Cpuid", "GetSec",
+      "Hlt", "Invd", "Invlpg", "Rdpmc",
+      "Rdtsc", "Rsm", "Vmcall", "Vmclear",
+      "Vmlaunch", "Vmptrld", "Vmptrst", "Vmread",
+      "Vmresume", "Vmwrite", "Vmoff", "Vmon",
+      "CrAccess", "DrAccess", "IoInstruction", "MsrRead",
+      "MsrWrite", "InvalidGuestState", "MsrLoading", "Undefined35",
+      "MwaitInstruction", "MonitorTrapFlag", "Undefined38",
+      "MonitorInstruction", "PauseInstruction", "MachineCheck",
+      "Undefined42", "TprBelowThreshold", "ApicAccess", "VirtualizedEoi",
+      "GdtrOrIdtrAccess", "LdtrOrTrAccess", "EptViolation", "EptMisconfig",
+      "Invept", "Rdtscp", "VmxPreemptionTime", "Invvpid",
+      "Wbinvd", "Xsetbv", "ApicWrite", "Rdrand",
+      "Invpcid", "Vmfunc", "Undefined60", "Rdseed",
+      "Undefined62", "Xsaves", "Xrstors",
+  };
+  if (exit_reason >= sizeof(kNames) / sizeof(kNames[0])) {
+    return "Unknown";
+  }
+  return kNames[exit_reason];
+}
+
+#endif  // HYPERPLATFORM_EXIT_TRACE_FORMAT_H_
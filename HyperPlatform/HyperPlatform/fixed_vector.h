@@ -0,0 +1,126 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines a vector with a fixed capacity.
+///
+/// FixedVector holds its elements in place and never allocates nor frees
+/// memory, so that it can be modified at VMX root where no kernel API may be
+/// called. Adding an element fails instead of growing the vector once it is
+/// full.
+///
+/// A single writer may add elements while other processors iterate over the
+/// vector; an element is written before the size that makes it visible. A
+/// reader may miss or see twice an element moved by remove_if(), but never
+/// sees an uninitialized one. A reader that started before a removal may still
+/// see the removed element, so what it refers to should be freed only after
+/// such readers are done.
+///
+/// This file does not depend on any Windows header so that it can be built
+/// and self-tested on other platforms.
+
+#ifndef HYPERPLATFORM_FIXED_VECTOR_H_
+#define HYPERPLATFORM_FIXED_VECTOR_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Prevents the compiler from reordering memory accesses across it. Stores are
+// not reordered with other stores on x86 and x64.
+#if defined(_MSC_VER)
+#define HYPERPLATFORM_FIXED_VECTOR_BARRIER() _ReadWriteBarrier()
+#else
+#define HYPERPLATFORM_FIXED_VECTOR_BARRIER() \
+  __asm__ __volatile__("" ::: "memory")
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// A vector of at most Capacity elements
+///
+/// T should be trivially copyable, e.g. a pointer. Iterators are pointers and
+/// are invalidated only by removal of elements.
+template <typename T, size_t Capacity>
+class FixedVector {
+ public:
+  using value_type = T;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  FixedVector() : size_(0) {}
+
+  size_t size() const { return size_; }
+  static size_t capacity() { return Capacity; }
+  bool empty() const { return size_ == 0; }
+  bool full() const { return size_ == Capacity; }
+
+  iterator begin() { return items_; }
+  iterator end() { return items_ + size_; }
+  const_iterator begin() const { return items_; }
+  const_iterator end() const { return items_ + size_; }
+  const_iterator cbegin() const { return items_; }
+  const_iterator cend() const { return items_ + size_; }
+
+  T &operator[](size_t index) { return items_[index]; }
+  const T &operator[](size_t index) const { return items_[index]; }
+
+  T &back() { return items_[size_ - 1]; }
+  const T &back() const { return items_[size_ - 1]; }
+
+  /// Appends an element
+  /// @param value  An element to append
+  /// @return false when the vector is full
+  bool try_push_back(const T &value) {
+    if (full()) {
+      return false;
+    }
+    items_[size_] = value;
+    HYPERPLATFORM_FIXED_VECTOR_BARRIER();
+    size_ = size_ + 1;
+    return true;
+  }
+
+  /// Removes the last element. The vector must not be empty.
+  void pop_back() { size_ = size_ - 1; }
+
+  /// Removes all elements
+  void clear() { size_ = 0; }
+
+  /// Removes elements satisfying the predicate, keeping order of the others
+  /// @param pred  A predicate called once for each element in order
+  /// @return A number of removed elements
+  template <typename Predicate>
+  size_t remove_if(Predicate pred) {
+    const auto old_size = size_;
+    size_t kept = 0;
+    for (size_t i = 0; i < old_size; ++i) {
+      if (pred(items_[i])) {
+        continue;
+      }
+      if (kept != i) {
+        items_[kept] = items_[i];
+      }
+      ++kept;
+    }
+    HYPERPLATFORM_FIXED_VECTOR_BARRIER();
+    size_ = kept;
+    return old_size - kept;
+  }
+
+ private:
+  T items_[Capacity];
+  volatile size_t size_;
+};
+
+#endif  // HYPERPLATFORM_FIXED_VECTOR_H_
@@ -450,6 +450,65 @@ union Cpuid80000008Eax {
   } fields;
 };
 
+/// See: Information Returned by CPUID Instruction (Architectural Performance
+/// Monitoring Leaf)
+union Cpuid0aEax {
+  ULONG32 all;
+  struct {
+    ULONG32 version_id : 8;             //!< [0:7]
+    ULONG32 number_of_counters : 8;     //!< [8:15]
+    ULONG32 counter_width : 8;          //!< [16:23]
+    ULONG32 ebx_bit_vector_length : 8;  //!< [24:31]
+  } fields;
+};
+static_assert(sizeof(Cpuid0aEax) == 4, "Size check");
+
+/// See: Information Returned by CPUID Instruction (Architectural Performance
+/// Monitoring Leaf). A set bit means the event is NOT available.
+union Cpuid0aEbx {
+  ULONG32 all;
+  struct {
+    ULONG32 core_cycles_unavailable : 1;           //!< [0]
+    ULONG32 instructions_retired_unavailable : 1;  //!< [1]
+    ULONG32 reference_cycles_unavailable : 1;      //!< [2]
+    ULONG32 llc_references_unavailable : 1;        //!< [3]
+    ULONG32 llc_misses_unavailable : 1;            //!< [4]
+    ULONG32 branch_instructions_unavailable : 1;   //!< [5]
+    ULONG32 branch_misses_unavailable : 1;         //!< [6]
+  } fields;
+};
+static_assert(sizeof(Cpuid0aEbx) == 4, "Size check");
+
+/// See: Information Returned by CPUID Instruction (Architectural Performance
+/// Monitoring Leaf)
+union Cpuid0aEdx {
+  ULONG32 all;
+  struct {
+    ULONG32 number_of_fixed_counters : 5;  //!< [0:4]
+    ULONG32 fixed_counter_width : 8;       //!< [5:12]
+  } fields;
+};
+static_assert(sizeof(Cpuid0aEdx) == 4, "Size check");
+
+/// See: Layout of IA32_PERFEVTSELx MSRs
+union Ia32PerfEvtSelMsr {
+  ULONG64 all;
+  struct {
+    ULONG64 event_select : 8;  //!< [0:7]
+    ULONG64 unit_mask : 8;     //!< [8:15]
+    ULONG64 usr : 1;           //!< [16]
+    ULONG64 os : 1;            //!< [17]
+    ULONG64 edge : 1;          //!< [18]
+    ULONG64 pin_control : 1;   //!< [19]
+    ULONG64 interrupt : 1;     //!< [20]
+    ULONG64 any_thread : 1;    //!< [21]
+    ULONG64 enable : 1;        //!< [22]
+    ULONG64 invert : 1;        //!< [23]
+    ULONG64 counter_mask : 8;  //!< [24:31]
+  } fields;
+};
+static_assert(sizeof(Ia32PerfEvtSelMsr) == 8, "Size check");
+
 /// See: IA32_MTRRCAP Register
 union Ia32MtrrCapabilitiesMsr {
   ULONG64 all;
@@ -528,10 +587,16 @@ enum class Msr : unsigned int {
 
   kIa32FeatureControl = 0x03A,
 
+  kIa32Pmc0 = 0x0C1,
+  kIa32Pmc1 = 0x0C2,
+
   kIa32SysenterCs = 0x174,
   kIa32SysenterEsp = 0x175,
   kIa32SysenterEip = 0x176,
 
+  kIa32PerfEvtSel0 = 0x186,
+  kIa32PerfEvtSel1 = 0x187,
+
   kIa32Debugctl = 0x1D9,
 
   kIa32MtrrCap = 0xFE,
@@ -550,6 +615,11 @@ enum class Msr : unsigned int {
   kIa32MtrrFix4kF0000 = 0x26E,
   kIa32MtrrFix4kF8000 = 0x26F,
 
+  kIa32FixedCtr0 = 0x309,
+  kIa32FixedCtr1 = 0x30A,
+  kIa32FixedCtrCtrl = 0x38D,
+  kIa32PerfGlobalCtrl = 0x38F,
+
   kIa32VmxBasic = 0x480,
   kIa32VmxPinbasedCtls = 0x481,
   kIa32VmxProcBasedCtls = 0x482,
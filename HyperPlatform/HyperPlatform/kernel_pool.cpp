@@ -0,0 +1,179 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements typed pool functions.
+
+// NonPagedPool means NonPagedPoolNx where it is available; see DriverEntry()
+#ifndef POOL_NX_OPTIN
+#define POOL_NX_OPTIN 1
+#endif
+#include "kernel_pool.h"
+#include "common.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Describes a pool
+struct KernelPoolpDescriptor {
+  ULONG tag;
+  SIZE_T block_size;  // A size of lookaside blocks, or 0 for no lookaside list
+};
+
+// State of a pool
+struct KernelPoolpState {
+  bool has_lookaside;  // Whether the lookaside list is initialized
+  LOOKASIDE_LIST_EX lookaside;
+  KernelPoolCounters counters;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, KernelPoolInitialization)
+#pragma alloc_text(PAGE, KernelPoolTermination)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Indexed by KernelPoolType. Tags are shown reversed by poolmon, e.g. KSTL.
+static const KernelPoolpDescriptor
+    kKernelPoolpDescriptors[kKernelPoolNumberOfTypes] = {
+        {'LTSK', 0},                        // kStl
+        {'dNrT', kKernelPoolHideNodeSize},  // kHideNode
+        {'gPrT', PAGE_SIZE},                // kHidePage
+        {'lPrT', 0},                        // kHidePolicy
+};
+
+static KernelPoolpState g_kernel_poolp_states[kKernelPoolNumberOfTypes];
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Initializes lookaside lists of pools that have them
+_Use_decl_annotations_ NTSTATUS KernelPoolInitialization() {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < RTL_NUMBER_OF(kKernelPoolpDescriptors); ++i) {
+    const auto &descriptor = kKernelPoolpDescriptors[i];
+    auto &state = g_kernel_poolp_states[i];
+    if (!descriptor.block_size) {
+      continue;
+    }
+    const auto status = ExInitializeLookasideListEx(
+        &state.lookaside, nullptr, nullptr, NonPagedPool, 0,
+        descriptor.block_size, descriptor.tag, 0);
+    if (!NT_SUCCESS(status)) {
+      KernelPoolTermination();
+      return status;
+    }
+    state.has_lookaside = true;
+  }
+  return STATUS_SUCCESS;
+}
+
+// Deletes lookaside lists, and reports leaks of each pool
+_Use_decl_annotations_ void KernelPoolTermination() {
+  PAGED_CODE();
+
+  for (auto i = 0ul; i < RTL_NUMBER_OF(kKernelPoolpDescriptors); ++i) {
+    const auto &descriptor = kKernelPoolpDescriptors[i];
+    auto &state = g_kernel_poolp_states[i];
+    KernelPoolCounters counters = {};
+    KernelPoolGetCounters(static_cast<KernelPoolType>(i), &counters);
+    if (counters.allocations != counters.frees) {
+      HYPERPLATFORM_LOG_WARN("Pool %.4s has %lld outstanding allocations.",
+                             reinterpret_cast<const char *>(&descriptor.tag),
+                             counters.allocations - counters.frees);
+    }
+    HYPERPLATFORM_LOG_DEBUG(
+        "Pool %.4s: %lld allocations, %lld from lookaside (%lld misses), "
+        "%lld failures.",
+        reinterpret_cast<const char *>(&descriptor.tag), counters.allocations,
+        counters.lookaside_allocations, counters.lookaside_misses,
+        counters.failures);
+
+    if (state.has_lookaside) {
+      state.has_lookaside = false;
+      ExDeleteLookasideListEx(&state.lookaside);
+    }
+  }
+}
+
+// Allocates from the lookaside list when the size fits in a block
+_Use_decl_annotations_ void *KernelPoolAllocate(KernelPoolType type,
+                                                SIZE_T size) {
+  const auto &descriptor = kKernelPoolpDescriptors[static_cast<ULONG>(type)];
+  auto &state = g_kernel_poolp_states[static_cast<ULONG>(type)];
+
+  void *p = nullptr;
+  const auto fits_in_block =
+      (descriptor.block_size && size <= descriptor.block_size);
+  if (fits_in_block && state.has_lookaside) {
+    p = ExAllocateFromLookasideListEx(&state.lookaside);
+    if (p) {
+      InterlockedIncrement64(&state.counters.lookaside_allocations);
+    }
+  } else {
+    // A block is allocated in full even without the lookaside list so that
+    // it can be freed to the list once it is initialized
+    const auto allocation_size =
+        fits_in_block ? descriptor.block_size : (size ? size : 1);
+    p = ExAllocatePoolWithTag(NonPagedPool, allocation_size, descriptor.tag);
+  }
+
+  InterlockedIncrement64(p ? &state.counters.allocations
+                           : &state.counters.failures);
+  return p;
+}
+
+// Frees to the lookaside list when the size fits in a block
+_Use_decl_annotations_ void KernelPoolFree(KernelPoolType type, void *p,
+                                           SIZE_T size) {
+  if (!p) {
+    return;
+  }
+
+  const auto &descriptor = kKernelPoolpDescriptors[static_cast<ULONG>(type)];
+  auto &state = g_kernel_poolp_states[static_cast<ULONG>(type)];
+  InterlockedIncrement64(&state.counters.frees);
+  if (state.has_lookaside && size <= descriptor.block_size) {
+    ExFreeToLookasideListEx(&state.lookaside, p);
+  } else {
+    ExFreePoolWithTag(p, descriptor.tag);
+  }
+}
+
+// Copies counters; misses are taken from the lookaside list itself
+_Use_decl_annotations_ void KernelPoolGetCounters(
+    KernelPoolType type, KernelPoolCounters *counters) {
+  const auto &state = g_kernel_poolp_states[static_cast<ULONG>(type)];
+  counters->allocations = state.counters.allocations;
+  counters->frees = state.counters.frees;
+  counters->failures = state.counters.failures;
+  counters->lookaside_allocations = state.counters.lookaside_allocations;
+  counters->lookaside_misses =
+      (state.has_lookaside) ? state.lookaside.L.AllocateMisses : 0;
+}
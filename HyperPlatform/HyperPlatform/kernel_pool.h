@@ -0,0 +1,178 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to typed pool functions.
+///
+/// Each kind of allocation of the driver has its own pool tag and counters so
+/// that memory of each subsystem can be told apart with poolmon and !poolused.
+/// Memory is always allocated from NonPagedPoolNx where it is available. A
+/// pool can also have a lookaside list of fixed size blocks; allocations that
+/// fit in a block are served by it so that churn of nodes does not go to the
+/// general pool.
+///
+/// KernelPoolAllocator and KernelPoolObject let STL containers and classes use
+/// those pools.
+
+#ifndef HYPERPLATFORM_KERNEL_POOL_H_
+#define HYPERPLATFORM_KERNEL_POOL_H_
+
+#include <fltKernel.h>
+#include "kernel_stl.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// Pools of the driver
+enum class KernelPoolType : unsigned int {
+  kStl,          //!< The global operator new
+  kHideNode,     //!< Hidden page nodes and their shared_ptr control blocks
+  kHidePage,     //!< Copies of hidden pages
+  kHidePolicy,   //!< Policies to hide modules
+  kNumberOfTypes,
+};
+
+/// A number of pools
+static const auto kKernelPoolNumberOfTypes =
+    static_cast<ULONG>(KernelPoolType::kNumberOfTypes);
+
+/// A size of blocks of the kHideNode lookaside list
+static const SIZE_T kKernelPoolHideNodeSize = 256;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Counters of a pool
+struct KernelPoolCounters {
+  LONG64 allocations;            //!< Succeeded allocations
+  LONG64 frees;                  //!< Frees
+  LONG64 failures;               //!< Failed allocations
+  LONG64 lookaside_allocations;  //!< Allocations served by a lookaside list
+  LONG64 lookaside_misses;  //!< Lookaside allocations that went to the pool
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Initializes lookaside lists of pools
+/// @return STATUS_SUCCESS on success
+///
+/// Pools can be used before this call and after KernelPoolTermination(); they
+/// just allocate from the general pool.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS KernelPoolInitialization();
+
+/// Deletes lookaside lists of pools
+///
+/// All blocks allocated from lookaside lists must have been freed. Reports
+/// pools that still have outstanding allocations.
+_IRQL_requires_max_(PASSIVE_LEVEL) void KernelPoolTermination();
+
+/// Allocates memory from the pool
+/// @param type   A pool to allocate from
+/// @param size   A size to allocate in bytes
+/// @return An allocated pointer, or nullptr on failure
+_IRQL_requires_max_(DISPATCH_LEVEL) void *KernelPoolAllocate(
+    _In_ KernelPoolType type, _In_ SIZE_T size);
+
+/// Frees memory allocated by KernelPoolAllocate()
+/// @param type   A pool \a p was allocated from
+/// @param p   A pointer to free
+/// @param size   The size given to KernelPoolAllocate()
+_IRQL_requires_max_(DISPATCH_LEVEL) void KernelPoolFree(
+    _In_ KernelPoolType type, _In_opt_ void *p, _In_ SIZE_T size);
+
+/// Returns counters of the pool
+/// @param type   A pool to query
+/// @param counters   Receives counters
+_IRQL_requires_max_(DISPATCH_LEVEL) void KernelPoolGetCounters(
+    _In_ KernelPoolType type, _Out_ KernelPoolCounters *counters);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// An STL allocator taking memory from the pool
+///
+/// It is stateless so that containers using it can be default constructed and
+/// moved freely. Single elements up to a block size of the pool come from its
+/// lookaside list, e.g. nodes of std::list and control blocks made by
+/// std::allocate_shared().
+template <typename T, KernelPoolType Type>
+class KernelPoolAllocator {
+ public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind {
+    using other = KernelPoolAllocator<U, Type>;
+  };
+
+  KernelPoolAllocator() = default;
+
+  template <typename U>
+  KernelPoolAllocator(const KernelPoolAllocator<U, Type> &) {}
+
+  T *allocate(size_t n) {
+    if (n > static_cast<size_t>(-1) / sizeof(T)) {
+      std::_Xbad_alloc();
+    }
+    const auto p = KernelPoolAllocate(Type, n * sizeof(T));
+    if (!p) {
+      std::_Xbad_alloc();
+    }
+    return static_cast<T *>(p);
+  }
+
+  void deallocate(T *p, size_t n) { KernelPoolFree(Type, p, n * sizeof(T)); }
+};
+
+template <typename T, typename U, KernelPoolType Type>
+bool operator==(const KernelPoolAllocator<T, Type> &,
+                const KernelPoolAllocator<U, Type> &) {
+  return true;
+}
+
+template <typename T, typename U, KernelPoolType Type>
+bool operator!=(const KernelPoolAllocator<T, Type> &,
+                const KernelPoolAllocator<U, Type> &) {
+  return false;
+}
+
+/// A base class giving operator new and delete taking memory from the pool
+///
+/// A class derived from it is allocated from the pool even through
+/// std::make_unique() and deleted by std::unique_ptr.
+template <KernelPoolType Type>
+struct KernelPoolObject {
+  static void *operator new(size_t size) {
+    const auto p = KernelPoolAllocate(Type, size);
+    if (!p) {
+      std::_Xbad_alloc();
+    }
+    return p;
+  }
+
+  static void operator delete(void *p, size_t size) {
+    KernelPoolFree(Type, p, size);
+  }
+};
+
+#endif  // HYPERPLATFORM_KERNEL_POOL_H_
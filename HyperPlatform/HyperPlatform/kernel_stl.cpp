@@ -6,6 +6,7 @@
 /// Implements code to use STL in a driver project
 
 #include <fltKernel.h>
+#include "kernel_pool.h"
 #undef _HAS_EXCEPTIONS
 #define _HAS_EXCEPTIONS 0
 
@@ -22,9 +23,6 @@
 // constants and macros
 //
 
-/// A pool tag for this module
-static const ULONG kKstlpPoolTag = 'LTSK';
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -82,14 +80,12 @@ DECLSPEC_NORETURN void __cdecl _Xruntime_error(_In_z_ const char *) {
 
 }  // namespace std
 
-// An alternative implementation of the new operator
+// An alternative implementation of the new operator. Classes and containers
+// that have their own pools use KernelPoolObject and KernelPoolAllocator
+// instead.
 _IRQL_requires_max_(DISPATCH_LEVEL) void *__cdecl operator new(
     _In_ size_t size) {
-  if (size == 0) {
-    size = 1;
-  }
-
-  const auto p = ExAllocatePoolWithTag(NonPagedPool, size, kKstlpPoolTag);
+  const auto p = KernelPoolAllocate(KernelPoolType::kStl, size);
   if (!p) {
     KernelStlpRaiseException(MUST_SUCCEED_POOL_EMPTY);
   }
@@ -98,18 +94,13 @@ _IRQL_requires_max_(DISPATCH_LEVEL) void *__cdecl operator new(
 
 // An alternative implementation of the new operator
 _IRQL_requires_max_(DISPATCH_LEVEL) void __cdecl operator delete(_In_ void *p) {
-  if (p) {
-    ExFreePoolWithTag(p, kKstlpPoolTag);
-  }
+  KernelPoolFree(KernelPoolType::kStl, p, 0);
 }
 
 // An alternative implementation of the new operator
 _IRQL_requires_max_(DISPATCH_LEVEL) void __cdecl operator delete(
     _In_ void *p, _In_ size_t size) {
-  UNREFERENCED_PARAMETER(size);
-  if (p) {
-    ExFreePoolWithTag(p, kKstlpPoolTag);
-  }
+  KernelPoolFree(KernelPoolType::kStl, p, size);
 }
 
 // An alternative implementation of __stdio_common_vsprintf_s
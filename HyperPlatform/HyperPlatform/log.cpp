@@ -23,20 +23,37 @@ extern "C" {
 // constant and macro
 //
 
-// A size for log buffer in NonPagedPool. Two buffers are allocated with this
-// size. Exceeded logs are ignored silently. Make it bigger if a buffered log
-// size often reach this size.
-static const auto kLogpBufferSizeInPages = 16ul;
-
-// An actual log buffer size in bytes.
-static const auto kLogpBufferSize = PAGE_SIZE * kLogpBufferSizeInPages;
-
-// A size that is usable for logging. Minus one because the last byte is kept
-// for \0.
-static const auto kLogpBufferUsableSize = kLogpBufferSize - 1;
-
-// An interval to flush buffered log entries into a log file.
-static const auto kLogpLogFlushIntervalMsec = 50;
+// A size for a log ring in NonPagedPool. One ring is allocated for each
+// processor with this size. Exceeded logs are dropped and counted for each
+// processor. Make it bigger if drops are often reported.
+static const auto kLogpRingSizeInPages = 8ul;
+
+// An actual log ring size in bytes. Must be a power of two.
+static const auto kLogpRingSize = PAGE_SIZE * kLogpRingSizeInPages;
+static_assert((kLogpRingSize & (kLogpRingSize - 1)) == 0,
+              "Must be a power of two");
+
+// Alignment of each entry in a log ring
+static const auto kLogpEntryAlignment = 8ul;
+
+// Values of LogEntryHeader::state
+static const LONG kLogpEntryFree = 0;       // Not written yet
+static const LONG kLogpEntryCommitted = 1;  // Ready to be flushed
+static const LONG kLogpEntryPadding = 2;    // Skipped up to the end of a ring
+
+// An interval to commit written log entries to a disk with
+// ZwFlushBuffersFile(). Buffered entries are also written into a log file at
+// this interval at latest. Make it shorter to lose less logs on a crash, or
+// longer to write logs in bigger batches.
+static const auto kLogpGroupCommitIntervalMsec = 500;
+
+// Usage of a log ring in bytes to wake up the flush thread before the ring
+// gets full. A producer at PASSIVE_LEVEL flushes the rings by itself when its
+// ring is used beyond this.
+static const auto kLogpRingWatermark = kLogpRingSize / 2;
+
+// A size of a buffer to batch log entries into a single ZwWriteFile() call
+static const auto kLogpWriteBufferSize = 64 * 1024ul;
 
 static const ULONG kLogpPoolTag = ' gol';
 
@@ -45,23 +62,75 @@ static const ULONG kLogpPoolTag = ' gol';
 // types
 //
 
-struct LogBufferInfo {
-  // A pointer to buffer currently used. It is either log_buffer1 or
-  // log_buffer2.
-  volatile char *log_buffer_head;
+// Precedes each log message in a log ring. Only state and size are valid for
+// kLogpEntryPadding.
+struct LogEntryHeader {
+  volatile LONG state;  // kLogpEntry*; set last by a producer
+  ULONG size;           // A size of the entry including this header
+  LONG64 timestamp;     // A performance counter value when it was logged
+  bool printed;         // Whether the message is already printed out
+  bool deferred;        // Followed by LogDeferredEntry instead of a message
+};
+static_assert(sizeof(LogEntryHeader) % kLogpEntryAlignment == 0,
+              "Size check");
+
+// A ring buffer for a single processor. Any number of producers can reserve
+// space with a CAS on write_offset without a lock, as a VM-exit or an
+// interrupt may log on the same processor while another log is being written.
+// Offsets are wrapped around 32bit, which is a multiple of the ring size.
+struct LogRing {
+  char *buffer;                 // kLogpRingSize bytes
+  volatile LONG write_offset;   // Bytes ever reserved by producers
+  volatile LONG read_offset;    // Bytes ever consumed by a flusher
+  volatile LONG dropped;        // A number of entries dropped as it was full
+  LONG reported_dropped;        // A number of dropped entries reported
+  ULONG flush_limit;            // write_offset when a flush started
+};
 
-  // A pointer to where the next log should be written.
-  volatile char *log_buffer_tail;
+// Represents an execution context in which a log is made
+struct LogContext {
+  LARGE_INTEGER system_time;
+  ULONG processor_number;
+  ULONG_PTR process_id;
+  ULONG_PTR thread_id;
+  char process_name[16];
+};
 
-  char *log_buffer1;
-  char *log_buffer2;
+// Follows LogEntryHeader of a message buffered by LogpPrintDeferred(). Packed
+// arguments and strings follow this structure.
+struct LogDeferredEntry {
+  ULONG level;
+  ULONG string_slots;
+  const char *function_name;
+  const char *format;
+  LogContext context;
+  ULONG arguments_size;
+  ULONG strings_size;
+};
+static_assert(sizeof(LogDeferredEntry) % kLogpEntryAlignment == 0,
+              "Size check");
 
-  // Holds the biggest buffer usage to determine a necessary buffer size.
-  SIZE_T log_max_usage;
+struct LogBufferInfo {
+  // An array of rings for each processor
+  LogRing *rings;
+  ULONG number_of_rings;
 
   HANDLE log_file_handle;
-  KSPIN_LOCK spin_lock;
   ERESOURCE resource;
+
+  // Signaled when a ring reaches kLogpRingWatermark or the thread should exit
+  KEVENT flush_event;
+
+  // Holds formatted entries until they are written at once. Protected by
+  // resource.
+  char *write_buffer;
+  SIZE_T write_buffer_used;
+
+  // Whether entries were written after the last ZwFlushBuffersFile(), and
+  // when it was called in an interrupt time. Protected by resource.
+  bool commit_needed;
+  ULONG64 last_commit_time;
+
   bool resource_initialized;
   volatile bool buffer_flush_thread_should_be_alive;
   volatile bool buffer_flush_thread_started;
@@ -88,12 +157,19 @@ static DRIVER_REINITIALIZE LogpReinitializationRoutine;
 _IRQL_requires_max_(PASSIVE_LEVEL) static void LogpFinalizeBufferInfo(
     _In_ LogBufferInfo *info);
 
+static void LogpCaptureContext(_Out_ LogContext *context);
+
 static NTSTATUS LogpMakePrefix(_In_ ULONG level,
                                _In_z_ const char *function_name,
                                _In_z_ const char *log_message,
+                               _In_ const LogContext &context,
                                _Out_ char *log_buffer,
                                _In_ SIZE_T log_buffer_length);
 
+static NTSTATUS LogpFormatDeferredMessage(_Inout_ LogDeferredEntry *entry,
+                                          _Out_ char *log_buffer,
+                                          _In_ SIZE_T log_buffer_length);
+
 static const char *LogpFindBaseFunctionName(_In_z_ const char *function_name);
 
 static NTSTATUS LogpPut(_In_z_ char *message, _In_ ULONG attribute);
@@ -101,13 +177,39 @@ static NTSTATUS LogpPut(_In_z_ char *message, _In_ ULONG attribute);
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpFlushLogBuffer(_Inout_ LogBufferInfo *info);
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpAppendToWriteBuffer(
+    _Inout_ LogBufferInfo *info, _In_reads_(length) const char *message,
+    _In_ SIZE_T length);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    LogpWriteOutWriteBuffer(_Inout_ LogBufferInfo *info);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
-    LogpWriteMessageToFile(_In_z_ const char *message,
-                           _In_ const LogBufferInfo &info);
+    LogpCommitLogFile(_Inout_ LogBufferInfo *info, _In_ bool force);
+
+static bool LogpIsRingAboveWatermark(_In_ const LogBufferInfo &info);
 
 static NTSTATUS LogpBufferMessage(_In_z_ const char *message,
+                                  _In_ bool printed,
                                   _Inout_ LogBufferInfo *info);
 
+_IRQL_raises_(DISPATCH_LEVEL) static LogEntryHeader *LogpReserveRingEntry(
+    _In_ ULONG payload_size, _Inout_ LogBufferInfo *info,
+    _Out_ _IRQL_saves_ KIRQL *old_irql);
+
+_IRQL_requires_(DISPATCH_LEVEL) static void LogpCommitRingEntry(
+    _Inout_ LogEntryHeader *entry, _In_ _IRQL_restores_ KIRQL old_irql);
+
+static LogEntryHeader *LogpPeekRingEntry(_Inout_ LogRing *ring);
+
+static void LogpConsumeRingEntry(_Inout_ LogRing *ring,
+                                 _Inout_ LogEntryHeader *entry);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void LogpReportDroppedEntries(
+    _Inout_ LogBufferInfo *info);
+
+static bool LogpIsLogBufferEmpty(_In_ const LogBufferInfo &info);
+
 static void LogpDoDbgPrint(_In_z_ char *message);
 
 static bool LogpIsLogFileEnabled(_In_ const LogBufferInfo &info);
@@ -123,10 +225,6 @@ static KSTART_ROUTINE LogpBufferFlushThreadRoutine;
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     LogpSleep(_In_ LONG millisecond);
 
-static void LogpSetPrintedBit(_In_z_ char *message, _In_ bool on);
-
-static bool LogpIsPrinted(_In_z_ char *message);
-
 static void LogpDbgBreak();
 
 #if defined(ALLOC_PRAGMA)
@@ -180,10 +278,11 @@ LogInitialization(ULONG flag, const wchar_t *log_file_path) {
   if (!NT_SUCCESS(status)) {
     goto Fail;
   }
-  HYPERPLATFORM_LOG_DEBUG("Info= %p, Buffer= %p %p, File= %S",
+  HYPERPLATFORM_LOG_DEBUG("Info= %p, Rings= %p (%lu), File= %S",
                           &g_logp_log_buffer_info,
-                          g_logp_log_buffer_info.log_buffer1,
-                          g_logp_log_buffer_info.log_buffer2, log_file_path);
+                          g_logp_log_buffer_info.rings,
+                          g_logp_log_buffer_info.number_of_rings,
+                          log_file_path);
   return (need_reinitialization ? STATUS_REINITIALIZATION_NEEDED
                                 : STATUS_SUCCESS);
 
@@ -201,8 +300,6 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeBufferInfo(
   NT_ASSERT(log_file_path);
   NT_ASSERT(info);
 
-  KeInitializeSpinLock(&info->spin_lock);
-
   auto status = RtlStringCchCopyW(
       info->log_file_path, RTL_NUMBER_OF_FIELD(LogBufferInfo, log_file_path),
       log_file_path);
@@ -216,34 +313,39 @@ _Use_decl_annotations_ static NTSTATUS LogpInitializeBufferInfo(
   }
   info->resource_initialized = true;
 
-  // Allocate two log buffers on NonPagedPool.
-  info->log_buffer1 = reinterpret_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPool, kLogpBufferSize, kLogpPoolTag));
-  if (!info->log_buffer1) {
+  KeInitializeEvent(&info->flush_event, SynchronizationEvent, FALSE);
+
+  info->write_buffer = reinterpret_cast<char *>(
+      ExAllocatePoolWithTag(PagedPool, kLogpWriteBufferSize, kLogpPoolTag));
+  if (!info->write_buffer) {
     LogpFinalizeBufferInfo(info);
     return STATUS_INSUFFICIENT_RESOURCES;
   }
 
-  info->log_buffer2 = reinterpret_cast<char *>(
-      ExAllocatePoolWithTag(NonPagedPool, kLogpBufferSize, kLogpPoolTag));
-  if (!info->log_buffer2) {
+  // Allocate a log ring for each processor on NonPagedPool. Rings must be
+  // zeroed as the flusher relies on kLogpEntryFree being zero.
+  const auto number_of_rings =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto rings_size = sizeof(LogRing) * number_of_rings;
+  const auto rings = reinterpret_cast<LogRing *>(
+      ExAllocatePoolWithTag(NonPagedPool, rings_size, kLogpPoolTag));
+  if (!rings) {
     LogpFinalizeBufferInfo(info);
     return STATUS_INSUFFICIENT_RESOURCES;
   }
-
-  // Initialize these buffers
-  RtlFillMemory(info->log_buffer1, kLogpBufferSize, 0xff);  // for diagnostic
-  info->log_buffer1[0] = '\0';
-  info->log_buffer1[kLogpBufferSize - 1] = '\0';  // at the end
-
-  RtlFillMemory(info->log_buffer2, kLogpBufferSize, 0xff);  // for diagnostic
-  info->log_buffer2[0] = '\0';
-  info->log_buffer2[kLogpBufferSize - 1] = '\0';  // at the end
-
-  // Buffer should be used is log_buffer1, and location should be written logs
-  // is the head of the buffer.
-  info->log_buffer_head = info->log_buffer1;
-  info->log_buffer_tail = info->log_buffer1;
+  RtlZeroMemory(rings, rings_size);
+  info->rings = rings;
+  info->number_of_rings = number_of_rings;
+
+  for (auto i = 0ul; i < number_of_rings; ++i) {
+    rings[i].buffer = reinterpret_cast<char *>(
+        ExAllocatePoolWithTag(NonPagedPool, kLogpRingSize, kLogpPoolTag));
+    if (!rings[i].buffer) {
+      LogpFinalizeBufferInfo(info);
+      return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    RtlZeroMemory(rings[i].buffer, kLogpRingSize);
+  }
 
   status = LogpInitializeLogFile(info);
   if (status == STATUS_OBJECT_PATH_NOT_FOUND) {
@@ -330,16 +432,17 @@ _Use_decl_annotations_ VOID static LogpReinitializationRoutine(
 _Use_decl_annotations_ void LogIrpShutdownHandler() {
   PAGED_CODE();
 
-  HYPERPLATFORM_LOG_DEBUG("Flushing... (Max log usage = %Iu/%lu bytes)",
-                          g_logp_log_buffer_info.log_max_usage,
-                          kLogpBufferSize);
+  HYPERPLATFORM_LOG_DEBUG("Flushing... (Log rings = %lu x %lu bytes)",
+                          g_logp_log_buffer_info.number_of_rings,
+                          kLogpRingSize);
   HYPERPLATFORM_LOG_INFO("Bye!");
   g_logp_debug_flag = kLogPutLevelDisable;
 
-  // Wait until the log buffer is emptied.
+  // Write and commit all buffered entries now.
   auto &info = g_logp_log_buffer_info;
-  while (info.log_buffer_head[0]) {
-    LogpSleep(kLogpLogFlushIntervalMsec);
+  if (LogpIsLogFileEnabled(info) && LogpIsLogFileActivated(info)) {
+    LogpFlushLogBuffer(&info);
+    LogpCommitLogFile(&info, true);
   }
 }
 
@@ -347,9 +450,9 @@ _Use_decl_annotations_ void LogIrpShutdownHandler() {
 _Use_decl_annotations_ void LogTermination() {
   PAGED_CODE();
 
-  HYPERPLATFORM_LOG_DEBUG("Finalizing... (Max log usage = %Iu/%lu bytes)",
-                          g_logp_log_buffer_info.log_max_usage,
-                          kLogpBufferSize);
+  HYPERPLATFORM_LOG_DEBUG("Finalizing... (Log rings = %lu x %lu bytes)",
+                          g_logp_log_buffer_info.number_of_rings,
+                          kLogpRingSize);
   HYPERPLATFORM_LOG_INFO("Bye!");
   g_logp_debug_flag = kLogPutLevelDisable;
   LogpFinalizeBufferInfo(&g_logp_log_buffer_info);
@@ -363,6 +466,7 @@ _Use_decl_annotations_ static void LogpFinalizeBufferInfo(LogBufferInfo *info) {
   // Closing the log buffer flush thread.
   if (info->buffer_flush_thread_handle) {
     info->buffer_flush_thread_should_be_alive = false;
+    KeSetEvent(&info->flush_event, IO_NO_INCREMENT, FALSE);
     auto status =
         ZwWaitForSingleObject(info->buffer_flush_thread_handle, FALSE, nullptr);
     if (!NT_SUCCESS(status)) {
@@ -377,13 +481,19 @@ _Use_decl_annotations_ static void LogpFinalizeBufferInfo(LogBufferInfo *info) {
     ZwClose(info->log_file_handle);
     info->log_file_handle = nullptr;
   }
-  if (info->log_buffer2) {
-    ExFreePoolWithTag(info->log_buffer2, kLogpPoolTag);
-    info->log_buffer2 = nullptr;
+  if (info->rings) {
+    for (auto i = 0ul; i < info->number_of_rings; ++i) {
+      if (info->rings[i].buffer) {
+        ExFreePoolWithTag(info->rings[i].buffer, kLogpPoolTag);
+      }
+    }
+    ExFreePoolWithTag(info->rings, kLogpPoolTag);
+    info->rings = nullptr;
+    info->number_of_rings = 0;
   }
-  if (info->log_buffer1) {
-    ExFreePoolWithTag(info->log_buffer1, kLogpPoolTag);
-    info->log_buffer1 = nullptr;
+  if (info->write_buffer) {
+    ExFreePoolWithTag(info->write_buffer, kLogpPoolTag);
+    info->write_buffer = nullptr;
   }
 
   if (info->resource_initialized) {
@@ -425,8 +535,10 @@ _Use_decl_annotations_ NTSTATUS LogpPrint(ULONG level,
   char message[512];
   static_assert(RTL_NUMBER_OF(message) <= 512,
                 "One log message should not exceed 512 bytes.");
-  status = LogpMakePrefix(pure_level, function_name, log_message, message,
-                          RTL_NUMBER_OF(message));
+  LogContext context = {};
+  LogpCaptureContext(&context);
+  status = LogpMakePrefix(pure_level, function_name, log_message, context,
+                          message, RTL_NUMBER_OF(message));
   if (!NT_SUCCESS(status)) {
     LogpDbgBreak();
     return status;
@@ -439,11 +551,95 @@ _Use_decl_annotations_ NTSTATUS LogpPrint(ULONG level,
   return status;
 }
 
+// Buffers a message without formatting it. It is formatted by
+// LogpFormatDeferredMessage() when it is flushed.
+_Use_decl_annotations_ NTSTATUS LogpBufferDeferredMessage(
+    ULONG level, const char *function_name, const char *format,
+    const LogDeferredArguments *arguments) {
+  auto &info = g_logp_log_buffer_info;
+  if (!LogpIsLogNeeded(level) || !LogpIsLogFileEnabled(info)) {
+    return STATUS_SUCCESS;
+  }
+
+  const auto payload_size = static_cast<ULONG>(sizeof(LogDeferredEntry) +
+                                               arguments->arguments_size +
+                                               arguments->strings_size);
+  KIRQL old_irql = 0;
+  const auto entry = LogpReserveRingEntry(payload_size, &info, &old_irql);
+  if (!entry) {
+    return STATUS_BUFFER_OVERFLOW;
+  }
+
+  const auto deferred = reinterpret_cast<LogDeferredEntry *>(entry + 1);
+  deferred->level = level;
+  deferred->string_slots = arguments->string_slots;
+  deferred->function_name = function_name;
+  deferred->format = format;
+  LogpCaptureContext(&deferred->context);
+  deferred->arguments_size = arguments->arguments_size;
+  deferred->strings_size = arguments->strings_size;
+  const auto packed_arguments = reinterpret_cast<UCHAR *>(deferred + 1);
+  RtlCopyMemory(packed_arguments, arguments->arguments,
+                arguments->arguments_size);
+  RtlCopyMemory(packed_arguments + arguments->arguments_size,
+                arguments->strings, arguments->strings_size);
+  entry->deferred = true;
+  LogpCommitRingEntry(entry, old_irql);
+  return STATUS_SUCCESS;
+}
+
+// Formats a buffered deferred message into the same form as LogpPrint() does.
+// String arguments are relocated to copies in the entry before formatting.
+_Use_decl_annotations_ static NTSTATUS LogpFormatDeferredMessage(
+    LogDeferredEntry *entry, char *log_buffer, SIZE_T log_buffer_length) {
+  const auto arguments = reinterpret_cast<UCHAR *>(entry + 1);
+  const auto strings = arguments + entry->arguments_size;
+  for (auto slot = 0ul; slot < entry->arguments_size / sizeof(void *); ++slot) {
+    if (entry->string_slots & (1ul << slot)) {
+      auto &value = reinterpret_cast<ULONG_PTR *>(arguments)[slot];
+      value = reinterpret_cast<ULONG_PTR>(strings + value);
+    }
+  }
+
+  char log_message[412];
+  auto status = RtlStringCchVPrintfA(log_message, RTL_NUMBER_OF(log_message),
+                                     entry->format,
+                                     reinterpret_cast<va_list>(arguments));
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+  return LogpMakePrefix(entry->level & 0xf0, entry->function_name, log_message,
+                        entry->context, log_buffer, log_buffer_length);
+}
+
+// Saves meta information such as the current time and a process ID.
+_Use_decl_annotations_ static void LogpCaptureContext(LogContext *context) {
+  KeQuerySystemTime(&context->system_time);
+  context->processor_number = KeGetCurrentProcessorNumberEx(nullptr);
+
+  // It uses PsGetProcessId(PsGetCurrentProcess()) instead of
+  // PsGetCurrentThreadProcessId() because the later sometimes returns
+  // unwanted value, for example:
+  //  PID == 4 but its image name != ntoskrnl.exe
+  // The author is guessing that it is related to attaching processes but
+  // not quite sure. The former way works as expected.
+  const auto process = PsGetCurrentProcess();
+  context->process_id = reinterpret_cast<ULONG_PTR>(PsGetProcessId(process));
+  context->thread_id = reinterpret_cast<ULONG_PTR>(PsGetCurrentThreadId());
+  const auto process_name = PsGetProcessImageFileName(process);
+  auto i = 0ul;
+  for (; i < RTL_NUMBER_OF(context->process_name) - 1 && process_name[i];
+       ++i) {
+    context->process_name[i] = static_cast<char>(process_name[i]);
+  }
+  context->process_name[i] = '\0';
+}
+
 // Concatenates meta information such as the current time and a process ID to
 // user given log message.
 _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
     ULONG level, const char *function_name, const char *log_message,
-    char *log_buffer, SIZE_T log_buffer_length) {
+    const LogContext &context, char *log_buffer, SIZE_T log_buffer_length) {
   char const *level_string = nullptr;
   switch (level) {
     case kLogpLevelDebug:
@@ -468,9 +664,9 @@ _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
   if ((g_logp_debug_flag & kLogOptDisableTime) == 0) {
     // Want the current time.
     TIME_FIELDS time_fields;
-    LARGE_INTEGER system_time, local_time;
-    KeQuerySystemTime(&system_time);
-    ExSystemTimeToLocalTime(&system_time, &local_time);
+    LARGE_INTEGER local_time;
+    ExSystemTimeToLocalTime(const_cast<LARGE_INTEGER *>(&context.system_time),
+                            &local_time);
     RtlTimeToTimeFields(&local_time, &time_fields);
 
     status = RtlStringCchPrintfA(time_buffer, RTL_NUMBER_OF(time_buffer),
@@ -499,24 +695,16 @@ _Use_decl_annotations_ static NTSTATUS LogpMakePrefix(
   if ((g_logp_debug_flag & kLogOptDisableProcessorNumber) == 0) {
     status =
         RtlStringCchPrintfA(processro_number, RTL_NUMBER_OF(processro_number),
-                            "#%lu\t", KeGetCurrentProcessorNumberEx(nullptr));
+                            "#%lu\t", context.processor_number);
     if (!NT_SUCCESS(status)) {
       return status;
     }
   }
 
-  // It uses PsGetProcessId(PsGetCurrentProcess()) instead of
-  // PsGetCurrentThreadProcessId() because the later sometimes returns
-  // unwanted value, for example:
-  //  PID == 4 but its image name != ntoskrnl.exe
-  // The author is guessing that it is related to attaching processes but
-  // not quite sure. The former way works as expected.
   status = RtlStringCchPrintfA(
       log_buffer, log_buffer_length, "%s%s%s%5Iu\t%5Iu\t%-15s\t%s%s\r\n",
-      time_buffer, level_string, processro_number,
-      reinterpret_cast<ULONG_PTR>(PsGetProcessId(PsGetCurrentProcess())),
-      reinterpret_cast<ULONG_PTR>(PsGetCurrentThreadId()),
-      PsGetProcessImageFileName(PsGetCurrentProcess()), function_name_buffer,
+      time_buffer, level_string, processro_number, context.process_id,
+      context.thread_id, context.process_name, function_name_buffer,
       log_message);
   return status;
 }
@@ -546,27 +734,31 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
   auto do_DbgPrint = ((attribute & kLogpLevelOptSafe) == 0 &&
                       KeGetCurrentIrql() < CLOCK_LEVEL);
 
-  // Log the entry to a file or buffer.
+  // Buffer the entry with whether it is going to be printed out. The flush
+  // thread writes it into a file later with other entries at once.
   auto &info = g_logp_log_buffer_info;
   if (LogpIsLogFileEnabled(info)) {
-    // Can it log it to a file now?
-    if (((attribute & kLogpLevelOptSafe) == 0) &&
-        KeGetCurrentIrql() == PASSIVE_LEVEL && LogpIsLogFileActivated(info)) {
+    // Can it write buffered entries into a file now if the ring is getting
+    // full?
+    const auto can_write_file = ((attribute & kLogpLevelOptSafe) == 0) &&
+                                KeGetCurrentIrql() == PASSIVE_LEVEL &&
+                                LogpIsLogFileActivated(info);
 #pragma warning(push)
 #pragma warning(disable : 28123)
-      if (!KeAreAllApcsDisabled()) {
-        // Yes, it can. Do it.
-        LogpFlushLogBuffer(&info);
-        status = LogpWriteMessageToFile(message, info);
-      }
+    if (can_write_file && !KeAreAllApcsDisabled() &&
+        LogpIsRingAboveWatermark(info)) {
+      LogpFlushLogBuffer(&info);
+    }
 #pragma warning(pop)
-    } else {
-      // No, it cannot. Set the printed bit if needed, and then buffer it.
-      if (do_DbgPrint) {
-        LogpSetPrintedBit(message, true);
-      }
-      status = LogpBufferMessage(message, &info);
-      LogpSetPrintedBit(message, false);
+
+    status = LogpBufferMessage(message, do_DbgPrint, &info);
+
+    // Wake up the flush thread if it is safe to do so. It cannot be done at
+    // VMX-root, where the thread picks up entries at the next commit.
+    if (((attribute & kLogpLevelOptSafe) == 0) &&
+        KeGetCurrentIrql() <= DISPATCH_LEVEL && LogpIsLogFileActivated(info) &&
+        LogpIsRingAboveWatermark(info)) {
+      KeSetEvent(&info.flush_event, IO_NO_INCREMENT, FALSE);
     }
   }
 
@@ -577,10 +769,10 @@ _Use_decl_annotations_ static NTSTATUS LogpPut(char *message, ULONG attribute) {
   return status;
 }
 
-// Switches the current log buffer, saves the contents of old buffer to the log
-// file, and prints them out as necessary. This function does not flush the log
-// file, so code should call LogpWriteMessageToFile() or ZwFlushBuffersFile()
-// later.
+// Saves buffered log entries in all rings to the log file in order of their
+// timestamps with as few ZwWriteFile() calls as possible, and prints them out
+// as necessary. This function does not flush the log file, so code should call
+// LogpCommitLogFile() later.
 _Use_decl_annotations_ static NTSTATUS LogpFlushLogBuffer(LogBufferInfo *info) {
   NT_ASSERT(info);
   NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
@@ -588,115 +780,274 @@ _Use_decl_annotations_ static NTSTATUS LogpFlushLogBuffer(LogBufferInfo *info) {
   auto status = STATUS_SUCCESS;
 
   // Enter a critical section and acquire a reader lock for info in order to
-  // write a log file safely.
+  // write a log file safely. It also makes this thread the only consumer of
+  // the rings.
   ExEnterCriticalRegionAndAcquireResourceExclusive(&info->resource);
 
-  // Acquire a spin lock for info.log_buffer(s) in order to switch its head
-  // safely.
-  KLOCK_QUEUE_HANDLE lock_handle = {};
-  KeAcquireInStackQueuedSpinLock(&info->spin_lock, &lock_handle);
-  const auto old_log_buffer = const_cast<char *>(info->log_buffer_head);
-  if (old_log_buffer[0]) {
-    info->log_buffer_head = (old_log_buffer == info->log_buffer1)
-                                ? info->log_buffer2
-                                : info->log_buffer1;
-    info->log_buffer_head[0] = '\0';
-    info->log_buffer_tail = info->log_buffer_head;
-  }
-  KeReleaseInStackQueuedSpinLock(&lock_handle);
-
-  // Write all log entries in old log buffer.
-  IO_STATUS_BLOCK io_status = {};
-  for (auto current_log_entry = old_log_buffer; current_log_entry[0]; /**/) {
-    // Check the printed bit and clear it
-    const auto printed_out = LogpIsPrinted(current_log_entry);
-    LogpSetPrintedBit(current_log_entry, false);
-
-    const auto current_log_entry_length = strlen(current_log_entry);
-    status = ZwWriteFile(info->log_file_handle, nullptr, nullptr, nullptr,
-                         &io_status, current_log_entry,
-                         static_cast<ULONG>(current_log_entry_length), nullptr,
-                         nullptr);
-    if (!NT_SUCCESS(status)) {
-      // It could happen when you did not register IRP_SHUTDOWN and call
-      // LogIrpShutdownHandler() and the system tried to log to a file after
-      // a file system was unmounted.
-      LogpDbgBreak();
+  // Only flush entries reserved so far so that this loop ends even while
+  // other processors keep logging.
+  for (auto i = 0ul; i < info->number_of_rings; ++i) {
+    info->rings[i].flush_limit = info->rings[i].write_offset;
+  }
+
+  // Write all log entries merging the rings by timestamps.
+  for (;;) {
+    LogRing *oldest_ring = nullptr;
+    LogEntryHeader *oldest_entry = nullptr;
+    for (auto i = 0ul; i < info->number_of_rings; ++i) {
+      const auto entry = LogpPeekRingEntry(&info->rings[i]);
+      if (entry &&
+          (!oldest_entry || entry->timestamp < oldest_entry->timestamp)) {
+        oldest_ring = &info->rings[i];
+        oldest_entry = entry;
+      }
+    }
+    if (!oldest_entry) {
+      break;
     }
 
+    // Format a deferred message now
+    char deferred_message[512];
+    auto message = reinterpret_cast<char *>(oldest_entry + 1);
+    if (oldest_entry->deferred) {
+      status = LogpFormatDeferredMessage(
+          reinterpret_cast<LogDeferredEntry *>(oldest_entry + 1),
+          deferred_message, RTL_NUMBER_OF(deferred_message));
+      if (!NT_SUCCESS(status)) {
+        LogpDbgBreak();
+        LogpConsumeRingEntry(oldest_ring, oldest_entry);
+        continue;
+      }
+      message = deferred_message;
+    }
+    LogpAppendToWriteBuffer(info, message, strlen(message));
+
     // Print it out if requested and the message is not already printed out
-    if (!printed_out) {
-      LogpDoDbgPrint(current_log_entry);
+    if (!oldest_entry->printed) {
+      LogpDoDbgPrint(message);
     }
 
-    current_log_entry += current_log_entry_length + 1;
+    LogpConsumeRingEntry(oldest_ring, oldest_entry);
   }
-  old_log_buffer[0] = '\0';
+
+  LogpReportDroppedEntries(info);
+  status = LogpWriteOutWriteBuffer(info);
 
   ExReleaseResourceAndLeaveCriticalRegion(&info->resource);
   return status;
 }
 
-// Logs the current log entry to and flush the log file.
-_Use_decl_annotations_ static NTSTATUS LogpWriteMessageToFile(
-    const char *message, const LogBufferInfo &info) {
+// Returns the oldest committed entry in the ring up to LogRing::flush_limit
+// while consuming paddings, or nullptr when there is nothing to flush or the
+// oldest one is still being written.
+_Use_decl_annotations_ static LogEntryHeader *LogpPeekRingEntry(
+    LogRing *ring) {
+  while (static_cast<ULONG>(ring->read_offset) != ring->flush_limit) {
+    const auto entry = reinterpret_cast<LogEntryHeader *>(
+        ring->buffer + (ring->read_offset & (kLogpRingSize - 1)));
+    const auto state = entry->state;
+    if (state == kLogpEntryPadding) {
+      LogpConsumeRingEntry(ring, entry);
+      continue;
+    }
+    return (state == kLogpEntryCommitted) ? entry : nullptr;
+  }
+  return nullptr;
+}
+
+// Clears the oldest entry and releases its space for producers. The entire
+// entry is zeroed as a next entry may begin anywhere in this range.
+_Use_decl_annotations_ static void LogpConsumeRingEntry(LogRing *ring,
+                                                        LogEntryHeader *entry) {
+  const auto size = entry->size;
+  RtlZeroMemory(entry, size);
+  InterlockedExchangeAdd(&ring->read_offset, static_cast<LONG>(size));
+}
+
+// Writes the number of entries dropped since the last report for each
+// processor to the log file.
+_Use_decl_annotations_ static void LogpReportDroppedEntries(
+    LogBufferInfo *info) {
+  for (auto i = 0ul; i < info->number_of_rings; ++i) {
+    auto &ring = info->rings[i];
+    const auto dropped = ring.dropped;
+    if (dropped == ring.reported_dropped) {
+      continue;
+    }
+
+    char log_message[100];
+    auto status = RtlStringCchPrintfA(
+        log_message, RTL_NUMBER_OF(log_message),
+        "%lu log entries were dropped on processor #%lu (total %lu).",
+        static_cast<ULONG>(dropped - ring.reported_dropped), i, dropped);
+    ring.reported_dropped = dropped;
+    if (!NT_SUCCESS(status)) {
+      continue;
+    }
+
+    char message[512];
+    LogContext context = {};
+    LogpCaptureContext(&context);
+    status = LogpMakePrefix(kLogpLevelWarn, __FUNCTION__, log_message, context,
+                            message, RTL_NUMBER_OF(message));
+    if (!NT_SUCCESS(status)) {
+      continue;
+    }
+
+    LogpAppendToWriteBuffer(info, message, strlen(message));
+    LogpDoDbgPrint(message);
+  }
+}
+
+// Copies the formatted entry to the write buffer, and writes out the buffer
+// first if it does not have enough space.
+_Use_decl_annotations_ static void LogpAppendToWriteBuffer(
+    LogBufferInfo *info, const char *message, SIZE_T length) {
+  NT_ASSERT(length <= kLogpWriteBufferSize);
+
+  if (info->write_buffer_used + length > kLogpWriteBufferSize) {
+    LogpWriteOutWriteBuffer(info);
+  }
+  RtlCopyMemory(info->write_buffer + info->write_buffer_used, message, length);
+  info->write_buffer_used += length;
+}
+
+// Writes all entries in the write buffer into the log file with a single
+// ZwWriteFile() call.
+_Use_decl_annotations_ static NTSTATUS LogpWriteOutWriteBuffer(
+    LogBufferInfo *info) {
   NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
 
+  if (!info->write_buffer_used) {
+    return STATUS_SUCCESS;
+  }
+
   IO_STATUS_BLOCK io_status = {};
-  auto status =
-      ZwWriteFile(info.log_file_handle, nullptr, nullptr, nullptr, &io_status,
-                  const_cast<char *>(message),
-                  static_cast<ULONG>(strlen(message)), nullptr, nullptr);
+  const auto status = ZwWriteFile(
+      info->log_file_handle, nullptr, nullptr, nullptr, &io_status,
+      info->write_buffer, static_cast<ULONG>(info->write_buffer_used), nullptr,
+      nullptr);
   if (!NT_SUCCESS(status)) {
     // It could happen when you did not register IRP_SHUTDOWN and call
     // LogIrpShutdownHandler() and the system tried to log to a file after
     // a file system was unmounted.
     LogpDbgBreak();
   }
-  status = ZwFlushBuffersFile(info.log_file_handle, &io_status);
+  info->write_buffer_used = 0;
+  info->commit_needed = true;
+  return status;
+}
+
+// Flushes the log file if entries were written and kLogpGroupCommitIntervalMsec
+// has passed since the last commit, or force is true.
+_Use_decl_annotations_ static NTSTATUS LogpCommitLogFile(LogBufferInfo *info,
+                                                         bool force) {
+  NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
+
+  auto status = STATUS_SUCCESS;
+  ExEnterCriticalRegionAndAcquireResourceExclusive(&info->resource);
+  const auto now = KeQueryInterruptTime();
+  const auto interval = 10000ull * kLogpGroupCommitIntervalMsec;
+  if (info->commit_needed &&
+      (force || now - info->last_commit_time >= interval)) {
+    IO_STATUS_BLOCK io_status = {};
+    status = ZwFlushBuffersFile(info->log_file_handle, &io_status);
+    info->commit_needed = false;
+    info->last_commit_time = now;
+  }
+  ExReleaseResourceAndLeaveCriticalRegion(&info->resource);
   return status;
 }
 
-// Buffer the log entry to the log buffer.
+// Buffer the log entry to the ring of the current processor.
 _Use_decl_annotations_ static NTSTATUS LogpBufferMessage(const char *message,
+                                                         bool printed,
                                                          LogBufferInfo *info) {
   NT_ASSERT(info);
 
-  // Acquire a spin lock to add the log safely.
-  KLOCK_QUEUE_HANDLE lock_handle = {};
-  const auto old_irql = KeGetCurrentIrql();
-  if (old_irql < DISPATCH_LEVEL) {
-    KeAcquireInStackQueuedSpinLock(&info->spin_lock, &lock_handle);
-  } else {
-    KeAcquireInStackQueuedSpinLockAtDpcLevel(&info->spin_lock, &lock_handle);
+  const auto message_length = strlen(message) + 1;
+  KIRQL old_irql = 0;
+  const auto entry = LogpReserveRingEntry(static_cast<ULONG>(message_length),
+                                          info, &old_irql);
+  if (!entry) {
+    return STATUS_BUFFER_OVERFLOW;
   }
-  NT_ASSERT(KeGetCurrentIrql() >= DISPATCH_LEVEL);
 
-  // Copy the current log to the buffer.
-  SIZE_T used_buffer_size = info->log_buffer_tail - info->log_buffer_head;
-  auto status =
-      RtlStringCchCopyA(const_cast<char *>(info->log_buffer_tail),
-                        kLogpBufferUsableSize - used_buffer_size, message);
+  // Copy the current log to the ring, and then commit it.
+  entry->printed = printed;
+  RtlCopyMemory(entry + 1, message, message_length);
+  LogpCommitRingEntry(entry, old_irql);
+  return STATUS_SUCCESS;
+}
 
-  // Update info.log_max_usage if necessary.
-  if (NT_SUCCESS(status)) {
-    const auto message_length = strlen(message) + 1;
-    info->log_buffer_tail += message_length;
-    used_buffer_size += message_length;
-    if (used_buffer_size > info->log_max_usage) {
-      info->log_max_usage = used_buffer_size;  // Update
+// Reserves an entry with payload_size bytes following LogEntryHeader in the
+// ring of the current processor, or returns nullptr when the ring is full. On
+// success, IRQL is raised to DISPATCH_LEVEL until LogpCommitRingEntry() is
+// called so that the entry is not left uncommitted for a long time due to a
+// context switch, which stops the flusher at this entry.
+_Use_decl_annotations_ static LogEntryHeader *LogpReserveRingEntry(
+    ULONG payload_size, LogBufferInfo *info, KIRQL *old_irql) {
+  const auto entry_size = static_cast<ULONG>(ALIGN_UP_BY(
+      sizeof(LogEntryHeader) + payload_size, kLogpEntryAlignment));
+  const auto timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+
+  *old_irql = KeGetCurrentIrql();
+  if (*old_irql < DISPATCH_LEVEL) {
+    KeRaiseIrql(DISPATCH_LEVEL, old_irql);
+  }
+
+  // Any ring can be used safely, so processors added after the initialization
+  // share rings.
+  auto &ring = info->rings[KeGetCurrentProcessorNumberEx(nullptr) %
+                           info->number_of_rings];
+
+  // Reserve space for the entry. An entry is not split at the end of a ring,
+  // and the remaining space is reserved as padding in that case.
+  ULONG position = 0;
+  ULONG padding = 0;
+  for (;;) {
+    const auto write_offset = static_cast<ULONG>(ring.write_offset);
+    const auto read_offset = static_cast<ULONG>(ring.read_offset);
+    position = write_offset & (kLogpRingSize - 1);
+    padding = (position + entry_size > kLogpRingSize)
+                  ? kLogpRingSize - position
+                  : 0;
+    if (write_offset - read_offset + padding + entry_size > kLogpRingSize) {
+      InterlockedIncrement(&ring.dropped);
+      if (*old_irql < DISPATCH_LEVEL) {
+        KeLowerIrql(*old_irql);
+      }
+      return nullptr;
+    }
+    const auto new_write_offset = write_offset + padding + entry_size;
+    if (static_cast<ULONG>(InterlockedCompareExchange(
+            &ring.write_offset, static_cast<LONG>(new_write_offset),
+            static_cast<LONG>(write_offset))) == write_offset) {
+      break;
     }
-  } else {
-    info->log_max_usage = kLogpBufferSize;  // Indicates overflow
   }
-  *info->log_buffer_tail = '\0';
 
+  if (padding) {
+    const auto padding_entry =
+        reinterpret_cast<LogEntryHeader *>(ring.buffer + position);
+    padding_entry->size = padding;
+    InterlockedExchange(&padding_entry->state, kLogpEntryPadding);
+    position = 0;
+  }
+
+  const auto entry = reinterpret_cast<LogEntryHeader *>(ring.buffer + position);
+  entry->size = entry_size;
+  entry->timestamp = timestamp;
+  return entry;
+}
+
+// Makes the entry visible to the flusher and restores IRQL.
+_Use_decl_annotations_ static void LogpCommitRingEntry(LogEntryHeader *entry,
+                                                       KIRQL old_irql) {
+  InterlockedExchange(&entry->state, kLogpEntryCommitted);
   if (old_irql < DISPATCH_LEVEL) {
-    KeReleaseInStackQueuedSpinLock(&lock_handle);
-  } else {
-    KeReleaseInStackQueuedSpinLockFromDpcLevel(&lock_handle);
+    KeLowerIrql(old_irql);
   }
-  return status;
 }
 
 // Calls DbgPrintEx() while converting \r\n to \n\0
@@ -713,18 +1064,35 @@ _Use_decl_annotations_ static void LogpDoDbgPrint(char *message) {
 // Returns true when a log file is enabled.
 _Use_decl_annotations_ static bool LogpIsLogFileEnabled(
     const LogBufferInfo &info) {
-  if (info.log_buffer1) {
-    NT_ASSERT(info.log_buffer2);
-    NT_ASSERT(info.log_buffer_head);
-    NT_ASSERT(info.log_buffer_tail);
+  if (info.rings) {
+    NT_ASSERT(info.number_of_rings);
     return true;
   }
-  NT_ASSERT(!info.log_buffer2);
-  NT_ASSERT(!info.log_buffer_head);
-  NT_ASSERT(!info.log_buffer_tail);
+  NT_ASSERT(!info.number_of_rings);
   return false;
 }
 
+// Returns true when the ring of the current processor is used beyond
+// kLogpRingWatermark.
+_Use_decl_annotations_ static bool LogpIsRingAboveWatermark(
+    const LogBufferInfo &info) {
+  const auto &ring = info.rings[KeGetCurrentProcessorNumberEx(nullptr) %
+                                info.number_of_rings];
+  return static_cast<ULONG>(ring.write_offset - ring.read_offset) >=
+         kLogpRingWatermark;
+}
+
+// Returns true when all entries in all rings are consumed.
+_Use_decl_annotations_ static bool LogpIsLogBufferEmpty(
+    const LogBufferInfo &info) {
+  for (auto i = 0ul; i < info.number_of_rings; ++i) {
+    if (info.rings[i].read_offset != info.rings[i].write_offset) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // Returns true when a log file is opened.
 _Use_decl_annotations_ static bool LogpIsLogFileActivated(
     const LogBufferInfo &info) {
@@ -750,7 +1118,8 @@ _Use_decl_annotations_ static bool LogpIsLogNeeded(ULONG level) {
 }
 
 // A thread runs as long as info.buffer_flush_thread_should_be_alive is true and
-// flushes a log buffer to a log file every kLogpLogFlushIntervalMsec msec.
+// flushes log buffers to a log file when a ring reaches kLogpRingWatermark or
+// every kLogpGroupCommitIntervalMsec msec. It sleeps while nothing is logged.
 _Use_decl_annotations_ static VOID LogpBufferFlushThreadRoutine(
     void *start_context) {
   PAGED_CODE();
@@ -760,18 +1129,23 @@ _Use_decl_annotations_ static VOID LogpBufferFlushThreadRoutine(
   HYPERPLATFORM_LOG_DEBUG("Log thread started (TID= %p).",
                           PsGetCurrentThreadId());
 
+  LARGE_INTEGER interval = {};
+  interval.QuadPart = -(10000ll * kLogpGroupCommitIntervalMsec);
   while (info->buffer_flush_thread_should_be_alive) {
     NT_ASSERT(LogpIsLogFileActivated(*info));
-    if (info->log_buffer_head[0]) {
+    KeWaitForSingleObject(&info->flush_event, Executive, KernelMode, FALSE,
+                          &interval);
+    if (!LogpIsLogBufferEmpty(*info)) {
       NT_ASSERT(KeGetCurrentIrql() == PASSIVE_LEVEL);
       NT_ASSERT(!KeAreAllApcsDisabled());
       status = LogpFlushLogBuffer(info);
-      // Do not flush the file for overall performance. Even a case of
-      // bug check, we should be able to recover logs by looking at both
-      // log buffers.
     }
-    LogpSleep(kLogpLogFlushIntervalMsec);
+    LogpCommitLogFile(info, false);
   }
+
+  // Write and commit entries left in the rings before exiting
+  LogpFlushLogBuffer(info);
+  LogpCommitLogFile(info, true);
   PsTerminateSystemThread(status);
 }
 
@@ -784,21 +1158,6 @@ _Use_decl_annotations_ static NTSTATUS LogpSleep(LONG millisecond) {
   return KeDelayExecutionThread(KernelMode, FALSE, &interval);
 }
 
-// Marks the message as it is already printed out, or clears the printed bit and
-// restores it to the original
-_Use_decl_annotations_ static void LogpSetPrintedBit(char *message, bool on) {
-  if (on) {
-    message[0] |= 0x80;
-  } else {
-    message[0] &= 0x7f;
-  }
-}
-
-// Tests if the printed bit is on
-_Use_decl_annotations_ static bool LogpIsPrinted(char *message) {
-  return (message[0] & 0x80) != 0;
-}
-
 // Sets a break point that works only when a debugger is present
 /*_Use_decl_annotations_*/ static void LogpDbgBreak() {
   if (!KD_DEBUGGER_NOT_PRESENT) {
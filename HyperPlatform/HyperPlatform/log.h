@@ -31,20 +31,43 @@ extern "C" {
 ///
 /// A message should not exceed 512 bytes after all string construction is
 /// done; otherwise this macro fails to log and returns non STATUS_SUCCESS.
-#define HYPERPLATFORM_LOG_DEBUG(format, ...) \
-  LogpPrint(kLogpLevelDebug, __FUNCTION__, (format), __VA_ARGS__)
+///
+/// A log below HYPERPLATFORM_LOG_COMPILED_LEVELS is removed at compile time
+/// together with evaluation of its arguments.
+#define HYPERPLATFORM_LOG_DEBUG(format, ...)                              \
+  (LogpIsLevelCompiled(kLogpLevelDebug)                                   \
+       ? LogpPrint(kLogpLevelDebug, __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
-#define HYPERPLATFORM_LOG_INFO(format, ...) \
-  LogpPrint(kLogpLevelInfo, __FUNCTION__, (format), __VA_ARGS__)
+#define HYPERPLATFORM_LOG_INFO(format, ...)                              \
+  (LogpIsLevelCompiled(kLogpLevelInfo)                                   \
+       ? LogpPrint(kLogpLevelInfo, __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
-#define HYPERPLATFORM_LOG_WARN(format, ...) \
-  LogpPrint(kLogpLevelWarn, __FUNCTION__, (format), __VA_ARGS__)
+#define HYPERPLATFORM_LOG_WARN(format, ...)                              \
+  (LogpIsLevelCompiled(kLogpLevelWarn)                                   \
+       ? LogpPrint(kLogpLevelWarn, __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG
-#define HYPERPLATFORM_LOG_ERROR(format, ...) \
-  LogpPrint(kLogpLevelError, __FUNCTION__, (format), __VA_ARGS__)
+#define HYPERPLATFORM_LOG_ERROR(format, ...)                              \
+  (LogpIsLevelCompiled(kLogpLevelError)                                   \
+       ? LogpPrint(kLogpLevelError, __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
+
+/// Defers formatting of HYPERPLATFORM_LOG_*_SAFE() messages to the log flush
+/// thread when it is 1
+#ifndef HYPERPLATFORM_LOG_ENABLE_DEFERRED_FORMAT
+#define HYPERPLATFORM_LOG_ENABLE_DEFERRED_FORMAT 1
+#endif
+
+#if HYPERPLATFORM_LOG_ENABLE_DEFERRED_FORMAT == 1
+#define HYPERPLATFORM_LOG_PRINT_SAFE LogpPrintDeferred
+#else
+#define HYPERPLATFORM_LOG_PRINT_SAFE LogpPrint
+#endif
 
 /// Buffers a message as respective severity
 /// @param format   A format string
@@ -53,25 +76,73 @@ extern "C" {
 /// Buffers the log to buffer and neither calls DbgPrint() nor writes to a file.
 /// It is strongly recommended to use it when a status of a system is not
 /// expectable in order to avoid system instability.
+///
+/// With HYPERPLATFORM_LOG_ENABLE_DEFERRED_FORMAT, the format string and raw
+/// arguments are buffered and formatted later by the log flush thread, so
+/// arguments are limited to integers, pointers and char strings, and the
+/// format string must be a literal.
 /// @see HYPERPLATFORM_LOG_DEBUG
-#define HYPERPLATFORM_LOG_DEBUG_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelDebug | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_DEBUG_SAFE(format, ...)                       \
+  (LogpIsLevelCompiled(kLogpLevelDebug)                                 \
+       ? HYPERPLATFORM_LOG_PRINT_SAFE(kLogpLevelDebug | kLogpLevelOptSafe, \
+                                      __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_INFO_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelInfo | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_INFO_SAFE(format, ...)                       \
+  (LogpIsLevelCompiled(kLogpLevelInfo)                                 \
+       ? HYPERPLATFORM_LOG_PRINT_SAFE(kLogpLevelInfo | kLogpLevelOptSafe, \
+                                      __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_WARN_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelWarn | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_WARN_SAFE(format, ...)                       \
+  (LogpIsLevelCompiled(kLogpLevelWarn)                                 \
+       ? HYPERPLATFORM_LOG_PRINT_SAFE(kLogpLevelWarn | kLogpLevelOptSafe, \
+                                      __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
 
 /// @see HYPERPLATFORM_LOG_DEBUG_SAFE
-#define HYPERPLATFORM_LOG_ERROR_SAFE(format, ...)                        \
-  LogpPrint(kLogpLevelError | kLogpLevelOptSafe, __FUNCTION__, (format), \
-            __VA_ARGS__)
+#define HYPERPLATFORM_LOG_ERROR_SAFE(format, ...)                       \
+  (LogpIsLevelCompiled(kLogpLevelError)                                 \
+       ? HYPERPLATFORM_LOG_PRINT_SAFE(kLogpLevelError | kLogpLevelOptSafe, \
+                                      __FUNCTION__, (format), __VA_ARGS__) \
+       : STATUS_SUCCESS)
+
+/// Logs a message at most \a per_second times a second on average
+/// @param level  kLogpLevel* optionally OR-ed with kLogpLevelOptSafe
+/// @param per_second   A number of messages allowed for a second
+/// @param format   A format string
+/// @return STATUS_SUCCESS on success
+///
+/// Each call site has its own token bucket holding up to \a per_second tokens.
+/// Messages are dropped while the bucket is empty, and the number of them is
+/// logged with the next message allowed. Use it for sites that may be hit
+/// on every VM-exit, such as an EPT violation handler.
+#define HYPERPLATFORM_LOG_RATE_LIMITED(level, per_second, format, ...)     \
+  (LogpIsLevelCompiled(level)                                              \
+       ? [&](const char *function_name) {                                  \
+           static LogRateLimit limit = {};                                 \
+           return LogpPrintRateLimited(&limit, (per_second), (level),      \
+                                       function_name, (format),            \
+                                       __VA_ARGS__);                       \
+         }(__FUNCTION__)                                                   \
+       : STATUS_SUCCESS)
+
+/// @see HYPERPLATFORM_LOG_RATE_LIMITED
+#define HYPERPLATFORM_LOG_DEBUG_LIMITED(per_second, format, ...) \
+  HYPERPLATFORM_LOG_RATE_LIMITED(kLogpLevelDebug, (per_second), (format), \
+                                 __VA_ARGS__)
+
+/// @see HYPERPLATFORM_LOG_RATE_LIMITED
+#define HYPERPLATFORM_LOG_DEBUG_SAFE_LIMITED(per_second, format, ...)  \
+  HYPERPLATFORM_LOG_RATE_LIMITED(kLogpLevelDebug | kLogpLevelOptSafe, \
+                                 (per_second), (format), __VA_ARGS__)
+
+/// @see HYPERPLATFORM_LOG_RATE_LIMITED
+#define HYPERPLATFORM_LOG_WARN_SAFE_LIMITED(per_second, format, ...)  \
+  HYPERPLATFORM_LOG_RATE_LIMITED(kLogpLevelWarn | kLogpLevelOptSafe, \
+                                 (per_second), (format), __VA_ARGS__)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -103,6 +174,16 @@ static const auto kLogPutLevelError = kLogpLevelError;
 /// For LogInitialization(). Disables all levels of logs
 static const auto kLogPutLevelDisable = 0x00ul;
 
+/// Levels of logs compiled in; one of kLogPutLevel*. Logs of other levels are
+/// removed at compile time regardless of a flag given to LogInitialization().
+#if !defined(HYPERPLATFORM_LOG_COMPILED_LEVELS)
+#if defined(DBG)
+#define HYPERPLATFORM_LOG_COMPILED_LEVELS kLogPutLevelDebug
+#else
+#define HYPERPLATFORM_LOG_COMPILED_LEVELS kLogPutLevelInfo
+#endif
+#endif
+
 /// For LogInitialization(). Do not log a current time
 static const auto kLogOptDisableTime = 0x100ul;
 
@@ -115,11 +196,43 @@ static const auto kLogOptDisableProcessorNumber = 0x400ul;
 /// For LogInitialization(). Do not log to debug buffer
 static const auto kLogOptDisableDbgPrint = 0x800ul;
 
+/// A maximum number of arguments of a deferred log message
+static const auto kLogpMaxDeferredArguments = 16ul;
+
+/// A size of a buffer to hold all string arguments of a deferred log message
+static const auto kLogpMaxDeferredStringsSize = 128ul;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+/// Holds arguments of a deferred log message
+///
+/// \a arguments is laid out as va_list of MSVC so that the flush thread can
+/// pass it to RtlStringCchVPrintfA() as is; each argument occupies a multiple
+/// of the pointer size after integral promotion. A slot of a string argument
+/// holds an offset into \a strings until the message is formatted.
+struct LogDeferredArguments {
+  ULONG arguments_size;  //!< Bytes used in \a arguments
+  ULONG strings_size;    //!< Bytes used in \a strings
+  ULONG string_slots;    //!< Bit N is set when slot N is a string offset
+  DECLSPEC_ALIGN(8)
+  UCHAR arguments[kLogpMaxDeferredArguments * sizeof(ULONG64)];
+  char strings[kLogpMaxDeferredStringsSize];
+};
+static_assert(sizeof(ULONG64) * kLogpMaxDeferredArguments / sizeof(void *) <=
+                  sizeof(ULONG) * 8,
+              "string_slots must cover all slots");
+
+/// Holds a state of a token bucket of HYPERPLATFORM_LOG_RATE_LIMITED(). It is
+/// implemented as the generic cell rate algorithm so that a single CAS updates
+/// it without a lock at any IRQL including VMX-root.
+struct LogRateLimit {
+  volatile LONG64 theoretical_arrival_time;  //!< In the interrupt time
+  volatile LONG suppressed;  //!< Messages dropped since the last one allowed
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -169,6 +282,18 @@ _IRQL_requires_max_(PASSIVE_LEVEL) void LogTermination();
 NTSTATUS LogpPrint(_In_ ULONG level, _In_z_ const char *function_name,
                    _In_z_ _Printf_format_string_ const char *format, ...);
 
+/// Buffers a deferred log message; use HYPERPLATFORM_LOG_*_SAFE() macros
+/// instead.
+/// @param level   Severity of a message
+/// @param function_name   A name of a function called this function
+/// @param format   A format string with a static storage duration
+/// @param arguments  Arguments packed by LogpPrintDeferred()
+/// @return STATUS_SUCCESS on success
+NTSTATUS LogpBufferDeferredMessage(_In_ ULONG level,
+                                   _In_z_ const char *function_name,
+                                   _In_z_ const char *format,
+                                   _In_ const LogDeferredArguments *arguments);
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
@@ -179,6 +304,150 @@ NTSTATUS LogpPrint(_In_ ULONG level, _In_z_ const char *function_name,
 // implementations
 //
 
+extern "C++" {
+
+/// Checks if logs of the level are compiled in
+/// @param level  kLogpLevel* optionally OR-ed with kLogpLevelOptSafe
+/// @return true if \a level is included in HYPERPLATFORM_LOG_COMPILED_LEVELS
+constexpr bool LogpIsLevelCompiled(_In_ ULONG level) {
+  return (HYPERPLATFORM_LOG_COMPILED_LEVELS & level & 0xf0) != 0;
+}
+
+/// Takes a token from the bucket
+/// @param limit  A state of the bucket
+/// @param per_second   A number of tokens added for a second and a capacity
+/// @param suppressed   Receives a number of messages dropped before this call
+/// @return true when a token was taken and a message can be logged
+inline bool LogpTakeRateLimitToken(_Inout_ LogRateLimit *limit,
+                                   _In_ ULONG per_second,
+                                   _Out_ ULONG *suppressed) {
+  *suppressed = 0;
+  if (!per_second) {
+    return false;
+  }
+
+  // The bucket is full when the theoretical arrival time is in the past, and
+  // empty when it is a second ahead of now.
+  const LONG64 interval = 10000000ll / per_second;  // In 100 ns units
+  const LONG64 tolerance = interval * (per_second - 1);
+  const auto now = static_cast<LONG64>(KeQueryInterruptTime());
+  for (;;) {
+    const auto tat = limit->theoretical_arrival_time;
+    if (tat - now > tolerance) {
+      InterlockedIncrement(&limit->suppressed);
+      return false;
+    }
+    const auto new_tat = ((tat > now) ? tat : now) + interval;
+    if (InterlockedCompareExchange64(&limit->theoretical_arrival_time, new_tat,
+                                     tat) == tat) {
+      break;
+    }
+  }
+  *suppressed = static_cast<ULONG>(InterlockedExchange(&limit->suppressed, 0));
+  return true;
+}
+
+/// Packs a string argument by copying it as the pointer may not be valid when
+/// the message is formatted
+inline void LogpPackDeferredArgument(_Inout_ LogDeferredArguments *packed,
+                                     _In_opt_z_ const char *value) {
+  const auto slot = packed->arguments_size / sizeof(void *);
+  const auto offset = packed->strings_size;
+  if (!value) {
+    value = "(null)";
+  }
+  auto size = offset;
+  for (; value[size - offset] && size < kLogpMaxDeferredStringsSize - 1;
+       ++size) {
+    packed->strings[size] = value[size - offset];
+  }
+  packed->strings[size] = '\0';
+  packed->strings_size = (size < kLogpMaxDeferredStringsSize - 1)
+                             ? size + 1
+                             : kLogpMaxDeferredStringsSize - 1;
+  packed->string_slots |= 1ul << slot;
+  *reinterpret_cast<ULONG_PTR *>(&packed->arguments[packed->arguments_size]) =
+      offset;
+  packed->arguments_size += sizeof(void *);
+}
+
+/// @copydoc LogpPackDeferredArgument(LogDeferredArguments *, const char *)
+inline void LogpPackDeferredArgument(_Inout_ LogDeferredArguments *packed,
+                                     _In_opt_z_ char *value) {
+  LogpPackDeferredArgument(packed, static_cast<const char *>(value));
+}
+
+/// Packs an integer or a pointer argument as va_arg() reads it
+template <typename T>
+inline void LogpPackDeferredArgument(_Inout_ LogDeferredArguments *packed,
+                                     _In_ T value) {
+  // Applies the integral promotion as the variable argument does
+  const auto promoted = +value;
+  static_assert(sizeof(promoted) <= sizeof(ULONG64),
+                "Unsupported argument type");
+  const auto slot_size = (sizeof(promoted) + sizeof(void *) - 1) &
+                         ~(sizeof(void *) - 1);
+  const auto slot = &packed->arguments[packed->arguments_size];
+  RtlZeroMemory(slot, slot_size);
+  RtlCopyMemory(slot, &promoted, sizeof(promoted));
+  packed->arguments_size += static_cast<ULONG>(slot_size);
+}
+
+/// Buffers a log message without formatting it; use
+/// HYPERPLATFORM_LOG_*_SAFE() macros instead.
+/// @param level   Severity of a message
+/// @param function_name   A name of a function called this function
+/// @param format   A format string with a static storage duration
+/// @param args   Arguments of \a format
+/// @return STATUS_SUCCESS on success
+///
+/// It only copies raw arguments, and does not call any of formatting
+/// functions, which are too expensive to call on each VM-exit.
+template <typename... Args>
+inline NTSTATUS LogpPrintDeferred(_In_ ULONG level,
+                                  _In_z_ const char *function_name,
+                                  _In_z_ const char *format, _In_ Args... args) {
+  static_assert(sizeof...(Args) <= kLogpMaxDeferredArguments,
+                "Too many arguments");
+  LogDeferredArguments packed;
+  packed.arguments_size = 0;
+  packed.strings_size = 0;
+  packed.string_slots = 0;
+  const int unused[] = {0, (LogpPackDeferredArgument(&packed, args), 0)...};
+  UNREFERENCED_PARAMETER(unused);
+  return LogpBufferDeferredMessage(level, function_name, format, &packed);
+}
+
+/// Logs a message if the bucket has a token; use
+/// HYPERPLATFORM_LOG_RATE_LIMITED() instead.
+template <typename... Args>
+inline NTSTATUS LogpPrintRateLimited(_Inout_ LogRateLimit *limit,
+                                     _In_ ULONG per_second, _In_ ULONG level,
+                                     _In_z_ const char *function_name,
+                                     _In_z_ const char *format,
+                                     _In_ Args... args) {
+  ULONG suppressed = 0;
+  if (!LogpTakeRateLimitToken(limit, per_second, &suppressed)) {
+    return STATUS_SUCCESS;
+  }
+
+  if (level & kLogpLevelOptSafe) {
+    if (suppressed) {
+      HYPERPLATFORM_LOG_PRINT_SAFE(level, function_name,
+                                   "(%lu similar messages suppressed)",
+                                   suppressed);
+    }
+    return HYPERPLATFORM_LOG_PRINT_SAFE(level, function_name, format, args...);
+  }
+  if (suppressed) {
+    LogpPrint(level, function_name, "(%lu similar messages suppressed)",
+              suppressed);
+  }
+  return LogpPrint(level, function_name, format, args...);
+}
+
+}  // extern "C++"
+
 }  // extern "C"
 
 #endif  // HYPERPLATFORM_LOG_H_
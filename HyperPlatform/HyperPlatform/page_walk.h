@@ -0,0 +1,217 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines a walker of 4-level paging structures and a cache of its results.
+///
+/// PageWalkTranslate() translates a virtual address with paging structures
+/// read through a callback taking a physical address, so that the VMM can
+/// walk page tables of a guest without switching CR3. 1GB and 2MB pages are
+/// handled. PageWalkCache remembers translations keyed by CR3 and a virtual
+/// page, and is invalidated as a TLB would be, on a write to CR3 or INVLPG.
+///
+/// This file does not depend on any Windows header so that it can be built
+/// and fuzz-tested on other platforms.
+
+#ifndef HYPERPLATFORM_PAGE_WALK_H_
+#define HYPERPLATFORM_PAGE_WALK_H_
+
+#if !defined(_MSC_VER)
+#include <stdint.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Fixed width integers usable with and without the CRT
+#if defined(_MSC_VER)
+typedef unsigned __int32 PageWalkU32;
+typedef unsigned __int64 PageWalkU64;
+#else
+typedef uint32_t PageWalkU32;
+typedef uint64_t PageWalkU64;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// Bits of an entry of paging structures
+static const PageWalkU64 kPageWalkPresent = 1ull << 0;
+static const PageWalkU64 kPageWalkLargePage = 1ull << 7;
+
+/// Bits of an entry holding a physical address (up to 52 bits)
+static const PageWalkU64 kPageWalkAddressMask = 0x000ffffffffff000ull;
+
+/// Sizes of pages
+static const PageWalkU64 kPageWalkPageSize4K = 1ull << 12;
+static const PageWalkU64 kPageWalkPageSize2M = 1ull << 21;
+static const PageWalkU64 kPageWalkPageSize1G = 1ull << 30;
+
+/// A number of entries of PageWalkCache. Must be a power of two.
+static const PageWalkU32 kPageWalkCacheEntries = 64;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Reads an 8-byte entry of paging structures
+/// @param context  An arbitrary parameter given to PageWalkTranslate()
+/// @param pa  A physical address of the entry
+/// @param entry  Receives the entry
+/// @return false if the entry cannot be read
+typedef bool (*PageWalkReadEntryType)(void *context, PageWalkU64 pa,
+                                      PageWalkU64 *entry);
+
+/// Represents a result of translation
+struct PageWalkResult {
+  PageWalkU64 pa;         //!< A physical address of the virtual address
+  PageWalkU64 page_size;  //!< A size of the page mapping it
+};
+
+/// Represents a cached translation of a 4KB virtual page
+struct PageWalkCacheEntry {
+  PageWalkU64 cr3;        //!< A physical address of PML4
+  PageWalkU64 va;         //!< A 4KB aligned virtual address
+  PageWalkU64 pa;         //!< A 4KB aligned physical address of va
+  PageWalkU64 page_size;  //!< A size of the page mapping it, or 0 if unused
+};
+
+/// Caches translations of a processor
+struct PageWalkCache {
+  PageWalkCacheEntry entries[kPageWalkCacheEntries];
+  PageWalkU64 hits;
+  PageWalkU64 misses;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns a physical address of PML4 in CR3, ignoring PCID and flags
+inline PageWalkU64 PageWalkGetPml4Address(PageWalkU64 cr3) {
+  return cr3 & kPageWalkAddressMask;
+}
+
+/// Translates a virtual address with 4-level paging
+/// @param cr3  A value of CR3 to walk from
+/// @param va  A virtual address to translate
+/// @param read_entry  A function reading an entry of paging structures
+/// @param context  An arbitrary parameter for \a read_entry
+/// @param result  Receives the physical address and a size of the page
+/// @return false if \a va is non-canonical, not mapped, or unreadable
+///
+/// Only presence of entries is checked. Reserved bits and access rights are
+/// ignored.
+inline bool PageWalkTranslate(PageWalkU64 cr3, PageWalkU64 va,
+                              PageWalkReadEntryType read_entry, void *context,
+                              PageWalkResult *result) {
+  // Bits 63:47 must be all zeros or all ones
+  const auto upper_bits = va >> 47;
+  if (upper_bits != 0 && upper_bits != 0x1ffff) {
+    return false;
+  }
+
+  // PML4E, PDPTE, PDE and PTE, indexed by bits 47:39, 38:30, 29:21 and 20:12
+  auto table = PageWalkGetPml4Address(cr3);
+  for (PageWalkU32 level = 4; level > 0; --level) {
+    const auto shift = 12 + (level - 1) * 9;
+    const auto index = (va >> shift) & 0x1ff;
+    PageWalkU64 entry = 0;
+    if (!read_entry(context, table + index * sizeof(entry), &entry)) {
+      return false;
+    }
+    if (!(entry & kPageWalkPresent)) {
+      return false;
+    }
+
+    const auto page_size = 1ull << shift;
+    const auto is_large_page =
+        (level == 3 || level == 2) && (entry & kPageWalkLargePage);
+    if (level == 1 || is_large_page) {
+      result->pa = (entry & kPageWalkAddressMask & ~(page_size - 1)) |
+                   (va & (page_size - 1));
+      result->page_size = page_size;
+      return true;
+    }
+    table = entry & kPageWalkAddressMask;
+  }
+  return false;
+}
+
+/// Returns an entry of the cache that may hold the translation
+inline PageWalkCacheEntry *PageWalkCacheGetEntry(PageWalkCache *cache,
+                                                 PageWalkU64 pml4,
+                                                 PageWalkU64 va_page) {
+  const auto hash = (va_page >> 12) ^ (pml4 >> 12);
+  return &cache->entries[hash & (kPageWalkCacheEntries - 1)];
+}
+
+/// Translates a virtual address, walking paging structures only on a miss
+/// @param cache  A cache to look up and update
+/// @param cr3  A value of CR3 to walk from
+/// @param va  A virtual address to translate
+/// @param read_entry  A function reading an entry of paging structures
+/// @param context  An arbitrary parameter for \a read_entry
+/// @param result  Receives the physical address and a size of the page
+/// @return false if \a va is non-canonical, not mapped, or unreadable
+///
+/// Failed translations are not cached.
+inline bool PageWalkTranslateCached(PageWalkCache *cache, PageWalkU64 cr3,
+                                    PageWalkU64 va,
+                                    PageWalkReadEntryType read_entry,
+                                    void *context, PageWalkResult *result) {
+  const auto pml4 = PageWalkGetPml4Address(cr3);
+  const auto va_page = va & ~(kPageWalkPageSize4K - 1);
+  const auto cached = PageWalkCacheGetEntry(cache, pml4, va_page);
+  if (cached->page_size && cached->cr3 == pml4 && cached->va == va_page) {
+    cache->hits++;
+    result->pa = cached->pa | (va & (kPageWalkPageSize4K - 1));
+    result->page_size = cached->page_size;
+    return true;
+  }
+
+  cache->misses++;
+  if (!PageWalkTranslate(cr3, va, read_entry, context, result)) {
+    return false;
+  }
+  cached->cr3 = pml4;
+  cached->va = va_page;
+  cached->pa = result->pa & ~(kPageWalkPageSize4K - 1);
+  cached->page_size = result->page_size;
+  return true;
+}
+
+/// Drops all translations, e.g. on a write to CR3 or CR4
+inline void PageWalkCacheInvalidateAll(PageWalkCache *cache) {
+  for (auto &entry : cache->entries) {
+    entry.page_size = 0;
+  }
+}
+
+/// Drops translations of the page containing the address, e.g. on INVLPG
+/// @param cache  A cache to update
+/// @param va  A virtual address being invalidated
+///
+/// As INVLPG does, drops all 4KB pages cached for a large page containing
+/// \a va regardless of CR3.
+inline void PageWalkCacheInvalidateAddress(PageWalkCache *cache,
+                                           PageWalkU64 va) {
+  for (auto &entry : cache->entries) {
+    if (!entry.page_size) {
+      continue;
+    }
+    const auto page_mask = ~(entry.page_size - 1);
+    if ((entry.va & page_mask) == (va & page_mask)) {
+      entry.page_size = 0;
+    }
+  }
+}
+
+#endif  // HYPERPLATFORM_PAGE_WALK_H_
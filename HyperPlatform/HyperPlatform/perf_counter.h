@@ -15,6 +15,7 @@
 #define HYPERPLATFORM_PERF_COUNTER_H_
 
 #include <fltKernel.h>
+#include "perf_histogram.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -38,21 +39,32 @@
 #define HYPERPLATFORM_PERFCOUNTER_P_TO_STRING(n) \
   HYPERPLATFORM_PERFCOUNTER_P_TO_STRING1(n)
 
+#define HYPERPLATFORM_PERFCOUNTER_P_MEASURE_TIME(collector,                 \
+                                                 query_time_routine, id)    \
+  static volatile LONG HYPERPLATFORM_PERFCOUNTER_P_JOIN(perf_slot_, id);    \
+  const PerfCounter HYPERPLATFORM_PERFCOUNTER_P_JOIN(perf_obj_, id)(        \
+      (collector), (query_time_routine),                                    \
+      __FUNCTION__ "(" HYPERPLATFORM_PERFCOUNTER_P_TO_STRING(__LINE__) ")", \
+      &HYPERPLATFORM_PERFCOUNTER_P_JOIN(perf_slot_, id))
+
 /// Creates an instance of PerfCounter to measure an elapsed time of this scope
 /// @param collector  A pointer to a PerfCollector instance
-/// @param query_time_routine   A function pointer to get an elapsed time
+/// @param query_time_routine   A function pointer to get an elapsed time, or
+///        nullptr to use serialized TSC reads
 /// @see HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME
 ///
 /// This macro should not be used directly. Instead use
 /// #HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME.
 ///
 /// This macro creates an instance of PerfCounter named perf_obj_N where N is
-/// a sequential number starting at 0. A current function name and a source line
-/// number are converted into a string literal and passed to the instance to
-/// uniquely identify a location of measurement. The instance gets "counters" in
-//  its constructor and destructor with \a query_time_routine, calculates an
-/// elapsed time and passes it to \a collector as well as the created string
-/// literal. In pseudo code, for example:
+/// a sequential number starting at 0, and a static slot number perf_slot_N
+/// for the location. A current function name and a source line number are
+/// converted into a string literal and passed to the instance to uniquely
+/// identify a location of measurement. The instance gets "counters" in its
+/// constructor and destructor with \a query_time_routine, calculates an
+/// elapsed time and passes it to \a collector as well as the slot number. The
+/// location is registered to \a collector and assigned a slot only on the
+/// first execution. In pseudo code, for example:
 ///
 /// @code{.cpp}
 /// Hello.cpp:233 | {
@@ -65,10 +77,14 @@
 ///
 /// @code{.cpp}
 /// {
+///   static slot_0;        // unregistered
 ///   begin_time = fn();    //perf_obj_0.ctor();
 ///   // do stuff
 ///   elapsed_time = fn();  //perf_obj_0.dtor();
-///   collector->AddTime(elapsed_time, "Hello.cpp(234)");
+///   if (!slot_0) {
+///     slot_0 = collector->Register("Hello.cpp(234)");
+///   }
+///   collector->AddTime(elapsed_time, slot_0);
 /// }
 /// @endcode
 ///
@@ -79,10 +95,13 @@
 /// referenced in the PerfCollector::Terminate(), while it is no longer
 /// accessible if the section is already destroyed. In other words, do not use
 /// it in any functions in the INIT section.
+///
+/// @warning
+/// A slot number is bound to the first PerfCollector instance passed at the
+/// location. Do not use different instances at the same location.
 #define HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(collector, query_time_routine) \
-  const PerfCounter HYPERPLATFORM_PERFCOUNTER_P_JOIN(perf_obj_, __COUNTER__)( \
-      (collector), (query_time_routine),                                      \
-      __FUNCTION__ "(" HYPERPLATFORM_PERFCOUNTER_P_TO_STRING(__LINE__) ")")
+  HYPERPLATFORM_PERFCOUNTER_P_MEASURE_TIME(collector, query_time_routine,     \
+                                           __COUNTER__)
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -110,8 +129,65 @@
 //
 
 /// Responsible for collecting and saving data supplied by PerfCounter.
+///
+/// Each measured location owns a fixed slot, and each processor owns a shard
+/// holding counters of all slots. Data is added to a shard of the current
+/// processor and aggregated only when results are printed out, so that
+/// measurement neither searches locations nor contends with other processors.
 class PerfCollector {
  public:
+  /// A maximum number of locations that can be measured
+  static const ULONG kMaxNumberOfDataEntries = 64;
+
+  /// Hardware events sampled when PMU sampling is enabled
+  enum PmuEvent : ULONG {
+    kPmuInstructionsRetired,  //!< IA32_FIXED_CTR0
+    kPmuUnhaltedCoreCycles,   //!< IA32_FIXED_CTR1
+    kPmuDtlbMisses,           //!< IA32_PMC0
+    kPmuLlcMisses,            //!< IA32_PMC1
+    kNumberOfPmuEvents,
+  };
+
+  /// Represents performance data of a single location on a single processor
+  struct PerfDataEntry {
+    volatile LONG64 total_execution_count;  //!< How many times executed
+    volatile LONG64 total_elapsed_time;     //!< An accumulated elapsed time
+    volatile LONG64 minimum_elapsed_time;   //!< The shortest elapsed time
+    volatile LONG64 maximum_elapsed_time;   //!< The longest elapsed time
+    volatile LONG64 pmu_sample_count;  //!< How many times PMU was sampled
+    volatile LONG64 total_pmu_counts[kNumberOfPmuEvents];  //!< By PmuEvent
+    PerfHistogram histogram;  //!< A distribution of elapsed time
+  };
+
+  /// Represents counters of a single location copied from a shard
+  struct PerfCounters {
+    ULONG64 total_execution_count;
+    ULONG64 total_elapsed_time;
+    ULONG64 minimum_elapsed_time;  //!< MAXLONG64 when never executed
+    ULONG64 maximum_elapsed_time;
+  };
+
+  /// Represents aggregated performance data of a single location
+  struct PerfStatistics {
+    ULONG64 total_execution_count;
+    ULONG64 total_elapsed_time;
+    ULONG64 minimum_elapsed_time;
+    ULONG64 maximum_elapsed_time;
+    ULONG64 p50_elapsed_time;
+    ULONG64 p90_elapsed_time;
+    ULONG64 p99_elapsed_time;
+    ULONG64 p999_elapsed_time;  //!< The 99.9th percentile
+    ULONG64 pmu_sample_count;   //!< Executions total_pmu_counts are of
+    ULONG64 total_pmu_counts[kNumberOfPmuEvents];  //!< By PmuEvent
+  };
+
+  /// Represents performance data of all locations on a single processor
+  struct Shard {
+    PerfDataEntry data[kMaxNumberOfDataEntries];
+  };
+  static_assert(sizeof(Shard) % SYSTEM_CACHE_ALIGNMENT_SIZE == 0,
+                "Shards must not share a cache line");
+
   /// A function type for printing out a header line of results
   using InitialOutputRoutine = void(_In_opt_ void* output_context);
 
@@ -120,111 +196,235 @@ class PerfCollector {
 
   /// A function type for printing out results
   using OutputRoutine = void(_In_ const char* location_name,
-                             _In_ ULONG64 total_execution_count,
-                             _In_ ULONG64 total_elapsed_time,
+                             _In_ const PerfStatistics* statistics,
                              _In_opt_ void* output_context);
 
-  /// A function type for acquiring and releasing a lock
-  using LockRoutine = void(_In_opt_ void* lock_context);
-
   /// Constructor; call this only once before any other code in this module runs
+  /// @param shards   An array of zero-initialized shards, one for each
+  ///        processor. The caller owns it and must keep it until Terminate().
+  /// @param number_of_shards   A number of elements of \a shards
   /// @param output_routine   A function pointer for printing out results
   /// @param initial_output_routine A function pointer for printing a header
   ///        line of results
   /// @param final_output_routine   A function pointer for printing a footer
   ///        line of results
-  /// @param lock_enter_routine   A function pointer for acquiring a lock
-  /// @param lock_leave_routine   A function pointer for releasing a lock
-  /// @param lock_context   An arbitrary parameter for \a lock_enter_routine and
-  ///        \a lock_leave_routine
   /// @param output_context   An arbitrary parameter for \a output_routine,
   ///        \a initial_output_routine and \a final_output_routine.
   void Initialize(
+      _In_ Shard* shards, _In_ ULONG number_of_shards,
       _In_ OutputRoutine* output_routine,
       _In_opt_ InitialOutputRoutine* initial_output_routine = NoOutputRoutine,
       _In_opt_ FinalOutputRoutine* final_output_routine = NoOutputRoutine,
-      _In_opt_ LockRoutine* lock_enter_routine = NoLockRoutine,
-      _In_opt_ LockRoutine* lock_leave_routine = NoLockRoutine,
-      _In_opt_ void* lock_context = nullptr,
       _In_opt_ void* output_context = nullptr) {
     initial_output_routine_ = initial_output_routine;
     final_output_routine_ = final_output_routine;
     output_routine_ = output_routine;
-    lock_enter_routine_ = lock_enter_routine;
-    lock_leave_routine_ = lock_leave_routine;
-    lock_context_ = lock_context;
     output_context_ = output_context;
-    memset(data_, 0, sizeof(data_));
+    shards_ = shards;
+    number_of_shards_ = number_of_shards;
+    number_of_entries_ = 0;
+    pmu_counter_mask_ = 0;
+    tsc_overhead_ = 0;
+    memset(keys_, 0, sizeof(keys_));
+    for (auto shard = 0ul; shard < number_of_shards_; shard++) {
+      for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
+        shards_[shard].data[i].minimum_elapsed_time = MAXLONG64;
+      }
+    }
   }
 
   /// Destructor; prints out accumulated performance results.
   void Terminate() {
-    if (data_[0].key) {
+    const auto number_of_entries = GetNumberOfLocations();
+    if (number_of_entries) {
       initial_output_routine_(output_context_);
     }
 
-    for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
-      if (data_[i].key == nullptr) {
-        break;
+    for (auto i = 0ul; i < number_of_entries; i++) {
+      if (keys_[i] == nullptr) {
+        continue;  // Lost a race in RegisterLocation()
       }
 
-      output_routine_(data_[i].key, data_[i].total_execution_count,
-                      data_[i].total_elapsed_time, output_context_);
+      PerfStatistics statistics;
+      GetStatistics(i, &statistics);
+      output_routine_(keys_[i], &statistics, output_context_);
     }
-    if (data_[0].key) {
+    if (number_of_entries) {
       final_output_routine_(output_context_);
     }
   }
 
-  /// Saves performance data taken by PerfCounter.
-  bool AddData(_In_ const char* location_name, _In_ ULONG64 elapsed_time) {
-    ScopedLock lock(lock_enter_routine_, lock_leave_routine_, lock_context_);
+  /// Lets PerfCounter sample hardware performance counters
+  /// @param counter_mask   A mask of valid bits of the counters, or 0 to stop
+  ///        sampling
+  ///
+  /// The caller is responsible for programming IA32_FIXED_CTR0-1 and
+  /// IA32_PMC0-1 to count events in PmuEvent on all processors beforehand.
+  void EnablePmu(_In_ ULONG64 counter_mask) {
+    pmu_counter_mask_ = counter_mask;
+  }
 
-    const auto data_index = GetPerfDataIndex(location_name);
-    if (data_index == kInvalidDataIndex) {
-      return false;
+  /// Returns a mask of valid bits of hardware performance counters
+  /// @return A mask, or 0 when PMU sampling is not enabled
+  ULONG64 GetPmuCounterMask() const { return pmu_counter_mask_; }
+
+  /// Sets a TSC count PerfCounter subtracts from each elapsed time
+  /// @param tsc_overhead   TSC counts elapsed by an empty scope
+  ///
+  /// Only applies to PerfCounter without a query time routine.
+  void SetTscOverhead(_In_ ULONG64 tsc_overhead) {
+    tsc_overhead_ = tsc_overhead;
+  }
+
+  /// Returns a TSC count PerfCounter subtracts from each elapsed time
+  /// @return TSC counts elapsed by an empty scope
+  ULONG64 GetTscOverhead() const { return tsc_overhead_; }
+
+  /// Saves performance data taken by PerfCounter.
+  /// @param slot   A slot number of the location; 0 when not registered yet
+  /// @param location_name  A location to register when \a slot is 0
+  /// @param elapsed_time   An elapsed time to add
+  /// @param pmu_counts   Events counted during \a elapsed_time indexed by
+  ///        PmuEvent, or nullptr when PMU was not sampled
+  /// @return true when the data was saved
+  ///
+  /// With interrupts disabled, which is always the case at VMX root, nothing
+  /// else can run on this processor, and plain additions on the shard of this
+  /// processor are exact. Otherwise, the thread may be interrupted or migrated
+  /// in the middle of update, so interlocked additions are used instead.
+  bool AddData(_Inout_ volatile LONG* slot, _In_ const char* location_name,
+               _In_ ULONG64 elapsed_time,
+               _In_opt_ const ULONG64* pmu_counts = nullptr) {
+    auto index = static_cast<ULONG>(*slot) - 1;
+    if (!*slot) {
+      index = RegisterLocation(slot, location_name);
+      if (index == kInvalidDataIndex) {
+        return false;
+      }
     }
 
-    data_[data_index].total_execution_count++;
-    data_[data_index].total_elapsed_time += elapsed_time;
+    const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+    auto& entry = shards_[processor % number_of_shards_].data[index];
+    const auto elapsed = static_cast<LONG64>(elapsed_time & MAXLONG64);
+    if (processor < number_of_shards_ && !(__readeflags() & kEflagsIf)) {
+      entry.total_execution_count++;
+      entry.total_elapsed_time += elapsed;
+      if (elapsed < entry.minimum_elapsed_time) {
+        entry.minimum_elapsed_time = elapsed;
+      }
+      if (elapsed > entry.maximum_elapsed_time) {
+        entry.maximum_elapsed_time = elapsed;
+      }
+      PerfHistogramRecord(&entry.histogram, elapsed_time);
+      if (pmu_counts) {
+        entry.pmu_sample_count++;
+        for (auto i = 0ul; i < kNumberOfPmuEvents; i++) {
+          entry.total_pmu_counts[i] += pmu_counts[i];
+        }
+      }
+    } else {
+      InterlockedIncrement64(&entry.total_execution_count);
+      InterlockedAdd64(&entry.total_elapsed_time, elapsed);
+      UpdateLimit(&entry.minimum_elapsed_time, elapsed, false);
+      UpdateLimit(&entry.maximum_elapsed_time, elapsed, true);
+      InterlockedIncrement64(reinterpret_cast<volatile LONG64*>(
+          &entry.histogram.counts[PerfHistogramGetBucketIndex(elapsed_time)]));
+      if (pmu_counts) {
+        InterlockedIncrement64(&entry.pmu_sample_count);
+        for (auto i = 0ul; i < kNumberOfPmuEvents; i++) {
+          InterlockedAdd64(&entry.total_pmu_counts[i],
+                           static_cast<LONG64>(pmu_counts[i]));
+        }
+      }
+    }
     return true;
   }
 
- private:
-  static const ULONG kInvalidDataIndex = MAXULONG;
-  static const ULONG kMaxNumberOfDataEntries = 200;
+  /// Returns a number of slots that may hold data
+  /// @return A number of slots; some of them may not have a location name
+  ULONG GetNumberOfLocations() const {
+    return (static_cast<ULONG>(number_of_entries_) < kMaxNumberOfDataEntries)
+               ? static_cast<ULONG>(number_of_entries_)
+               : kMaxNumberOfDataEntries;
+  }
 
-  /// Represents performance data for each location
-  struct PerfDataEntry {
-    const char* key;                //!< Identifies a subject matter location
-    ULONG64 total_execution_count;  //!< How many times executed
-    ULONG64 total_elapsed_time;     //!< An accumulated elapsed time
-  };
+  /// Returns a location name of the slot
+  /// @param index  An index of the slot
+  /// @return A location name, or nullptr when the slot is not used
+  const char* GetLocationName(_In_ ULONG index) const {
+    return (index < kMaxNumberOfDataEntries) ? keys_[index] : nullptr;
+  }
 
-  /// Scoped lock
-  class ScopedLock {
-   public:
-    /// Acquires a lock using \a lock_routine.
-    /// @param lock_routine  A function pointer for acquiring a lock
-    /// @param leave_routine A function pointer for releasing a lock
-    /// @param lock_context  An arbitrary parameter for \a lock_enter_routine
-    ///        and \a lock_leave_routine
-    ScopedLock(_In_ LockRoutine* lock_routine, _In_ LockRoutine* leave_routine,
-               _In_opt_ void* lock_context)
-        : lock_routine_(lock_routine),
-          leave_routine_(leave_routine),
-          lock_context_(lock_context) {
-      lock_routine_(lock_context_);
+  /// Copies counters of all slots in a shard owned by the current processor
+  /// @param counters   An array of kMaxNumberOfDataEntries elements to receive
+  ///        counters
+  /// @return true when the current processor owns a shard
+  ///
+  /// Processors added after initialization do not own a shard, and their data
+  /// is copied by an owner of the shard they share.
+  bool CopyCurrentShard(_Out_ PerfCounters* counters) const {
+    const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+    if (processor >= number_of_shards_) {
+      return false;
     }
+    for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
+      const auto& entry = shards_[processor].data[i];
+      counters[i].total_execution_count = entry.total_execution_count;
+      counters[i].total_elapsed_time = entry.total_elapsed_time;
+      counters[i].minimum_elapsed_time = entry.minimum_elapsed_time;
+      counters[i].maximum_elapsed_time = entry.maximum_elapsed_time;
+    }
+    return true;
+  }
 
-    /// Releases a lock using ScopedLock::leave_routine_.
-    ~ScopedLock() { leave_routine_(lock_context_); }
+  /// Sums up data of the slot on all processors
+  /// @param index  An index of data to sum up
+  /// @param statistics   Receives aggregated data
+  ///
+  /// Uses PerfCollector::histogram_ as a work area and so must not be called
+  /// concurrently. Data added while it runs may or may not be included.
+  void GetStatistics(_In_ ULONG index, _Out_ PerfStatistics* statistics) {
+    memset(statistics, 0, sizeof(*statistics));
+    statistics->minimum_elapsed_time = MAXULONG64;
+    memset(&histogram_, 0, sizeof(histogram_));
+    for (auto shard = 0ul; shard < number_of_shards_; shard++) {
+      const auto& entry = shards_[shard].data[index];
+      statistics->total_execution_count += entry.total_execution_count;
+      statistics->total_elapsed_time += entry.total_elapsed_time;
+      if (static_cast<ULONG64>(entry.minimum_elapsed_time) <
+          statistics->minimum_elapsed_time) {
+        statistics->minimum_elapsed_time = entry.minimum_elapsed_time;
+      }
+      if (static_cast<ULONG64>(entry.maximum_elapsed_time) >
+          statistics->maximum_elapsed_time) {
+        statistics->maximum_elapsed_time = entry.maximum_elapsed_time;
+      }
+      statistics->pmu_sample_count += entry.pmu_sample_count;
+      for (auto i = 0ul; i < kNumberOfPmuEvents; i++) {
+        statistics->total_pmu_counts[i] += entry.total_pmu_counts[i];
+      }
+      PerfHistogramMerge(&histogram_, &entry.histogram);
+    }
+    if (!statistics->total_execution_count) {
+      statistics->minimum_elapsed_time = 0;
+    }
 
-   private:
-    LockRoutine* lock_routine_;
-    LockRoutine* leave_routine_;
-    void* lock_context_;
-  };
+    // A bound of a bucket may exceed any values actually observed
+    const auto get_percentile = [&](ULONG per_mille) {
+      const auto value = PerfHistogramGetPercentile(&histogram_, per_mille);
+      return (value < statistics->maximum_elapsed_time)
+                 ? value
+                 : statistics->maximum_elapsed_time;
+    };
+    statistics->p50_elapsed_time = get_percentile(500);
+    statistics->p90_elapsed_time = get_percentile(900);
+    statistics->p99_elapsed_time = get_percentile(990);
+    statistics->p999_elapsed_time = get_percentile(999);
+  }
+
+ private:
+  static const ULONG kInvalidDataIndex = MAXULONG;
+  static const ULONG_PTR kEflagsIf = 0x200;
 
   /// Default empty output routine
   /// @param output_context   Ignored
@@ -232,84 +432,179 @@ class PerfCollector {
     UNREFERENCED_PARAMETER(output_context);
   }
 
-  /// Default empty lock and release routine
-  /// @param lock_context   Ignored
-  static void NoLockRoutine(_In_opt_ void* lock_context) {
-    UNREFERENCED_PARAMETER(lock_context);
+  /// Replaces a limit with the value if the value exceeds it
+  /// @param limit  A minimum or maximum value to update
+  /// @param value  A value to compare with \a limit
+  /// @param is_maximum   true when \a limit is a maximum value
+  static void UpdateLimit(_Inout_ volatile LONG64* limit, _In_ LONG64 value,
+                          _In_ bool is_maximum) {
+    auto current = *limit;
+    while (is_maximum ? (value > current) : (value < current)) {
+      const auto previous = InterlockedCompareExchange64(limit, value, current);
+      if (previous == current) {
+        break;
+      }
+      current = previous;
+    }
   }
 
-  /// Returns an index of data corresponds to the location_name.
-  /// @param key   A location to get an index of corresponding data entry
+  /// Assigns a slot to the location and returns its index
+  /// @param slot   A slot number of the location to update
+  /// @param key   A location to assign a slot
   /// @return   An index of data or kInvalidDataIndex
   ///
-  /// It adds a new entry when the key is not found in existing entries. Returns
-  /// kInvalidDataIndex if a corresponding entry is not found and there is no
-  /// room to add a new entry.
-  ULONG GetPerfDataIndex(_In_ const char* key) {
-    if (!key) {
-      return false;
+  /// Returns kInvalidDataIndex if there is no room to add a new entry. When
+  /// other processors register the same location concurrently, only one of
+  /// them wins, and the others release their entries and use the winner's.
+  ULONG RegisterLocation(_Inout_ volatile LONG* slot, _In_ const char* key) {
+    if (!key ||
+        static_cast<ULONG>(number_of_entries_) >= kMaxNumberOfDataEntries) {
+      return kInvalidDataIndex;
     }
 
-    for (auto i = 0ul; i < kMaxNumberOfDataEntries; i++) {
-      if (data_[i].key == key) {
-        return i;
-      }
+    const auto index =
+        static_cast<ULONG>(InterlockedIncrement(&number_of_entries_)) - 1;
+    if (index >= kMaxNumberOfDataEntries) {
+      return kInvalidDataIndex;
+    }
 
-      if (data_[i].key == nullptr) {
-        data_[i].key = key;
-        return i;
-      }
+    keys_[index] = key;
+    const auto registered_slot =
+        InterlockedCompareExchange(slot, static_cast<LONG>(index + 1), 0);
+    if (registered_slot) {
+      keys_[index] = nullptr;
+      return static_cast<ULONG>(registered_slot) - 1;
     }
-    return kInvalidDataIndex;
+    return index;
   }
 
   InitialOutputRoutine* initial_output_routine_;
   FinalOutputRoutine* final_output_routine_;
   OutputRoutine* output_routine_;
-  LockRoutine* lock_enter_routine_;
-  LockRoutine* lock_leave_routine_;
-  void* lock_context_;
   void* output_context_;
-  PerfDataEntry data_[kMaxNumberOfDataEntries];
+  Shard* shards_;
+  ULONG number_of_shards_;
+  volatile LONG number_of_entries_;  //!< A number of slots ever assigned
+  ULONG64 pmu_counter_mask_;  //!< Valid bits of PMU counters; 0 if disabled
+  ULONG64 tsc_overhead_;      //!< TSC counts elapsed by an empty scope
+  const char* keys_[kMaxNumberOfDataEntries];  //!< Locations of each slot
+  PerfHistogram histogram_;  //!< A work area of GetStatistics()
 };
 
 /// Measure elapsed time of the scope
+///
+/// Without a query time routine, TSC is read with LFENCE and RDTSCP so that
+/// neither instructions before the scope nor after it are executed while the
+/// TSC is being read, and the cost of reading it, as measured by
+/// PerfCollector::SetTscOverhead(), is subtracted.
+///
+/// When PMU sampling is enabled on the collector and the scope starts with
+/// interrupts disabled, hardware performance counters are also read at entry
+/// and exit. They are not read otherwise since the thread may migrate to
+/// another processor, whose counters are unrelated.
 class PerfCounter {
  public:
   using QueryTimeRoutine = ULONG64();
 
   /// Gets the current time using \a query_time_routine.
   /// @param collector  PerfCollector instance to store performance data
-  /// @param query_time_routine  A function pointer for getting times
+  /// @param query_time_routine  A function pointer for getting times, or
+  ///        nullptr to use serialized TSC reads
   /// @param location_name  A function name where being measured
+  /// @param slot   A static slot number of the location
   ///
   /// #HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME() should be used to create an
   /// instance of this class.
   PerfCounter(_In_ PerfCollector* collector,
               _In_opt_ QueryTimeRoutine* query_time_routine,
-              _In_ const char* location_name)
+              _In_ const char* location_name, _Inout_ volatile LONG* slot)
       : collector_(collector),
-        query_time_routine_((query_time_routine) ? query_time_routine : RdTsc),
+        query_time_routine_(query_time_routine),
         location_name_(location_name),
-        before_time_(query_time_routine_()) {}
+        slot_(slot),
+        pmu_counter_mask_((collector && !(__readeflags() & kEflagsIf))
+                              ? collector->GetPmuCounterMask()
+                              : 0) {
+    // Counters are read outside of the time being measured
+    if (pmu_counter_mask_) {
+      ReadPmu(before_pmu_counts_);
+    }
+    before_time_ =
+        (query_time_routine_) ? query_time_routine_() : ReadTscBegin();
+  }
 
   /// Measures an elapsed time and stores it to PerfCounter::collector_.
   ~PerfCounter() {
     if (collector_) {
-      const auto elapsed_time = query_time_routine_() - before_time_;
-      collector_->AddData(location_name_, elapsed_time);
+      ULONG64 elapsed_time = 0;
+      if (query_time_routine_) {
+        elapsed_time = query_time_routine_() - before_time_;
+      } else {
+        elapsed_time = ReadTscEnd() - before_time_;
+        const auto overhead = collector_->GetTscOverhead();
+        elapsed_time = (elapsed_time > overhead) ? elapsed_time - overhead : 0;
+      }
+      if (!pmu_counter_mask_) {
+        collector_->AddData(slot_, location_name_, elapsed_time);
+        return;
+      }
+
+      ULONG64 pmu_counts[PerfCollector::kNumberOfPmuEvents];
+      ReadPmu(pmu_counts);
+      for (auto i = 0ul; i < PerfCollector::kNumberOfPmuEvents; i++) {
+        pmu_counts[i] = (pmu_counts[i] - before_pmu_counts_[i]) &
+                        pmu_counter_mask_;  // Counters may wrap around
+      }
+      collector_->AddData(slot_, location_name_, elapsed_time, pmu_counts);
     }
   }
 
+  /// Reads TSC at the beginning of a scope
+  /// @return the current TSC
+  ///
+  /// The first LFENCE waits for preceding instructions to complete, and the
+  /// second keeps following instructions from starting before RDTSC.
+  static ULONG64 ReadTscBegin() {
+    _mm_lfence();
+    const auto tsc = __rdtsc();
+    _mm_lfence();
+    return tsc;
+  }
+
+  /// Reads TSC at the end of a scope
+  /// @return the current TSC
+  ///
+  /// RDTSCP waits for preceding instructions to complete, and LFENCE keeps
+  /// following instructions from starting before it.
+  static ULONG64 ReadTscEnd() {
+    unsigned int tsc_aux = 0;
+    const auto tsc = __rdtscp(&tsc_aux);
+    _mm_lfence();
+    return tsc;
+  }
+
  private:
-  /// Gets the current time using the RDTSC instruction
-  /// @return the current time
-  static ULONG64 RdTsc() { return __rdtsc(); }
+  static const ULONG_PTR kEflagsIf = 0x200;
+  static const ULONG kRdpmcFixedCounter = 0x40000000;
+
+  /// Reads hardware performance counters with the RDPMC instruction
+  /// @param counts   Receives counters indexed by PerfCollector::PmuEvent
+  static void ReadPmu(_Out_ ULONG64* counts) {
+    counts[PerfCollector::kPmuInstructionsRetired] =
+        __readpmc(kRdpmcFixedCounter | 0);
+    counts[PerfCollector::kPmuUnhaltedCoreCycles] =
+        __readpmc(kRdpmcFixedCounter | 1);
+    counts[PerfCollector::kPmuDtlbMisses] = __readpmc(0);
+    counts[PerfCollector::kPmuLlcMisses] = __readpmc(1);
+  }
 
   PerfCollector* collector_;
   QueryTimeRoutine* query_time_routine_;
   const char* location_name_;
-  const ULONG64 before_time_;
+  volatile LONG* slot_;
+  const ULONG64 pmu_counter_mask_;  //!< 0 when not sampling PMU
+  ULONG64 before_pmu_counts_[PerfCollector::kNumberOfPmuEvents];
+  ULONG64 before_time_;
 };
 
 #endif  // HYPERPLATFORM_PERF_COUNTER_H_
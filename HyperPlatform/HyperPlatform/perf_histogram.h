@@ -0,0 +1,179 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines a log-linear histogram of elapsed times.
+///
+/// Values below kPerfHistogramSubBuckets are counted exactly. Each power of two
+/// above that is split into kPerfHistogramSubBuckets linear buckets, so any
+/// value is reported with a relative error of at most 1/8. It is in the same
+/// spirit as HdrHistogram, but with a fixed layout that can be updated at VMX
+/// root and summed across processors.
+///
+/// This file does not depend on any Windows header so that it can be used by
+/// a user-mode consumer and built on other platforms.
+
+#ifndef HYPERPLATFORM_PERF_HISTOGRAM_H_
+#define HYPERPLATFORM_PERF_HISTOGRAM_H_
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <stdint.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Fixed width integers usable with and without the CRT
+#if defined(_MSC_VER)
+typedef unsigned __int32 PerfHistogramU32;
+typedef unsigned __int64 PerfHistogramU64;
+#else
+typedef uint32_t PerfHistogramU32;
+typedef uint64_t PerfHistogramU64;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// log2 of kPerfHistogramSubBuckets
+static const PerfHistogramU32 kPerfHistogramSubBucketBits = 3;
+
+/// A number of linear buckets in each power of two
+static const PerfHistogramU32 kPerfHistogramSubBuckets =
+    1u << kPerfHistogramSubBucketBits;
+
+/// The highest power of two tracked separately. Larger values are counted in
+/// the last bucket.
+static const PerfHistogramU32 kPerfHistogramMaxExponent = 39;
+
+/// A number of buckets in PerfHistogram
+static const PerfHistogramU32 kPerfHistogramNumberOfBuckets =
+    (kPerfHistogramMaxExponent - kPerfHistogramSubBucketBits + 2) *
+    kPerfHistogramSubBuckets;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Represents a distribution of values
+struct PerfHistogram {
+  PerfHistogramU64 counts[kPerfHistogramNumberOfBuckets];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Returns an index of the bucket counting the value
+/// @param value  A value to count
+/// @return An index of PerfHistogram::counts
+inline PerfHistogramU32 PerfHistogramGetBucketIndex(PerfHistogramU64 value) {
+  if (value < kPerfHistogramSubBuckets) {
+    return static_cast<PerfHistogramU32>(value);
+  }
+
+#if defined(_MSC_VER)
+  unsigned long exponent = 0;
+  _BitScanReverse64(&exponent, value);
+#else
+  const PerfHistogramU32 exponent = 63 - __builtin_clzll(value);
+#endif
+  if (exponent > kPerfHistogramMaxExponent) {
+    return kPerfHistogramNumberOfBuckets - 1;
+  }
+  const auto shift = exponent - kPerfHistogramSubBucketBits;
+  const auto sub_bucket = static_cast<PerfHistogramU32>(value >> shift) &
+                          (kPerfHistogramSubBuckets - 1);
+  return (shift + 1) * kPerfHistogramSubBuckets + sub_bucket;
+}
+
+/// Returns the smallest value counted in the bucket
+/// @param index  An index of PerfHistogram::counts
+/// @return The smallest value counted in the bucket \a index
+inline PerfHistogramU64 PerfHistogramGetBucketLowerBound(
+    PerfHistogramU32 index) {
+  if (index < kPerfHistogramSubBuckets) {
+    return index;
+  }
+  const auto shift = index / kPerfHistogramSubBuckets - 1;
+  const auto sub_bucket = index % kPerfHistogramSubBuckets;
+  return static_cast<PerfHistogramU64>(kPerfHistogramSubBuckets + sub_bucket)
+         << shift;
+}
+
+/// Returns the largest value counted in the bucket
+/// @param index  An index of PerfHistogram::counts
+/// @return The largest value counted in the bucket \a index
+inline PerfHistogramU64 PerfHistogramGetBucketUpperBound(
+    PerfHistogramU32 index) {
+  if (index + 1 >= kPerfHistogramNumberOfBuckets) {
+    return ~static_cast<PerfHistogramU64>(0);
+  }
+  return PerfHistogramGetBucketLowerBound(index + 1) - 1;
+}
+
+/// Counts the value
+/// @param histogram  A histogram to update
+/// @param value  A value to count
+///
+/// Not atomic; the caller is responsible for serializing updates.
+inline void PerfHistogramRecord(PerfHistogram *histogram,
+                                PerfHistogramU64 value) {
+  histogram->counts[PerfHistogramGetBucketIndex(value)]++;
+}
+
+/// Adds counts of one histogram to another
+/// @param histogram  A histogram to update
+/// @param other  A histogram to add
+inline void PerfHistogramMerge(PerfHistogram *histogram,
+                               const PerfHistogram *other) {
+  for (PerfHistogramU32 i = 0; i < kPerfHistogramNumberOfBuckets; ++i) {
+    histogram->counts[i] += other->counts[i];
+  }
+}
+
+/// Returns a value at the percentile
+/// @param histogram  A histogram to look up
+/// @param per_mille  A percentile in per mille, e.g. 999 for p99.9
+/// @return The largest value of the bucket at the percentile, or 0 when
+///         \a histogram is empty
+///
+/// The caller should clamp the result with an observed maximum since the
+/// bound of a bucket can exceed any values actually counted.
+inline PerfHistogramU64 PerfHistogramGetPercentile(
+    const PerfHistogram *histogram, PerfHistogramU32 per_mille) {
+  PerfHistogramU64 total_count = 0;
+  for (PerfHistogramU32 i = 0; i < kPerfHistogramNumberOfBuckets; ++i) {
+    total_count += histogram->counts[i];
+  }
+  if (!total_count) {
+    return 0;
+  }
+
+  // The rank is rounded up and computed without overflowing
+  auto rank = total_count / 1000 * per_mille +
+              (total_count % 1000 * per_mille + 999) / 1000;
+  if (!rank) {
+    rank = 1;
+  }
+
+  PerfHistogramU64 cumulative_count = 0;
+  for (PerfHistogramU32 i = 0; i < kPerfHistogramNumberOfBuckets; ++i) {
+    cumulative_count += histogram->counts[i];
+    if (cumulative_count >= rank) {
+      return PerfHistogramGetBucketUpperBound(i);
+    }
+  }
+  return PerfHistogramGetBucketUpperBound(kPerfHistogramNumberOfBuckets - 1);
+}
+
+#endif  // HYPERPLATFORM_PERF_HISTOGRAM_H_
@@ -6,8 +6,10 @@
 /// Implements performance measurement functions.
 
 #include "performance.h"
+#include <intrin.h>
 #include "common.h"
 #include "log.h"
+#include "util.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -19,23 +21,71 @@
 // constants and macros
 //
 
+// DTLB_LOAD_MISSES.MISS_CAUSES_A_WALK. It is not an architectural event and is
+// only valid on Nehalem through Skylake based processors.
+static const ULONG kPerfpDtlbMissesEvent = 0x08;
+static const ULONG kPerfpDtlbMissesUnitMask = 0x01;
+
+// The architectural LLC Misses event
+static const ULONG kPerfpLlcMissesEvent = 0x2e;
+static const ULONG kPerfpLlcMissesUnitMask = 0x41;
+
+// IA32_FIXED_CTR_CTRL enabling IA32_FIXED_CTR0-1 at all rings
+static const ULONG64 kPerfpFixedCounterControl = 0x33;
+
+// IA32_PERF_GLOBAL_CTRL bits for IA32_PMC0-1 and IA32_FIXED_CTR0-1
+static const ULONG64 kPerfpGlobalControl = 0x300000003ull;
+
+// How many empty scopes are measured to calibrate the measurement overhead
+static const ULONG kPerfpCalibrationIterations = 1000;
+
+// How long TSC is compared with the performance counter in microseconds
+static const ULONG kPerfpCalibrationPeriodUs = 10 * 1000;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 
+// PMU MSRs of a processor before PerfpProgramPmu() changed them
+struct PerfpPmuState {
+  ULONG64 fixed_counter_control;
+  ULONG64 global_control;
+  ULONG64 event_select[2];
+  bool programmed;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
 //
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void PerfpCalibrateTsc(
+    _In_ PerfCollector* perf_collector);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void PerfpEnablePmu(
+    _In_ PerfCollector* perf_collector);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void PerfpDisablePmu();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    PerfpProgramPmu(_In_ void* context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    PerfpRestorePmu(_In_ void* context);
+
 static PerfCollector::InitialOutputRoutine PerfpInitialOutputRoutine;
 static PerfCollector::OutputRoutine PerfpOutputRoutine;
 static PerfCollector::FinalOutputRoutine PerfpFinalOutputRoutine;
 
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, PerfInitialization)
+#pragma alloc_text(INIT, PerfpCalibrateTsc)
+#pragma alloc_text(INIT, PerfpEnablePmu)
 #pragma alloc_text(PAGE, PerfTermination)
+#pragma alloc_text(PAGE, PerfpDisablePmu)
+#pragma alloc_text(PAGE, PerfpProgramPmu)
+#pragma alloc_text(PAGE, PerfpRestorePmu)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -45,6 +95,15 @@ static PerfCollector::FinalOutputRoutine PerfpFinalOutputRoutine;
 
 PerfCollector* g_performance_collector;
 
+// Per-processor counters referenced by g_performance_collector
+static PerfCollector::Shard* g_performancep_shards;
+
+// PMU MSRs to restore on each processor; nullptr when PMU is not sampled
+static PerfpPmuState* g_performancep_pmu_states;
+
+// TSC counts in a millisecond
+static ULONG64 g_performancep_tsc_per_ms;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
@@ -61,12 +120,33 @@ _Use_decl_annotations_ NTSTATUS PerfInitialization() {
     return STATUS_MEMORY_NOT_ALLOCATED;
   }
 
-  // No lock to avoid calling kernel APIs from VMM and race condition here is
-  // not an issue.
-  perf_collector->Initialize(PerfpOutputRoutine, PerfpInitialOutputRoutine,
+  // A shard holds histograms and is not small. Processors added later share
+  // shards with others and update them with interlocked operations.
+  const auto number_of_shards =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto shards = reinterpret_cast<PerfCollector::Shard*>(
+      ExAllocatePoolWithTag(NonPagedPool,
+                            sizeof(PerfCollector::Shard) * number_of_shards,
+                            kHyperPlatformCommonPoolTag));
+  if (!shards) {
+    ExFreePoolWithTag(perf_collector, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(shards, sizeof(PerfCollector::Shard) * number_of_shards);
+
+  // No lock to avoid calling kernel APIs from VMM. Each processor updates its
+  // own shard.
+  perf_collector->Initialize(shards, number_of_shards, PerfpOutputRoutine,
+                             PerfpInitialOutputRoutine,
                              PerfpFinalOutputRoutine);
+  PerfpCalibrateTsc(perf_collector);
+
+#if (HYPERPLATFORM_PERFORMANCE_ENABLE_PMU != 0)
+  PerfpEnablePmu(perf_collector);
+#endif
 
   g_performance_collector = perf_collector;
+  g_performancep_shards = shards;
   return status;
 }
 
@@ -75,29 +155,245 @@ _Use_decl_annotations_ void PerfTermination() {
 
   if (g_performance_collector) {
     g_performance_collector->Terminate();
+  }
+  PerfpDisablePmu();
+  if (g_performance_collector) {
     ExFreePoolWithTag(g_performance_collector, kHyperPlatformCommonPoolTag);
     g_performance_collector = nullptr;
   }
+  if (g_performancep_shards) {
+    ExFreePoolWithTag(g_performancep_shards, kHyperPlatformCommonPoolTag);
+    g_performancep_shards = nullptr;
+  }
 }
 
-/*_Use_decl_annotations_*/ ULONG64 PerfGetTime() {
-  LARGE_INTEGER counter = KeQueryPerformanceCounter(nullptr);
-  return static_cast<ULONG64>(counter.QuadPart);
+// Measures the cost of an empty scope and a frequency of TSC. The minimum
+// cost is used so that a measured time is never reduced more than the actual
+// overhead.
+_Use_decl_annotations_ static void PerfpCalibrateTsc(
+    PerfCollector* perf_collector) {
+  PAGED_CODE();
+
+  // Stays on this processor while comparing TSC with the performance counter
+  KIRQL old_irql = 0;
+  KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+
+  auto overhead = MAXULONG64;
+  for (auto i = 0ul; i < kPerfpCalibrationIterations; i++) {
+    const auto begin = PerfCounter::ReadTscBegin();
+    const auto elapsed = PerfCounter::ReadTscEnd() - begin;
+    if (elapsed < overhead) {
+      overhead = elapsed;
+    }
+  }
+
+  LARGE_INTEGER frequency = {};
+  const auto counter_begin = KeQueryPerformanceCounter(&frequency);
+  const auto tsc_begin = PerfCounter::ReadTscBegin();
+  KeStallExecutionProcessor(kPerfpCalibrationPeriodUs);
+  const auto tsc_end = PerfCounter::ReadTscEnd();
+  const auto counter_end = KeQueryPerformanceCounter(nullptr);
+  KeLowerIrql(old_irql);
+
+  const auto counter_elapsed =
+      static_cast<ULONG64>(counter_end.QuadPart - counter_begin.QuadPart);
+  if (counter_elapsed && frequency.QuadPart) {
+    g_performancep_tsc_per_ms = (tsc_end - tsc_begin) *
+                                static_cast<ULONG64>(frequency.QuadPart) /
+                                (counter_elapsed * 1000);
+  }
+  perf_collector->SetTscOverhead(overhead);
+  HYPERPLATFORM_LOG_INFO("TSC: %I64u counts/ms, overhead %I64u counts",
+                         g_performancep_tsc_per_ms, overhead);
+}
+
+// Programs PMU on all processors and lets perf_collector sample it. Failure is
+// not fatal; measurement continues without PMU.
+_Use_decl_annotations_ static void PerfpEnablePmu(
+    PerfCollector* perf_collector) {
+  PAGED_CODE();
+
+  int cpu_info[4] = {};
+  __cpuid(cpu_info, 0);
+  if (static_cast<ULONG>(cpu_info[0]) < 0xa) {
+    HYPERPLATFORM_LOG_INFO("PMU sampling is not supported.");
+    return;
+  }
+  __cpuid(cpu_info, 0xa);
+  const Cpuid0aEax eax = {static_cast<ULONG32>(cpu_info[0])};
+  const Cpuid0aEbx ebx = {static_cast<ULONG32>(cpu_info[1])};
+  const Cpuid0aEdx edx = {static_cast<ULONG32>(cpu_info[3])};
+  if (eax.fields.version_id < 2 || eax.fields.number_of_counters < 2 ||
+      edx.fields.number_of_fixed_counters < 2 ||
+      ebx.fields.instructions_retired_unavailable ||
+      ebx.fields.core_cycles_unavailable ||
+      ebx.fields.llc_misses_unavailable) {
+    HYPERPLATFORM_LOG_INFO("PMU sampling is not supported.");
+    return;
+  }
+
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto states = reinterpret_cast<PerfpPmuState*>(ExAllocatePoolWithTag(
+      NonPagedPool, sizeof(PerfpPmuState) * number_of_processors,
+      kHyperPlatformCommonPoolTag));
+  if (!states) {
+    return;
+  }
+  RtlZeroMemory(states, sizeof(PerfpPmuState) * number_of_processors);
+
+  g_performancep_pmu_states = states;
+  auto status = UtilForEachProcessor(PerfpProgramPmu, states);
+  if (!NT_SUCCESS(status)) {
+    HYPERPLATFORM_LOG_INFO("PMU is in use. PMU sampling is disabled.");
+    PerfpDisablePmu();
+    return;
+  }
+
+  // Counters are as wide as the narrower of general and fixed counters
+  const auto counter_width =
+      (eax.fields.counter_width < edx.fields.fixed_counter_width)
+          ? eax.fields.counter_width
+          : edx.fields.fixed_counter_width;
+  perf_collector->EnablePmu(
+      (counter_width && counter_width < 64) ? (1ull << counter_width) - 1
+                                            : MAXULONG64);
+  HYPERPLATFORM_LOG_INFO("PMU sampling is enabled.");
+}
+
+// Stops sampling PMU and restores PMU MSRs on all processors
+_Use_decl_annotations_ static void PerfpDisablePmu() {
+  PAGED_CODE();
+
+  if (!g_performancep_pmu_states) {
+    return;
+  }
+  if (g_performance_collector) {
+    g_performance_collector->EnablePmu(0);
+  }
+  UtilForEachProcessor(PerfpRestorePmu, g_performancep_pmu_states);
+  ExFreePoolWithTag(g_performancep_pmu_states, kHyperPlatformCommonPoolTag);
+  g_performancep_pmu_states = nullptr;
+}
+
+// Programs counters of the current processor unless they are already in use
+_Use_decl_annotations_ static NTSTATUS PerfpProgramPmu(void* context) {
+  PAGED_CODE();
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  auto& state = reinterpret_cast<PerfpPmuState*>(context)[processor];
+  state.fixed_counter_control = UtilReadMsr64(Msr::kIa32FixedCtrCtrl);
+  state.global_control = UtilReadMsr64(Msr::kIa32PerfGlobalCtrl);
+  state.event_select[0] = UtilReadMsr64(Msr::kIa32PerfEvtSel0);
+  state.event_select[1] = UtilReadMsr64(Msr::kIa32PerfEvtSel1);
+  const Ia32PerfEvtSelMsr event_select0 = {state.event_select[0]};
+  const Ia32PerfEvtSelMsr event_select1 = {state.event_select[1]};
+  if ((state.fixed_counter_control & 0xff) || event_select0.fields.enable ||
+      event_select1.fields.enable) {
+    return STATUS_DEVICE_BUSY;
+  }
+
+  Ia32PerfEvtSelMsr dtlb_misses = {};
+  dtlb_misses.fields.event_select = kPerfpDtlbMissesEvent;
+  dtlb_misses.fields.unit_mask = kPerfpDtlbMissesUnitMask;
+  dtlb_misses.fields.usr = true;
+  dtlb_misses.fields.os = true;
+  dtlb_misses.fields.enable = true;
+  Ia32PerfEvtSelMsr llc_misses = dtlb_misses;
+  llc_misses.fields.event_select = kPerfpLlcMissesEvent;
+  llc_misses.fields.unit_mask = kPerfpLlcMissesUnitMask;
+
+  UtilWriteMsr64(Msr::kIa32PerfEvtSel0, dtlb_misses.all);
+  UtilWriteMsr64(Msr::kIa32PerfEvtSel1, llc_misses.all);
+  UtilWriteMsr64(Msr::kIa32FixedCtrCtrl,
+                 (state.fixed_counter_control & ~0xffull) |
+                     kPerfpFixedCounterControl);
+  UtilWriteMsr64(Msr::kIa32PerfGlobalCtrl,
+                 state.global_control | kPerfpGlobalControl);
+  state.programmed = true;
+  return STATUS_SUCCESS;
+}
+
+// Restores counters of the current processor if PerfpProgramPmu() changed them
+_Use_decl_annotations_ static NTSTATUS PerfpRestorePmu(void* context) {
+  PAGED_CODE();
+
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  auto& state = reinterpret_cast<PerfpPmuState*>(context)[processor];
+  if (!state.programmed) {
+    return STATUS_SUCCESS;
+  }
+  UtilWriteMsr64(Msr::kIa32PerfGlobalCtrl, state.global_control);
+  UtilWriteMsr64(Msr::kIa32FixedCtrCtrl, state.fixed_counter_control);
+  UtilWriteMsr64(Msr::kIa32PerfEvtSel0, state.event_select[0]);
+  UtilWriteMsr64(Msr::kIa32PerfEvtSel1, state.event_select[1]);
+  state.programmed = false;
+  return STATUS_SUCCESS;
+}
+
+// Divides before multiplying so that an accumulated time does not overflow
+_Use_decl_annotations_ ULONG64 PerfConvertToNanoseconds(ULONG64 elapsed_time) {
+  const auto tsc_per_ms = g_performancep_tsc_per_ms;
+  if (!tsc_per_ms) {
+    return 0;
+  }
+  return elapsed_time / tsc_per_ms * 1000000 +
+         elapsed_time % tsc_per_ms * 1000000 / tsc_per_ms;
 }
 
 _Use_decl_annotations_ static void PerfpInitialOutputRoutine(
     void* output_context) {
   UNREFERENCED_PARAMETER(output_context);
-  HYPERPLATFORM_LOG_INFO("%-45s,%-20s,%-20s", "FunctionName(Line)",
-                         "Execution Count", "Elapsed Time");
+  if (!g_performancep_pmu_states) {
+    HYPERPLATFORM_LOG_INFO(
+        "%-45s,%-20s,%-20s,%-12s,%-12s,%-12s,%-12s,%-12s,%-12s",
+        "FunctionName(Line)", "Execution Count", "Elapsed Time(ns)", "Min",
+        "P50", "P90", "P99", "P99.9", "Max");
+  } else {
+    // PMU events are averages over executions PMU was sampled in
+    HYPERPLATFORM_LOG_INFO(
+        "%-45s,%-20s,%-20s,%-12s,%-12s,%-12s,%-12s,%-12s,%-12s,%-20s,%-12s,"
+        "%-12s,%-12s,%-12s",
+        "FunctionName(Line)", "Execution Count", "Elapsed Time(ns)", "Min",
+        "P50", "P90", "P99", "P99.9", "Max", "PMU Samples", "Instructions",
+        "Cycles", "DTLB Misses", "LLC Misses");
+  }
 }
 
 _Use_decl_annotations_ static void PerfpOutputRoutine(
-    const char* location_name, ULONG64 total_execution_count,
-    ULONG64 total_elapsed_time, void* output_context) {
+    const char* location_name, const PerfCollector::PerfStatistics* statistics,
+    void* output_context) {
   UNREFERENCED_PARAMETER(output_context);
-  HYPERPLATFORM_LOG_INFO("%-45s,%20I64u,%20I64u,", location_name,
-                         total_execution_count, total_elapsed_time);
+  const auto ns = PerfConvertToNanoseconds;
+  if (!g_performancep_pmu_states) {
+    HYPERPLATFORM_LOG_INFO(
+        "%-45s,%20I64u,%20I64u,%12I64u,%12I64u,%12I64u,%12I64u,%12I64u,"
+        "%12I64u,",
+        location_name, statistics->total_execution_count,
+        ns(statistics->total_elapsed_time),
+        ns(statistics->minimum_elapsed_time),
+        ns(statistics->p50_elapsed_time), ns(statistics->p90_elapsed_time),
+        ns(statistics->p99_elapsed_time), ns(statistics->p999_elapsed_time),
+        ns(statistics->maximum_elapsed_time));
+    return;
+  }
+
+  const auto samples = statistics->pmu_sample_count;
+  const auto average = [statistics, samples](PerfCollector::PmuEvent event) {
+    return (samples) ? statistics->total_pmu_counts[event] / samples : 0;
+  };
+  HYPERPLATFORM_LOG_INFO(
+      "%-45s,%20I64u,%20I64u,%12I64u,%12I64u,%12I64u,%12I64u,%12I64u,%12I64u,"
+      "%20I64u,%12I64u,%12I64u,%12I64u,%12I64u,",
+      location_name, statistics->total_execution_count,
+      ns(statistics->total_elapsed_time), ns(statistics->minimum_elapsed_time),
+      ns(statistics->p50_elapsed_time), ns(statistics->p90_elapsed_time),
+      ns(statistics->p99_elapsed_time), ns(statistics->p999_elapsed_time),
+      ns(statistics->maximum_elapsed_time), samples,
+      average(PerfCollector::kPmuInstructionsRetired),
+      average(PerfCollector::kPmuUnhaltedCoreCycles),
+      average(PerfCollector::kPmuDtlbMisses),
+      average(PerfCollector::kPmuLlcMisses));
 }
 
 _Use_decl_annotations_ static void PerfpFinalOutputRoutine(
@@ -20,11 +20,15 @@ extern "C" {
 
 /// Measures an elapsed time from execution of this macro to the end of a scope
 ///
+/// The time is measured in TSC counts with serialized reads, excluding the
+/// cost of the measurement itself. Use PerfConvertToNanoseconds() to convert
+/// it.
+///
 /// @warning
 /// This macro cannot be called from an INIT section. See
 /// #HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME() for details.
 #define HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE() \
-  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(g_performance_collector, PerfGetTime)
+  HYPERPLATFORM_PERFCOUNTER_MEASURE_TIME(g_performance_collector, nullptr)
 
 #else
 #define HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE()
@@ -52,11 +56,11 @@ _IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS PerfInitialization();
 /// Ends performance monitoring and outputs its results
 _IRQL_requires_max_(PASSIVE_LEVEL) void PerfTermination();
 
-/// Returns the current "time" for performance measurement.
-/// @return Current performance counter
-///
-/// It should only be used by #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE().
-ULONG64 PerfGetTime();
+/// Converts a time measured by #HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE()
+/// into nanoseconds
+/// @param elapsed_time   A time in TSC counts
+/// @return \a elapsed_time in nanoseconds
+ULONG64 PerfConvertToNanoseconds(_In_ ULONG64 elapsed_time);
 
 ////////////////////////////////////////////////////////////////////////////////
 //
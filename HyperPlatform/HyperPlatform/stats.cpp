@@ -0,0 +1,256 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements statistics snapshot functions.
+
+#include "stats.h"
+#define NTSTRSAFE_NO_CB_FUNCTIONS
+#include <ntstrsafe.h>
+#include "common.h"
+#include "exit_trace.h"
+#include "log.h"
+#include "performance.h"
+#include "stats_format.h"
+#include "util.h"
+#include "../../NoTruth/NoTruth.h"
+#include "../../NoTruth/MemoryHide.h"
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Counters copied by a single processor
+struct StatspProcessorCounters {
+  PerfCollector::PerfCounters perf[PerfCollector::kMaxNumberOfDataEntries];
+  ULONG64 exit_counts[kStatsNumberOfExitReasons];
+  StatsHideCounters hide;
+  bool has_perf;  // Whether the processor owns a perf counter shard
+};
+
+// Passed to StatspCaptureRoutine()
+struct StatspCaptureContext {
+  StatspProcessorCounters *counters;  // Indexed by a processor number
+  ULONG number_of_processors;
+  LONG64 timestamp;  // A performance counter when counters were copied
+};
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+// Runs at IPI_LEVEL; must stay non-paged
+static NTSTATUS StatspCaptureRoutine(_In_ void *context);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    StatspBuildSnapshot(_In_ const StatspCaptureContext &context,
+                        _Out_ void *buffer, _In_ ULONG buffer_size,
+                        _Out_ ULONG *snapshot_size);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(PAGE, StatsTakeSnapshot)
+#pragma alloc_text(PAGE, StatspBuildSnapshot)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Whether a snapshot is being taken
+static volatile LONG g_statsp_busy;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+// Copies counters on all processors at once, then lays them out
+_Use_decl_annotations_ NTSTATUS StatsTakeSnapshot(void *buffer,
+                                                  ULONG buffer_size,
+                                                  ULONG *snapshot_size) {
+  PAGED_CODE();
+
+  *snapshot_size = 0;
+  if (InterlockedExchange(&g_statsp_busy, true)) {
+    return STATUS_DEVICE_BUSY;
+  }
+
+  StatspCaptureContext context = {};
+  context.number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto counters_size =
+      sizeof(StatspProcessorCounters) * context.number_of_processors;
+  context.counters = reinterpret_cast<StatspProcessorCounters *>(
+      ExAllocatePoolWithTag(NonPagedPool, counters_size,
+                            kHyperPlatformCommonPoolTag));
+  if (!context.counters) {
+    InterlockedExchange(&g_statsp_busy, false);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(context.counters, counters_size);
+
+  auto status =
+      UtilForEachProcessorIpi(StatspCaptureRoutine, &context, nullptr, 0);
+  if (NT_SUCCESS(status)) {
+    status = StatspBuildSnapshot(context, buffer, buffer_size, snapshot_size);
+  }
+
+  ExFreePoolWithTag(context.counters, kHyperPlatformCommonPoolTag);
+  InterlockedExchange(&g_statsp_busy, false);
+  return status;
+}
+
+// Copies counters of the current processor. Since all processors run this at
+// the same time, no processor is updating counters while others copy theirs.
+_Use_decl_annotations_ static NTSTATUS StatspCaptureRoutine(void *context) {
+  const auto capture_context =
+      reinterpret_cast<StatspCaptureContext *>(context);
+  const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor >= capture_context->number_of_processors) {
+    return STATUS_SUCCESS;  // A processor added after allocation
+  }
+
+  auto &counters = capture_context->counters[processor];
+  if (g_performance_collector) {
+    counters.has_perf =
+        g_performance_collector->CopyCurrentShard(counters.perf);
+  }
+  ExitTraceCopyExitCounts(counters.exit_counts, kStatsNumberOfExitReasons);
+  TruthCopyStatistics(sharedata, &counters.hide);
+  if (processor == 0) {
+    capture_context->timestamp = KeQueryPerformanceCounter(nullptr).QuadPart;
+  }
+  return STATUS_SUCCESS;
+}
+
+// Sums up counters of all processors into a snapshot. The exit counts are
+// placed right after the header so that the perf entries can be cut short.
+_Use_decl_annotations_ static NTSTATUS StatspBuildSnapshot(
+    const StatspCaptureContext &context, void *buffer, ULONG buffer_size,
+    ULONG *snapshot_size) {
+  PAGED_CODE();
+
+  const auto collector = g_performance_collector;
+  const auto number_of_locations =
+      (collector) ? collector->GetNumberOfLocations() : 0;
+  const auto exit_count_offset =
+      static_cast<ULONG>(sizeof(StatsSnapshotHeader));
+  const auto perf_entry_offset = static_cast<ULONG>(
+      exit_count_offset + sizeof(StatsU64) * kStatsNumberOfExitReasons);
+  const auto max_size = static_cast<ULONG>(
+      perf_entry_offset + sizeof(StatsPerfEntry) * number_of_locations);
+  if (!buffer || buffer_size < max_size) {
+    return STATUS_BUFFER_TOO_SMALL;
+  }
+  RtlZeroMemory(buffer, max_size);
+
+  const auto header = reinterpret_cast<StatsSnapshotHeader *>(buffer);
+  const auto exit_counts = reinterpret_cast<StatsU64 *>(
+      reinterpret_cast<UCHAR *>(buffer) + exit_count_offset);
+  const auto entries = reinterpret_cast<StatsPerfEntry *>(
+      reinterpret_cast<UCHAR *>(buffer) + perf_entry_offset);
+
+  LARGE_INTEGER frequency = {};
+  KeQueryPerformanceCounter(&frequency);
+  header->magic = kStatsSnapshotMagic;
+  header->version = kStatsSnapshotVersion;
+  header->number_of_processors = context.number_of_processors;
+  header->timestamp = context.timestamp;
+  header->frequency = frequency.QuadPart;
+  header->exit_count_offset = exit_count_offset;
+  header->number_of_exit_reasons = kStatsNumberOfExitReasons;
+  header->perf_entry_offset = perf_entry_offset;
+
+  for (auto processor = 0ul; processor < context.number_of_processors;
+       ++processor) {
+    const auto &counters = context.counters[processor];
+    for (auto i = 0ul; i < kStatsNumberOfExitReasons; ++i) {
+      exit_counts[i] += counters.exit_counts[i];
+    }
+    header->hide.read_violations += counters.hide.read_violations;
+    header->hide.write_violations += counters.hide.write_violations;
+    header->hide.execute_violations += counters.hide.execute_violations;
+    header->hide.unmatched_violations += counters.hide.unmatched_violations;
+    header->hide.monitor_trap_flags += counters.hide.monitor_trap_flags;
+    if (counters.hide.hidden_pages > header->hide.hidden_pages) {
+      header->hide.hidden_pages = counters.hide.hidden_pages;
+    }
+  }
+
+  auto number_of_entries = 0ul;
+  for (auto i = 0ul; i < number_of_locations; ++i) {
+    const auto location_name = collector->GetLocationName(i);
+    if (!location_name) {
+      continue;
+    }
+
+    auto &entry = entries[number_of_entries++];
+    RtlStringCchCopyA(entry.location_name, RTL_NUMBER_OF(entry.location_name),
+                      location_name);
+    entry.minimum_elapsed_time = MAXULONG64;
+    for (auto processor = 0ul; processor < context.number_of_processors;
+         ++processor) {
+      const auto &counters = context.counters[processor];
+      if (!counters.has_perf || !counters.perf[i].total_execution_count) {
+        continue;
+      }
+      const auto &perf = counters.perf[i];
+      entry.execution_count += perf.total_execution_count;
+      entry.elapsed_time += perf.total_elapsed_time;
+      if (perf.minimum_elapsed_time < entry.minimum_elapsed_time) {
+        entry.minimum_elapsed_time = perf.minimum_elapsed_time;
+      }
+      if (perf.maximum_elapsed_time > entry.maximum_elapsed_time) {
+        entry.maximum_elapsed_time = perf.maximum_elapsed_time;
+      }
+    }
+    if (!entry.execution_count) {
+      entry.minimum_elapsed_time = 0;
+    }
+
+    // Histograms are not copied at once and may include slightly newer data
+    PerfCollector::PerfStatistics statistics;
+    collector->GetStatistics(i, &statistics);
+    const auto clamp = [&entry](ULONG64 value) {
+      return (value < entry.maximum_elapsed_time) ? value
+                                                  : entry.maximum_elapsed_time;
+    };
+    entry.p50_elapsed_time = clamp(statistics.p50_elapsed_time);
+    entry.p90_elapsed_time = clamp(statistics.p90_elapsed_time);
+    entry.p99_elapsed_time = clamp(statistics.p99_elapsed_time);
+    entry.p999_elapsed_time = clamp(statistics.p999_elapsed_time);
+
+    // Consumers do not know a frequency of TSC
+    const auto ns = PerfConvertToNanoseconds;
+    entry.elapsed_time = ns(entry.elapsed_time);
+    entry.minimum_elapsed_time = ns(entry.minimum_elapsed_time);
+    entry.maximum_elapsed_time = ns(entry.maximum_elapsed_time);
+    entry.p50_elapsed_time = ns(entry.p50_elapsed_time);
+    entry.p90_elapsed_time = ns(entry.p90_elapsed_time);
+    entry.p99_elapsed_time = ns(entry.p99_elapsed_time);
+    entry.p999_elapsed_time = ns(entry.p999_elapsed_time);
+  }
+
+  header->number_of_perf_entries = number_of_entries;
+  header->size = static_cast<ULONG>(perf_entry_offset +
+                                    sizeof(StatsPerfEntry) * number_of_entries);
+  *snapshot_size = header->size;
+  return STATUS_SUCCESS;
+}
+
+}  // extern "C"
@@ -0,0 +1,62 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Declares interfaces to statistics snapshot functions.
+
+#ifndef HYPERPLATFORM_STATS_H_
+#define HYPERPLATFORM_STATS_H_
+
+#include <fltKernel.h>
+
+extern "C" {
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+/// Takes a snapshot of perf counters, VM-exit counts and hide engine counters
+/// @param buffer   Receives a snapshot
+/// @param buffer_size  A size of \a buffer in bytes
+/// @param snapshot_size  Receives a size of the snapshot in bytes
+/// @return STATUS_SUCCESS on success
+///
+/// The snapshot is laid out as defined in stats_format.h. Counters are copied
+/// by all processors at the same time so that they are consistent with each
+/// other; only percentiles are computed from histograms afterwards. Only one
+/// snapshot can be taken at a time, and a concurrent request fails with
+/// STATUS_DEVICE_BUSY.
+_IRQL_requires_max_(PASSIVE_LEVEL) NTSTATUS
+    StatsTakeSnapshot(_Out_writes_bytes_to_(buffer_size, *snapshot_size)
+                          void *buffer,
+                      _In_ ULONG buffer_size, _Out_ ULONG *snapshot_size);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+}  // extern "C"
+
+#endif  // HYPERPLATFORM_STATS_H_
@@ -0,0 +1,186 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Defines a binary layout of a statistics snapshot returned by the driver.
+///
+/// A snapshot begins with StatsSnapshotHeader, followed by StatsPerfEntry and
+/// exit counts at offsets given by the header. A consumer must check
+/// StatsSnapshotHeader::version and only use fields it knows of; new fields
+/// are only appended to the end of each structure.
+///
+/// This file is shared by the driver and user-mode consumers, and so must not
+/// depend on any Windows header.
+
+#ifndef HYPERPLATFORM_STATS_FORMAT_H_
+#define HYPERPLATFORM_STATS_FORMAT_H_
+
+#include <stddef.h>
+#if !defined(_MSC_VER)
+#include <stdint.h>
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+// Fixed width integers usable with and without the CRT
+#if defined(_MSC_VER)
+typedef unsigned __int32 StatsU32;
+typedef unsigned __int64 StatsU64;
+#else
+typedef uint32_t StatsU32;
+typedef uint64_t StatsU64;
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+/// StatsSnapshotHeader::magic ('HPSS')
+static const StatsU32 kStatsSnapshotMagic = 0x53535048;
+
+/// A version of the layout defined in this file
+static const StatsU32 kStatsSnapshotVersion = 1;
+
+/// A length of StatsPerfEntry::location_name including a null terminator
+static const StatsU32 kStatsLocationNameLength = 64;
+
+/// A number of basic exit reasons counted in a snapshot
+static const StatsU32 kStatsNumberOfExitReasons = 65;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+/// Represents performance data of a single measured location. Times are in
+/// nanoseconds.
+struct StatsPerfEntry {
+  char location_name[kStatsLocationNameLength];  //!< Null terminated
+  StatsU64 execution_count;
+  StatsU64 elapsed_time;  //!< An accumulated elapsed time
+  StatsU64 minimum_elapsed_time;
+  StatsU64 maximum_elapsed_time;
+  StatsU64 p50_elapsed_time;
+  StatsU64 p90_elapsed_time;
+  StatsU64 p99_elapsed_time;
+  StatsU64 p999_elapsed_time;
+};
+static_assert(sizeof(StatsPerfEntry) == 128, "Size check");
+
+/// Represents counters of the memory hiding engine
+struct StatsHideCounters {
+  StatsU64 read_violations;       //!< EPT violations by reads of hidden pages
+  StatsU64 write_violations;      //!< EPT violations by writes
+  StatsU64 execute_violations;    //!< EPT violations by execution
+  StatsU64 unmatched_violations;  //!< EPT violations not for hidden pages
+  StatsU64 monitor_trap_flags;    //!< MTF VM-exits re-protecting pages
+  StatsU64 hidden_pages;          //!< Pages being hidden
+  StatsU64 reserved[2];
+};
+static_assert(sizeof(StatsHideCounters) == 64, "Size check");
+
+/// Represents the beginning of a snapshot
+struct StatsSnapshotHeader {
+  StatsU32 magic;                 //!< kStatsSnapshotMagic
+  StatsU32 version;               //!< kStatsSnapshotVersion
+  StatsU32 size;                  //!< A size of the snapshot in bytes
+  StatsU32 number_of_processors;  //!< Processors counters were taken from
+  StatsU64 timestamp;  //!< A performance counter when the snapshot was taken
+  StatsU64 frequency;  //!< A frequency of the performance counter
+  StatsU32 perf_entry_offset;  //!< An offset of StatsPerfEntry[]
+  StatsU32 number_of_perf_entries;
+  StatsU32 exit_count_offset;  //!< An offset of StatsU64[] indexed by reason
+  StatsU32 number_of_exit_reasons;
+  StatsHideCounters hide;
+};
+static_assert(sizeof(StatsSnapshotHeader) == 112, "Size check");
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+/// Validates a snapshot and returns its header
+/// @param data   A snapshot returned by the driver
+/// @param size   A size of \a data in bytes
+/// @return A header of \a data, or nullptr when \a data is malformed or of an
+///         unsupported version
+inline const StatsSnapshotHeader *StatsParseSnapshot(const void *data,
+                                                     size_t size) {
+  const auto header = static_cast<const StatsSnapshotHeader *>(data);
+  if (!data || size < sizeof(*header) || header->magic != kStatsSnapshotMagic ||
+      header->version != kStatsSnapshotVersion || header->size > size ||
+      header->size < sizeof(*header)) {
+    return nullptr;
+  }
+
+  const StatsU64 perf_end =
+      header->perf_entry_offset +
+      static_cast<StatsU64>(header->number_of_perf_entries) *
+          sizeof(StatsPerfEntry);
+  const StatsU64 exit_end =
+      header->exit_count_offset +
+      static_cast<StatsU64>(header->number_of_exit_reasons) * sizeof(StatsU64);
+  if (header->perf_entry_offset < sizeof(*header) || perf_end > header->size ||
+      header->exit_count_offset < sizeof(*header) || exit_end > header->size ||
+      header->perf_entry_offset % sizeof(StatsU64) ||
+      header->exit_count_offset % sizeof(StatsU64)) {
+    return nullptr;
+  }
+
+  // Location names are used as C strings
+  const auto entries = reinterpret_cast<const StatsPerfEntry *>(
+      reinterpret_cast<const unsigned char *>(header) +
+      header->perf_entry_offset);
+  for (StatsU32 i = 0; i < header->number_of_perf_entries; ++i) {
+    if (entries[i].location_name[kStatsLocationNameLength - 1] != '\0') {
+      return nullptr;
+    }
+  }
+  return header;
+}
+
+/// Returns performance data in the snapshot
+/// @param header   A header returned by StatsParseSnapshot()
+/// @return StatsPerfEntry[StatsSnapshotHeader::number_of_perf_entries]
+inline const StatsPerfEntry *StatsGetPerfEntries(
+    const StatsSnapshotHeader *header) {
+  return reinterpret_cast<const StatsPerfEntry *>(
+      reinterpret_cast<const unsigned char *>(header) +
+      header->perf_entry_offset);
+}
+
+/// Returns a number of VM-exits for each basic exit reason in the snapshot
+/// @param header   A header returned by StatsParseSnapshot()
+/// @return StatsU64[StatsSnapshotHeader::number_of_exit_reasons]
+inline const StatsU64 *StatsGetExitCounts(const StatsSnapshotHeader *header) {
+  return reinterpret_cast<const StatsU64 *>(
+      reinterpret_cast<const unsigned char *>(header) +
+      header->exit_count_offset);
+}
+
+/// Returns a number of events per second between two snapshots
+/// @param older  A header of a snapshot taken earlier
+/// @param newer  A header of a snapshot taken later
+/// @param older_count  A counter value in \a older
+/// @param newer_count  A counter value in \a newer
+/// @return A rate of the counter, or 0 when it cannot be computed
+inline double StatsGetRate(const StatsSnapshotHeader *older,
+                           const StatsSnapshotHeader *newer,
+                           StatsU64 older_count, StatsU64 newer_count) {
+  if (!newer->frequency || newer->timestamp <= older->timestamp ||
+      newer_count < older_count) {
+    return 0.0;
+  }
+  const auto seconds =
+      static_cast<double>(newer->timestamp - older->timestamp) /
+      static_cast<double>(newer->frequency);
+  return static_cast<double>(newer_count - older_count) / seconds;
+}
+
+#endif  // HYPERPLATFORM_STATS_FORMAT_H_
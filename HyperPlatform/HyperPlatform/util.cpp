@@ -10,6 +10,7 @@
 #include "asm.h"
 #include "common.h"
 #include "log.h"
+#include "page_walk.h"
 
 extern "C" {
 ////////////////////////////////////////////////////////////////////////////////
@@ -61,6 +62,22 @@ struct LdrDataTableEntry {
   // ...
 };
 
+// A context of UtilpIpiBroadcastRoutine()
+struct UtilpIpiContext {
+  NTSTATUS (*callback_routine)(void *);
+  void *context;
+  NTSTATUS *processor_statuses;
+  ULONG number_of_statuses;
+  volatile LONG status;  // The first failure status reported by any processor
+};
+
+// Translates guest virtual addresses on a processor; see UtilGpaFromGva()
+struct UtilpGvaTranslator {
+  void *mapping;             // A page reserved to map paging structures
+  HardwarePte *mapping_pte;  // A PTE of mapping; valid only during a walk
+  PageWalkCache cache;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -81,6 +98,22 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
 _IRQL_requires_max_(PASSIVE_LEVEL) static PhysicalMemoryDescriptor
     *UtilpBuildPhysicalMemoryRanges();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static void
+UtilpSortAndMergePhysicalMemoryRuns(
+    _Inout_ PhysicalMemoryDescriptor *pm_block);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    UtilpInitializeGvaTranslators();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void UtilpTerminateGvaTranslators();
+
+static UtilpGvaTranslator *UtilpGetCurrentGvaTranslator();
+
+static bool UtilpReadGuestPagingEntry(_In_ void *context, _In_ PageWalkU64 pa,
+                                      _Out_ PageWalkU64 *entry);
+
+static KIPI_BROADCAST_WORKER UtilpIpiBroadcastRoutine;
+
 static bool UtilpIsCanonicalFormAddress(_In_ void *address);
 
 static HardwarePte *UtilpAddressToPxe(_In_ const void *address);
@@ -98,6 +131,9 @@ static HardwarePte *UtilpAddressToPte(_In_ const void *address);
 #pragma alloc_text(INIT, UtilpInitializeRtlPcToFileHeader)
 #pragma alloc_text(INIT, UtilpInitializePhysicalMemoryRanges)
 #pragma alloc_text(INIT, UtilpBuildPhysicalMemoryRanges)
+#pragma alloc_text(INIT, UtilpSortAndMergePhysicalMemoryRuns)
+#pragma alloc_text(INIT, UtilpInitializeGvaTranslators)
+#pragma alloc_text(PAGE, UtilpTerminateGvaTranslators)
 #pragma alloc_text(PAGE, UtilForEachProcessor)
 #pragma alloc_text(PAGE, UtilSleep)
 #pragma alloc_text(PAGE, UtilGetSystemProcAddress)
@@ -114,6 +150,10 @@ static LIST_ENTRY *g_utilp_PsLoadedModuleList;
 
 static PhysicalMemoryDescriptor *g_utilp_physical_memory_ranges;
 
+// Indexed by a processor number; nullptr on x86
+static UtilpGvaTranslator *g_utilp_gva_translators;
+static ULONG g_utilp_gva_translator_count;
+
 static MmAllocateContiguousNodeMemoryType
     *g_utilp_MmAllocateContiguousNodeMemory;
 
@@ -160,6 +200,11 @@ UtilInitialization(PDRIVER_OBJECT driver_object) {
     return status;
   }
 
+  status = UtilpInitializeGvaTranslators();
+  if (!NT_SUCCESS(status)) {
+    return status;
+  }
+
   g_utilp_MmAllocateContiguousNodeMemory =
       reinterpret_cast<MmAllocateContiguousNodeMemoryType *>(
           UtilGetSystemProcAddress(L"MmAllocateContiguousNodeMemory"));
@@ -170,6 +215,8 @@ UtilInitialization(PDRIVER_OBJECT driver_object) {
 _Use_decl_annotations_ void UtilTermination() {
   PAGED_CODE();
 
+  UtilpTerminateGvaTranslators();
+
   if (g_utilp_physical_memory_ranges) {
     ExFreePoolWithTag(g_utilp_physical_memory_ranges,
                       kHyperPlatformCommonPoolTag);
@@ -395,15 +442,109 @@ UtilpBuildPhysicalMemoryRanges() {
   }
 
   ExFreePoolWithTag(pm_ranges, 'hPmM');
+  UtilpSortAndMergePhysicalMemoryRuns(pm_block);
   return pm_block;
 }
 
+// Sorts runs and merges overlapping or adjoining ones so that runs can be
+// binary searched. MmGetPhysicalMemoryRanges() does not document its order.
+_Use_decl_annotations_ static void UtilpSortAndMergePhysicalMemoryRuns(
+    PhysicalMemoryDescriptor *pm_block) {
+  PAGED_CODE();
+
+  const auto runs = pm_block->run;
+  for (auto i = 1ul; i < pm_block->number_of_runs; ++i) {
+    const auto run = runs[i];
+    auto j = i;
+    for (/**/; j > 0 && runs[j - 1].base_page > run.base_page; --j) {
+      runs[j] = runs[j - 1];
+    }
+    runs[j] = run;
+  }
+
+  PFN_COUNT number_of_runs = 0;
+  PFN_NUMBER number_of_pages = 0;
+  for (auto i = 0ul; i < pm_block->number_of_runs; ++i) {
+    const auto run = runs[i];
+    if (!run.page_count) {
+      continue;
+    }
+    if (number_of_runs) {
+      auto &last = runs[number_of_runs - 1];
+      const auto last_end = last.base_page + last.page_count;
+      if (run.base_page <= last_end) {
+        const auto run_end = run.base_page + run.page_count;
+        if (run_end > last_end) {
+          number_of_pages += run_end - last_end;
+          last.page_count = run_end - last.base_page;
+        }
+        continue;
+      }
+    }
+    runs[number_of_runs++] = run;
+    number_of_pages += run.page_count;
+  }
+  pm_block->number_of_runs = number_of_runs;
+  pm_block->number_of_pages = number_of_pages;
+}
+
 // Returns the physical memory ranges
 /*_Use_decl_annotations_*/ const PhysicalMemoryDescriptor *
 UtilGetPhysicalMemoryRanges() {
   return g_utilp_physical_memory_ranges;
 }
 
+// Binary searches runs for the one containing the address
+_Use_decl_annotations_ const PhysicalMemoryRun *UtilFindPhysicalMemoryRun(
+    ULONG64 physical_address) {
+  const auto pm_ranges = g_utilp_physical_memory_ranges;
+  const auto page = UtilPfnFromPa(physical_address);
+  auto low = 0ul;
+  auto high = static_cast<ULONG>(pm_ranges->number_of_runs);
+  while (low < high) {
+    const auto middle = low + (high - low) / 2;
+    const auto run = &pm_ranges->run[middle];
+    if (page < run->base_page) {
+      high = middle;
+    } else if (page - run->base_page >= run->page_count) {
+      low = middle + 1;
+    } else {
+      return run;
+    }
+  }
+  return nullptr;
+}
+
+// Returns the next chunk, taking the largest size aligned at its base
+_Use_decl_annotations_ bool UtilGetNextPhysicalMemoryChunk(
+    PhysicalMemoryChunkIterator *iterator, ULONG64 *base, ULONG64 *size) {
+  static const ULONG64 kChunkSizes[] = {
+      1ull << 30, 1ull << 21, PAGE_SIZE,
+  };
+
+  const auto pm_ranges = g_utilp_physical_memory_ranges;
+  for (/**/; iterator->run_index < pm_ranges->number_of_runs;
+       ++iterator->run_index) {
+    const auto run = &pm_ranges->run[iterator->run_index];
+    const auto run_base = static_cast<ULONG64>(run->base_page) * PAGE_SIZE;
+    const auto run_end =
+        run_base + static_cast<ULONG64>(run->page_count) * PAGE_SIZE;
+    const auto address = max(iterator->next_address, run_base);
+    for (const auto chunk_size : kChunkSizes) {
+      if (address < run_end && run_end - address >= chunk_size &&
+          address % chunk_size == 0) {
+        *base = address;
+        *size = chunk_size;
+        iterator->next_address = address + chunk_size;
+        return true;
+      }
+    }
+  }
+  *base = 0;
+  *size = 0;
+  return false;
+}
+
 // Execute a given callback routine on all processors in PASSIVE_LEVEL. Returns
 // STATUS_SUCCESS when all callback returned STATUS_SUCCESS as well. When
 // one of callbacks returns anything but STATUS_SUCCESS, this function stops
@@ -473,6 +614,45 @@ UtilForEachProcessorDpc(PKDEFERRED_ROUTINE deferred_routine, void *context) {
   return STATUS_SUCCESS;
 }
 
+// Executes a given callback routine on all processors simultaneously by
+// broadcasting an IPI. KeIpiGenericCall() does not return until all processors
+// finished the routine, so no additional barrier is required. Returns
+// STATUS_SUCCESS when all callbacks returned STATUS_SUCCESS; otherwise, returns
+// one of failure values. Unlike UtilForEachProcessor(), a failure on one
+// processor does not prevent the callback from running on other processors.
+_Use_decl_annotations_ NTSTATUS UtilForEachProcessorIpi(
+    NTSTATUS (*callback_routine)(void *), void *context,
+    NTSTATUS *processor_statuses, ULONG number_of_statuses) {
+  if (processor_statuses) {
+    for (ULONG i = 0; i < number_of_statuses; i++) {
+      processor_statuses[i] = STATUS_UNSUCCESSFUL;
+    }
+  }
+
+  UtilpIpiContext ipi_context = {callback_routine, context, processor_statuses,
+                                 (processor_statuses) ? number_of_statuses : 0,
+                                 STATUS_SUCCESS};
+  KeIpiGenericCall(UtilpIpiBroadcastRoutine,
+                   reinterpret_cast<ULONG_PTR>(&ipi_context));
+  return ipi_context.status;
+}
+
+// Runs on each processor at IPI_LEVEL
+_Use_decl_annotations_ static ULONG_PTR UtilpIpiBroadcastRoutine(
+    ULONG_PTR argument) {
+  const auto ipi_context = reinterpret_cast<UtilpIpiContext *>(argument);
+  const auto status = ipi_context->callback_routine(ipi_context->context);
+
+  const auto processor_index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (processor_index < ipi_context->number_of_statuses) {
+    ipi_context->processor_statuses[processor_index] = status;
+  }
+  if (!NT_SUCCESS(status)) {
+    InterlockedCompareExchange(&ipi_context->status, status, STATUS_SUCCESS);
+  }
+  return 0;
+}
+
 // Sleep the current thread's execution for Millisecond milliseconds.
 _Use_decl_annotations_ NTSTATUS UtilSleep(LONG Millisecond) {
   PAGED_CODE();
@@ -619,6 +799,126 @@ _Use_decl_annotations_ void *UtilVaFromPfn(PFN_NUMBER pfn) {
   return UtilVaFromPa(UtilPaFromPfn(pfn));
 }
 
+// Reserves a page to map guest paging structures for each processor,
+// including ones that may be added later
+_Use_decl_annotations_ static NTSTATUS UtilpInitializeGvaTranslators() {
+  PAGED_CODE();
+
+  if (!IsX64()) {
+    return STATUS_SUCCESS;  // UtilGpaFromGva() switches CR3 instead
+  }
+
+  const auto count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto size = sizeof(UtilpGvaTranslator) * count;
+  const auto translators = reinterpret_cast<UtilpGvaTranslator *>(
+      ExAllocatePoolWithTag(NonPagedPool, size, kHyperPlatformCommonPoolTag));
+  if (!translators) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(translators, size);
+  g_utilp_gva_translators = translators;
+  g_utilp_gva_translator_count = count;
+
+  for (auto i = 0ul; i < count; ++i) {
+    auto &translator = translators[i];
+    translator.mapping =
+        MmAllocateMappingAddress(PAGE_SIZE, kHyperPlatformCommonPoolTag);
+    if (!translator.mapping) {
+      UtilpTerminateGvaTranslators();
+      return STATUS_MEMORY_NOT_ALLOCATED;
+    }
+    translator.mapping_pte = UtilpAddressToPte(translator.mapping);
+  }
+  return STATUS_SUCCESS;
+}
+
+// Releases pages reserved by UtilpInitializeGvaTranslators()
+_Use_decl_annotations_ static void UtilpTerminateGvaTranslators() {
+  PAGED_CODE();
+
+  if (!g_utilp_gva_translators) {
+    return;
+  }
+  for (auto i = 0ul; i < g_utilp_gva_translator_count; ++i) {
+    const auto mapping = g_utilp_gva_translators[i].mapping;
+    if (mapping) {
+      MmFreeMappingAddress(mapping, kHyperPlatformCommonPoolTag);
+    }
+  }
+  ExFreePoolWithTag(g_utilp_gva_translators, kHyperPlatformCommonPoolTag);
+  g_utilp_gva_translators = nullptr;
+  g_utilp_gva_translator_count = 0;
+}
+
+// Returns a translator of the current processor, or nullptr on x86
+_Use_decl_annotations_ static UtilpGvaTranslator *
+UtilpGetCurrentGvaTranslator() {
+  const auto index = KeGetCurrentProcessorNumberEx(nullptr);
+  if (index >= g_utilp_gva_translator_count) {
+    return nullptr;
+  }
+  return &g_utilp_gva_translators[index];
+}
+
+// Reads an entry of guest paging structures through the reserved page. A guest
+// physical address is the same as a host one as EPT maps them 1:1, except for
+// hidden pages, which are never paging structures.
+_Use_decl_annotations_ static bool UtilpReadGuestPagingEntry(
+    void *context, PageWalkU64 pa, PageWalkU64 *entry) {
+  const auto translator = static_cast<UtilpGvaTranslator *>(context);
+  HardwarePte pte = {};
+  pte.valid = true;
+  pte.page_frame_number = UtilPfnFromPa(pa);
+  *translator->mapping_pte = pte;
+  __invlpg(translator->mapping);
+  *entry = *reinterpret_cast<const ULONG64 *>(
+      static_cast<UCHAR *>(translator->mapping) + BYTE_OFFSET(pa));
+  return true;
+}
+
+// Guest VA -> guest PA with the guest CR3
+_Use_decl_annotations_ ULONG64 UtilGpaFromGva(ULONG64 cr3, void *va) {
+  const auto translator = UtilpGetCurrentGvaTranslator();
+  if (!translator) {
+    // Let the processor walk them with the guest CR3
+    const auto vmm_cr3 = __readcr3();
+    __writecr3(static_cast<ULONG_PTR>(cr3));
+    const auto pa = UtilPaFromVa(va);
+    __writecr3(vmm_cr3);
+    return pa;
+  }
+
+  PageWalkResult result = {};
+  const auto translated = PageWalkTranslateCached(
+      &translator->cache, cr3, reinterpret_cast<ULONG_PTR>(va),
+      UtilpReadGuestPagingEntry, translator, &result);
+
+  // Unmap the page so that no stale translation of it outlives the walk
+  if (translator->mapping_pte->valid) {
+    const HardwarePte unmapped = {};
+    *translator->mapping_pte = unmapped;
+    __invlpg(translator->mapping);
+  }
+  return (translated) ? result.pa : 0;
+}
+
+// Drops cached translations of the page on the current processor
+_Use_decl_annotations_ void UtilInvalidateGvaTranslation(void *va) {
+  const auto translator = UtilpGetCurrentGvaTranslator();
+  if (translator) {
+    PageWalkCacheInvalidateAddress(&translator->cache,
+                                   reinterpret_cast<ULONG_PTR>(va));
+  }
+}
+
+// Drops all cached translations on the current processor
+_Use_decl_annotations_ void UtilInvalidateGvaTranslations() {
+  const auto translator = UtilpGetCurrentGvaTranslator();
+  if (translator) {
+    PageWalkCacheInvalidateAll(&translator->cache);
+  }
+}
+
 // Allocates continuous physical memory
 _Use_decl_annotations_ void *UtilAllocateContiguousMemory(
     SIZE_T number_of_bytes) {
@@ -49,6 +49,12 @@ static_assert(sizeof(PhysicalMemoryDescriptor) == 0x20, "Size check");
 static_assert(sizeof(PhysicalMemoryDescriptor) == 0x10, "Size check");
 #endif
 
+/// A position of UtilGetNextPhysicalMemoryChunk(); zero-initialize to start
+struct PhysicalMemoryChunkIterator {
+  ULONG run_index;       //!< An index of PhysicalMemoryDescriptor::run
+  ULONG64 next_address;  //!< A physical address the next chunk starts from
+};
+
 /// Indicates a result of VMX-instructions
 ///
 /// This convention was taken from the VMX-intrinsic functions by Microsoft.
@@ -98,8 +104,29 @@ void *UtilPcToFileHeader(_In_ void *address);
 
 /// Returns ranges of physical memory on the system
 /// @return Physical memory ranges; never fails
+///
+/// Runs are sorted by their base addresses, and neither overlap nor adjoin.
 const PhysicalMemoryDescriptor *UtilGetPhysicalMemoryRanges();
 
+/// Returns a run of physical memory containing the address
+/// @param physical_address   A physical address to look up
+/// @return A run containing \a physical_address, or nullptr if it is not RAM,
+/// eg, device memory
+const PhysicalMemoryRun *UtilFindPhysicalMemoryRun(
+    _In_ ULONG64 physical_address);
+
+/// Returns the next largest aligned chunk of physical memory
+/// @param iterator   A position to continue from, updated on return
+/// @param base   Receives a physical address of the chunk
+/// @param size   Receives a size of the chunk; 1GB, 2MB or PAGE_SIZE
+/// @return false when all physical memory has been returned
+///
+/// Each chunk is aligned to its size, so that it can be mapped by a single
+/// page table entry or fills a single page table.
+bool UtilGetNextPhysicalMemoryChunk(
+    _Inout_ PhysicalMemoryChunkIterator *iterator, _Out_ ULONG64 *base,
+    _Out_ ULONG64 *size);
+
 /// Executes \a callback_routine on each processor
 /// @param callback_routine   A function to execute
 /// @param context  An arbitrary parameter for \a callback_routine
@@ -119,6 +146,25 @@ _IRQL_requires_max_(DISPATCH_LEVEL) NTSTATUS
     UtilForEachProcessorDpc(_In_ PKDEFERRED_ROUTINE deferred_routine,
                             _In_opt_ void *context);
 
+/// Executes \a callback_routine on all processors at once with an IPI
+/// @param callback_routine   A function to execute at IPI_LEVEL
+/// @param context  An arbitrary parameter for \a callback_routine
+/// @param processor_statuses  An optional array receiving a returned value of
+///                            \a callback_routine for each processor index
+/// @param number_of_statuses  A number of elements in \a processor_statuses
+/// @return STATUS_SUCCESS when \a callback_routine returned STATUS_SUCCESS on
+///         all processors
+///
+/// Unlike UtilForEachProcessor(), all processors run \a callback_routine
+/// concurrently and this function returns only after all of them completed it.
+/// \a callback_routine and anything it touches must be non-paged.
+_IRQL_requires_max_(DISPATCH_LEVEL) NTSTATUS
+    UtilForEachProcessorIpi(_In_ NTSTATUS (*callback_routine)(void *),
+                            _In_opt_ void *context,
+                            _Out_writes_opt_(number_of_statuses)
+                                NTSTATUS *processor_statuses,
+                            _In_ ULONG number_of_statuses);
+
 /// Suspends the execution of the current thread
 /// @param millisecond  Time to suspend in milliseconds
 /// @return STATUS_SUCCESS on success
@@ -184,6 +230,31 @@ ULONG64 UtilPaFromPfn(_In_ PFN_NUMBER pfn);
 /// @return A virtual address of \a pfn
 void *UtilVaFromPfn(_In_ PFN_NUMBER pfn);
 
+/// Guest VA -> guest PA
+/// @param cr3   A value of guest CR3 to translate \a va with
+/// @param va   A guest virtual address to get its guest physical address
+/// @return A guest physical address of \a va, or 0 if it is not mapped
+///
+/// On x64, guest paging structures are read by physical address without
+/// switching CR3, and translations are cached for each processor until
+/// UtilInvalidateGvaTranslation() or UtilInvalidateGvaTranslations() is called
+/// on the processor. Must be called at VMX root.
+///
+/// @warning
+/// INVLPG exiting is not enabled, so a cached translation can be stale
+/// until the next write to CR3 if the guest remaps the page in between. Use it
+/// for pages that stay mapped, e.g. ones locked with an MDL.
+ULONG64 UtilGpaFromGva(_In_ ULONG64 cr3, _In_ void *va);
+
+/// Drops cached translations of the page containing \a va on the current
+/// processor, as INVLPG does for TLBs
+/// @param va   A guest virtual address being invalidated
+void UtilInvalidateGvaTranslation(_In_ void *va);
+
+/// Drops all cached translations on the current processor, as a write to CR3
+/// does for TLBs
+void UtilInvalidateGvaTranslations();
+
 /// Allocates continuous physical memory
 /// @param number_of_bytes  A size to allocate
 /// @return A base address of an allocated memory or nullptr
@@ -32,6 +32,27 @@ extern "C" {
 // types
 //
 
+// State of the two-phase virtualization of all processors
+struct VmpStartupContext {
+  SharedProcessorData *shared_data;
+  ULONG_PTR host_cr3;  // CR3 of the System process for the VMM
+  ULONG number_of_processors;
+  // Indexed by a processor index. Each entry is allocated in the first phase
+  // and set to nullptr in the second phase when the VMM takes its ownership.
+  ProcessorData **processor_data;
+  KDPC *launch_dpcs;                 // Indexed by a processor index
+  volatile LONG remaining_launches;  // Processors yet to finish the launch
+  volatile LONG failed_launches;     // Processors failed to launch
+  KEVENT launch_completed;           // Set when remaining_launches is 0
+};
+
+// A per NUMA node worker of the first phase
+struct VmpNodeAllocationWorker {
+  VmpStartupContext *startup_context;
+  GROUP_AFFINITY affinity;  // Processors belonging to the node
+  NTSTATUS status;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -49,41 +70,62 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static void *VmpBuildMsrBitmap();
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static UCHAR *VmpBuildIoBitmaps();
 
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    VmpStartAllVms(_In_ SharedProcessorData *shared_data);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    VmpAllocateAllProcessorData(_Inout_ VmpStartupContext *startup_context);
+
+static KSTART_ROUTINE VmpNodeAllocationWorkerRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void VmpAllocateNodeProcessorData(
+    _Inout_ VmpNodeAllocationWorker *worker);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
+    VmpLaunchAllProcessors(_Inout_ VmpStartupContext *startup_context);
+
+static KDEFERRED_ROUTINE VmpLaunchDpcRoutine;
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static ProcessorData
+    *VmpAllocateProcessorData(_In_ SharedProcessorData *shared_data);
+
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
     VmpStartVm(_In_opt_ void *context);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static void VmpInitializeVm(
+_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG_PTR VmpGetSystemCr3();
+
+_IRQL_requires_max_(DISPATCH_LEVEL) static void VmpInitializeVm(
     _In_ ULONG_PTR guest_stack_pointer,
     _In_ ULONG_PTR guest_instruction_pointer, _In_opt_ void *context);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpEnterVmxMode(
+_IRQL_requires_max_(DISPATCH_LEVEL) static bool VmpEnterVmxMode(
     _Inout_ ProcessorData *processor_data);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpInitializeVmcs(
+_IRQL_requires_max_(DISPATCH_LEVEL) static bool VmpInitializeVmcs(
     _Inout_ ProcessorData *processor_data);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpSetupVmcs(
+_IRQL_requires_max_(DISPATCH_LEVEL) static bool VmpSetupVmcs(
     _In_ const ProcessorData *processor_data,
     _In_ ULONG_PTR guest_stack_pointer,
     _In_ ULONG_PTR guest_instruction_pointer, _In_ ULONG_PTR vmm_stack_pointer);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static void VmpLaunchVm();
+_IRQL_requires_max_(DISPATCH_LEVEL) static void VmpLaunchVm();
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG
+_IRQL_requires_max_(DISPATCH_LEVEL) static ULONG
     VmpGetSegmentAccessRight(_In_ USHORT segment_selector);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG_PTR
+_IRQL_requires_max_(DISPATCH_LEVEL) static ULONG_PTR
     VmpGetSegmentBase(_In_ ULONG_PTR gdt_base, _In_ USHORT segment_selector);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static SegmentDescriptor
+_IRQL_requires_max_(DISPATCH_LEVEL) static SegmentDescriptor
     *VmpGetSegmentDescriptor(_In_ ULONG_PTR descriptor_table_base,
                              _In_ USHORT segment_selector);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG_PTR
+_IRQL_requires_max_(DISPATCH_LEVEL) static ULONG_PTR
     VmpGetSegmentBaseByDescriptor(
         _In_ const SegmentDescriptor *segment_descriptor);
 
-_IRQL_requires_max_(PASSIVE_LEVEL) static ULONG
+_IRQL_requires_max_(DISPATCH_LEVEL) static ULONG
     VmpAdjustControlValue(_In_ Msr msr, _In_ ULONG requested_value);
 
 _IRQL_requires_max_(PASSIVE_LEVEL) static NTSTATUS
@@ -105,17 +147,14 @@ _IRQL_requires_max_(PASSIVE_LEVEL) static bool VmpIsHyperPlatformInstalled();
 #pragma alloc_text(PAGE, VmpInitializeSharedData)
 #pragma alloc_text(PAGE, VmpBuildMsrBitmap)
 #pragma alloc_text(PAGE, VmpBuildIoBitmaps)
+#pragma alloc_text(PAGE, VmpStartAllVms)
+#pragma alloc_text(PAGE, VmpAllocateAllProcessorData)
+#pragma alloc_text(PAGE, VmpNodeAllocationWorkerRoutine)
+#pragma alloc_text(PAGE, VmpAllocateNodeProcessorData)
+#pragma alloc_text(PAGE, VmpLaunchAllProcessors)
+#pragma alloc_text(PAGE, VmpAllocateProcessorData)
 #pragma alloc_text(PAGE, VmpStartVm)
-#pragma alloc_text(PAGE, VmpInitializeVm)
-#pragma alloc_text(PAGE, VmpEnterVmxMode)
-#pragma alloc_text(PAGE, VmpInitializeVmcs)
-#pragma alloc_text(PAGE, VmpSetupVmcs)
-#pragma alloc_text(PAGE, VmpLaunchVm)
-#pragma alloc_text(PAGE, VmpGetSegmentAccessRight)
-#pragma alloc_text(PAGE, VmpGetSegmentBase)
-#pragma alloc_text(PAGE, VmpGetSegmentDescriptor)
-#pragma alloc_text(PAGE, VmpGetSegmentBaseByDescriptor)
-#pragma alloc_text(PAGE, VmpAdjustControlValue)
+#pragma alloc_text(PAGE, VmpGetSystemCr3)
 #pragma alloc_text(PAGE, VmpStopVm)
 #pragma alloc_text(PAGE, VmpFreeProcessorData)
 #pragma alloc_text(PAGE, VmpFreeSharedData)
@@ -162,7 +201,7 @@ _Use_decl_annotations_ NTSTATUS VmInitialization() {
 
 
   // Virtualize all processors
-  auto status = UtilForEachProcessor(VmpStartVm, shared_data);
+  auto status = VmpStartAllVms(shared_data);
   if (!NT_SUCCESS(status)) {
     UtilForEachProcessor(VmpStopVm, nullptr);
     return status;
@@ -356,39 +395,287 @@ _Use_decl_annotations_ static UCHAR *VmpBuildIoBitmaps() {
   return io_bitmaps;
 }
 
-// Virtualize the current processor
-_Use_decl_annotations_ static NTSTATUS VmpStartVm(void *context) {
+// Virtualizes all processors in two phases. The first phase allocates and
+// builds all per-processor structures, including EPT, in parallel with a
+// worker thread per NUMA node. The second phase launches a VM on all
+// processors at once and waits for all of them to complete it.
+_Use_decl_annotations_ static NTSTATUS VmpStartAllVms(
+    SharedProcessorData *shared_data) {
   PAGED_CODE();
 
-  HYPERPLATFORM_LOG_INFO("Initializing VMX for the processor %d.",
-                         KeGetCurrentProcessorNumberEx(nullptr));
-  const auto ok = AsmInitializeVm(VmpInitializeVm, context);
-  NT_ASSERT(VmpIsHyperPlatformInstalled() == ok);
-  if (!ok) {
-    return STATUS_UNSUCCESSFUL;
+  const auto number_of_processors =
+      KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+  const auto startup_context =
+      reinterpret_cast<VmpStartupContext *>(ExAllocatePoolWithTag(
+          NonPagedPool, sizeof(VmpStartupContext), kHyperPlatformCommonPoolTag));
+  if (!startup_context) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
   }
-  HYPERPLATFORM_LOG_INFO("Initialized successfully.");
-  return STATUS_SUCCESS;
+  RtlZeroMemory(startup_context, sizeof(VmpStartupContext));
+  startup_context->shared_data = shared_data;
+  startup_context->host_cr3 = VmpGetSystemCr3();
+  startup_context->number_of_processors = number_of_processors;
+
+  const auto processor_data_size =
+      sizeof(ProcessorData *) * number_of_processors;
+  startup_context->processor_data =
+      reinterpret_cast<ProcessorData **>(ExAllocatePoolWithTag(
+          NonPagedPool, processor_data_size, kHyperPlatformCommonPoolTag));
+  const auto launch_dpcs_size = sizeof(KDPC) * number_of_processors;
+  startup_context->launch_dpcs = reinterpret_cast<KDPC *>(ExAllocatePoolWithTag(
+      NonPagedPool, launch_dpcs_size, kHyperPlatformCommonPoolTag));
+  if (!startup_context->processor_data || !startup_context->launch_dpcs) {
+    if (startup_context->processor_data) {
+      ExFreePoolWithTag(startup_context->processor_data,
+                        kHyperPlatformCommonPoolTag);
+    }
+    if (startup_context->launch_dpcs) {
+      ExFreePoolWithTag(startup_context->launch_dpcs,
+                        kHyperPlatformCommonPoolTag);
+    }
+    ExFreePoolWithTag(startup_context, kHyperPlatformCommonPoolTag);
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(startup_context->processor_data, processor_data_size);
+  RtlZeroMemory(startup_context->launch_dpcs, launch_dpcs_size);
+
+  LARGE_INTEGER frequency = {};
+  const auto start_time = KeQueryPerformanceCounter(&frequency);
+
+  // Phase 1: allocate and build per-processor structures
+  auto status = VmpAllocateAllProcessorData(startup_context);
+  const auto allocated_time = KeQueryPerformanceCounter(nullptr);
+
+  // Phase 2: launch VMs
+  if (NT_SUCCESS(status)) {
+    status = VmpLaunchAllProcessors(startup_context);
+  }
+  const auto launched_time = KeQueryPerformanceCounter(nullptr);
+
+  const auto to_us = [frequency](LONGLONG ticks) {
+    return static_cast<ULONG64>(ticks * 1000 * 1000 / frequency.QuadPart);
+  };
+  HYPERPLATFORM_LOG_INFO(
+      "Virtualized %lu processors in %I64u us (allocation %I64u us, launch "
+      "%I64u us), status = %08x",
+      number_of_processors,
+      to_us(launched_time.QuadPart - start_time.QuadPart),
+      to_us(allocated_time.QuadPart - start_time.QuadPart),
+      to_us(launched_time.QuadPart - allocated_time.QuadPart), status);
+
+  // Free structures not taken by the VMM, ie, ones for processors failed to
+  // launch or not launched at all
+  for (ULONG i = 0; i < number_of_processors; i++) {
+    VmpFreeProcessorData(startup_context->processor_data[i]);
+  }
+  ExFreePoolWithTag(startup_context->launch_dpcs, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(startup_context->processor_data,
+                    kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(startup_context, kHyperPlatformCommonPoolTag);
+  return status;
 }
 
-// Allocates structures for virtualization, initializes VMCS and virtualizes
-// the current processor
-_Use_decl_annotations_ static void VmpInitializeVm(
-    ULONG_PTR guest_stack_pointer, ULONG_PTR guest_instruction_pointer,
-    void *context) {
+// Allocates structures for all processors with a worker thread per NUMA node.
+// Falls back to the current thread when a worker thread cannot be created.
+_Use_decl_annotations_ static NTSTATUS VmpAllocateAllProcessorData(
+    VmpStartupContext *startup_context) {
   PAGED_CODE();
 
-  const auto shared_data = reinterpret_cast<SharedProcessorData *>(context);
-  if (!shared_data) {
-    return;
+  const auto number_of_nodes = KeQueryHighestNodeNumber() + 1ul;
+  const auto workers_size = sizeof(VmpNodeAllocationWorker) * number_of_nodes;
+  const auto workers =
+      reinterpret_cast<VmpNodeAllocationWorker *>(ExAllocatePoolWithTag(
+          NonPagedPool, workers_size, kHyperPlatformCommonPoolTag));
+  const auto threads_size = sizeof(HANDLE) * number_of_nodes;
+  const auto threads = reinterpret_cast<HANDLE *>(ExAllocatePoolWithTag(
+      NonPagedPool, threads_size, kHyperPlatformCommonPoolTag));
+  if (!workers || !threads) {
+    if (workers) {
+      ExFreePoolWithTag(workers, kHyperPlatformCommonPoolTag);
+    }
+    if (threads) {
+      ExFreePoolWithTag(threads, kHyperPlatformCommonPoolTag);
+    }
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  RtlZeroMemory(workers, workers_size);
+  RtlZeroMemory(threads, threads_size);
+
+  for (ULONG node = 0; node < number_of_nodes; node++) {
+    auto &worker = workers[node];
+    worker.startup_context = startup_context;
+    worker.status = STATUS_SUCCESS;
+
+    USHORT count = 0;
+    KeQueryNodeActiveAffinity(static_cast<USHORT>(node), &worker.affinity,
+                              &count);
+    if (!count) {
+      continue;
+    }
+
+    auto status = PsCreateSystemThread(&threads[node], GENERIC_ALL, nullptr,
+                                       nullptr, nullptr,
+                                       VmpNodeAllocationWorkerRoutine, &worker);
+    if (!NT_SUCCESS(status)) {
+      threads[node] = nullptr;
+      VmpAllocateNodeProcessorData(&worker);
+    }
+  }
+
+  auto status = STATUS_SUCCESS;
+  for (ULONG node = 0; node < number_of_nodes; node++) {
+    if (threads[node]) {
+      ZwWaitForSingleObject(threads[node], FALSE, nullptr);
+      ZwClose(threads[node]);
+    }
+    if (NT_SUCCESS(status) && !NT_SUCCESS(workers[node].status)) {
+      status = workers[node].status;
+    }
+  }
+
+  ExFreePoolWithTag(threads, kHyperPlatformCommonPoolTag);
+  ExFreePoolWithTag(workers, kHyperPlatformCommonPoolTag);
+  return status;
+}
+
+// A thread routine of the first phase
+_Use_decl_annotations_ static void VmpNodeAllocationWorkerRoutine(
+    void *start_context) {
+  PAGED_CODE();
+
+  VmpAllocateNodeProcessorData(
+      reinterpret_cast<VmpNodeAllocationWorker *>(start_context));
+  PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+// Allocates structures for processors belonging to the worker's node. The
+// thread runs on the node so that pool allocations are served from memory
+// local to the processors using it.
+_Use_decl_annotations_ static void VmpAllocateNodeProcessorData(
+    VmpNodeAllocationWorker *worker) {
+  PAGED_CODE();
+
+  const auto startup_context = worker->startup_context;
+  GROUP_AFFINITY previous_affinity = {};
+  KeSetSystemGroupAffinityThread(&worker->affinity, &previous_affinity);
+
+  for (ULONG processor_index = 0;
+       processor_index < startup_context->number_of_processors;
+       processor_index++) {
+    PROCESSOR_NUMBER processor_number = {};
+    auto status =
+        KeGetProcessorNumberFromIndex(processor_index, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      worker->status = status;
+      break;
+    }
+    if (processor_number.Group != worker->affinity.Group ||
+        !(worker->affinity.Mask & (1ull << processor_number.Number))) {
+      continue;
+    }
+
+    const auto processor_data =
+        VmpAllocateProcessorData(startup_context->shared_data);
+    if (!processor_data) {
+      worker->status = STATUS_MEMORY_NOT_ALLOCATED;
+      break;
+    }
+    processor_data->host_cr3 = startup_context->host_cr3;
+    startup_context->processor_data[processor_index] = processor_data;
+  }
+
+  KeRevertToUserGroupAffinityThread(&previous_affinity);
+}
+
+// Launches VMs on all processors at once with DPCs and waits until all of them
+// completed it
+_Use_decl_annotations_ static NTSTATUS VmpLaunchAllProcessors(
+    VmpStartupContext *startup_context) {
+  PAGED_CODE();
+
+  // Set up all DPCs first so that either all or none of them are queued
+  for (ULONG processor_index = 0;
+       processor_index < startup_context->number_of_processors;
+       processor_index++) {
+    PROCESSOR_NUMBER processor_number = {};
+    auto status =
+        KeGetProcessorNumberFromIndex(processor_index, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      return status;
+    }
+
+    const auto dpc = &startup_context->launch_dpcs[processor_index];
+    KeInitializeDpc(dpc, VmpLaunchDpcRoutine, startup_context);
+    KeSetImportanceDpc(dpc, HighImportance);
+    status = KeSetTargetProcessorDpcEx(dpc, &processor_number);
+    if (!NT_SUCCESS(status)) {
+      return status;
+    }
+  }
+
+  KeInitializeEvent(&startup_context->launch_completed, NotificationEvent,
+                    FALSE);
+  startup_context->remaining_launches =
+      static_cast<LONG>(startup_context->number_of_processors);
+  for (ULONG processor_index = 0;
+       processor_index < startup_context->number_of_processors;
+       processor_index++) {
+    KeInsertQueueDpc(&startup_context->launch_dpcs[processor_index], nullptr,
+                     nullptr);
   }
 
+  KeWaitForSingleObject(&startup_context->launch_completed, Executive,
+                        KernelMode, FALSE, nullptr);
+
+  // The last DPC may still be inside KeSetEvent(); wait for it to return
+  // before the caller frees startup_context
+  KeFlushQueuedDpcs();
+  return (startup_context->failed_launches) ? STATUS_UNSUCCESSFUL
+                                            : STATUS_SUCCESS;
+}
+
+// Virtualizes the current processor with the structures allocated in the first
+// phase
+_Use_decl_annotations_ static void VmpLaunchDpcRoutine(
+    KDPC *dpc, void *deferred_context, void *system_argument1,
+    void *system_argument2) {
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(system_argument1);
+  UNREFERENCED_PARAMETER(system_argument2);
+
+  const auto startup_context =
+      reinterpret_cast<VmpStartupContext *>(deferred_context);
+  const auto processor_index = KeGetCurrentProcessorNumberEx(nullptr);
+  const auto processor_data =
+      (processor_index < startup_context->number_of_processors)
+          ? startup_context->processor_data[processor_index]
+          : nullptr;
+
+  HYPERPLATFORM_LOG_DEBUG("Initializing VMX for the processor %lu.",
+                          processor_index);
+  if (processor_data && AsmInitializeVm(VmpInitializeVm, processor_data)) {
+    // The VMM owns it now, and returns it with kTerminateVmm
+    startup_context->processor_data[processor_index] = nullptr;
+  } else {
+    InterlockedIncrement(&startup_context->failed_launches);
+  }
+
+  if (InterlockedDecrement(&startup_context->remaining_launches) == 0) {
+    KeSetEvent(&startup_context->launch_completed, IO_NO_INCREMENT, FALSE);
+  }
+}
+
+// Allocates structures for virtualization of a processor
+_Use_decl_annotations_ static ProcessorData *VmpAllocateProcessorData(
+    SharedProcessorData *shared_data) {
+  PAGED_CODE();
+
   // Allocate related structures
   const auto processor_data =
       reinterpret_cast<ProcessorData *>(ExAllocatePoolWithTag(
           NonPagedPool, sizeof(ProcessorData), kHyperPlatformCommonPoolTag));
   if (!processor_data) {
-    return;
+    return nullptr;
   }
   RtlZeroMemory(processor_data, sizeof(ProcessorData));
   processor_data->shared_data = shared_data;
@@ -397,20 +684,20 @@ _Use_decl_annotations_ static void VmpInitializeVm(
   // Set up EPT
   processor_data->ept_data = EptInitialization();
   if (!processor_data->ept_data) {
-    goto ReturnFalse;
+    goto ReturnNull;
   }
 
   //for bookkepping.
   processor_data->sh_data = TruthAllocateHiddenData();
   if (!processor_data->sh_data) {
-	  goto ReturnFalse;
+	  goto ReturnNull;
   }
 
   // Allocate other processor data fields
   processor_data->vmm_stack_limit =
       UtilAllocateContiguousMemory(KERNEL_STACK_SIZE);
   if (!processor_data->vmm_stack_limit) {
-    goto ReturnFalse;
+    goto ReturnNull;
   }
   RtlZeroMemory(processor_data->vmm_stack_limit, KERNEL_STACK_SIZE);
 
@@ -418,7 +705,7 @@ _Use_decl_annotations_ static void VmpInitializeVm(
       reinterpret_cast<VmControlStructure *>(ExAllocatePoolWithTag(
           NonPagedPool, kVmxMaxVmcsSize, kHyperPlatformCommonPoolTag));
   if (!processor_data->vmcs_region) {
-    goto ReturnFalse;
+    goto ReturnNull;
   }
   RtlZeroMemory(processor_data->vmcs_region, kVmxMaxVmcsSize);
 
@@ -426,9 +713,61 @@ _Use_decl_annotations_ static void VmpInitializeVm(
       reinterpret_cast<VmControlStructure *>(ExAllocatePoolWithTag(
           NonPagedPool, kVmxMaxVmcsSize, kHyperPlatformCommonPoolTag));
   if (!processor_data->vmxon_region) {
-    goto ReturnFalse;
+    goto ReturnNull;
   }
   RtlZeroMemory(processor_data->vmxon_region, kVmxMaxVmcsSize);
+  return processor_data;
+
+ReturnNull:;
+  VmpFreeProcessorData(processor_data);
+  return nullptr;
+}
+
+// Virtualize the current processor
+_Use_decl_annotations_ static NTSTATUS VmpStartVm(void *context) {
+  PAGED_CODE();
+
+  HYPERPLATFORM_LOG_INFO("Initializing VMX for the processor %d.",
+                         KeGetCurrentProcessorNumberEx(nullptr));
+  const auto processor_data =
+      VmpAllocateProcessorData(reinterpret_cast<SharedProcessorData *>(context));
+  if (!processor_data) {
+    return STATUS_MEMORY_NOT_ALLOCATED;
+  }
+  processor_data->host_cr3 = VmpGetSystemCr3();
+  const auto ok = AsmInitializeVm(VmpInitializeVm, processor_data);
+  NT_ASSERT(VmpIsHyperPlatformInstalled() == ok);
+  if (!ok) {
+    VmpFreeProcessorData(processor_data);
+    return STATUS_UNSUCCESSFUL;
+  }
+  HYPERPLATFORM_LOG_INFO("Initialized successfully.");
+  return STATUS_SUCCESS;
+}
+
+// Returns CR3 of the System process. The VMM cannot run with CR3 of whatever
+// process a processor was running when launched, as page tables of that
+// process are freed when it exits.
+_Use_decl_annotations_ static ULONG_PTR VmpGetSystemCr3() {
+  PAGED_CODE();
+
+  KAPC_STATE apc_state = {};
+  KeStackAttachProcess(PsInitialSystemProcess, &apc_state);
+  const auto system_cr3 = __readcr3();
+  KeUnstackDetachProcess(&apc_state);
+  return system_cr3;
+}
+
+// Initializes VMCS and virtualizes the current processor with already allocated
+// structures. It runs at up to DISPATCH_LEVEL and leaves \a context to a caller
+// to free on failure.
+_Use_decl_annotations_ static void VmpInitializeVm(
+    ULONG_PTR guest_stack_pointer, ULONG_PTR guest_instruction_pointer,
+    void *context) {
+  const auto processor_data = reinterpret_cast<ProcessorData *>(context);
+  if (!processor_data) {
+    return;
+  }
 
   // Initialize stack memory for VMM like this:
   //
@@ -463,7 +802,7 @@ _Use_decl_annotations_ static void VmpInitializeVm(
 
   // Set up VMCS
   if (!VmpEnterVmxMode(processor_data)) {
-    goto ReturnFalse;
+    return;
   }
   if (!VmpInitializeVmcs(processor_data)) {
     goto ReturnFalseWithVmxOff;
@@ -481,16 +820,11 @@ _Use_decl_annotations_ static void VmpInitializeVm(
 
 ReturnFalseWithVmxOff:;
   __vmx_off();
-
-ReturnFalse:;
-  VmpFreeProcessorData(processor_data);
 }
 
 // See: VMM SETUP & TEAR DOWN
 _Use_decl_annotations_ static bool VmpEnterVmxMode(
     ProcessorData *processor_data) {
-  PAGED_CODE();
-
   // Apply FIXED bits
   // See: VMX-FIXED BITS IN CR0
 
@@ -545,8 +879,6 @@ _Use_decl_annotations_ static bool VmpEnterVmxMode(
 // See: VMM SETUP & TEAR DOWN
 _Use_decl_annotations_ static bool VmpInitializeVmcs(
     ProcessorData *processor_data) {
-  PAGED_CODE();
-
   // Write a VMCS revision identifier
   const Ia32VmxBasicMsr vmx_basic_msr = {UtilReadMsr64(Msr::kIa32VmxBasic)};
   processor_data->vmcs_region->revision_identifier =
@@ -568,8 +900,6 @@ _Use_decl_annotations_ static bool VmpInitializeVmcs(
 _Use_decl_annotations_ static bool VmpSetupVmcs(
     const ProcessorData *processor_data, ULONG_PTR guest_stack_pointer,
     ULONG_PTR guest_instruction_pointer, ULONG_PTR vmm_stack_pointer) {
-  PAGED_CODE();
-
   Gdtr gdtr = {};
   __sgdt(&gdtr);
 
@@ -775,7 +1105,7 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
 
   /* Natural-Width Host-State Fields */
   error |= UtilVmWrite(VmcsField::kHostCr0, __readcr0());
-  error |= UtilVmWrite(VmcsField::kHostCr3, __readcr3());
+  error |= UtilVmWrite(VmcsField::kHostCr3, processor_data->host_cr3);
   error |= UtilVmWrite(VmcsField::kHostCr4, __readcr4());
 #if defined(_AMD64_)
   error |= UtilVmWrite(VmcsField::kHostFsBase, UtilReadMsr(Msr::kIa32FsBase));
@@ -799,8 +1129,6 @@ _Use_decl_annotations_ static bool VmpSetupVmcs(
 
 // Executes vmlaunch
 _Use_decl_annotations_ static void VmpLaunchVm() {
-  PAGED_CODE();
-
   auto error_code = UtilVmRead(VmcsField::kVmInstructionError);
   if (error_code) {
     HYPERPLATFORM_LOG_WARN("VM_INSTRUCTION_ERROR = %Iu", error_code);
@@ -820,8 +1148,6 @@ _Use_decl_annotations_ static void VmpLaunchVm() {
 // Returns access right of the segment specified by the SegmentSelector for VMX
 _Use_decl_annotations_ static ULONG VmpGetSegmentAccessRight(
     USHORT segment_selector) {
-  PAGED_CODE();
-
   VmxRegmentDescriptorAccessRight access_right = {};
   const SegmentSelector ss = {segment_selector};
   if (segment_selector) {
@@ -840,8 +1166,6 @@ _Use_decl_annotations_ static ULONG VmpGetSegmentAccessRight(
 // Returns a base address of the segment specified by SegmentSelector
 _Use_decl_annotations_ static ULONG_PTR VmpGetSegmentBase(
     ULONG_PTR gdt_base, USHORT segment_selector) {
-  PAGED_CODE();
-
   const SegmentSelector ss = {segment_selector};
   if (!ss.all) {
     return 0;
@@ -865,8 +1189,6 @@ _Use_decl_annotations_ static ULONG_PTR VmpGetSegmentBase(
 // Returns the segment descriptor corresponds to the SegmentSelector
 _Use_decl_annotations_ static SegmentDescriptor *VmpGetSegmentDescriptor(
     ULONG_PTR descriptor_table_base, USHORT segment_selector) {
-  PAGED_CODE();
-
   const SegmentSelector ss = {segment_selector};
   return reinterpret_cast<SegmentDescriptor *>(
       descriptor_table_base + ss.fields.index * sizeof(SegmentDescriptor));
@@ -875,8 +1197,6 @@ _Use_decl_annotations_ static SegmentDescriptor *VmpGetSegmentDescriptor(
 // Returns a base address of segment_descriptor
 _Use_decl_annotations_ static ULONG_PTR VmpGetSegmentBaseByDescriptor(
     const SegmentDescriptor *segment_descriptor) {
-  PAGED_CODE();
-
   // Calculate a 32bit base address
   const auto base_high = segment_descriptor->fields.base_high << (6 * 4);
   const auto base_middle = segment_descriptor->fields.base_mid << (4 * 4);
@@ -895,8 +1215,6 @@ _Use_decl_annotations_ static ULONG_PTR VmpGetSegmentBaseByDescriptor(
 // Adjust the requested control value with consulting a value of related MSR
 _Use_decl_annotations_ static ULONG VmpAdjustControlValue(
     Msr msr, ULONG requested_value) {
-  PAGED_CODE();
-
   LARGE_INTEGER msr_value = {};
   msr_value.QuadPart = UtilReadMsr64(msr);
   auto adjusted_value = requested_value;
@@ -912,6 +1230,9 @@ _Use_decl_annotations_ static ULONG VmpAdjustControlValue(
 _Use_decl_annotations_ void VmTermination() {
   PAGED_CODE();
 
+  // Unregisters callbacks of NoTruth while hypercalls are still available
+  NoTruthTermination();
+
   HYPERPLATFORM_LOG_INFO("Uninstalling VMM.");
   auto status = UtilForEachProcessor(VmpStopVm, nullptr);
   if (NT_SUCCESS(status)) {
@@ -927,6 +1248,12 @@ _Use_decl_annotations_ static NTSTATUS VmpStopVm(void *context) {
   UNREFERENCED_PARAMETER(context);
   PAGED_CODE();
 
+  // The processor may not be virtualized when only some of processors failed
+  // to launch a VM during VmInitialization()
+  if (!VmpIsHyperPlatformInstalled()) {
+    return STATUS_SUCCESS;
+  }
+
   HYPERPLATFORM_LOG_INFO("Terminating VMX for the processor %d.",
                          KeGetCurrentProcessorNumberEx(nullptr));
 
@@ -10,6 +10,7 @@
 #include "asm.h"
 #include "common.h"
 #include "ept.h"
+#include "exit_trace.h"
 #include "log.h"
 #include "util.h"
 #include "performance.h"
@@ -226,6 +227,8 @@ _Use_decl_annotations_ static void VmmpHandleVmExit(
 
   const VmExitInformation exit_reason = {
       static_cast<ULONG32>(UtilVmRead(VmcsField::kVmExitReason))};
+  ExitTraceRecordVmExit(static_cast<USHORT>(exit_reason.fields.reason),
+                        guest_context->ip);
 
   if (kVmmpEnableRecordVmExit) {
     // Save them for ease of trouble shooting
@@ -929,6 +932,7 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
           }
           UtilInvvpidSingleContextExceptGlobal(
               static_cast<USHORT>(KeGetCurrentProcessorNumberEx(nullptr) + 1));
+          UtilInvalidateGvaTranslations();
           UtilVmWrite(VmcsField::kGuestCr3, *register_used);
           break;
         }
@@ -940,6 +944,7 @@ _Use_decl_annotations_ static void VmmpHandleCrAccess(
             UtilLoadPdptes(UtilVmRead(VmcsField::kGuestCr3));
           }
           UtilInvvpidAllContext();
+          UtilInvalidateGvaTranslations();
           const Cr4 cr4_fixed0 = {UtilReadMsr(Msr::kIa32VmxCr4Fixed0)};
           const Cr4 cr4_fixed1 = {UtilReadMsr(Msr::kIa32VmxCr4Fixed1)};
           Cr4 cr4 = {*register_used};
@@ -1129,6 +1134,7 @@ _Use_decl_annotations_ static void VmmpHandleInvalidateTlbEntry(
   UtilInvvpidIndividualAddress(
       static_cast<USHORT>(KeGetCurrentProcessorNumberEx(nullptr) + 1),
       invalidate_address);
+  UtilInvalidateGvaTranslation(invalidate_address);
   VmmpAdjustGuestInstructionPointer(guest_context);
 }
 
@@ -42,6 +42,7 @@ struct ProcessorData {
   struct VmControlStructure* vmcs_region;   //!< VA of a VMCS region
   struct EptData* ept_data;                 //!< A pointer to EPT related data
   struct HiddenData* sh_data;           ///< Per-processor shadow hook data
+  ULONG_PTR host_cr3;                       //!< CR3 of the System process
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,548 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Implements hide policy functions.
+
+#include "HidePolicy.h"
+#include <ntimage.h>
+#include "../HyperPlatform/HyperPlatform/common.h"
+#include "../HyperPlatform/HyperPlatform/log.h"
+#include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include "../HyperPlatform/HyperPlatform/kernel_pool.h"
+#include <vector>
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+// The largest number of entries a policy can have
+static const ULONG kHidePolicyMaxEntries = 1024;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+// Entries of a policy. They have their own pool tag.
+using HidePolicyVector = std::vector<HIDE_POLICY_ENTRY,
+	KernelPoolAllocator<HIDE_POLICY_ENTRY, KernelPoolType::kHidePolicy>>;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+extern "C" {
+	PCHAR PsGetProcessImageFileName(PEPROCESS);
+}
+
+static VOID HidePolicyImageLoadMonitor(
+	_In_opt_ PUNICODE_STRING FullImageName,
+	_In_ HANDLE ProcessId,
+	_In_ PIMAGE_INFO ImageInfo);
+
+static bool HidePolicyMatches(
+	_In_ const HIDE_POLICY_ENTRY& policy,
+	_In_ const char* image_name,
+	_In_ PCUNICODE_STRING module_name);
+
+static void HidePolicyApply(
+	_In_ PEPROCESS proc,
+	_In_ HANDLE process_id,
+	_In_ PCUNICODE_STRING module_name,
+	_In_ PIMAGE_INFO image_info,
+	_In_ const HidePolicyVector& policies);
+
+static NTSTATUS HidePolicyResolveRange(
+	_In_ const HIDE_POLICY_ENTRY& policy,
+	_In_ ULONG_PTR base,
+	_In_ SIZE_T image_size,
+	_Out_ ULONG64* start,
+	_Out_ ULONG64* length);
+
+static PIMAGE_NT_HEADERS HidePolicyGetNtHeaders(
+	_In_ ULONG_PTR base,
+	_In_ SIZE_T image_size);
+
+static NTSTATUS HidePolicyFindSection(
+	_In_ ULONG_PTR base,
+	_In_ SIZE_T image_size,
+	_In_ const char* name,
+	_Out_ ULONG* rva,
+	_Out_ ULONG* size);
+
+static NTSTATUS HidePolicyFindExport(
+	_In_ ULONG_PTR base,
+	_In_ SIZE_T image_size,
+	_In_ const char* name,
+	_Out_ ULONG* rva);
+
+#if defined(ALLOC_PRAGMA)
+#pragma alloc_text(INIT, HidePolicyInitialization)
+#pragma alloc_text(PAGE, HidePolicyTermination)
+#pragma alloc_text(PAGE, HidePolicyLoad)
+#pragma alloc_text(PAGE, HidePolicyImageLoadMonitor)
+#pragma alloc_text(PAGE, HidePolicyMatches)
+#pragma alloc_text(PAGE, HidePolicyApply)
+#pragma alloc_text(PAGE, HidePolicyResolveRange)
+#pragma alloc_text(PAGE, HidePolicyGetNtHeaders)
+#pragma alloc_text(PAGE, HidePolicyFindSection)
+#pragma alloc_text(PAGE, HidePolicyFindExport)
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Protects g_HidePolicy
+static FAST_MUTEX g_HidePolicyLock;
+
+// A loaded policy, or nullptr when none is loaded
+static HidePolicyVector* g_HidePolicy;
+
+// Whether HidePolicyImageLoadMonitor() is registered. Before Windows 8, image
+// load notifications are delivered with the address space lock of the process
+// held, and hiding pages there deadlocks.
+static bool g_HidePolicySupported;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C NTSTATUS HidePolicyInitialization()
+{
+	PAGED_CODE();
+
+	ExInitializeFastMutex(&g_HidePolicyLock);
+	if (!RtlIsNtDdiVersionAvailable(NTDDI_WIN8))
+	{
+		return STATUS_SUCCESS;
+	}
+
+	const auto status = PsSetLoadImageNotifyRoutine(HidePolicyImageLoadMonitor);
+	g_HidePolicySupported = NT_SUCCESS(status);
+	return status;
+}
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C void HidePolicyTermination()
+{
+	PAGED_CODE();
+
+	if (!g_HidePolicySupported)
+	{
+		return;
+	}
+
+	// Waits for callbacks in progress to return
+	PsRemoveLoadImageNotifyRoutine(HidePolicyImageLoadMonitor);
+	g_HidePolicySupported = false;
+	delete g_HidePolicy;
+	g_HidePolicy = nullptr;
+}
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C NTSTATUS HidePolicyLoad(
+	const HIDE_POLICY_ENTRY* entries,
+	ULONG count)
+{
+	PAGED_CODE();
+
+	if (count > kHidePolicyMaxEntries)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	if (count && !g_HidePolicySupported)
+	{
+		return STATUS_NOT_SUPPORTED;
+	}
+
+	HidePolicyVector* policy = nullptr;
+	if (count)
+	{
+		policy = new HidePolicyVector(entries, entries + count);
+		for (auto& entry : *policy)
+		{
+			// Names given by a caller may not be terminated
+			entry.ImageName[RTL_NUMBER_OF(entry.ImageName) - 1] = '\0';
+			entry.ModuleName[RTL_NUMBER_OF(entry.ModuleName) - 1] = L'\0';
+			entry.Name[RTL_NUMBER_OF(entry.Name) - 1] = '\0';
+			if (!entry.ImageName[0] || !entry.ModuleName[0] ||
+				entry.Kind > HIDE_POLICY_RANGE ||
+				(entry.Kind != HIDE_POLICY_RANGE && !entry.Name[0]) ||
+				(entry.Kind == HIDE_POLICY_SECTION &&
+					strlen(entry.Name) > IMAGE_SIZEOF_SHORT_NAME) ||
+				(entry.Kind == HIDE_POLICY_RANGE && !entry.Length))
+			{
+				delete policy;
+				return STATUS_INVALID_PARAMETER;
+			}
+		}
+	}
+
+	ExAcquireFastMutex(&g_HidePolicyLock);
+	const auto old_policy = g_HidePolicy;
+	g_HidePolicy = policy;
+	ExReleaseFastMutex(&g_HidePolicyLock);
+
+	delete old_policy;
+	HYPERPLATFORM_LOG_INFO("A hide policy with %lu entries has been loaded.", count);
+	return STATUS_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------------//
+// Called after an image is mapped and before any code of it runs, in a context
+// of the process loading it
+_Use_decl_annotations_ static VOID HidePolicyImageLoadMonitor(
+	PUNICODE_STRING FullImageName,
+	HANDLE ProcessId,
+	PIMAGE_INFO ImageInfo)
+{
+	PAGED_CODE();
+
+	// Drivers are loaded with a process ID 0
+	if (!ProcessId || !FullImageName || ImageInfo->SystemModeImage)
+	{
+		return;
+	}
+
+	// A file name part of the full path
+	UNICODE_STRING module_name = *FullImageName;
+	for (auto i = FullImageName->Length / sizeof(WCHAR); i > 0; i--)
+	{
+		if (FullImageName->Buffer[i - 1] == L'\\')
+		{
+			module_name.Buffer = FullImageName->Buffer + i;
+			module_name.Length = static_cast<USHORT>(
+				FullImageName->Length - i * sizeof(WCHAR));
+			module_name.MaximumLength = module_name.Length;
+			break;
+		}
+	}
+
+	PEPROCESS proc = nullptr;
+	if (!NT_SUCCESS(PsLookupProcessByProcessId(ProcessId, &proc)))
+	{
+		return;
+	}
+	const auto image_name = PsGetProcessImageFileName(proc);
+
+	// Matched entries are copied so that the lock is not held while hiding
+	HidePolicyVector matched;
+	ExAcquireFastMutex(&g_HidePolicyLock);
+	if (g_HidePolicy)
+	{
+		for (const auto& policy : *g_HidePolicy)
+		{
+			if (HidePolicyMatches(policy, image_name, &module_name))
+			{
+				matched.push_back(policy);
+			}
+		}
+	}
+	ExReleaseFastMutex(&g_HidePolicyLock);
+
+	if (!matched.empty())
+	{
+		HidePolicyApply(proc, ProcessId, &module_name, ImageInfo, matched);
+	}
+	ObDereferenceObject(proc);
+}
+
+//--------------------------------------------------------------------------------------//
+// Checks if the entry is for the module of the process. Names are compared
+// case-insensitively.
+_Use_decl_annotations_ static bool HidePolicyMatches(
+	const HIDE_POLICY_ENTRY& policy,
+	const char* image_name,
+	PCUNICODE_STRING module_name)
+{
+	PAGED_CODE();
+
+	// PsGetProcessImageFileName() returns up to 15 characters
+	if (_strnicmp(policy.ImageName, image_name, 15) != 0)
+	{
+		return false;
+	}
+	UNICODE_STRING policy_module_name;
+	RtlInitUnicodeString(&policy_module_name, policy.ModuleName);
+	return !!RtlEqualUnicodeString(&policy_module_name, module_name, TRUE);
+}
+
+//--------------------------------------------------------------------------------------//
+// Resolves ranges of the entries in the module and hides them at once. Hiding
+// is started so that the pages are hidden before the module runs.
+_Use_decl_annotations_ static void HidePolicyApply(
+	PEPROCESS proc,
+	HANDLE process_id,
+	PCUNICODE_STRING module_name,
+	PIMAGE_INFO image_info,
+	const HidePolicyVector& policies)
+{
+	PAGED_CODE();
+
+	std::vector<HIDE_BULK_ENTRY> entries;
+	entries.reserve(policies.size());
+
+	KAPC_STATE apc_state;
+	KeStackAttachProcess(proc, &apc_state);
+	for (const auto& policy : policies)
+	{
+		ULONG64 start = 0;
+		ULONG64 length = 0;
+		const auto status = HidePolicyResolveRange(policy,
+			reinterpret_cast<ULONG_PTR>(image_info->ImageBase),
+			image_info->ImageSize, &start, &length);
+		if (!NT_SUCCESS(status))
+		{
+			HYPERPLATFORM_LOG_INFO("Cannot resolve %s in %wZ (%08x)",
+				policy.Name, module_name, status);
+			continue;
+		}
+		const HIDE_BULK_ENTRY entry = {
+			reinterpret_cast<ULONG64>(process_id), start, length, policy.Flags };
+		entries.push_back(entry);
+	}
+	KeUnstackDetachProcess(&apc_state);
+
+	if (entries.empty())
+	{
+		return;
+	}
+
+	std::vector<NTSTATUS> statuses(entries.size());
+	auto status = AddMemoryHideBulk(entries.data(),
+		static_cast<ULONG>(entries.size()), statuses.data());
+	if (!NT_SUCCESS(status))
+	{
+		HYPERPLATFORM_LOG_ERROR("Cannot hide %wZ (%08x)", module_name, status);
+		return;
+	}
+
+	auto hidden = false;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (NT_SUCCESS(statuses[i]))
+		{
+			hidden = true;
+			continue;
+		}
+		HYPERPLATFORM_LOG_ERROR("Cannot hide %llx (%llu bytes) in %wZ (%08x)",
+			entries[i].Address, entries[i].Length, module_name, statuses[i]);
+	}
+	if (!hidden)
+	{
+		return;
+	}
+
+	status = StartMemoryHide();
+	HYPERPLATFORM_LOG_INFO("Hid %wZ in %s (%08x)", module_name,
+		PsGetProcessImageFileName(proc), status);
+}
+
+//--------------------------------------------------------------------------------------//
+// Resolves a range of the entry in the image mapped at base. Must be called in
+// a context of the process where the image is mapped.
+_Use_decl_annotations_ static NTSTATUS HidePolicyResolveRange(
+	const HIDE_POLICY_ENTRY& policy,
+	ULONG_PTR base,
+	SIZE_T image_size,
+	ULONG64* start,
+	ULONG64* length)
+{
+	PAGED_CODE();
+
+	*start = 0;
+	*length = 0;
+	auto offset = policy.Offset;
+	auto size = policy.Length;
+	auto status = STATUS_SUCCESS;
+
+	// The image is user memory and may be unmapped or malformed
+	__try
+	{
+		switch (policy.Kind)
+		{
+		case HIDE_POLICY_SECTION:
+		{
+			ULONG rva = 0;
+			ULONG section_size = 0;
+			status = HidePolicyFindSection(base, image_size, policy.Name, &rva,
+				&section_size);
+			offset = rva;
+			size = section_size;
+			break;
+		}
+		case HIDE_POLICY_EXPORT:
+		{
+			ULONG rva = 0;
+			status = HidePolicyFindExport(base, image_size, policy.Name, &rva);
+			offset += rva;
+			size = (size) ? size : 1;
+			break;
+		}
+		default:
+			break;
+		}
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		status = GetExceptionCode();
+	}
+
+	if (!NT_SUCCESS(status))
+	{
+		return status;
+	}
+	if (!size || offset >= image_size || size > image_size - offset)
+	{
+		return STATUS_INVALID_PARAMETER;
+	}
+	*start = base + offset;
+	*length = size;
+	return STATUS_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------------//
+// Returns NT headers of the image, or nullptr when they are malformed
+_Use_decl_annotations_ static PIMAGE_NT_HEADERS HidePolicyGetNtHeaders(
+	ULONG_PTR base,
+	SIZE_T image_size)
+{
+	PAGED_CODE();
+
+	const auto dos_header = reinterpret_cast<PIMAGE_DOS_HEADER>(base);
+	if (dos_header->e_magic != IMAGE_DOS_SIGNATURE || dos_header->e_lfanew < 0 ||
+		static_cast<SIZE_T>(dos_header->e_lfanew) + sizeof(IMAGE_NT_HEADERS) >
+			image_size)
+	{
+		return nullptr;
+	}
+	const auto nt_headers =
+		reinterpret_cast<PIMAGE_NT_HEADERS>(base + dos_header->e_lfanew);
+	return (nt_headers->Signature == IMAGE_NT_SIGNATURE) ? nt_headers : nullptr;
+}
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ static NTSTATUS HidePolicyFindSection(
+	ULONG_PTR base,
+	SIZE_T image_size,
+	const char* name,
+	ULONG* rva,
+	ULONG* size)
+{
+	PAGED_CODE();
+
+	*rva = 0;
+	*size = 0;
+	const auto nt_headers = HidePolicyGetNtHeaders(base, image_size);
+	if (!nt_headers)
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	auto section = IMAGE_FIRST_SECTION(nt_headers);
+	const auto sections_end = reinterpret_cast<ULONG_PTR>(
+		section + nt_headers->FileHeader.NumberOfSections);
+	if (sections_end - base > image_size)
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+	for (USHORT i = 0; i < nt_headers->FileHeader.NumberOfSections; i++, section++)
+	{
+		if (strncmp(reinterpret_cast<const char*>(section->Name), name,
+			IMAGE_SIZEOF_SHORT_NAME) == 0)
+		{
+			*rva = section->VirtualAddress;
+			*size = (section->Misc.VirtualSize) ? section->Misc.VirtualSize
+				: section->SizeOfRawData;
+			return STATUS_SUCCESS;
+		}
+	}
+	return STATUS_NOT_FOUND;
+}
+
+//--------------------------------------------------------------------------------------//
+// Returns an RVA of the export. A forwarder is not supported since its code is
+// in another module.
+_Use_decl_annotations_ static NTSTATUS HidePolicyFindExport(
+	ULONG_PTR base,
+	SIZE_T image_size,
+	const char* name,
+	ULONG* rva)
+{
+	PAGED_CODE();
+
+	*rva = 0;
+	const auto nt_headers = HidePolicyGetNtHeaders(base, image_size);
+	if (!nt_headers)
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	// An image of a WoW64 process is 32-bit
+	const auto directory =
+		(nt_headers->OptionalHeader.Magic == IMAGE_NT_OPTIONAL_HDR64_MAGIC)
+		? &reinterpret_cast<PIMAGE_NT_HEADERS64>(nt_headers)
+			->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT]
+		: &reinterpret_cast<PIMAGE_NT_HEADERS32>(nt_headers)
+			->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXPORT];
+	if (!directory->VirtualAddress || directory->Size < sizeof(IMAGE_EXPORT_DIRECTORY) ||
+		directory->VirtualAddress >= image_size ||
+		directory->Size > image_size - directory->VirtualAddress)
+	{
+		return STATUS_NOT_FOUND;
+	}
+
+	const auto exports = reinterpret_cast<PIMAGE_EXPORT_DIRECTORY>(
+		base + directory->VirtualAddress);
+	if (exports->AddressOfNames >= image_size ||
+		exports->AddressOfNameOrdinals >= image_size ||
+		exports->AddressOfFunctions >= image_size ||
+		exports->NumberOfNames >
+			(image_size - exports->AddressOfNames) / sizeof(ULONG) ||
+		exports->NumberOfNames >
+			(image_size - exports->AddressOfNameOrdinals) / sizeof(USHORT) ||
+		exports->NumberOfFunctions >
+			(image_size - exports->AddressOfFunctions) / sizeof(ULONG))
+	{
+		return STATUS_INVALID_IMAGE_FORMAT;
+	}
+
+	const auto names = reinterpret_cast<const ULONG*>(base + exports->AddressOfNames);
+	const auto ordinals =
+		reinterpret_cast<const USHORT*>(base + exports->AddressOfNameOrdinals);
+	const auto functions =
+		reinterpret_cast<const ULONG*>(base + exports->AddressOfFunctions);
+	for (ULONG i = 0; i < exports->NumberOfNames; i++)
+	{
+		if (names[i] >= image_size ||
+			strcmp(reinterpret_cast<const char*>(base + names[i]), name) != 0)
+		{
+			continue;
+		}
+		if (ordinals[i] >= exports->NumberOfFunctions)
+		{
+			return STATUS_INVALID_IMAGE_FORMAT;
+		}
+		const auto function = functions[ordinals[i]];
+		if (function >= directory->VirtualAddress &&
+			function < directory->VirtualAddress + directory->Size)
+		{
+			return STATUS_NOT_SUPPORTED;
+		}
+		*rva = function;
+		return STATUS_SUCCESS;
+	}
+	return STATUS_NOT_FOUND;
+}
@@ -0,0 +1,58 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// @brief Declares interfaces to hide policy functions.
+
+#ifndef NoTruth_HidePolicy_H_
+#define NoTruth_HidePolicy_H_
+
+#include <fltKernel.h>
+#include "NoTruth.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// macro utilities
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// constants and macros
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// types
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// prototypes
+//
+
+// Starts applying a policy to modules being loaded
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS HidePolicyInitialization();
+
+// Stops applying a policy and frees it. Pages already hidden are left hidden.
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C void HidePolicyTermination();
+
+// Replaces a policy with entries. Modules loaded afterwards are hidden as
+// entries specify; ones already loaded are not. An empty policy disables it.
+// Fails with STATUS_NOT_SUPPORTED before Windows 8, where pages cannot be
+// hidden while an image load is being notified.
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C NTSTATUS HidePolicyLoad(
+	_In_reads_(count) const HIDE_POLICY_ENTRY* entries,
+	_In_ ULONG count);
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// implementations
+//
+
+#endif  // NoTruth_HidePolicy_H_
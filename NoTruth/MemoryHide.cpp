@@ -14,6 +14,10 @@
 #include "../HyperPlatform/HyperPlatform/util.h"
 #include "../HyperPlatform/HyperPlatform/ept.h"
 #include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include "../HyperPlatform/HyperPlatform/kernel_pool.h"
+#include "../HyperPlatform/HyperPlatform/fixed_vector.h"
+#include "../HyperPlatform/HyperPlatform/performance.h"
+#include "../HyperPlatform/HyperPlatform/stats_format.h"
 #include <vector>
 #include <memory>
 #include <algorithm>
@@ -33,6 +37,12 @@
 
 #define ComparePage(x,y)  (PAGE_ALIGN(x) == PAGE_ALIGN(y))
 
+// How many debug logs each EPT violation log site emits a second at most
+static const auto kTruthpViolationLogsPerSecond = 10ul;
+
+// How many pages can be hidden at once
+static const auto kTruthpMaxHideNodes = 8192u;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
@@ -46,9 +56,16 @@ struct Page {
 };
 
 
+// Nodes of hidden pages. Preallocated so that VMX root never allocates nor
+// frees memory to modify it.
+using HideNodeVector = FixedVector<HideInformation*, kTruthpMaxHideNodes>;
+
 // Data structure shared across all processors
 struct ShareDataContainer {
-  std::vector<std::unique_ptr<HideInformation>> UserModeList; //var hide 
+  HideNodeVector UserModeList; //var hide 
+  HideNodeVector FreeQueue;	// removed at VMX root, deleted at PASSIVE_LEVEL
+  FAST_MUTEX Lock;	// serializes adding and removing nodes
+  std::vector<StatsHideCounters> Statistics;	// indexed by a processor number
 };
 
 // Data structure for each processor
@@ -56,6 +73,12 @@ struct HiddenData {
   const HideInformation* UserModeBackup;   // remember which var hit the last 
 }; 
 
+// A hypercall to be broadcast to all processors
+struct HypercallRequest {
+	HypercallNumber number;
+	void* context;
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // prototypes
@@ -92,10 +115,28 @@ static void TruthDisableVarHiding(_In_ const HideInformation& info,
 
 static void TruthSetMonitorTrapFlag(_In_ bool enable);
 
+// Invalidates EPT translations; measured separately from the handlers
+static void TruthInvalidateEpt();
+
 static void TruthSaveLastHideInfo(_In_ HiddenData* sh_data,
 								_In_ const HideInformation& info); 
 
 static bool IsUserModeHideActive( _In_ const ShareDataContainer* shared_sh_data);
+
+static StatsHideCounters* TruthGetCurrentStatistics(_In_ ShareDataContainer* shared_data);
+
+// Runs at IPI_LEVEL; must stay non-paged
+static NTSTATUS TruthHypercallRoutine(_In_ void* context);
+
+// Runs at IPI_LEVEL; must stay non-paged
+static ULONG_PTR TruthSynchronizeProcessors(_In_ ULONG_PTR argument);
+
+_IRQL_requires_max_(APC_LEVEL) static void TruthFreeRemovedNodes(
+	_In_ ShareDataContainer* shared_data);
+
+_IRQL_requires_max_(APC_LEVEL) static NTSTATUS TruthBroadcastHypercall(
+	_In_ HypercallNumber hypercall_number, 
+	_In_opt_ void* context);
   
 
 extern "C" {
@@ -107,41 +148,23 @@ extern "C" {
 #pragma alloc_text(PAGE, TruthCreateNewHiddenNode)
 #pragma alloc_text(PAGE, TruthFreeHiddenData)
 #pragma alloc_text(PAGE, TruthFreeSharedHiddenData)
+#pragma alloc_text(PAGE, TruthBroadcastHypercall)
+#pragma alloc_text(PAGE, TruthFreeRemovedNodes)
 #endif
 
 ////////////////////////////////////////////////////////////////////////////////
 //
 // variables
 //
+
+extern ShareDataContainer* sharedata;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // implementations
 //
 //-------------------------------------------------------------------------------//
 
-_Use_decl_annotations_ static VOID GetPhysicalAddressByNewCR3(
-	_In_ PVOID va, 
-	_In_ ULONG64 newCR3, 
-	_Out_ ULONG64* newPA
-)
-{
-	PHYSICAL_ADDRESS oldPA = { 0 };
-	if (newCR3 && va)
-	{
-		ULONG64 oldCR3 = 0;
-		oldCR3 = __readcr3();
-		__writecr3(newCR3);
-		oldPA = MmGetPhysicalAddress(va);
-		if (!oldPA.QuadPart)
-		{
-			///KeBugCheckEx(0x22334455, oldPA.QuadPart, (ULONG_PTR)va, (ULONG_PTR)newCR3, (ULONG_PTR)oldCR3);
-		}
-		__writecr3(oldCR3);
-	}
-	*newPA = oldPA.QuadPart;
-}
-
-//-------------------------------------------------------------------------------//
 _Use_decl_annotations_ static VOID ModifyEPTEntryRWX(
 	_In_ EptData* ept_data, 
 	_In_ ULONG64 GuestPhysicalAddress,
@@ -179,48 +202,138 @@ _Use_decl_annotations_ EXTERN_C ShareDataContainer* TruthAllocateSharedDataConta
   PAGED_CODE();
   auto p = new ShareDataContainer();
   RtlFillMemory(p, sizeof(ShareDataContainer), 0);
+  ExInitializeFastMutex(&p->Lock);
+  p->Statistics.resize(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
   return p;
 }
 
 //-------------------------------------------------------------------------------//
+// Deletes remaining nodes too; no processor is in VMX operation anymore
 _Use_decl_annotations_ EXTERN_C void TruthFreeSharedHiddenData(
     ShareDataContainer* shared_data
 ) 
 {
   PAGED_CODE();
+  for (const auto info : shared_data->UserModeList)
+  {
+    delete info;
+  }
+  for (const auto info : shared_data->FreeQueue)
+  {
+    delete info;
+  }
   delete shared_data;
 }
 
 
+//-------------------------------------------------------------------------------//
+_Use_decl_annotations_ static NTSTATUS TruthHypercallRoutine(void* context)
+{
+	const auto request = reinterpret_cast<HypercallRequest*>(context);
+	return UtilVmCall(request->number, request->context);
+}
+
+//-------------------------------------------------------------------------------//
+_Use_decl_annotations_ static ULONG_PTR TruthSynchronizeProcessors(
+	ULONG_PTR argument
+)
+{
+	UNREFERENCED_PARAMETER(argument);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------//
+// Deletes nodes removed at VMX root. An IPI is not delivered to a processor
+// at VMX root, so once all processors have run an IPI, no VM-exit handler
+// still refers to the removed nodes.
+_Use_decl_annotations_ static void TruthFreeRemovedNodes(
+	ShareDataContainer* shared_data
+)
+{
+	PAGED_CODE();
+
+	if (shared_data->FreeQueue.empty())
+	{
+		return;
+	}
+	KeIpiGenericCall(TruthSynchronizeProcessors, 0);
+
+	while (!shared_data->FreeQueue.empty())
+	{
+		delete shared_data->FreeQueue.back();
+		shared_data->FreeQueue.pop_back();
+	}
+}
+
+//-------------------------------------------------------------------------------//
+// Issues the same VM-CALL on all processors at once and reports processors 
+// failed to handle it.
+_Use_decl_annotations_ static NTSTATUS TruthBroadcastHypercall(
+	HypercallNumber hypercall_number, 
+	void* context
+)
+{
+	PAGED_CODE();
+
+	// Written at IPI_LEVEL; must be non-paged. operator new is not used as it
+	// bugchecks on failure.
+	const auto number_of_processors =
+		KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+	const auto statuses = reinterpret_cast<NTSTATUS*>(ExAllocatePoolWithTag(
+		NonPagedPool, sizeof(NTSTATUS) * number_of_processors,
+		kHyperPlatformCommonPoolTag));
+	if (!statuses)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	HypercallRequest request = { hypercall_number, context };
+
+	const auto status = UtilForEachProcessorIpi(TruthHypercallRoutine, 
+		&request, statuses, number_of_processors);
+
+	if (!NT_SUCCESS(status))
+	{
+		for (ULONG i = 0; i < number_of_processors; i++)
+		{
+			if (!NT_SUCCESS(statuses[i]))
+			{
+				HYPERPLATFORM_LOG_ERROR("Hypercall %d failed on processor %lu (%08x)",
+					static_cast<int>(hypercall_number), i, statuses[i]);
+			}
+		}
+	}
+	ExFreePoolWithTag(statuses, kHyperPlatformCommonPoolTag);
+	return status;
+}
+
 //-------------------------------------------------------------------------------//
 _Use_decl_annotations_ EXTERN_C NTSTATUS TruthStartHiddenEngine()
 {
 	PAGED_CODE();
 	//VM-CALL, after vm-call trap into VMM
-	return UtilForEachProcessor(
-		[](void* context) {
-		UNREFERENCED_PARAMETER(context);
-		return UtilVmCall(HypercallNumber::kEnableAllHideMemory, nullptr);
-	},
-		nullptr);
+	return TruthBroadcastHypercall(HypercallNumber::kEnableAllHideMemory, nullptr);
 }
 
 //-------------------------------------------------------------------------------//
 _Use_decl_annotations_ EXTERN_C NTSTATUS TruthStopHiddenEngine() {
 	PAGED_CODE();
 
+	const auto shared_data = sharedata;
+	if (!shared_data)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	ExAcquireFastMutex(&shared_data->Lock);
 	NTSTATUS status; 
-	status = UtilForEachProcessor(
-		[](void* context) {
-		UNREFERENCED_PARAMETER(context);
-		return UtilVmCall(HypercallNumber::kDisableAllHideMemory, nullptr);
-	},
-		nullptr);
+	status = TruthBroadcastHypercall(HypercallNumber::kDisableAllHideMemory, nullptr);
 
 	if (NT_SUCCESS(status))
 	{
 		status = UtilVmCall(HypercallNumber::kRemoveAllHideNode, nullptr);
 	}
+	TruthFreeRemovedNodes(shared_data);
+	ExReleaseFastMutex(&shared_data->Lock);
 	return status;
 }
 
@@ -229,17 +342,22 @@ _Use_decl_annotations_ EXTERN_C NTSTATUS TruthDisableHideByProcess(PEPROCESS pro
 {
 	PAGED_CODE();
 
+	const auto shared_data = sharedata;
+	if (!shared_data)
+	{
+		return STATUS_SUCCESS;
+	}
+
+	ExAcquireFastMutex(&shared_data->Lock);
 	NTSTATUS status; 
-	status = UtilForEachProcessor(
-		[](void* context) {
-		return UtilVmCall(HypercallNumber::kDisableSingleHideMemory, context);
-	},
-		proc);
+	status = TruthBroadcastHypercall(HypercallNumber::kDisableSingleHideMemory, proc);
 
 	if (NT_SUCCESS(status))
 	{
 		status = UtilVmCall(HypercallNumber::kRemoveSingleHideNode, proc);
 	}
+	TruthFreeRemovedNodes(shared_data);
+	ExReleaseFastMutex(&shared_data->Lock);
 	return status;
 } 
 
@@ -278,60 +396,33 @@ _Use_decl_annotations_ void TruthDisableSingleMemoryHide(
 	{
 		if (info->proc == proc)
 		{
-			//info
 			TruthDisableVarHiding(*info, ept_data);
- 			break;
 		}
 	}
 }
 
 //--------------------------------------------------------------------------//
+// Unlinks all nodes into FreeQueue; they are deleted by TruthFreeRemovedNodes()
+// as nothing can be freed at VMX root. A node stays listed if FreeQueue is full.
 _Use_decl_annotations_ void TruthRemoveAllHideNode( 
 	_In_ ShareDataContainer* shared_data
 )
 {
-	HYPERPLATFORM_LOG_ERROR("All - ListSize: %d", shared_data->UserModeList.size());
-
-	for (auto& info : shared_data->UserModeList)
-	{ 
-		shared_data->UserModeList.erase(
-				std::remove(
-					shared_data->UserModeList.begin(),
-					shared_data->UserModeList.end(),
-					info
-				),
-			shared_data->UserModeList.end()
-			); 
-	} 
-
-	HYPERPLATFORM_LOG_ERROR("All - ListSize: %d", shared_data->UserModeList.size());
+	shared_data->UserModeList.remove_if([shared_data](HideInformation* info) {
+		return shared_data->FreeQueue.try_push_back(info);
+	});
 }
 
 //--------------------------------------------------------------------------//
+// Unlinks nodes of the process into FreeQueue as TruthRemoveAllHideNode() does
 _Use_decl_annotations_ void TruthRemoveSingleHideNode( 
 	_In_ ShareDataContainer* shared_data,
 	_In_ PEPROCESS proc
 )
 {
-	HYPERPLATFORM_LOG_ERROR("Single - ListSize: %d", shared_data->UserModeList.size());
-
-	for (auto& info : shared_data->UserModeList)
-	{
-		if (info->proc == proc)
-		{  
-			shared_data->UserModeList.erase(
-				std::remove(
-					shared_data->UserModeList.begin(),
-					shared_data->UserModeList.end(),
-					info
-				),
-				shared_data->UserModeList.end()
-			);
- 			break; 
-		}
-	} 			
-
-	HYPERPLATFORM_LOG_ERROR("Single - ListSize: %d", shared_data->UserModeList.size());
+	shared_data->UserModeList.remove_if([shared_data, proc](HideInformation* info) {
+		return info->proc == proc && shared_data->FreeQueue.try_push_back(info);
+	});
 }
 //------------------------------------------------------------------------//
 _Use_decl_annotations_ bool TruthHandleBreakpoint(
@@ -358,6 +449,11 @@ _Use_decl_annotations_ void TruthHandleMonitorTrapFlag(
 	TruthEnableEntryForExecuteOnly(*info, ept_data);		     //turn back read-only	  
 	TruthSetMonitorTrapFlag(false);
 
+	if (const auto statistics = TruthGetCurrentStatistics(shared_data))
+	{
+		statistics->monitor_trap_flags++;
+	}
+
  }  
 //-------------------------------------------------------------------------------//
 _Use_decl_annotations_ bool TruthHandleEptViolation(
@@ -375,18 +471,28 @@ _Use_decl_annotations_ bool TruthHandleEptViolation(
 	{
 		return false;
 	}
+	HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
 
 	//This have to handle carefully. Easily got hang from this. If we can't find 
 	const auto info = TruthFindHideInfoByPhyAddr(shared_data,  (ULONG64)fault_pa);
+	const auto statistics = TruthGetCurrentStatistics(shared_data);
 
 	if (!info) {
-		HYPERPLATFORM_LOG_DEBUG("Cannot find info %d  fault_pa: %I64X  \r\n" ,PsGetCurrentProcessId(), fault_pa);
+		if (statistics)
+		{
+			statistics->unmatched_violations++;
+		}
+		HYPERPLATFORM_LOG_DEBUG_SAFE_LIMITED(kTruthpViolationLogsPerSecond, "Cannot find info %d  fault_pa: %I64X  \r\n" ,PsGetCurrentProcessId(), fault_pa);
 		return false;
 	}
 
 	//Read in single page
 	if (IsRead)
 	{
+		if (statistics)
+		{
+			statistics->read_violations++;
+		}
 		TruthEnableEntryForReadOnly(*info, ept_data); 
 	
 		if (!ComparePage(UtilVmRead(VmcsField::kGuestRip), fault_va))
@@ -396,12 +502,16 @@ _Use_decl_annotations_ bool TruthHandleEptViolation(
 			//used for reset read-only
 			TruthSaveLastHideInfo(sh_data, *info);
 		}
-		HYPERPLATFORM_LOG_DEBUG("Read.. fault_va: %I64X  GuestRIP: %I64X \r\n", fault_va, UtilVmRead(VmcsField::kGuestRip));
+		HYPERPLATFORM_LOG_DEBUG_SAFE_LIMITED(kTruthpViolationLogsPerSecond, "Read.. fault_va: %I64X  GuestRIP: %I64X \r\n", fault_va, UtilVmRead(VmcsField::kGuestRip));
  	}
 
 	//Write,Execute in same page
 	else if (IsWrite)
 	{		
+		if (statistics)
+		{
+			statistics->write_violations++;
+		}
 		//Set R/W/!X for RING3/ RING0
 		TruthEnableEntryForAll(*info, ept_data);
 		//Set MTF flags 
@@ -420,6 +530,10 @@ _Use_decl_annotations_ bool TruthHandleEptViolation(
 		//	 4. MTF try to executes the instruction, ept execute violation occurs, MTF pending...
 		//	 5. After VMM handles execute exeception , set Execute-Only again, 
 		//	 6. Re-execute the instruction, CPU will read once again now, it cause for-ever loop.
+		if (statistics)
+		{
+			statistics->execute_violations++;
+		}
 
 		TruthEnableEntryForReadAndExec(*info, ept_data);
 		//Set MTF flags 
@@ -427,7 +541,7 @@ _Use_decl_annotations_ bool TruthHandleEptViolation(
 		//used for reset read-only
 		TruthSaveLastHideInfo(sh_data, *info);
 
-		HYPERPLATFORM_LOG_DEBUG("Exec.. fault_va: %I64X  GuestRIP: %I64X \r\n",fault_va, UtilVmRead(VmcsField::kGuestRip));
+		HYPERPLATFORM_LOG_DEBUG_SAFE_LIMITED(kTruthpViolationLogsPerSecond, "Exec.. fault_va: %I64X  GuestRIP: %I64X \r\n",fault_va, UtilVmRead(VmcsField::kGuestRip));
 	}
 
 	//after return to Guset OS, run a single instruction --> and trap into VMM again
@@ -435,21 +549,70 @@ _Use_decl_annotations_ bool TruthHandleEptViolation(
 }
 
 //-------------------------------------------------------------------------------//
-_Use_decl_annotations_ EXTERN_C PMDLX TruthGetHideMDL(
+// Copies counters of the current processor. Called at IPI_LEVEL while no
+// processor modifies the list of hidden pages.
+_Use_decl_annotations_ void TruthCopyStatistics(
+	const ShareDataContainer* shared_data,
+	StatsHideCounters* statistics
+)
+{
+	RtlZeroMemory(statistics, sizeof(*statistics));
+	if (!shared_data)
+	{
+		return;
+	}
+
+	const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+	if (processor < shared_data->Statistics.size())
+	{
+		*statistics = shared_data->Statistics[processor];
+	}
+	statistics->hidden_pages = shared_data->UserModeList.size();
+}
+
+//-------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C ULONG TruthGetHideMDLs(
 	_In_ ShareDataContainer* shared_data,
-	_In_ PEPROCESS proc
+	_In_ PEPROCESS proc,
+	_Out_writes_opt_(max_count) PMDLX* mdls,
+	_In_ ULONG max_count
 )
 {
+	// Pages hidden at once share an MDL
+	ULONG count = 0;
 	for (auto &info : shared_data->UserModeList)
 	{
-		if (info->proc == proc)
+		const auto mdl = reinterpret_cast<PMDLX>(info->MDL);
+		if (info->proc != proc || !mdl)
+		{
+			continue;
+		}
+		if (mdls)
 		{
-			return (PMDLX)info->MDL;
+			const auto end = mdls + min(count, max_count);
+			if (std::find(mdls, end, mdl) != end)
+			{
+				continue;
+			}
+			if (count < max_count)
+			{
+				mdls[count] = mdl;
+			}
 		}
+		count++;
 	}
-	return NULL;
+	return count;
 } 
 
+//-------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C bool TruthIsHiddenPage(
+	_In_ const ShareDataContainer* shared_data,
+	_In_ void* address
+)
+{
+	return TruthFindHideInfoByVaAddr(shared_data, address) != nullptr;
+}
+
 //-------------------------------------------------------------------------------//
 _Use_decl_annotations_ EXTERN_C bool TruthCreateNewHiddenNode(
 	ShareDataContainer* shared_data,
@@ -467,20 +630,29 @@ _Use_decl_annotations_ EXTERN_C bool TruthCreateNewHiddenNode(
 	{
 		return FALSE;
 	} 
+	ExAcquireFastMutex(&shared_data->Lock);
 	//Filter repeat address
 	auto found = TruthFindHideInfoByVaAddr(shared_data, address);
 	if (found != nullptr)
 	{
+		ExReleaseFastMutex(&shared_data->Lock);
 		return true;
 	}
+	// Fails rather than grows the list, which VM-exit handlers may be reading
+	if (shared_data->UserModeList.full())
+	{
+		ExReleaseFastMutex(&shared_data->Lock);
+		return false;
+	}
 	auto info = Factory.CreateNoTruthNode(address, name, CR3, mdl, proc, P_Paddr); 
-	shared_data->UserModeList.push_back(std::move(info));
-
 	if (!info)
 	{
+		ExReleaseFastMutex(&shared_data->Lock);
+		HYPERPLATFORM_LOG_DEBUG("Info Empty Create Failed \r\n");
 		return false;
 	}	
-	HYPERPLATFORM_LOG_INFO("Info Empty Create Failed \r\n");
+	NT_VERIFY(shared_data->UserModeList.try_push_back(info.release()));
+	ExReleaseFastMutex(&shared_data->Lock);
 	return true;
 }
 
@@ -497,7 +669,7 @@ _Use_decl_annotations_ static HideInformation* TruthFindHideInfoByVaAddr(
 	{
 		return nullptr;
 	}
-	return found->get();
+	return *found;
 }
 
 //-------------------------------------------------------------------------------//
@@ -513,50 +685,51 @@ _Use_decl_annotations_ static HideInformation* TruthFindHideInfoByPhyAddr(
 	{
 		return nullptr;
 	}
-	return found->get();
+	return *found;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
 _Use_decl_annotations_ static void TruthEnableEntryForExecuteOnly(const HideInformation& info, EptData* ept_data)
 {
-	ULONG64 newPA = 0;
-	GetPhysicalAddressByNewCR3(info.patch_address, info.CR3, &newPA);
+	const auto newPA = UtilGpaFromGva(info.CR3, info.patch_address);
 	ModifyEPTEntryRWX(ept_data, newPA, info.pa_base_for_exec, FALSE, FALSE, TRUE);
-	UtilInveptGlobal(); 
+	TruthInvalidateEpt(); 
 }
 //----------------------------------------------------------------------------------------------------------------------
 _Use_decl_annotations_ static void TruthEnableEntryForAll(const HideInformation& info, EptData* ept_data)
 {
-	ULONG64 newPA = 0;
-	GetPhysicalAddressByNewCR3(info.patch_address, info.CR3, &newPA);
+	const auto newPA = UtilGpaFromGva(info.CR3, info.patch_address);
 	ModifyEPTEntryRWX(ept_data, newPA, info.pa_base_for_exec, TRUE, TRUE, TRUE);
-	UtilInveptGlobal();
+	TruthInvalidateEpt();
 }
 //----------------------------------------------------------------------------------------------------------------------
 _Use_decl_annotations_ static void TruthEnableEntryForReadOnly(const HideInformation& info, EptData* ept_data)
 {
 
-	ULONG64 newPA = 0;
-	GetPhysicalAddressByNewCR3(info.patch_address, info.CR3, &newPA);
+	const auto newPA = UtilGpaFromGva(info.CR3, info.patch_address);
 	ModifyEPTEntryRWX(ept_data, newPA, info.pa_base_for_rw, TRUE, FALSE, FALSE);
-	UtilInveptGlobal();
+	TruthInvalidateEpt();
 }
 //----------------------------------------------------------------------------------------------------------------------
 _Use_decl_annotations_ static void TruthEnableEntryForReadAndExec(const HideInformation& info, EptData* ept_data)
 {
 
-	ULONG64 newPA = 0;
-	GetPhysicalAddressByNewCR3(info.patch_address, info.CR3, &newPA);
+	const auto newPA = UtilGpaFromGva(info.CR3, info.patch_address);
 	ModifyEPTEntryRWX(ept_data, newPA, info.pa_base_for_exec, TRUE, FALSE, TRUE);
-	UtilInveptGlobal();
+	TruthInvalidateEpt();
 }
 //----------------------------------------------------------------------------------------------------------------------
 _Use_decl_annotations_ static void TruthDisableVarHiding(const HideInformation& info, EptData* ept_data)
 {
 	// ring-3 start 
-	ULONG64 newPA = 0;
-	GetPhysicalAddressByNewCR3(info.patch_address, info.CR3, &newPA);
+	const auto newPA = UtilGpaFromGva(info.CR3, info.patch_address);
 	ModifyEPTEntryRWX(ept_data, newPA, info.pa_base_original_page, TRUE, TRUE, TRUE);  
+	TruthInvalidateEpt();
+}
+//----------------------------------------------------------------------------------------------------------------------
+/*_Use_decl_annotations_*/ static void TruthInvalidateEpt()
+{
+	HYPERPLATFORM_PERFORMANCE_MEASURE_THIS_SCOPE();
 	UtilInveptGlobal();
 }
 // Set MTF on the current processor
@@ -589,6 +762,21 @@ _Use_decl_annotations_ static const HideInformation* TruthRestoreLastHideInfo(
 }
 
 
+//----------------------------------------------------------------------------------------------------------------------
+// Returns counters of the current processor, or nullptr for processors added
+// after the container was allocated
+_Use_decl_annotations_ static StatsHideCounters* TruthGetCurrentStatistics(
+	ShareDataContainer* shared_data
+)
+{
+	const auto processor = KeGetCurrentProcessorNumberEx(nullptr);
+	if (processor >= shared_data->Statistics.size())
+	{
+		return nullptr;
+	}
+	return &shared_data->Statistics[processor];
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Checks if NoTruth is already initialized
 _Use_decl_annotations_ static bool IsUserModeHideActive(
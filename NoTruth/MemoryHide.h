@@ -28,6 +28,7 @@
 struct EptData;
 struct HiddenData;
 struct ShareDataContainer;
+struct StatsHideCounters;
 // Expresses where to install KernelModeList by a function name, and its handlers
 struct ShadowHookTarget {
   UNICODE_STRING target_name;  // An export name to hook
@@ -63,6 +64,7 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void TruthHandleMonitorTrapFlag(
 
 //-------------------------------------------------------------------------------------------------------------------------------------
 
+// Fails when as many pages as the list can hold are hidden already
 _IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool TruthCreateNewHiddenNode(
 	_In_ ShareDataContainer* shared_sh_data,
 	_In_ void* address, 
@@ -100,7 +102,9 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void TruthDisableSingleMemoryHide(
 	_In_ PEPROCESS proc
 );
 
-_Use_decl_annotations_ void TruthRemoveSingleHideNode( 
+// Unlinks nodes of the process at VMX root. They are deleted by
+// TruthDisableHideByProcess() after the hypercall returns.
+_IRQL_requires_min_(DISPATCH_LEVEL) void TruthRemoveSingleHideNode( 
 	_In_ ShareDataContainer* shared_sh_data,
 	_In_ PEPROCESS proc
 );
@@ -109,13 +113,28 @@ _IRQL_requires_min_(DISPATCH_LEVEL) void TruthDisableAllMemoryHide(
 	_In_ EptData* ept_data,
 	_In_ ShareDataContainer* shared_sh_data);
 
-_Use_decl_annotations_ void TruthRemoveAllHideNode( 
+// Unlinks all nodes at VMX root. They are deleted by TruthStopHiddenEngine()
+// after the hypercall returns.
+_IRQL_requires_min_(DISPATCH_LEVEL) void TruthRemoveAllHideNode( 
 	_In_ ShareDataContainer* shared_sh_data
 );
 
-_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C PMDLX TruthGetHideMDL(
+// Copies counters of the current processor and a number of hidden pages
+void TruthCopyStatistics(
+	_In_opt_ const ShareDataContainer* shared_sh_data,
+	_Out_ StatsHideCounters* statistics);
+
+// Returns distinct MDLs locking hidden pages of the process. When mdls is
+// nullptr, returns an upper bound of the number instead.
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C ULONG TruthGetHideMDLs(
 	_In_ ShareDataContainer* shared_sh_data, 
-	_In_ PEPROCESS proc);
+	_In_ PEPROCESS proc,
+	_Out_writes_opt_(max_count) PMDLX* mdls,
+	_In_ ULONG max_count);
+
+_IRQL_requires_max_(PASSIVE_LEVEL) EXTERN_C bool TruthIsHiddenPage(
+	_In_ const ShareDataContainer* shared_sh_data,
+	_In_ void* address);
  
 ////////////////////////////////////////////////////////////////////////////////
 //
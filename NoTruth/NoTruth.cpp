@@ -15,10 +15,14 @@
 #include "../HyperPlatform/HyperPlatform/log.h"
 #include "../HyperPlatform/HyperPlatform/util.h"
 #include "../HyperPlatform/HyperPlatform/ept.h"
+#include "../HyperPlatform/HyperPlatform/exit_trace.h"
 #include "../HyperPlatform/HyperPlatform/kernel_stl.h"
 #include <array>
+#include <algorithm>
+#include <vector>
 #include "MemoryHide.h"
 #include "Ring3Hide.h"
+#include "HidePolicy.h"
 ////////////////////////////////////////////////////////////////////////////////
 //
 // macro utilities
@@ -27,19 +31,74 @@
 #define TargetAppName "notepad.exe"
 #define TargetAppName2 "VTxRing3.exe"
 
+// The longest range IOCTL_HIDE_ADD_BULK locks with a single MDL
+static const ULONG64 kBulkMaxRangeLength = 64 * 1024 * 1024;
+
+// MemoryWorkingSetExInformation, which the WDK does not define
+static const auto kMemoryWorkingSetExInformation =
+	static_cast<MEMORY_INFORMATION_CLASS>(4);
+
+// g_HiddenProcesses has 2^kHiddenProcessBucketBits buckets
+static const ULONG kHiddenProcessBucketBits = 8;
+static const ULONG kHiddenProcessBuckets = 1ul << kHiddenProcessBucketBits;
+
+// A number of slots of g_WatchedImageNames; a power of 2 larger than a number
+// of watched names
+static const ULONG kWatchedImageSlots = 16;
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // global variable
 // 
 extern ShareDataContainer* sharedata;
 
-
 ////////////////////////////////////////////////////////////////////////////////
 //
 // types
 //
 // A helper type for parsing a PoolTag value
 
+// MEMORY_WORKING_SET_EX_INFORMATION
+typedef struct _WORKING_SET_EX_INFORMATION
+{
+	PVOID VirtualAddress;
+	union
+	{
+		ULONG_PTR Flags;
+		struct
+		{
+			ULONG_PTR Valid : 1;
+			ULONG_PTR ShareCount : 3;
+			ULONG_PTR Win32Protection : 11;
+			ULONG_PTR Shared : 1;
+			ULONG_PTR Node : 6;
+			ULONG_PTR Locked : 1;
+			ULONG_PTR LargePage : 1;
+		};
+	};
+}WORKING_SET_EX_INFORMATION, *PWORKING_SET_EX_INFORMATION;
+
+// A process that may own hidden pages, chained in a bucket of g_HiddenProcesses
+struct HiddenProcessEntry
+{
+	HiddenProcessEntry* next;
+	PEPROCESS proc;
+};
+
+// A slot of g_WatchedImageNames
+struct WatchedImageSlot
+{
+	ULONG hash;			// 0 for an empty slot
+	const char* name;
+};
+
+typedef NTSTATUS(NTAPI *ZwProtectVirtualMemoryType)(
+	_In_ HANDLE ProcessHandle,
+	_Inout_ PVOID* BaseAddress,
+	_Inout_ PSIZE_T RegionSize,
+	_In_ ULONG NewProtect,
+	_Out_ PULONG OldProtect);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -55,11 +114,97 @@ extern "C" {
 	PCHAR PsGetProcessImageFileName(PEPROCESS);
 }
 
+static NTSTATUS BreakCopyOnWrite(
+	_In_ ULONG64 start,
+	_In_ ULONG64 end,
+	_In_ ULONG flags);
+
+static NTSTATUS BreakCopyOnWriteRegion(
+	_In_ ULONG64 start,
+	_In_ ULONG64 end,
+	_In_ ULONG protect,
+	_In_ ULONG flags);
+
+static NTSTATUS TouchPageForWrite(
+	_In_ ULONG64 page);
+
+static NTSTATUS HideBulkRange(
+	_In_ PEPROCESS proc,
+	_In_ ULONG64 cr3,
+	_In_ ULONG64 start,
+	_In_ ULONG64 end,
+	_In_ ULONG flags);
+
+static void HideBulkProcess(
+	_In_ const HIDE_BULK_ENTRY* entries,
+	_In_reads_(count) const ULONG* indexes,
+	_In_ ULONG count,
+	_Inout_ NTSTATUS* statuses);
+
+static VOID ProcessMonitor(
+	_Inout_ PEPROCESS Process,
+	_In_ HANDLE ProcessId,
+	_Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo);
+
+static ULONG HashImageName(
+	_In_ const char* name);
+
+static bool IsWatchedImage(
+	_In_ const char* name);
+
+static ULONG HashProcess(
+	_In_ PEPROCESS proc);
+
+// Spin locks are held; must stay non-paged
+static NTSTATUS TrackHiddenProcess(
+	_In_ PEPROCESS proc);
+
+static bool UntrackHiddenProcess(
+	_In_ PEPROCESS proc);
+
+static bool IsHiddenProcessTracked(
+	_In_ PEPROCESS proc);
+
+static PEPROCESS GetAnyHiddenProcess();
+
+_IRQL_requires_max_(PASSIVE_LEVEL) static void ReleaseHiddenProcess(
+	_In_ PEPROCESS proc);
+
 #if defined(ALLOC_PRAGMA)
 #pragma alloc_text(INIT, NoTruthInitialization)
 #pragma alloc_text(PAGE, NoTruthTermination)
+#pragma alloc_text(PAGE, AddMemoryHideBulk)
+#pragma alloc_text(PAGE, HideBulkProcess)
+#pragma alloc_text(PAGE, HideBulkRange)
+#pragma alloc_text(PAGE, BreakCopyOnWrite)
+#pragma alloc_text(PAGE, BreakCopyOnWriteRegion)
+#pragma alloc_text(PAGE, TouchPageForWrite)
 #endif
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// variables
+//
+
+// Not exported by older kernels; copy-on-write of read-only pages cannot be
+// broken without it
+static ZwProtectVirtualMemoryType g_ZwProtectVirtualMemory;
+
+// Image names of processes whose creation is logged
+static const char* const kWatchedImageNames[] = { TargetAppName, TargetAppName2 };
+
+// kWatchedImageNames hashed by HashImageName() with linear probing
+static WatchedImageSlot g_WatchedImageNames[kWatchedImageSlots];
+
+// Processes that may own hidden pages, hashed by HashProcess(). A process
+// exiting without hidden pages leaves ProcessMonitor() after probing it once.
+static HiddenProcessEntry* g_HiddenProcesses[kHiddenProcessBuckets];
+static KSPIN_LOCK g_HiddenProcessLock;
+
+// Serializes releasing hidden pages of a process between ProcessMonitor() and
+// NoTruthTermination(). A mutex keeps IRQL at PASSIVE_LEVEL for hypercalls.
+static KMUTEX g_HiddenProcessReleaseLock;
+
 typedef struct _SECURITY_ATTRIBUTES {
 	DWORD  nLength;
 	PVOID  lpSecurityDescriptor;
@@ -84,10 +229,18 @@ PMDLX LockMemory(
 	if (mdl == NULL)
 		return NULL;
 
-	// Attempt to probe and lock the pages into memory
+	// Attempt to probe and lock the pages into memory. Another thread of the
+	// process may free them at any time.
+	__try
+	{
+		MmProbeAndLockPages(mdl, UserMode, IoReadAccess);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		IoFreeMdl(mdl);
+		return NULL;
+	}
 
-	MmProbeAndLockPages(mdl, UserMode, IoReadAccess);
-	
 	HYPERPLATFORM_LOG_INFO("locked Memory \r\n");
 
 	return mdl;
@@ -105,7 +258,7 @@ void UnLockMemory(
 
  
 //--------------------------------------------------------------------------------------//
-NTSTATUS AddMemoryHide(PEPROCESS proc, ULONG64 Address) {
+NTSTATUS AddMemoryHide(PEPROCESS proc, ULONG64 Address, ULONG flags) {
 	
 	KAPC_STATE ApcState; 
 	ULONG64			cr3; 
@@ -115,8 +268,27 @@ NTSTATUS AddMemoryHide(PEPROCESS proc, ULONG64 Address) {
 
 	cr3 = __readcr3(); 
 
+	//ensure the page is private to the process before locking it
+	const auto page = reinterpret_cast<ULONG64>(PAGE_ALIGN(Address));
+	status = BreakCopyOnWrite(page, page + PAGE_SIZE, flags);
+	if (NT_SUCCESS(status))
+	{
+		status = TrackHiddenProcess(proc);
+	}
+	if (!NT_SUCCESS(status))
+	{
+		KeUnstackDetachProcess(&ApcState);
+		return status;
+	}
+	status = STATUS_UNSUCCESSFUL;
+
 	//ensure resides in physical memory 
 	mdl = LockMemory((PVOID)Address, PAGE_SIZE);
+	if (!mdl)
+	{
+		KeUnstackDetachProcess(&ApcState);
+		return status;
+	}
 
 	if (TruthCreateNewHiddenNode(
 		reinterpret_cast<ShareDataContainer*>(sharedata), //included two list var_hide and hook_hide
@@ -130,12 +302,338 @@ NTSTATUS AddMemoryHide(PEPROCESS proc, ULONG64 Address) {
 	{
 		status = STATUS_SUCCESS;
 	}
+	else
+	{
+		// No node owns the MDL, e.g. as the page is already hidden
+		UnLockMemory(mdl);
+	}
 	 
 	KeUnstackDetachProcess(&ApcState);
 
 	return status;
 }
 
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ EXTERN_C NTSTATUS AddMemoryHideBulk(
+	const HIDE_BULK_ENTRY* entries,
+	ULONG count,
+	NTSTATUS* statuses)
+{
+	PAGED_CODE();
+
+	if (!sharedata)
+	{
+		return STATUS_UNSUCCESSFUL;
+	}
+
+	// Entries are processed in order of a process and an address so that each
+	// process is attached once and contiguous pages are locked at once
+	std::vector<ULONG> indexes;
+	indexes.reserve(count);
+	for (ULONG i = 0; i < count; i++)
+	{
+		const auto& entry = entries[i];
+		const auto end = entry.Address + entry.Length;
+		if (!entry.Length || entry.Length > kBulkMaxRangeLength ||
+			end < entry.Address ||
+			end > reinterpret_cast<ULONG64>(MM_HIGHEST_USER_ADDRESS))
+		{
+			statuses[i] = STATUS_INVALID_PARAMETER;
+			continue;
+		}
+		indexes.push_back(i);
+	}
+	std::sort(indexes.begin(), indexes.end(), [entries](ULONG lhs, ULONG rhs) {
+		return (entries[lhs].ProcID != entries[rhs].ProcID)
+			? entries[lhs].ProcID < entries[rhs].ProcID
+			: entries[lhs].Address < entries[rhs].Address;
+	});
+
+	for (size_t i = 0; i < indexes.size();)
+	{
+		auto j = i + 1;
+		while (j < indexes.size() &&
+			entries[indexes[j]].ProcID == entries[indexes[i]].ProcID)
+		{
+			j++;
+		}
+		HideBulkProcess(entries, &indexes[i], static_cast<ULONG>(j - i), statuses);
+		i = j;
+	}
+	return STATUS_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------------//
+// Hides entries of a single process sorted by an address. Entries overlapping
+// or adjacent to each other are merged into a range and share an MDL.
+_Use_decl_annotations_ static void HideBulkProcess(
+	const HIDE_BULK_ENTRY* entries,
+	const ULONG* indexes,
+	ULONG count,
+	NTSTATUS* statuses)
+{
+	PAGED_CODE();
+
+	PEPROCESS proc = nullptr;
+	auto status = PsLookupProcessByProcessId(
+		reinterpret_cast<HANDLE>(entries[indexes[0]].ProcID), &proc);
+	if (!NT_SUCCESS(status))
+	{
+		for (ULONG i = 0; i < count; i++)
+		{
+			statuses[indexes[i]] = status;
+		}
+		return;
+	}
+
+	KAPC_STATE apc_state;
+	KeStackAttachProcess(proc, &apc_state);
+	const auto cr3 = __readcr3();
+
+	for (ULONG i = 0; i < count;)
+	{
+		const auto& first = entries[indexes[i]];
+		const auto start = reinterpret_cast<ULONG64>(PAGE_ALIGN(first.Address));
+		auto end = ROUND_TO_PAGES(first.Address + first.Length);
+		auto flags = static_cast<ULONG>(first.Flags);
+
+		auto j = i + 1;
+		for (; j < count; j++)
+		{
+			const auto& entry = entries[indexes[j]];
+			const auto entry_end = ROUND_TO_PAGES(entry.Address + entry.Length);
+			if (reinterpret_cast<ULONG64>(PAGE_ALIGN(entry.Address)) > end ||
+				entry_end - start > kBulkMaxRangeLength)
+			{
+				break;
+			}
+			end = max(end, entry_end);
+			// Private pages are skipped only when all entries allow it
+			flags &= static_cast<ULONG>(entry.Flags);
+		}
+
+		status = HideBulkRange(proc, cr3, start, end, flags);
+		for (; i < j; i++)
+		{
+			statuses[indexes[i]] = status;
+		}
+	}
+
+	KeUnstackDetachProcess(&apc_state);
+	ObDereferenceObject(proc);
+}
+
+//--------------------------------------------------------------------------------------//
+// Makes [start, end) of the current process private, then locks it with one
+// MDL and hides each page of it. The MDL is owned by created nodes and
+// unlocked when the process exits, or right away when no node is created.
+_Use_decl_annotations_ static NTSTATUS HideBulkRange(
+	PEPROCESS proc,
+	ULONG64 cr3,
+	ULONG64 start,
+	ULONG64 end,
+	ULONG flags)
+{
+	PAGED_CODE();
+
+	auto status = BreakCopyOnWrite(start, end, flags);
+	if (NT_SUCCESS(status))
+	{
+		status = TrackHiddenProcess(proc);
+	}
+	if (!NT_SUCCESS(status))
+	{
+		return status;
+	}
+
+	const auto mdl = IoAllocateMdl(reinterpret_cast<PVOID>(start),
+		static_cast<ULONG>(end - start), FALSE, FALSE, NULL);
+	if (!mdl)
+	{
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	__try
+	{
+		MmProbeAndLockPages(mdl, UserMode, IoReadAccess);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		IoFreeMdl(mdl);
+		return GetExceptionCode();
+	}
+
+	const auto shared_data = reinterpret_cast<ShareDataContainer*>(sharedata);
+	auto mdl_used = false;
+	for (auto page = start; page < end; page += PAGE_SIZE)
+	{
+		// Already hidden pages are left as they are, as in AddMemoryHide()
+		const auto address = reinterpret_cast<PVOID>(page);
+		if (TruthIsHiddenPage(shared_data, address))
+		{
+			continue;
+		}
+		if (!TruthCreateNewHiddenNode(shared_data, address, "bulk",
+			MmGetPhysicalAddress(address).QuadPart, cr3, mdl, proc))
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			continue;
+		}
+		mdl_used = true;
+	}
+
+	if (!mdl_used)
+	{
+		UnLockMemory(mdl);
+	}
+	return status;
+}
+
+//--------------------------------------------------------------------------------------//
+// Makes pages in [start, end) of the current process private to it by writing
+// to them, as a write to a copy-on-write page creates a private copy of it.
+// A region of private memory is skipped since it is never shared.
+_Use_decl_annotations_ static NTSTATUS BreakCopyOnWrite(
+	ULONG64 start,
+	ULONG64 end,
+	ULONG flags)
+{
+	PAGED_CODE();
+
+	for (auto address = start; address < end;)
+	{
+		MEMORY_BASIC_INFORMATION info = {};
+		auto status = ZwQueryVirtualMemory(NtCurrentProcess(),
+			reinterpret_cast<PVOID>(address), MemoryBasicInformation, &info,
+			sizeof(info), nullptr);
+		if (!NT_SUCCESS(status))
+		{
+			return status;
+		}
+		if (info.State != MEM_COMMIT ||
+			(info.Protect & (PAGE_NOACCESS | PAGE_GUARD)))
+		{
+			return STATUS_INVALID_PAGE_PROTECTION;
+		}
+
+		const auto region_end = min(end,
+			reinterpret_cast<ULONG64>(info.BaseAddress) + info.RegionSize);
+		if (info.Type != MEM_PRIVATE)
+		{
+			status = BreakCopyOnWriteRegion(address, region_end, info.Protect,
+				flags);
+			if (!NT_SUCCESS(status))
+			{
+				return status;
+			}
+		}
+		address = region_end;
+	}
+	return STATUS_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------------//
+// Writes to pages in [start, end) that have the same protection. A read-only
+// region is made copy-on-write only once for all of its pages, and is restored
+// afterwards. Without ZwProtectVirtualMemory (Windows 7), read-only pages are
+// accepted only when the caller has already made them private, and otherwise
+// fail with STATUS_NOT_SUPPORTED so that the caller can do it and retry.
+_Use_decl_annotations_ static NTSTATUS BreakCopyOnWriteRegion(
+	ULONG64 start,
+	ULONG64 end,
+	ULONG protect,
+	ULONG flags)
+{
+	PAGED_CODE();
+
+	const auto number_of_pages = static_cast<ULONG>((end - start) / PAGE_SIZE);
+	std::vector<WORKING_SET_EX_INFORMATION> pages(number_of_pages);
+	for (ULONG i = 0; i < number_of_pages; i++)
+	{
+		pages[i].VirtualAddress = reinterpret_cast<PVOID>(start + i * PAGE_SIZE);
+	}
+
+	const auto writable = PAGE_READWRITE | PAGE_WRITECOPY |
+		PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY;
+	const auto executable = PAGE_EXECUTE | PAGE_EXECUTE_READ |
+		PAGE_EXECUTE_READWRITE | PAGE_EXECUTE_WRITECOPY;
+	const auto needs_protection = !(protect & writable);
+
+	// Pages in the working set and not shared are already private
+	if ((flags & HIDE_FLAG_SKIP_PRIVATE) ||
+		(needs_protection && !g_ZwProtectVirtualMemory))
+	{
+		const auto status = ZwQueryVirtualMemory(NtCurrentProcess(), nullptr,
+			kMemoryWorkingSetExInformation, pages.data(),
+			pages.size() * sizeof(WORKING_SET_EX_INFORMATION), nullptr);
+		if (NT_SUCCESS(status))
+		{
+			pages.erase(std::remove_if(pages.begin(), pages.end(),
+				[](const WORKING_SET_EX_INFORMATION& page) {
+					return page.Valid && !page.Shared;
+				}), pages.end());
+		}
+		if (pages.empty())
+		{
+			return STATUS_SUCCESS;
+		}
+	}
+
+	auto base = reinterpret_cast<PVOID>(start);
+	auto size = static_cast<SIZE_T>(end - start);
+	ULONG old_protect = 0;
+	if (needs_protection)
+	{
+		if (!g_ZwProtectVirtualMemory)
+		{
+			return STATUS_NOT_SUPPORTED;
+		}
+		const auto new_protect = (protect & ~0xff) |
+			((protect & executable) ? PAGE_EXECUTE_WRITECOPY : PAGE_WRITECOPY);
+		const auto status = g_ZwProtectVirtualMemory(NtCurrentProcess(), &base,
+			&size, new_protect, &old_protect);
+		if (!NT_SUCCESS(status))
+		{
+			return status;
+		}
+	}
+
+	auto status = STATUS_SUCCESS;
+	for (const auto& page : pages)
+	{
+		status = TouchPageForWrite(reinterpret_cast<ULONG64>(page.VirtualAddress));
+		if (!NT_SUCCESS(status))
+		{
+			break;
+		}
+	}
+
+	if (needs_protection)
+	{
+		g_ZwProtectVirtualMemory(NtCurrentProcess(), &base, &size, old_protect,
+			&old_protect);
+	}
+	return status;
+}
+
+//--------------------------------------------------------------------------------------//
+// Writes the same value to the page atomically so that a concurrent write by
+// the process is not lost
+_Use_decl_annotations_ static NTSTATUS TouchPageForWrite(
+	ULONG64 page)
+{
+	PAGED_CODE();
+
+	__try
+	{
+		InterlockedOr8(reinterpret_cast<volatile char*>(page), 0);
+	}
+	__except (EXCEPTION_EXECUTE_HANDLER)
+	{
+		return GetExceptionCode();
+	}
+	return STATUS_SUCCESS;
+}
+
 //--------------------------------------------------------------------------------------//
 NTSTATUS StartMemoryHide()
 { 
@@ -149,39 +647,243 @@ NTSTATUS StopMemoryHide()
 }
 
 //--------------------------------------------------------------------------------------//
-VOID ProcessMonitor(
-	IN HANDLE  ParentId,
-	IN HANDLE  ProcessId,
-	IN BOOLEAN  Create)
+// Called on every process creation and exit in the system; unrelated processes
+// leave after a single hash probe
+_Use_decl_annotations_ static VOID ProcessMonitor(
+	PEPROCESS Process,
+	HANDLE ProcessId,
+	PPS_CREATE_NOTIFY_INFO CreateInfo)
 {
-	UNREFERENCED_PARAMETER(ParentId);
-	char *procName;
-	PEPROCESS proc;
-	PsLookupProcessByProcessId(ProcessId, &proc);
-	procName = PsGetProcessImageFileName(proc); 
-	if (strncmp(TargetAppName, procName, strlen(TargetAppName)) == 0||
-		strncmp(TargetAppName2, procName, strlen(TargetAppName2)) == 0)
-	{
-		HYPERPLATFORM_LOG_INFO("Process %s Exiting...  \r\n", procName);
-
-		if (Create) 
-		{ 
-			// do nothing.
-		}
-		else
-		{
-			HYPERPLATFORM_LOG_INFO("Process Exiting... \r\n");
-			PMDLX mdl = TruthGetHideMDL(reinterpret_cast<ShareDataContainer*>(sharedata), proc);
-		 
-			//hyper-call
-			TruthDisableHideByProcess(proc);
-			 
-			if (mdl)
-			{  
-				UnLockMemory(mdl); 
+	UNREFERENCED_PARAMETER(ProcessId);
+
+	if (CreateInfo)
+	{
+		const auto procName = PsGetProcessImageFileName(Process);
+		if (IsWatchedImage(procName))
+		{
+			HYPERPLATFORM_LOG_INFO("Process %s Creating... \r\n", procName);
+		}
+		return;
+	}
+
+	// Exit trace rings must not stay mapped into a process being destroyed,
+	// even if another process still has a handle to the device
+	ExitTraceUnmapFromExitingProcess(Process);
+
+	if (!IsHiddenProcessTracked(Process))
+	{
+		return;
+	}
+
+	// NoTruthTermination() may be releasing the process; it untracks the
+	// process only after releasing it
+	KeWaitForSingleObject(&g_HiddenProcessReleaseLock, Executive, KernelMode,
+		FALSE, nullptr);
+	if (UntrackHiddenProcess(Process))
+	{
+		HYPERPLATFORM_LOG_INFO("Process %s Exiting... \r\n",
+			PsGetProcessImageFileName(Process));
+		ReleaseHiddenProcess(Process);
+	}
+	KeReleaseMutex(&g_HiddenProcessReleaseLock, FALSE);
+}
+
+//--------------------------------------------------------------------------------------//
+// Disables hiding pages of the process and unlocks them. The process must be
+// still alive, and g_HiddenProcessReleaseLock must be held.
+_Use_decl_annotations_ static void ReleaseHiddenProcess(
+	PEPROCESS proc)
+{
+	const auto shared_data = reinterpret_cast<ShareDataContainer*>(sharedata);
+	if (!shared_data)
+	{
+		return;
+	}
+
+	// Pages locked by IOCTL_HIDE_ADD_BULK share an MDL
+	std::vector<PMDLX> mdls(TruthGetHideMDLs(shared_data, proc, nullptr, 0));
+	mdls.resize(TruthGetHideMDLs(shared_data, proc, mdls.data(),
+		static_cast<ULONG>(mdls.size())));
+
+	//hyper-call
+	TruthDisableHideByProcess(proc);
+
+	// NoTruthTermination() runs in the context of another process
+	KAPC_STATE apc_state;
+	KeStackAttachProcess(proc, &apc_state);
+	for (const auto mdl : mdls)
+	{
+		UnLockMemory(mdl);
+	}
+	KeUnstackDetachProcess(&apc_state);
+}
+
+//--------------------------------------------------------------------------------------//
+// FNV-1a of up to 15 characters of the name, as PsGetProcessImageFileName()
+// returns, without case. Never returns 0.
+_Use_decl_annotations_ static ULONG HashImageName(
+	const char* name)
+{
+	ULONG hash = 2166136261ul;
+	for (auto i = 0; i < 15 && name[i]; i++)
+	{
+		const auto c = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] + ('a' - 'A')
+			: name[i];
+		hash = (hash ^ static_cast<UCHAR>(c)) * 16777619ul;
+	}
+	return (hash) ? hash : 1;
+}
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ static bool IsWatchedImage(
+	const char* name)
+{
+	const auto hash = HashImageName(name);
+	for (auto i = hash & (kWatchedImageSlots - 1);;
+		i = (i + 1) & (kWatchedImageSlots - 1))
+	{
+		const auto& slot = g_WatchedImageNames[i];
+		if (!slot.hash)
+		{
+			return false;
+		}
+		if (slot.hash == hash && _strnicmp(slot.name, name, 15) == 0)
+		{
+			return true;
+		}
+	}
+}
+
+//--------------------------------------------------------------------------------------//
+// Returns a bucket index of g_HiddenProcesses. Low bits of an address of
+// EPROCESS are the same for all processes and ignored.
+_Use_decl_annotations_ static ULONG HashProcess(
+	PEPROCESS proc)
+{
+	const auto value = static_cast<ULONG64>(reinterpret_cast<ULONG_PTR>(proc)) >> 4;
+	const auto folded = static_cast<ULONG>(value ^ (value >> 32));
+	return (folded * 0x9E3779B1ul) >> (32 - kHiddenProcessBucketBits);
+}
+
+//--------------------------------------------------------------------------------------//
+// Records that the process may own hidden pages, so that they are released
+// when it exits
+_Use_decl_annotations_ static NTSTATUS TrackHiddenProcess(
+	PEPROCESS proc)
+{
+	const auto bucket = HashProcess(proc);
+	HiddenProcessEntry* entry = nullptr;
+	for (;;)
+	{
+		KLOCK_QUEUE_HANDLE lock_handle;
+		KeAcquireInStackQueuedSpinLock(&g_HiddenProcessLock, &lock_handle);
+		auto found = false;
+		for (auto it = g_HiddenProcesses[bucket]; it; it = it->next)
+		{
+			if (it->proc == proc)
+			{
+				found = true;
+				break;
 			}
 		}
+		if (!found && entry)
+		{
+			entry->proc = proc;
+			entry->next = g_HiddenProcesses[bucket];
+			g_HiddenProcesses[bucket] = entry;
+			entry = nullptr;
+			found = true;
+		}
+		KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+		if (found)
+		{
+			break;
+		}
+		// Allocates an entry outside the lock and tries again
+		entry = reinterpret_cast<HiddenProcessEntry*>(ExAllocatePoolWithTag(
+			NonPagedPool, sizeof(HiddenProcessEntry), kHyperPlatformCommonPoolTag));
+		if (!entry)
+		{
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
 	}
+
+	if (entry)
+	{
+		ExFreePoolWithTag(entry, kHyperPlatformCommonPoolTag);
+	}
+	return STATUS_SUCCESS;
+}
+
+//--------------------------------------------------------------------------------------//
+// Forgets the process and returns whether it may own hidden pages
+_Use_decl_annotations_ static bool UntrackHiddenProcess(
+	PEPROCESS proc)
+{
+	const auto bucket = HashProcess(proc);
+	HiddenProcessEntry* entry = nullptr;
+
+	KLOCK_QUEUE_HANDLE lock_handle;
+	KeAcquireInStackQueuedSpinLock(&g_HiddenProcessLock, &lock_handle);
+	for (auto link = &g_HiddenProcesses[bucket]; *link; link = &(*link)->next)
+	{
+		if ((*link)->proc == proc)
+		{
+			entry = *link;
+			*link = entry->next;
+			break;
+		}
+	}
+	KeReleaseInStackQueuedSpinLock(&lock_handle);
+
+	if (!entry)
+	{
+		return false;
+	}
+	ExFreePoolWithTag(entry, kHyperPlatformCommonPoolTag);
+	return true;
+}
+
+//--------------------------------------------------------------------------------------//
+_Use_decl_annotations_ static bool IsHiddenProcessTracked(
+	PEPROCESS proc)
+{
+	const auto bucket = HashProcess(proc);
+	auto found = false;
+
+	KLOCK_QUEUE_HANDLE lock_handle;
+	KeAcquireInStackQueuedSpinLock(&g_HiddenProcessLock, &lock_handle);
+	for (auto it = g_HiddenProcesses[bucket]; it; it = it->next)
+	{
+		if (it->proc == proc)
+		{
+			found = true;
+			break;
+		}
+	}
+	KeReleaseInStackQueuedSpinLock(&lock_handle);
+	return found;
+}
+
+//--------------------------------------------------------------------------------------//
+// Returns any process that may own hidden pages, or nullptr if none
+_Use_decl_annotations_ static PEPROCESS GetAnyHiddenProcess()
+{
+	PEPROCESS proc = nullptr;
+
+	KLOCK_QUEUE_HANDLE lock_handle;
+	KeAcquireInStackQueuedSpinLock(&g_HiddenProcessLock, &lock_handle);
+	for (const auto bucket : g_HiddenProcesses)
+	{
+		if (bucket)
+		{
+			proc = bucket->proc;
+			break;
+		}
+	}
+	KeReleaseInStackQueuedSpinLock(&lock_handle);
+	return proc;
 }
 
 //--------------------------------------------------------------------------------------//
@@ -190,7 +892,34 @@ _Use_decl_annotations_ EXTERN_C NTSTATUS NoTruthInitialization()
   PAGED_CODE();
 
   NTSTATUS status = STATUS_SUCCESS; 
-  PsSetCreateProcessNotifyRoutine(ProcessMonitor, FALSE);
+  g_ZwProtectVirtualMemory = reinterpret_cast<ZwProtectVirtualMemoryType>(
+      UtilGetSystemProcAddress(L"ZwProtectVirtualMemory"));
+
+  for (const auto name : kWatchedImageNames)
+  {
+    const auto hash = HashImageName(name);
+    auto i = hash & (kWatchedImageSlots - 1);
+    while (g_WatchedImageNames[i].hash)
+    {
+      i = (i + 1) & (kWatchedImageSlots - 1);
+    }
+    g_WatchedImageNames[i].hash = hash;
+    g_WatchedImageNames[i].name = name;
+  }
+  KeInitializeSpinLock(&g_HiddenProcessLock);
+  KeInitializeMutex(&g_HiddenProcessReleaseLock, 0);
+
+  // Requires /INTEGRITYCHECK
+  status = PsSetCreateProcessNotifyRoutineEx(ProcessMonitor, FALSE);
+  if (!NT_SUCCESS(status))
+  {
+    return status;
+  }
+  status = HidePolicyInitialization();
+  if (!NT_SUCCESS(status))
+  {
+    PsSetCreateProcessNotifyRoutineEx(ProcessMonitor, TRUE);
+  }
    return status;
 }
 //--------------------------------------------------------------------------------------//
@@ -198,8 +927,31 @@ _Use_decl_annotations_ EXTERN_C NTSTATUS NoTruthInitialization()
 _Use_decl_annotations_ EXTERN_C void NoTruthTermination() {
   PAGED_CODE();
 
+  HidePolicyTermination();
+
+  // Releases pages of processes still running as ProcessMonitor() does when
+  // they exit; otherwise they remain locked and the system bugchecks with
+  // PROCESS_HAS_LOCKED_PAGES. A tracked process cannot finish exiting while
+  // it is released, as its ProcessMonitor() waits for the lock.
+  for (;;)
+  {
+    KeWaitForSingleObject(&g_HiddenProcessReleaseLock, Executive, KernelMode,
+        FALSE, nullptr);
+    const auto proc = GetAnyHiddenProcess();
+    if (proc)
+    {
+      ReleaseHiddenProcess(proc);
+      UntrackHiddenProcess(proc);
+    }
+    KeReleaseMutex(&g_HiddenProcessReleaseLock, FALSE);
+    if (!proc)
+    {
+      break;
+    }
+  }
+
   TruthStopHiddenEngine();
-  PsSetCreateProcessNotifyRoutine(ProcessMonitor, TRUE); 
+  PsSetCreateProcessNotifyRoutineEx(ProcessMonitor, TRUE);
   HYPERPLATFORM_LOG_INFO("NoTruth has been terminated.");
 }
 //--------------------------------------------------------------------------------------//
@@ -4,7 +4,7 @@
 
 std::unique_ptr<HideInformation> VariableHiding::CreateNoTruthNode(
 	PVOID TargetAddress,
-	string name,
+	const char* name,
 	ULONG64 CR3, 
 	PVOID64 mdl,
 	PEPROCESS proc, 
@@ -14,8 +14,10 @@ std::unique_ptr<HideInformation> VariableHiding::CreateNoTruthNode(
 		
 	auto page_base = PAGE_ALIGN(TargetAddress);
 	auto info = std::make_unique<HideInformation>();
-	info->shadow_page_base_for_rw = std::make_shared<MyPage>();
-	info->shadow_page_base_for_exec = std::make_shared<MyPage>();
+	// Control blocks are small enough to come from the lookaside list of nodes
+	KernelPoolAllocator<MyPage, KernelPoolType::kHideNode> allocator;
+	info->shadow_page_base_for_rw = std::allocate_shared<MyPage>(allocator);
+	info->shadow_page_base_for_exec = std::allocate_shared<MyPage>(allocator);
 	
 	 if (page_base == NULL) 
 	 {
@@ -42,7 +44,7 @@ std::unique_ptr<HideInformation> VariableHiding::CreateNoTruthNode(
 
 	HYPERPLATFORM_LOG_INFO("\r\n hiding address : 0x%I64X  \r\n name : %s \r\n PA(RW) : 0x%I64X PA(Exec) : 0x%I64X \r\n VA(RW) : 0x%I64X VA(Exec) : 0x%I64X  \r\n  ",
 		info->patch_address,
-		info->name,
+		info->name.c_str(),
 		info->pa_base_for_rw,
 		info->pa_base_for_exec,
 		info->shadow_page_base_for_rw,
@@ -59,9 +61,11 @@ VariableHiding::VariableHiding()
 VariableHiding::~VariableHiding()
 {
 }
+// Pages come from a lookaside list of the kHidePage pool, and are page-aligned
+// as any pool allocation of PAGE_SIZE is
 MyPage::MyPage()
-	: page(reinterpret_cast<UCHAR*>(ExAllocatePoolWithTag(
-		NonPagedPool, PAGE_SIZE, kHyperPlatformCommonPoolTag))) {
+	: page(reinterpret_cast<UCHAR*>(KernelPoolAllocate(
+		KernelPoolType::kHidePage, PAGE_SIZE))) {
 	if (!page) {
 		HYPERPLATFORM_COMMON_BUG_CHECK(
 			HyperPlatformBugCheck::kCritialPoolAllocationFailure, 0, 0, 0);
@@ -69,4 +73,4 @@ MyPage::MyPage()
 }
 
 // De-allocates the allocated page
-MyPage::~MyPage() { ExFreePoolWithTag(page, kHyperPlatformCommonPoolTag); }
+MyPage::~MyPage() { KernelPoolFree(KernelPoolType::kHidePage, page, PAGE_SIZE); }
@@ -1,6 +1,7 @@
 #ifndef HYPERPLATFORM_VARHIDE_H_
 #define HYPERPLATFORM_VARHIDE_H_
 #include "../HyperPlatform/HyperPlatform/kernel_stl.h"
+#include "../HyperPlatform/HyperPlatform/kernel_pool.h"
 #include "ntifs.h"
 #include <fltKernel.h>
 #include <string>
@@ -28,8 +29,13 @@ struct MyPage {
 	~MyPage(); 
 };
 
+// A name of a hidden page. Kept in the pool of nodes.
+using HideString = std::basic_string<char, std::char_traits<char>,
+	KernelPoolAllocator<char, KernelPoolType::kHideNode>>;
+
 struct HiddenData;
-struct HideInformation {
+// Nodes come from a lookaside list of the kHideNode pool
+struct HideInformation : KernelPoolObject<KernelPoolType::kHideNode> {
 	void* patch_address;  // An address where a hook is installed
 	void* handler;        // An address of the handler routine
 
@@ -44,7 +50,7 @@ struct HideInformation {
 	ULONG_PTR	pa_base_for_exec;						//PA of above
 	ULONG_PTR	pa_base_original_page;
 													// Name
-	string name;
+	HideString name;
 
 	PEPROCESS proc;									
 	ULONG64 NewPhysicalAddress;						//use for compare new and old address when Copy-on-write occur							
@@ -52,6 +58,8 @@ struct HideInformation {
 	ULONG64 CR3;
 	PVOID64 MDL;   
 };
+static_assert(sizeof(HideInformation) <= kKernelPoolHideNodeSize,
+	"HideInformation must fit in a block of the kHideNode pool");
 
 class VariableHiding
 {
@@ -60,7 +68,7 @@ public:
 	//unique_ptr cannot use with extern type !!!
 	std::unique_ptr<HideInformation> CreateNoTruthNode(
 		PVOID address, 
-		string name,
+		const char* name,
 	    ULONG64 CR3,
 		PVOID64 mdl,
 		PEPROCESS proc, 
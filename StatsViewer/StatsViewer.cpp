@@ -0,0 +1,276 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Shows statistics of the driver and their rates while it is running.
+///
+/// On Windows, it polls IOCTL_STATS_SNAPSHOT and prints deltas and rates of
+/// counters between snapshots. It can also save a snapshot into a file, and
+/// compare two saved snapshots on any platform, e.g.:
+///
+///   g++ -std=c++11 -O2 -o stats_viewer StatsViewer.cpp
+///   ./stats_viewer -c before.bin after.bin
+
+#if defined(_WIN32)
+#include <windows.h>
+#include <winioctl.h>
+#endif
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/exit_trace_format.h"
+#include "../HyperPlatform/HyperPlatform/stats_format.h"
+
+#if defined(_WIN32)
+#include "../VTxRing3/IOCTL.h"
+#endif
+
+namespace {
+
+// A size of a buffer receiving a snapshot; large enough for any snapshot
+const size_t kSnapshotBufferSize = 64 * 1024;
+
+// Represents a validated snapshot
+struct Snapshot {
+  std::vector<unsigned char> data;
+  const StatsSnapshotHeader *header;
+};
+
+// Validates data as a snapshot
+bool ParseSnapshot(Snapshot *snapshot) {
+  snapshot->header =
+      StatsParseSnapshot(snapshot->data.data(), snapshot->data.size());
+  if (!snapshot->header) {
+    std::fprintf(stderr, "Malformed or unsupported snapshot\n");
+    return false;
+  }
+  return true;
+}
+
+// Returns counter at the index, or 0 when the snapshot does not have it
+StatsU64 GetExitCount(const StatsSnapshotHeader *header, StatsU32 reason) {
+  return (reason < header->number_of_exit_reasons)
+             ? StatsGetExitCounts(header)[reason]
+             : 0;
+}
+
+// Returns perf data of the location in the snapshot, or nullptr
+const StatsPerfEntry *FindPerfEntry(const StatsSnapshotHeader *header,
+                                    const char *location_name) {
+  const auto entries = StatsGetPerfEntries(header);
+  for (StatsU32 i = 0; i < header->number_of_perf_entries; ++i) {
+    if (std::strcmp(entries[i].location_name, location_name) == 0) {
+      return &entries[i];
+    }
+  }
+  return nullptr;
+}
+
+// Prints a single counter with its delta and rate
+void PrintCounter(const char *name, const StatsSnapshotHeader *older,
+                  const StatsSnapshotHeader *newer, StatsU64 older_count,
+                  StatsU64 newer_count) {
+  std::printf("  %-24s %16" PRIu64 " %12" PRIu64 " %12.1f\n", name,
+              newer_count, newer_count - older_count,
+              StatsGetRate(older, newer, older_count, newer_count));
+}
+
+// Prints differences between two snapshots. Counters that did not change are
+// omitted.
+void PrintDifference(const StatsSnapshotHeader *older,
+                     const StatsSnapshotHeader *newer) {
+  const auto seconds =
+      (newer->frequency && newer->timestamp > older->timestamp)
+          ? static_cast<double>(newer->timestamp - older->timestamp) /
+                static_cast<double>(newer->frequency)
+          : 0.0;
+  std::printf("--- %.3f s, %" PRIu32 " processor(s), %" PRIu64
+              " hidden page(s)\n",
+              seconds, newer->number_of_processors, newer->hide.hidden_pages);
+
+  std::printf("  %-24s %16s %12s %12s\n", "VM-exit", "Total", "Delta",
+              "Rate/s");
+  for (StatsU32 reason = 0; reason < newer->number_of_exit_reasons;
+       ++reason) {
+    const auto older_count = GetExitCount(older, reason);
+    const auto newer_count = GetExitCount(newer, reason);
+    if (newer_count != older_count) {
+      PrintCounter(ExitTraceGetReasonName(static_cast<ExitTraceU16>(reason)),
+                   older, newer, older_count, newer_count);
+    }
+  }
+
+  std::printf("  %-24s %16s %12s %12s\n", "Hide engine", "Total", "Delta",
+              "Rate/s");
+  PrintCounter("ReadViolation", older, newer, older->hide.read_violations,
+               newer->hide.read_violations);
+  PrintCounter("WriteViolation", older, newer, older->hide.write_violations,
+               newer->hide.write_violations);
+  PrintCounter("ExecuteViolation", older, newer,
+               older->hide.execute_violations,
+               newer->hide.execute_violations);
+  PrintCounter("UnmatchedViolation", older, newer,
+               older->hide.unmatched_violations,
+               newer->hide.unmatched_violations);
+  PrintCounter("MonitorTrapFlag", older, newer, older->hide.monitor_trap_flags,
+               newer->hide.monitor_trap_flags);
+
+  // The average is of the interval; percentiles are of the whole lifetime
+  std::printf("  %-45s %12s %12s %10s %10s %10s %10s %10s\n",
+              "Location", "Delta", "Rate/s", "Avg(ns)", "P50", "P99", "P99.9",
+              "Max");
+  const auto entries = StatsGetPerfEntries(newer);
+  for (StatsU32 i = 0; i < newer->number_of_perf_entries; ++i) {
+    const auto &entry = entries[i];
+    const auto previous = FindPerfEntry(older, entry.location_name);
+    const auto older_count = (previous) ? previous->execution_count : 0;
+    const auto older_time = (previous) ? previous->elapsed_time : 0;
+    if (entry.execution_count == older_count) {
+      continue;
+    }
+    const auto delta = entry.execution_count - older_count;
+    std::printf("  %-45s %12" PRIu64 " %12.1f %10" PRIu64 " %10" PRIu64
+                " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                entry.location_name, delta,
+                StatsGetRate(older, newer, older_count, entry.execution_count),
+                (entry.elapsed_time - older_time) / delta,
+                entry.p50_elapsed_time, entry.p99_elapsed_time,
+                entry.p999_elapsed_time, entry.maximum_elapsed_time);
+  }
+  std::fflush(stdout);
+}
+
+// Reads a snapshot saved in the file
+bool LoadSnapshot(const char *path, Snapshot *snapshot) {
+  const auto file = std::fopen(path, "rb");
+  if (!file) {
+    std::perror(path);
+    return false;
+  }
+  snapshot->data.resize(kSnapshotBufferSize);
+  const auto read_bytes =
+      std::fread(snapshot->data.data(), 1, snapshot->data.size(), file);
+  std::fclose(file);
+  snapshot->data.resize(read_bytes);
+  return ParseSnapshot(snapshot);
+}
+
+#if defined(_WIN32)
+
+// Takes a snapshot from the driver
+bool TakeSnapshot(HANDLE device, Snapshot *snapshot) {
+  snapshot->data.resize(kSnapshotBufferSize);
+  DWORD returned = 0;
+  if (!DeviceIoControl(device, IOCTL_STATS_SNAPSHOT, nullptr, 0,
+                       snapshot->data.data(),
+                       static_cast<DWORD>(snapshot->data.size()), &returned,
+                       nullptr)) {
+    std::fprintf(stderr, "IOCTL_STATS_SNAPSHOT failed (%lu)\n",
+                 GetLastError());
+    return false;
+  }
+  snapshot->data.resize(returned);
+  return ParseSnapshot(snapshot);
+}
+
+// Polls snapshots every interval_ms and prints differences. Runs forever when
+// count is 0.
+int Poll(DWORD interval_ms, unsigned long count) {
+  const auto device =
+      CreateFileA("\\\\.\\NoTruth", GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (device == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "Cannot open the device (%lu)\n", GetLastError());
+    return 1;
+  }
+
+  Snapshot snapshots[2] = {};
+  auto older = &snapshots[0];
+  auto newer = &snapshots[1];
+  auto succeeded = TakeSnapshot(device, older);
+  for (unsigned long i = 0; succeeded && (!count || i < count); ++i) {
+    Sleep(interval_ms);
+    succeeded = TakeSnapshot(device, newer);
+    if (succeeded) {
+      PrintDifference(older->header, newer->header);
+      std::swap(older, newer);
+    }
+  }
+  CloseHandle(device);
+  return succeeded ? 0 : 1;
+}
+
+// Saves a single snapshot into the file
+int Save(const char *path) {
+  const auto device =
+      CreateFileA("\\\\.\\NoTruth", GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (device == INVALID_HANDLE_VALUE) {
+    std::fprintf(stderr, "Cannot open the device (%lu)\n", GetLastError());
+    return 1;
+  }
+  Snapshot snapshot = {};
+  const auto succeeded = TakeSnapshot(device, &snapshot);
+  CloseHandle(device);
+  if (!succeeded) {
+    return 1;
+  }
+
+  const auto file = std::fopen(path, "wb");
+  if (!file) {
+    std::perror(path);
+    return 1;
+  }
+  const auto written =
+      std::fwrite(snapshot.data.data(), 1, snapshot.data.size(), file);
+  std::fclose(file);
+  return (written == snapshot.data.size()) ? 0 : 1;
+}
+
+#endif
+
+// Prints how to use this program
+void PrintUsage(const char *program) {
+#if defined(_WIN32)
+  std::fprintf(stderr,
+               "Usage: %s [interval_ms [count]]   poll the driver\n"
+               "       %s -s <file>               save a snapshot\n"
+               "       %s -c <older> <newer>      compare saved snapshots\n",
+               program, program, program);
+#else
+  std::fprintf(stderr, "Usage: %s -c <older> <newer>\n", program);
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc == 4 && std::strcmp(argv[1], "-c") == 0) {
+    Snapshot older = {};
+    Snapshot newer = {};
+    if (!LoadSnapshot(argv[2], &older) || !LoadSnapshot(argv[3], &newer)) {
+      return 1;
+    }
+    PrintDifference(older.header, newer.header);
+    return 0;
+  }
+
+#if defined(_WIN32)
+  if (argc == 3 && std::strcmp(argv[1], "-s") == 0) {
+    return Save(argv[2]);
+  }
+  if (argc <= 3 && (argc < 2 || argv[1][0] != '-')) {
+    const auto interval_ms =
+        (argc >= 2) ? std::strtoul(argv[1], nullptr, 10) : 1000;
+    const auto count = (argc >= 3) ? std::strtoul(argv[2], nullptr, 10) : 0;
+    return Poll(static_cast<DWORD>(interval_ms ? interval_ms : 1000), count);
+  }
+#endif
+
+  PrintUsage(argv[0]);
+  return 1;
+}
@@ -106,37 +106,25 @@ ULONG DumpExecptionCode(ULONG exception)
 	return 1;
 }
 //----------------------------------------------//
-DWORD WINAPI ExecuteThread(PVOID Param)
+// Calls the hooked function once; the handler runs when the hook is in place
+static void CheckExecute()
 {
-	ULONG  Hash;
-	while (1)
+	__try {
+		g_NtCreateThread(0, 0, 0, 0, 0, 0, 0, 0);
+		printf("Execute: OK \r\n");
+	}
+	__except (DumpExecptionCode(GetExceptionCode()))
 	{
-		__try {
-			g_NtCreateThread(0, 0, 0, 0, 0, 0, 0, 0);
-		}
-		__except (DumpExecptionCode(GetExceptionCode()))
-		{
-
-		}
-		Sleep(1000);
+
 	}
-	return 0;
 }
 //----------------------------------------------//
-DWORD WINAPI CheckSumThread(PVOID Param)
+// Reads the hooked function once; it should still read unpatched bytes
+static void CheckSum()
 {
-	 
-	ULONG  Hash;
-
-	while (1)
-	{
-		ULONG value = 0;
-		value = *(PULONG)g_NtCreateThread;
-		printf("Checksum Value: %x TickCount: %I64x \r\n", value, GetTickCount());
-		Sleep(1000);
-	}
-	return 0;
-} 
+	ULONG value = *(PULONG)g_NtCreateThread;
+	printf("Checksum Value: %x \r\n", value);
+}
 //----------------------------------------------//
 int main()
 {
@@ -152,11 +140,10 @@ int main()
 		UnitTest(g_NtCreateThread, MyNtCreateThread);
 		SetupInlineHook_X64(&g_HookObj, g_NtCreateThread, MyNtCreateThread); 
 
-		for (int i = 0; i < 10; i++)
-		{
-			CreateThread(0, 0, (LPTHREAD_START_ROUTINE)CheckSumThread, 0, 0, 0);
-			CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ExecuteThread, 0, 0, 0);
-		}
+		// A single pass only checks that the hook works while it is hidden.
+		// Use HideBench to measure access latencies of hidden pages.
+		CheckSum();
+		CheckExecute();
 	}
 
 	getchar();
@@ -0,0 +1,137 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Decodes VM-exit trace captures offline.
+///
+/// Accepts either a capture file written by CaptureExitTrace() in VTxRing3 or
+/// a raw dump of the shared trace region. Only depends on the standard library
+/// so that it can be built anywhere, e.g.:
+///
+///   g++ -std=c++11 -O2 -o exit_trace_decoder exit_trace_decoder.cpp
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/exit_trace_format.h"
+
+namespace {
+
+// Prints a single record
+void PrintRecord(ExitTraceU32 processor, const ExitTraceRecord &record,
+                 ExitTraceU64 lost) {
+  if (lost) {
+    std::printf("#%-3" PRIu32 " ... %" PRIu64 " record(s) lost\n", processor,
+                lost);
+  }
+  std::printf("#%-3" PRIu32 " %10" PRIu64 " +%-10" PRIu32
+              " %-20s ip=%016" PRIx64 " qual=%016" PRIx64,
+              processor, record.sequence, record.tsc_delta,
+              ExitTraceGetReasonName(record.exit_reason), record.guest_ip,
+              record.exit_qualification);
+  if (record.flags & kExitTraceFlagGpaValid) {
+    std::printf(" gpa=%016" PRIx64, record.guest_physical_address);
+  }
+  std::printf("\n");
+}
+
+// Decodes a file written by CaptureExitTrace()
+bool DecodeCapture(const std::vector<unsigned char> &data) {
+  ExitTraceCaptureHeader header = {};
+  std::memcpy(&header, data.data(), sizeof(header));
+  if (header.version != kExitTraceVersion) {
+    std::fprintf(stderr, "Unsupported version %" PRIu32 "\n", header.version);
+    return false;
+  }
+
+  std::vector<ExitTraceU64> counts(header.number_of_processors);
+  ExitTraceU64 total_lost = 0;
+  for (auto offset = sizeof(header);
+       offset + sizeof(ExitTraceCaptureEntry) <= data.size();
+       offset += sizeof(ExitTraceCaptureEntry)) {
+    ExitTraceCaptureEntry entry = {};
+    std::memcpy(&entry, data.data() + offset, sizeof(entry));
+    PrintRecord(entry.processor, entry.record, entry.lost);
+    if (entry.processor < counts.size()) {
+      counts[entry.processor]++;
+    }
+    total_lost += entry.lost;
+  }
+
+  for (ExitTraceU32 i = 0; i < counts.size(); ++i) {
+    std::printf("Processor %" PRIu32 ": %" PRIu64 " record(s)\n", i,
+                counts[i]);
+  }
+  std::printf("Lost: %" PRIu64 " record(s)\n", total_lost);
+  return true;
+}
+
+// Decodes a raw dump of the shared region with the same reader as VTxRing3
+bool DecodeRegion(std::vector<unsigned char> &data) {
+  const auto header = reinterpret_cast<const ExitTraceHeader *>(data.data());
+  if (data.size() < sizeof(*header) || header->total_size > data.size() ||
+      header->version != kExitTraceVersion || !header->records_per_ring ||
+      (header->records_per_ring & (header->records_per_ring - 1)) ||
+      header->ring_offset + header->ring_stride * header->number_of_processors >
+          data.size()) {
+    std::fprintf(stderr, "Malformed trace region\n");
+    return false;
+  }
+
+  std::vector<ExitTraceRecord> records(header->records_per_ring);
+  for (ExitTraceU32 i = 0; i < header->number_of_processors; ++i) {
+    const auto ring = ExitTraceGetRing(header, i);
+    ExitTraceU64 cursor = 0;
+    ExitTraceU64 lost = 0;
+    const auto count =
+        ExitTraceReadRing(header, ring, &cursor, records.data(),
+                          header->records_per_ring, &lost);
+    for (ExitTraceU32 j = 0; j < count; ++j) {
+      PrintRecord(ring->processor, records[j], j ? 0 : lost);
+    }
+    std::printf("Processor %" PRIu32 ": %" PRIu32 " record(s), %" PRIu64
+                " lost\n",
+                ring->processor, count, lost);
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    std::fprintf(stderr, "Usage: %s <capture or region dump>\n", argv[0]);
+    return 1;
+  }
+
+  const auto file = std::fopen(argv[1], "rb");
+  if (!file) {
+    std::perror(argv[1]);
+    return 1;
+  }
+  std::vector<unsigned char> data;
+  unsigned char buffer[64 * 1024];
+  size_t read_bytes = 0;
+  while ((read_bytes = std::fread(buffer, 1, sizeof(buffer), file)) != 0) {
+    data.insert(data.end(), buffer, buffer + read_bytes);
+  }
+  std::fclose(file);
+
+  ExitTraceU32 magic = 0;
+  if (data.size() < sizeof(ExitTraceCaptureHeader)) {
+    std::fprintf(stderr, "Too small\n");
+    return 1;
+  }
+  std::memcpy(&magic, data.data(), sizeof(magic));
+  bool succeeded = false;
+  if (magic == kExitTraceCaptureMagic) {
+    succeeded = DecodeCapture(data);
+  } else if (magic == kExitTraceMagic) {
+    succeeded = DecodeRegion(data);
+  } else {
+    std::fprintf(stderr, "Unknown magic %08" PRIx32 "\n", magic);
+  }
+  return succeeded ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Checks the fixed-capacity vector holding hidden pages in the driver.
+///
+/// It first runs fixed cases as the driver uses the vector: hidden pages are
+/// moved to a vector of removed ones with remove_if(), which must keep an
+/// element whenever the destination is full. It then applies random
+/// operations to the vector and to std::vector side by side and checks that
+/// they always hold the same elements. It only depends on the standard
+/// library:
+///
+///   g++ -std=c++11 -O2 -o fixed_vector_test fixed_vector_test.cpp
+///   ./fixed_vector_test [seed]
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/fixed_vector.h"
+
+namespace {
+
+// A capacity of vectors under the random test
+const size_t kCapacity = 8;
+
+using Vector = FixedVector<int *, kCapacity>;
+
+// Prints the message if the condition is false
+bool Expect(bool condition, const char *message) {
+  if (!condition) {
+    std::printf("%s\n", message);
+  }
+  return condition;
+}
+
+// Checks fixed cases of hidden pages and removed ones
+bool CheckCases() {
+  using SmallVector = FixedVector<int *, 4>;
+  static int nodes[5] = {0, 1, 2, 3, 4};
+  SmallVector list;
+  SmallVector removed;
+
+  auto ok = true;
+  ok &= Expect(list.empty() && list.capacity() == 4, "empty vector");
+  for (auto &node : nodes) {
+    list.try_push_back(&node);
+  }
+  ok &= Expect(list.full() && list.size() == 4 && list[3] == &nodes[3],
+               "full vector");
+  ok &= Expect(!list.try_push_back(&nodes[4]) && list.size() == 4,
+               "push to full vector");
+
+  // Removal keeps order of the others
+  auto count = list.remove_if([&](int *node) {
+    return (*node % 2) == 1 && removed.try_push_back(node);
+  });
+  ok &= Expect(count == 2 && list.size() == 2 && list[0] == &nodes[0] &&
+                   list[1] == &nodes[2],
+               "remove_if");
+  ok &= Expect(removed.size() == 2 && removed[0] == &nodes[1] &&
+                   removed.back() == &nodes[3],
+               "removed elements");
+
+  // An element stays if the destination is full
+  removed.try_push_back(&nodes[4]);
+  count = list.remove_if(
+      [&](int *node) { return removed.try_push_back(node); });
+  ok &= Expect(count == 1 && list.size() == 1 && list[0] == &nodes[2],
+               "remove_if to full vector");
+
+  auto drained = 0;
+  while (!removed.empty()) {
+    removed.pop_back();
+    ++drained;
+  }
+  ok &= Expect(drained == 4, "drain");
+
+  list.clear();
+  ok &= Expect(list.empty() && list.begin() == list.end(), "clear");
+  ok &= Expect(list.try_push_back(&nodes[4]) && *list.cbegin() == &nodes[4],
+               "reuse");
+  return ok;
+}
+
+// Checks that the vector holds the same elements as the model
+bool IsSame(const Vector &vector, const std::vector<int *> &model) {
+  if (vector.size() != model.size() || vector.empty() != model.empty() ||
+      vector.full() != (model.size() == kCapacity) ||
+      static_cast<size_t>(vector.end() - vector.begin()) != model.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < model.size(); ++i) {
+    if (vector[i] != model[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Applies random operations to the vector and to std::vector
+bool CheckRandomOperations(unsigned long long seed) {
+  std::mt19937_64 random(seed);
+  static int nodes[64];
+  Vector vector;
+  std::vector<int *> model;
+
+  for (auto i = 0; i < 1000000; ++i) {
+    const auto operation = random() % 8;
+    if (operation < 4) {
+      const auto node = &nodes[random() % 64];
+      const auto pushed = vector.try_push_back(node);
+      if (pushed != (model.size() < kCapacity)) {
+        std::printf("iteration %d: try_push_back returned %d\n", i, pushed);
+        return false;
+      }
+      if (pushed) {
+        model.push_back(node);
+      }
+    } else if (operation < 6) {
+      if (!model.empty()) {
+        vector.pop_back();
+        model.pop_back();
+      }
+    } else if (operation < 7) {
+      // Removes at random, calling the predicate once per element in order
+      std::vector<int *> kept;
+      std::vector<int *> visited;
+      const auto mask = random();
+      size_t index = 0;
+      const auto count = vector.remove_if([&](int *node) {
+        visited.push_back(node);
+        const auto remove = ((mask >> index++) & 1) != 0;
+        if (!remove) {
+          kept.push_back(node);
+        }
+        return remove;
+      });
+      if (visited != model || count != model.size() - kept.size()) {
+        std::printf("iteration %d: remove_if visited wrong elements\n", i);
+        return false;
+      }
+      model = kept;
+    } else if (random() % 16 == 0) {
+      vector.clear();
+      model.clear();
+    }
+    if (!IsSame(vector, model)) {
+      std::printf("iteration %d: differs from std::vector\n", i);
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    std::fprintf(stderr, "Usage: %s [seed]\n", argv[0]);
+    return 1;
+  }
+  const auto seed = (argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 1;
+
+  auto ok = CheckCases();
+  ok &= CheckRandomOperations(seed);
+  std::printf("%s (seed %llu)\n", ok ? "PASSED" : "FAILED", seed);
+  return ok ? 0 : 1;
+}
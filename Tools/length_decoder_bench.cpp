@@ -0,0 +1,334 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Checks and measures the instruction length decoder used by inline hooks.
+///
+/// Without arguments, it checks the decoder against a built-in corpus of
+/// instructions with known lengths. Given a file of raw code bytes, e.g. a
+/// .text section dumped from a module, it decodes the file sequentially and
+/// measures throughput. It only depends on the standard library:
+///
+///   g++ -std=c++11 -O2 -o length_decoder_bench length_decoder_bench.cpp
+///       ../VTxRing3/LengthDecoder.cpp
+///
+/// Defining USE_CAPSTONE additionally compares the decoder with capstone at
+/// every offset of the file, and measures capstone both with a cached handle
+/// and with a handle opened for each instruction as hooks used to do:
+///
+///   g++ -std=c++11 -O2 -DUSE_CAPSTONE -I../VTxRing3/capstone/include
+///       -o length_decoder_bench length_decoder_bench.cpp
+///       ../VTxRing3/LengthDecoder.cpp -lcapstone
+///
+/// Differences are only reported when the decoder returns a length. When it
+/// returns 0, hooks fall back to capstone, so those are counted separately.
+
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "../VTxRing3/LengthDecoder.h"
+
+#if defined(USE_CAPSTONE)
+#include <capstone.h>
+#endif
+
+namespace {
+
+// An instruction with a known length
+struct CorpusEntry {
+  bool is_64bit;
+  size_t length;  // 0 when the decoder should defer to a disassembler
+  unsigned char bytes[kMaxInstructionLength];
+};
+
+// Instructions seen at function entries, plus ones exercising each path of the
+// decoder. Bytes after an instruction are filler and must not be consumed.
+const CorpusEntry kCorpus[] = {
+    // Function entries of x64 code
+    {true, 5, {0x48, 0x89, 0x5c, 0x24, 0x08}},        // mov [rsp+8], rbx
+    {true, 4, {0x48, 0x83, 0xec, 0x28}},              // sub rsp, 28h
+    {true, 7, {0x48, 0x81, 0xec, 0x00, 0x01, 0x00, 0x00}},  // sub rsp, 100h
+    {true, 2, {0x40, 0x53}},                          // push rbx
+    {true, 3, {0x4c, 0x8b, 0xd1}},                    // mov r10, rcx
+    {true, 5, {0xb8, 0x55, 0x00, 0x00, 0x00}},        // mov eax, 55h
+    {true, 8, {0xf6, 0x04, 0x25, 0x08, 0x03, 0xfe, 0x7f, 0x01}},  // test
+    {true, 2, {0x0f, 0x05}},                          // syscall
+    {true, 1, {0xc3}},                                // ret
+    {true, 2, {0xcd, 0x2e}},                          // int 2Eh
+    {true, 7, {0x48, 0x8b, 0x05, 0x11, 0x22, 0x33, 0x44}},  // mov rax, [rip+x]
+    {true, 7, {0x48, 0x8d, 0x0d, 0x11, 0x22, 0x33, 0x44}},  // lea rcx, [rip+x]
+    {true, 4, {0xf3, 0x0f, 0x1e, 0xfa}},              // endbr64
+    {true, 5, {0xe9, 0x11, 0x22, 0x33, 0x44}},        // jmp rel32
+    {true, 5, {0xe8, 0x11, 0x22, 0x33, 0x44}},        // call rel32
+    {true, 6, {0xff, 0x25, 0x00, 0x00, 0x00, 0x00}},  // jmp [rip]
+    {true, 6, {0x0f, 0x84, 0x11, 0x22, 0x33, 0x44}},  // je rel32
+    {true, 2, {0x74, 0x10}},                          // je rel8
+    {true, 10, {0x48, 0xb8, 1, 2, 3, 4, 5, 6, 7, 8}},  // mov rax, imm64
+    {true, 5, {0x66, 0x41, 0xb8, 0x34, 0x12}},         // mov r8w, 1234h
+    {true, 10, {0x48, 0xa1, 1, 2, 3, 4, 5, 6, 7, 8}},  // mov rax, moffs64
+    {true, 6, {0x67, 0xa1, 1, 2, 3, 4}},              // mov eax, moffs32
+    {true, 9, {0x48, 0xc7, 0x44, 0x24, 0x20, 1, 2, 3, 4}},  // mov [rsp+20h], imm
+    {true, 7, {0x66, 0x81, 0x7c, 0x24, 0x08, 0x34, 0x12}},  // cmp word, imm16
+    {true, 2, {0xf7, 0xd8}},                          // neg eax
+    {true, 6, {0xf7, 0xc1, 1, 2, 3, 4}},              // test ecx, imm32
+    {true, 3, {0xf6, 0xc1, 0x01}},                    // test cl, 1
+    {true, 4, {0xc8, 0x10, 0x00, 0x00}},              // enter 10h, 0
+    {true, 3, {0xc2, 0x08, 0x00}},                    // ret 8
+    {true, 8, {0x48, 0x8b, 0x84, 0x24, 1, 2, 3, 4}},  // mov rax, [rsp+disp32]
+    {true, 7, {0x8b, 0x04, 0x25, 1, 2, 3, 4}},        // mov eax, [disp32]
+    {true, 7, {0xf0, 0x48, 0x0f, 0xb1, 0x4c, 0x24, 0x10}},  // lock cmpxchg
+    {true, 4, {0x0f, 0x1f, 0x40, 0x00}},              // nop dword [rax]
+    {true, 3, {0x0f, 0x20, 0xd8}},                    // mov rax, cr3
+    {true, 3, {0x0f, 0x01, 0xc1}},                    // vmcall
+    {true, 3, {0x0f, 0xae, 0xf0}},                    // mfence
+    {true, 6, {0x66, 0x0f, 0x3a, 0x0f, 0xc1, 0x08}},  // palignr xmm0, xmm1, 8
+    {true, 5, {0x66, 0x0f, 0x38, 0x00, 0xc1}},        // pshufb xmm0, xmm1
+    {true, 5, {0x66, 0x0f, 0x70, 0xc1, 0x1b}},        // pshufd xmm0, xmm1, 1Bh
+    {true, 4, {0xf3, 0x0f, 0xb8, 0xc1}},              // popcnt eax, ecx
+    {true, 4, {0xc5, 0xf8, 0x10, 0x01}},              // vmovups xmm0, [rcx]
+    {true, 3, {0xc5, 0xf8, 0x77}},                    // vzeroupper
+    {true, 6, {0xc4, 0xe3, 0x79, 0x0f, 0xc1, 0x08}},  // vpalignr
+    {true, 5, {0xc4, 0xe2, 0x79, 0x00, 0xc1}},        // vpshufb
+    {true, 6, {0x62, 0xf1, 0x7c, 0x48, 0x10, 0x01}},  // vmovups zmm0, [rcx]
+    {true, 7, {0x62, 0xf1, 0x7c, 0x48, 0x10, 0x41, 0x01}},  // ... [rcx+40h]
+    {true, 2, {0xd9, 0xe8}},                          // fld1
+    {true, 2, {0x0f, 0x0b, 0x90}},                    // ud2
+    {true, 10, {0x66, 0x2e, 0x0f, 0x1f, 0x84, 0, 0, 0, 0, 0}},  // nop padding
+    // Deferred to a disassembler
+    {true, 0, {0x66, 0xe8, 0x11, 0x22}},              // call rel16 or rel32
+    {true, 0, {0x0f, 0xb9, 0xc0}},                    // ud1
+    {true, 0, {0x06}},                                // push es
+    {true, 0, {0x9b, 0xdd, 0x38}},                    // fstsw [rax]
+    {true, 0, {0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+               0x66, 0x66, 0x66, 0x66, 0x66}},        // longer than 15 bytes
+    // 32-bit code
+    {false, 1, {0x55}},                               // push ebp
+    {false, 2, {0x8b, 0xff}},                         // mov edi, edi
+    {false, 2, {0x8b, 0xec}},                         // mov ebp, esp
+    {false, 3, {0x83, 0xec, 0x10}},                   // sub esp, 10h
+    {false, 1, {0x48}},                               // dec eax
+    {false, 5, {0xa1, 1, 2, 3, 4}},                   // mov eax, moffs32
+    {false, 4, {0x67, 0xa1, 1, 2}},                   // mov eax, moffs16
+    {false, 4, {0x67, 0x8b, 0x46, 0x10, 0x90}},       // mov eax, [bp+10h]
+    {false, 5, {0x67, 0x8b, 0x06, 0x34, 0x12}},       // mov eax, [1234h]
+    {false, 7, {0x9a, 1, 2, 3, 4, 5, 6}},             // call far ptr16:32
+    {false, 6, {0x66, 0xea, 1, 2, 3, 4}},             // jmp far ptr16:16
+    {false, 4, {0x66, 0xe8, 0x11, 0x22}},             // call rel16
+    {false, 2, {0xc4, 0x01}},                         // les eax, [ecx]
+    {false, 4, {0xc5, 0xf8, 0x10, 0x01}},             // vmovups xmm0, [ecx]
+    {false, 2, {0x62, 0x01}},                         // bound eax, [ecx]
+    {false, 2, {0x8f, 0xc0}},                         // pop eax
+    {false, 6, {0x8f, 0xe8, 0x78, 0xc0, 0xc1, 0x08}},  // vprotb (XOP)
+    {false, 2, {0xd4, 0x0a}},                         // aam
+    {false, 1, {0x06}},                               // push es
+};
+
+// Returns a monotonic time in nanoseconds
+double GetNanoseconds() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Checks the decoder against the built-in corpus
+bool CheckCorpus() {
+  size_t failures = 0;
+  for (const auto &entry : kCorpus) {
+    const auto length = DecodeInstructionLength(
+        entry.bytes, sizeof(entry.bytes), entry.is_64bit);
+    if (length != entry.length) {
+      std::printf("Mismatch (%s):", entry.is_64bit ? "64" : "32");
+      for (auto byte : entry.bytes) {
+        std::printf(" %02x", byte);
+      }
+      std::printf(" -> %zu, expected %zu\n", length, entry.length);
+      failures++;
+    }
+  }
+
+  // An instruction truncated by the end of readable bytes
+  const unsigned char truncated[] = {0x48, 0x8b, 0x05, 0x11, 0x22};
+  if (DecodeInstructionLength(truncated, sizeof(truncated), true)) {
+    std::printf("Truncated instruction was decoded\n");
+    failures++;
+  }
+
+  std::printf("%zu of %zu corpus entries passed\n",
+              sizeof(kCorpus) / sizeof(kCorpus[0]) - failures,
+              sizeof(kCorpus) / sizeof(kCorpus[0]));
+  return failures == 0;
+}
+
+// Decodes code sequentially and returns the number of instructions. Bytes the
+// decoder cannot tell are skipped one by one.
+size_t DecodeSequentially(const std::vector<unsigned char> &code,
+                          bool is_64bit) {
+  size_t count = 0;
+  for (size_t offset = 0; offset < code.size(); ++count) {
+    const auto length = DecodeInstructionLength(
+        &code[offset], code.size() - offset, is_64bit);
+    offset += (length) ? length : 1;
+  }
+  return count;
+}
+
+#if defined(USE_CAPSTONE)
+
+// Returns a length of an instruction with the cached handle, or 0
+size_t GetCapstoneLength(csh handle, cs_insn *instruction,
+                         const unsigned char *code, size_t size) {
+  auto address = static_cast<uint64_t>(0);
+  if (size > kMaxInstructionLength) {
+    size = kMaxInstructionLength;
+  }
+  return cs_disasm_iter(handle, &code, &size, &address, instruction)
+             ? instruction->size
+             : 0;
+}
+
+// Returns a length of an instruction opening a handle for it, or 0
+size_t GetCapstoneLengthUncached(const unsigned char *code, size_t size,
+                                 bool is_64bit) {
+  csh handle = 0;
+  if (cs_open(CS_ARCH_X86, is_64bit ? CS_MODE_64 : CS_MODE_32, &handle) !=
+      CS_ERR_OK) {
+    return 0;
+  }
+  cs_insn *instructions = nullptr;
+  const auto count =
+      cs_disasm(handle, code, (size < kMaxInstructionLength)
+                                  ? size
+                                  : kMaxInstructionLength,
+                0, 1, &instructions);
+  const auto length = (count) ? instructions[0].size : 0;
+  cs_free(instructions, count);
+  cs_close(&handle);
+  return length;
+}
+
+// Compares the decoder with capstone at every offset and measures capstone
+bool CompareWithCapstone(const std::vector<unsigned char> &code,
+                         bool is_64bit, size_t instructions) {
+  csh handle = 0;
+  if (cs_open(CS_ARCH_X86, is_64bit ? CS_MODE_64 : CS_MODE_32, &handle) !=
+      CS_ERR_OK) {
+    std::fprintf(stderr, "cs_open failed\n");
+    return false;
+  }
+  const auto instruction = cs_malloc(handle);
+
+  size_t agreed = 0;
+  size_t deferred = 0;
+  size_t mismatched = 0;
+  for (size_t offset = 0; offset < code.size(); ++offset) {
+    const auto size = code.size() - offset;
+    const auto length = DecodeInstructionLength(&code[offset], size, is_64bit);
+    if (!length) {
+      deferred++;
+      continue;
+    }
+    const auto expected =
+        GetCapstoneLength(handle, instruction, &code[offset], size);
+    if (length == expected) {
+      agreed++;
+      continue;
+    }
+    if (mismatched++ < 32) {
+      std::printf("Mismatch at %08zx: %zu (capstone: %zu):", offset, length,
+                  expected);
+      for (size_t i = 0; i < kMaxInstructionLength && i < size; ++i) {
+        std::printf(" %02x", code[offset + i]);
+      }
+      std::printf("\n");
+    }
+  }
+  std::printf("Every offset: %zu agreed, %zu deferred, %zu mismatched\n",
+              agreed, deferred, mismatched);
+
+  // Capstone with the cached handle
+  auto start = GetNanoseconds();
+  for (size_t offset = 0; offset < code.size();) {
+    const auto length = GetCapstoneLength(handle, instruction, &code[offset],
+                                          code.size() - offset);
+    offset += (length) ? length : 1;
+  }
+  std::printf("%-32s %10.1f ns/instruction\n", "capstone (cached handle)",
+              (GetNanoseconds() - start) / instructions);
+
+  // Capstone opened for each instruction, on a part of the file as it is slow
+  size_t count = 0;
+  start = GetNanoseconds();
+  for (size_t offset = 0; offset < code.size() && count < 100000; ++count) {
+    const auto length = GetCapstoneLengthUncached(
+        &code[offset], code.size() - offset, is_64bit);
+    offset += (length) ? length : 1;
+  }
+  std::printf("%-32s %10.1f ns/instruction\n", "capstone (handle per call)",
+              (GetNanoseconds() - start) / count);
+
+  cs_free(instruction, 1);
+  cs_close(&handle);
+  return mismatched == 0;
+}
+
+#endif
+
+// Decodes a file of raw code bytes and prints throughput
+int ProcessFile(const char *path, bool is_64bit) {
+  const auto file = std::fopen(path, "rb");
+  if (!file) {
+    std::perror(path);
+    return 1;
+  }
+  std::vector<unsigned char> code;
+  unsigned char buffer[64 * 1024];
+  size_t read_bytes = 0;
+  while ((read_bytes = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    code.insert(code.end(), buffer, buffer + read_bytes);
+  }
+  std::fclose(file);
+  if (code.empty()) {
+    std::fprintf(stderr, "%s is empty\n", path);
+    return 1;
+  }
+
+  // Repeats decoding so that short files take measurable time
+  const auto repeat = 1 + (16 * 1024 * 1024) / code.size();
+  size_t instructions = 0;
+  const auto start = GetNanoseconds();
+  for (size_t i = 0; i < repeat; ++i) {
+    instructions = DecodeSequentially(code, is_64bit);
+  }
+  const auto elapsed = GetNanoseconds() - start;
+  std::printf("%zu bytes, %zu instructions (%s-bit)\n", code.size(),
+              instructions, is_64bit ? "64" : "32");
+  std::printf("%-32s %10.1f ns/instruction\n", "LengthDecoder",
+              elapsed / (instructions * repeat));
+
+#if defined(USE_CAPSTONE)
+  return CompareWithCapstone(code, is_64bit, instructions) ? 0 : 1;
+#else
+  return 0;
+#endif
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc == 1) {
+    return CheckCorpus() ? 0 : 1;
+  }
+  if (argc == 2 || argc == 3) {
+    const auto is_64bit = (argc == 2) || std::strcmp(argv[2], "32") != 0;
+    return ProcessFile(argv[1], is_64bit);
+  }
+  std::fprintf(stderr,
+               "Usage: %s                  check the built-in corpus\n"
+               "       %s <file> [32|64]   decode a file of raw code bytes\n",
+               argv[0], argv[0]);
+  return 1;
+}
@@ -0,0 +1,359 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Fuzzes the guest page table walker and its translation cache.
+///
+/// It builds random 4-level page tables with 4KB, 2MB and 1GB pages in a
+/// software model of physical memory, and compares translations of the walker
+/// with the mappings the tables were built from. Entries carry random bits
+/// the walker must ignore, e.g. accessed, dirty, NX and PAT on 4KB pages. It
+/// then remaps, unmaps and invalidates pages at random and checks that the
+/// cache never returns a translation dropped by an invalidation. It only
+/// depends on the standard library:
+///
+///   g++ -std=c++11 -O2 -o page_walk_fuzz page_walk_fuzz.cpp
+///   ./page_walk_fuzz [seed] [iterations]
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/page_walk.h"
+
+namespace {
+
+// Bits the walker must ignore: R/W, U/S, PWT, PCD, A, D, G, AVL, and 62:52
+// including NX. PAT (bit 7) is added for 4KB pages separately.
+const PageWalkU64 kIgnoredBits = 0x7ff0000000000f7eull;
+
+// A page of paging structures
+using Table = std::vector<PageWalkU64>;
+
+// Physical memory holding paging structures, keyed by a page frame number
+class PhysicalMemory {
+ public:
+  explicit PhysicalMemory(std::mt19937_64 *random) : random_(random) {}
+
+  // Allocates a zeroed table at an unused, random physical page
+  PageWalkU64 AllocateTable() {
+    for (;;) {
+      const auto pfn = (*random_)() & 0xffffffffull;
+      if (pfn && tables_.find(pfn) == tables_.end()) {
+        tables_[pfn] = Table(512);
+        return pfn << 12;
+      }
+    }
+  }
+
+  PageWalkU64 *GetEntry(PageWalkU64 pa) {
+    const auto found = tables_.find(pa >> 12);
+    if (found == tables_.end()) {
+      return nullptr;
+    }
+    return &found->second[(pa & 0xfff) / sizeof(PageWalkU64)];
+  }
+
+  // PageWalkReadEntryType
+  static bool ReadEntry(void *context, PageWalkU64 pa, PageWalkU64 *entry) {
+    const auto memory = static_cast<PhysicalMemory *>(context);
+    memory->reads_++;
+    const auto p = memory->GetEntry(pa);
+    if (!p) {
+      return false;
+    }
+    *entry = *p;
+    return true;
+  }
+
+  PageWalkU64 reads() const { return reads_; }
+
+ private:
+  std::mt19937_64 *random_;
+  std::unordered_map<PageWalkU64, Table> tables_;
+  PageWalkU64 reads_ = 0;
+};
+
+// A mapping the tables were built from
+struct Mapping {
+  PageWalkU64 pa;
+  PageWalkU64 *leaf;  // An entry mapping it
+};
+
+// Mappings of an address space, keyed by a base address and a page size
+using Mappings = std::map<std::pair<PageWalkU64, PageWalkU64>, Mapping>;
+
+// An address space under test
+struct AddressSpace {
+  PageWalkU64 cr3;
+  Mappings mappings;
+};
+
+class Fuzzer {
+ public:
+  explicit Fuzzer(PageWalkU64 seed) : random_(seed), memory_(&random_) {}
+
+  bool Run(int iterations) {
+    for (auto i = 0; i < 3; ++i) {
+      AddressSpace space = {};
+      // PCID and flags in CR3 must be ignored
+      space.cr3 = memory_.AllocateTable() | (random_() & 0xfff);
+      for (auto j = 0; j < 2000; ++j) {
+        Map(&space);
+      }
+      spaces_.push_back(space);
+    }
+
+    auto ok = CheckWalker(iterations);
+    ok &= CheckCache(iterations);
+    std::printf("%llu entries read\n",
+                static_cast<unsigned long long>(memory_.reads()));
+    return ok;
+  }
+
+ private:
+  // Returns a random canonical address, biased to a few regions so that pages
+  // share paging structures
+  PageWalkU64 RandomAddress() {
+    auto va = random_() & 0x0000ffffffffffffull;
+    if (random_() % 4) {
+      va &= 0x000000ff3fffffffull | (random_() & 0x0000800000000000ull);
+    }
+    if (va & 0x0000800000000000ull) {
+      va |= 0xffff000000000000ull;
+    }
+    return va;
+  }
+
+  PageWalkU64 RandomPageSize() {
+    switch (random_() % 8) {
+      case 0:
+        return kPageWalkPageSize1G;
+      case 1:
+      case 2:
+        return kPageWalkPageSize2M;
+      default:
+        return kPageWalkPageSize4K;
+    }
+  }
+
+  PageWalkU64 RandomEntry(PageWalkU64 pa, bool is_present) {
+    auto entry = (pa & kPageWalkAddressMask) | (random_() & kIgnoredBits);
+    return (is_present) ? entry | kPageWalkPresent : entry;
+  }
+
+  // Maps a random page unless it overlaps with existing ones
+  void Map(AddressSpace *space) {
+    const auto page_size = RandomPageSize();
+    const auto va = RandomAddress() & ~(page_size - 1);
+    const auto pa = (random_() & 0x000fffffffffffffull) & ~(page_size - 1);
+
+    auto table = space->cr3 & kPageWalkAddressMask;
+    for (PageWalkU32 level = 4; level > 0; --level) {
+      const auto shift = 12 + (level - 1) * 9;
+      const auto entry = memory_.GetEntry(table + ((va >> shift) & 0x1ff) * 8);
+      if ((1ull << shift) == page_size) {
+        if (*entry & kPageWalkPresent) {
+          return;  // Already mapped or used by a table
+        }
+        *entry = RandomEntry(pa, true);
+        if (level > 1) {
+          *entry |= kPageWalkLargePage;
+        } else if (random_() % 2) {
+          *entry |= kPageWalkLargePage;  // PAT; not a large page
+        }
+        space->mappings[{va, page_size}] = Mapping{pa, entry};
+        return;
+      }
+      if (*entry & kPageWalkPresent) {
+        if (level < 4 && (*entry & kPageWalkLargePage)) {
+          return;  // Covered by a large page
+        }
+      } else {
+        // Not-present entries may hold any garbage
+        if (random_() % 16 == 0) {
+          *entry = RandomEntry(random_(), false);
+          return;
+        }
+        *entry = RandomEntry(memory_.AllocateTable(), true) &
+                 ~kPageWalkLargePage;
+      }
+      table = *entry & kPageWalkAddressMask;
+    }
+  }
+
+  // Translates with the mappings the tables were built from
+  static bool Expect(const AddressSpace &space, PageWalkU64 va,
+                     PageWalkResult *result) {
+    for (const auto page_size :
+         {kPageWalkPageSize4K, kPageWalkPageSize2M, kPageWalkPageSize1G}) {
+      const auto found =
+          space.mappings.find({va & ~(page_size - 1), page_size});
+      if (found != space.mappings.end()) {
+        result->pa = found->second.pa | (va & (page_size - 1));
+        result->page_size = page_size;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Returns an address in a mapped page most of the time
+  PageWalkU64 RandomQuery(const AddressSpace &space) {
+    switch (random_() % 8) {
+      case 0:
+        return random_();  // Mostly non-canonical
+      case 1:
+        return RandomAddress();
+      default: {
+        auto it = space.mappings.begin();
+        std::advance(it, random_() % space.mappings.size());
+        return it->first.first | (random_() & (it->first.second - 1));
+      }
+    }
+  }
+
+  bool Compare(const char *name, const AddressSpace &space, PageWalkU64 va,
+               bool translated, const PageWalkResult &actual) {
+    PageWalkResult expected = {};
+    const auto is_mapped = Expect(space, va, &expected);
+    if (translated == is_mapped &&
+        (!is_mapped || (actual.pa == expected.pa &&
+                        actual.page_size == expected.page_size))) {
+      return true;
+    }
+    std::printf(
+        "%s: CR3 %016" PRIx64 " VA %016" PRIx64 ": got %d %016" PRIx64
+        " (%" PRIx64 "), expected %d %016" PRIx64 " (%" PRIx64 ")\n",
+        name, static_cast<uint64_t>(space.cr3), static_cast<uint64_t>(va),
+        translated, static_cast<uint64_t>(actual.pa),
+        static_cast<uint64_t>(actual.page_size), is_mapped,
+        static_cast<uint64_t>(expected.pa),
+        static_cast<uint64_t>(expected.page_size));
+    return false;
+  }
+
+  bool CheckWalker(int iterations) {
+    auto mismatches = 0;
+    for (auto i = 0; i < iterations && mismatches < 10; ++i) {
+      const auto &space = spaces_[random_() % spaces_.size()];
+      const auto va = RandomQuery(space);
+      PageWalkResult actual = {};
+      const auto translated = PageWalkTranslate(
+          space.cr3, va, PhysicalMemory::ReadEntry, &memory_, &actual);
+      if (!Compare("walker", space, va, translated, actual)) {
+        mismatches++;
+      }
+    }
+
+    // CR3 pointing to nowhere
+    PageWalkResult actual = {};
+    if (PageWalkTranslate(0x1000, 0, PhysicalMemory::ReadEntry, &memory_,
+                          &actual)) {
+      std::printf("walker: translated with an unreadable PML4\n");
+      mismatches++;
+    }
+    return mismatches == 0;
+  }
+
+  bool CheckCache(int iterations) {
+    // A few pages queried, remapped and unmapped over and over so that the
+    // cache holds them when they change
+    struct HotPage {
+      AddressSpace *space;
+      PageWalkU64 va;
+      PageWalkU64 page_size;
+      PageWalkU64 *leaf;
+    };
+    std::vector<HotPage> hot_pages;
+
+    PageWalkCache cache = {};
+    auto mismatches = 0;
+    for (auto i = 0; i < iterations && mismatches < 10; ++i) {
+      if (hot_pages.size() < 8 || random_() % 256 == 0) {
+        auto &space = spaces_[random_() % spaces_.size()];
+        auto it = space.mappings.begin();
+        std::advance(it, random_() % space.mappings.size());
+        const HotPage hot_page = {&space, it->first.first, it->first.second,
+                                  it->second.leaf};
+        if (hot_pages.size() < 8) {
+          hot_pages.push_back(hot_page);
+        } else {
+          hot_pages[random_() % hot_pages.size()] = hot_page;
+        }
+      }
+
+      const auto &hot_page = hot_pages[random_() % hot_pages.size()];
+      const auto action = random_() % 64;
+      if (action == 0) {
+        PageWalkCacheInvalidateAll(&cache);
+        continue;
+      }
+      if (action < 8) {
+        // Remap or unmap the page, and invalidate it as a guest would with
+        // INVLPG on any address in the page
+        const auto key = std::make_pair(hot_page.va, hot_page.page_size);
+        if (random_() % 4) {
+          const auto pa = (random_() & 0x000fffffffffffffull) &
+                          ~(hot_page.page_size - 1);
+          *hot_page.leaf =
+              (*hot_page.leaf & ~kPageWalkAddressMask) | pa | kPageWalkPresent;
+          hot_page.space->mappings[key] = Mapping{pa, hot_page.leaf};
+        } else {
+          *hot_page.leaf &= ~kPageWalkPresent;
+          hot_page.space->mappings.erase(key);
+        }
+        PageWalkCacheInvalidateAddress(
+            &cache, hot_page.va | (random_() & (hot_page.page_size - 1)));
+        continue;
+      }
+
+      auto &space = (random_() % 4) ? *hot_page.space
+                                    : spaces_[random_() % spaces_.size()];
+      const auto va =
+          (&space == hot_page.space && random_() % 2)
+              ? hot_page.va | (random_() & (hot_page.page_size - 1))
+              : RandomQuery(space);
+      PageWalkResult actual = {};
+      const auto translated =
+          PageWalkTranslateCached(&cache, space.cr3, va,
+                                  PhysicalMemory::ReadEntry, &memory_, &actual);
+      if (!Compare("cache", space, va, translated, actual)) {
+        mismatches++;
+      }
+    }
+    std::printf("cache: %llu hits, %llu misses\n",
+                static_cast<unsigned long long>(cache.hits),
+                static_cast<unsigned long long>(cache.misses));
+    if (!cache.hits) {
+      std::printf("cache: never hit\n");
+      mismatches++;
+    }
+    return mismatches == 0;
+  }
+
+  std::mt19937_64 random_;
+  PhysicalMemory memory_;
+  std::vector<AddressSpace> spaces_;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    std::fprintf(stderr, "Usage: %s [seed] [iterations]\n", argv[0]);
+    return 1;
+  }
+  const auto seed = (argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 1;
+  const auto iterations = (argc > 2) ? std::atoi(argv[2]) : 1000000;
+
+  Fuzzer fuzzer(seed);
+  const auto ok = fuzzer.Run(iterations);
+  std::printf("%s (seed %llu)\n", ok ? "PASSED" : "FAILED", seed);
+  return ok ? 0 : 1;
+}
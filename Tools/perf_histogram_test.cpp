@@ -0,0 +1,199 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Checks the log-linear histogram used by perf counters.
+///
+/// It sweeps values across all buckets and checks that each value falls
+/// between the bounds of its bucket, that buckets are contiguous and ordered,
+/// and that no bucket is wider than 1/8 of its lower bound. It then records
+/// random distributions and checks that each percentile is never below the
+/// exact one and exceeds it by at most 12.5%. It only depends on the standard
+/// library:
+///
+///   g++ -std=c++11 -O2 -o perf_histogram_test perf_histogram_test.cpp
+///   ./perf_histogram_test [seed]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/perf_histogram.h"
+
+namespace {
+
+// Percentiles checked, in per mille
+const PerfHistogramU32 kPerMilles[] = {1,   10,  250, 500, 750,
+                                      900, 990, 999, 1000};
+
+// Checks a bucket of a single value
+bool CheckValue(PerfHistogramU64 value) {
+  const auto index = PerfHistogramGetBucketIndex(value);
+  if (index >= kPerfHistogramNumberOfBuckets) {
+    std::printf("%llu: index %u out of range\n",
+                static_cast<unsigned long long>(value), index);
+    return false;
+  }
+  const auto lower = PerfHistogramGetBucketLowerBound(index);
+  const auto upper = PerfHistogramGetBucketUpperBound(index);
+  if (value < lower || value > upper) {
+    std::printf("%llu: outside of bucket %u [%llu, %llu]\n",
+                static_cast<unsigned long long>(value), index,
+                static_cast<unsigned long long>(lower),
+                static_cast<unsigned long long>(upper));
+    return false;
+  }
+  return true;
+}
+
+// Checks bounds of all buckets and values around them
+bool CheckBuckets() {
+  auto ok = true;
+  for (PerfHistogramU32 index = 0; index < kPerfHistogramNumberOfBuckets;
+       ++index) {
+    const auto lower = PerfHistogramGetBucketLowerBound(index);
+    const auto upper = PerfHistogramGetBucketUpperBound(index);
+    if (PerfHistogramGetBucketIndex(lower) != index ||
+        PerfHistogramGetBucketIndex(upper) != index) {
+      std::printf("bucket %u: bounds [%llu, %llu] map to other buckets\n",
+                  index, static_cast<unsigned long long>(lower),
+                  static_cast<unsigned long long>(upper));
+      ok = false;
+    }
+    if (index &&
+        PerfHistogramGetBucketUpperBound(index - 1) + 1 != lower) {
+      std::printf("bucket %u: not contiguous with the previous one\n", index);
+      ok = false;
+    }
+    // The last bucket counts everything larger
+    const auto is_last = index + 1 == kPerfHistogramNumberOfBuckets;
+    if (!is_last && lower >= kPerfHistogramSubBuckets &&
+        (upper - lower + 1) * 8 > lower) {
+      std::printf("bucket %u: [%llu, %llu] is wider than 1/8\n", index,
+                  static_cast<unsigned long long>(lower),
+                  static_cast<unsigned long long>(upper));
+      ok = false;
+    }
+    ok &= CheckValue(lower) && CheckValue(upper);
+    if (lower) {
+      ok &= CheckValue(lower - 1);
+    }
+  }
+
+  // Every small value, and a sweep over all magnitudes
+  auto previous_index = 0u;
+  for (PerfHistogramU64 value = 0; value < (1u << 20); ++value) {
+    const auto index = PerfHistogramGetBucketIndex(value);
+    if (index < previous_index) {
+      std::printf("%llu: index decreased\n",
+                  static_cast<unsigned long long>(value));
+      ok = false;
+    }
+    previous_index = index;
+    ok &= CheckValue(value);
+  }
+  for (auto exponent = 0; exponent < 64; ++exponent) {
+    const auto base = 1ull << exponent;
+    for (auto delta = -3; delta <= 3; ++delta) {
+      ok &= CheckValue(base + delta);
+    }
+  }
+  ok &= CheckValue(~0ull);
+  return ok;
+}
+
+// Checks percentiles of the values against exact ones
+bool CheckPercentiles(const char *name, std::vector<PerfHistogramU64> values) {
+  PerfHistogram histogram = {};
+  PerfHistogram first_half = {};
+  PerfHistogram second_half = {};
+  for (size_t i = 0; i < values.size(); ++i) {
+    PerfHistogramRecord(&histogram, values[i]);
+    PerfHistogramRecord((i % 2) ? &second_half : &first_half, values[i]);
+  }
+  PerfHistogramMerge(&first_half, &second_half);
+  auto ok = std::memcmp(&first_half, &histogram, sizeof(histogram)) == 0;
+  if (!ok) {
+    std::printf("%s: merged halves differ\n", name);
+  }
+
+  std::sort(values.begin(), values.end());
+  const auto count = static_cast<PerfHistogramU64>(values.size());
+  for (const auto per_mille : kPerMilles) {
+    auto rank = (count * per_mille + 999) / 1000;
+    if (!rank) {
+      rank = 1;
+    }
+    const auto exact = values[rank - 1];
+    const auto reported = std::min(
+        PerfHistogramGetPercentile(&histogram, per_mille), values.back());
+    // Values below kPerfHistogramSubBuckets are exact
+    if (reported < exact || reported - exact > exact / 8) {
+      std::printf("%s: p%u.%u = %llu, exactly %llu\n", name, per_mille / 10,
+                  per_mille % 10, static_cast<unsigned long long>(reported),
+                  static_cast<unsigned long long>(exact));
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Records random distributions and checks their percentiles
+bool CheckDistributions(PerfHistogramU64 seed) {
+  std::mt19937_64 random(seed);
+  auto ok = true;
+
+  PerfHistogram empty = {};
+  if (PerfHistogramGetPercentile(&empty, 500)) {
+    std::printf("empty: p50 is not 0\n");
+    ok = false;
+  }
+
+  for (auto round = 0; round < 20; ++round) {
+    const auto count = 1 + random() % 100000;
+
+    std::vector<PerfHistogramU64> uniform(count);
+    std::uniform_int_distribution<PerfHistogramU64> uniform_distribution(
+        0, 1 + random() % 100000);
+    for (auto &value : uniform) {
+      value = uniform_distribution(random);
+    }
+    ok &= CheckPercentiles("uniform", uniform);
+
+    // Log-uniform over all tracked powers of two. The last bucket has no
+    // bound on the error.
+    std::vector<PerfHistogramU64> log_uniform(count);
+    for (auto &value : log_uniform) {
+      const auto exponent = random() % (kPerfHistogramMaxExponent + 1);
+      value = (random() | (1ull << exponent)) & ((2ull << exponent) - 1);
+    }
+    ok &= CheckPercentiles("log-uniform", log_uniform);
+
+    // A long tail like latencies of VM-exits
+    std::vector<PerfHistogramU64> tail(count);
+    std::exponential_distribution<double> tail_distribution(1.0 / 2000);
+    for (auto &value : tail) {
+      value = 200 + static_cast<PerfHistogramU64>(tail_distribution(random));
+    }
+    ok &= CheckPercentiles("tail", tail);
+  }
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    std::fprintf(stderr, "Usage: %s [seed]\n", argv[0]);
+    return 1;
+  }
+  const auto seed = (argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 1;
+
+  auto ok = CheckBuckets();
+  ok &= CheckDistributions(seed);
+  std::printf("%s (seed %llu)\n", ok ? "PASSED" : "FAILED", seed);
+  return ok ? 0 : 1;
+}
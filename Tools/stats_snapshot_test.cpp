@@ -0,0 +1,234 @@
+// Copyright (c) 2016-2017, KelvinChan. All rights reserved.
+// Use of this source code is governed by a MIT-style license that can be
+// found in the LICENSE file.
+
+/// @file
+/// Checks the parser of statistics snapshots used by consumers.
+///
+/// It builds a well-formed snapshot as the driver does, and checks that it is
+/// accepted while truncated ones, ones of other versions, and ones claiming
+/// more data than given are rejected. It then corrupts random bytes of the
+/// header and checks that whatever is accepted lies within the given buffer.
+/// It only depends on the standard library:
+///
+///   g++ -std=c++11 -O2 -o stats_snapshot_test stats_snapshot_test.cpp
+///   ./stats_snapshot_test [seed] [iterations]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <vector>
+#include "../HyperPlatform/HyperPlatform/stats_format.h"
+
+namespace {
+
+// A number of StatsPerfEntry in a snapshot under test
+const StatsU32 kNumberOfPerfEntries = 3;
+
+// A snapshot in a buffer aligned as the driver's
+class Snapshot {
+ public:
+  Snapshot() {
+    const auto perf_entry_offset =
+        static_cast<StatsU32>(sizeof(StatsSnapshotHeader));
+    const auto exit_count_offset = static_cast<StatsU32>(
+        perf_entry_offset + sizeof(StatsPerfEntry) * kNumberOfPerfEntries);
+    const auto size = static_cast<StatsU32>(
+        exit_count_offset + sizeof(StatsU64) * kStatsNumberOfExitReasons);
+    buffer_.resize(size / sizeof(StatsU64));
+
+    auto header = this->header();
+    header->magic = kStatsSnapshotMagic;
+    header->version = kStatsSnapshotVersion;
+    header->size = size;
+    header->number_of_processors = 4;
+    header->timestamp = 1000;
+    header->frequency = 10000000;
+    header->perf_entry_offset = perf_entry_offset;
+    header->number_of_perf_entries = kNumberOfPerfEntries;
+    header->exit_count_offset = exit_count_offset;
+    header->number_of_exit_reasons = kStatsNumberOfExitReasons;
+    auto entries = const_cast<StatsPerfEntry *>(StatsGetPerfEntries(header));
+    for (StatsU32 i = 0; i < kNumberOfPerfEntries; ++i) {
+      std::snprintf(entries[i].location_name, kStatsLocationNameLength,
+                    "Location%u", i);
+      entries[i].execution_count = i + 1;
+    }
+  }
+
+  StatsSnapshotHeader *header() {
+    return reinterpret_cast<StatsSnapshotHeader *>(buffer_.data());
+  }
+  unsigned char *bytes() { return reinterpret_cast<unsigned char *>(header()); }
+  size_t size() const { return buffer_.size() * sizeof(StatsU64); }
+
+ private:
+  std::vector<StatsU64> buffer_;
+};
+
+// Parses a snapshot modified by the function and checks the result
+bool Expect(const char *name, bool accepted,
+            const std::function<void(Snapshot *)> &modify) {
+  Snapshot snapshot;
+  modify(&snapshot);
+  const auto parsed = StatsParseSnapshot(snapshot.bytes(), snapshot.size());
+  if (!!parsed != accepted) {
+    std::printf("%s: %s\n", name, accepted ? "rejected" : "accepted");
+    return false;
+  }
+  return true;
+}
+
+// Checks fixed cases of well-formed and malformed snapshots
+bool CheckCases() {
+  auto ok = true;
+  ok &= Expect("well-formed", true, [](Snapshot *) {});
+  ok &= Expect("no perf entries", true, [](Snapshot *s) {
+    s->header()->number_of_perf_entries = 0;
+  });
+  ok &= Expect("slack after the snapshot", true, [](Snapshot *s) {
+    s->header()->size -= sizeof(StatsU64);
+    s->header()->number_of_exit_reasons -= 1;
+  });
+
+  // Version
+  ok &= Expect("wrong magic", false,
+               [](Snapshot *s) { s->header()->magic ^= 1; });
+  ok &= Expect("version 0", false,
+               [](Snapshot *s) { s->header()->version = 0; });
+  ok &= Expect("newer version", false, [](Snapshot *s) {
+    s->header()->version = kStatsSnapshotVersion + 1;
+  });
+
+  // Sizes larger than the buffer or smaller than the header
+  ok &= Expect("size beyond the buffer", false,
+               [](Snapshot *s) { s->header()->size += 1; });
+  ok &= Expect("size of 4GB", false,
+               [](Snapshot *s) { s->header()->size = 0xffffffff; });
+  ok &= Expect("size below the header", false, [](Snapshot *s) {
+    s->header()->size = sizeof(StatsSnapshotHeader) - 1;
+  });
+
+  // Arrays extending beyond the snapshot, including wrapping counts
+  ok &= Expect("one perf entry too many", false, [](Snapshot *s) {
+    const auto header = s->header();
+    header->number_of_perf_entries =
+        (header->size - header->perf_entry_offset) / sizeof(StatsPerfEntry) +
+        1;
+  });
+  ok &= Expect("4G perf entries", false, [](Snapshot *s) {
+    s->header()->number_of_perf_entries = 0xffffffff;
+  });
+  ok &= Expect("one exit reason too many", false, [](Snapshot *s) {
+    s->header()->number_of_exit_reasons += 1;
+  });
+  ok &= Expect("4G exit reasons", false, [](Snapshot *s) {
+    s->header()->number_of_exit_reasons = 0xffffffff;
+  });
+  ok &= Expect("perf entries past the end", false, [](Snapshot *s) {
+    s->header()->perf_entry_offset = 0xfffffff8;
+  });
+  ok &= Expect("exit counts past the end", false, [](Snapshot *s) {
+    s->header()->exit_count_offset = 0xfffffff8;
+  });
+
+  // Arrays overlapping the header or misaligned
+  ok &= Expect("perf entries in the header", false,
+               [](Snapshot *s) { s->header()->perf_entry_offset = 0; });
+  ok &= Expect("exit counts in the header", false, [](Snapshot *s) {
+    s->header()->exit_count_offset = sizeof(StatsSnapshotHeader) - 8;
+  });
+  ok &= Expect("misaligned perf entries", false, [](Snapshot *s) {
+    s->header()->perf_entry_offset += 4;
+    s->header()->number_of_perf_entries -= 1;
+  });
+  ok &= Expect("misaligned exit counts", false, [](Snapshot *s) {
+    s->header()->exit_count_offset += 4;
+    s->header()->number_of_exit_reasons -= 1;
+  });
+
+  // Location names used as C strings
+  ok &= Expect("unterminated location name", false, [](Snapshot *s) {
+    auto entries = const_cast<StatsPerfEntry *>(
+        StatsGetPerfEntries(s->header()));
+    std::memset(entries[kNumberOfPerfEntries - 1].location_name, 'A',
+                kStatsLocationNameLength);
+  });
+
+  // Truncated at every length
+  Snapshot snapshot;
+  for (size_t size = 0; size < snapshot.size(); ++size) {
+    std::vector<unsigned char> truncated(snapshot.bytes(),
+                                         snapshot.bytes() + size);
+    if (StatsParseSnapshot(truncated.data(), truncated.size())) {
+      std::printf("truncated to %zu bytes: accepted\n", size);
+      ok = false;
+    }
+  }
+  if (StatsParseSnapshot(nullptr, snapshot.size())) {
+    std::printf("null: accepted\n");
+    ok = false;
+  }
+  return ok;
+}
+
+// Corrupts the header at random and checks that anything accepted is within
+// the buffer
+bool CheckCorruption(StatsU64 seed, int iterations) {
+  std::mt19937_64 random(seed);
+  auto ok = true;
+  auto accepted = 0;
+  for (auto i = 0; i < iterations && ok; ++i) {
+    Snapshot snapshot;
+    const auto changes = 1 + random() % 4;
+    for (StatsU64 j = 0; j < changes; ++j) {
+      // Corrupt small values as often as random ones, as they are more likely
+      // to get through
+      const auto offset = random() % sizeof(StatsSnapshotHeader);
+      snapshot.bytes()[offset] = (random() % 2)
+                                     ? static_cast<unsigned char>(random())
+                                     : snapshot.bytes()[offset] + 1;
+    }
+    const auto given = snapshot.size() - random() % 16;
+    const auto header = StatsParseSnapshot(snapshot.bytes(), given);
+    if (!header) {
+      continue;
+    }
+    ++accepted;
+    const auto begin = snapshot.bytes();
+    const auto end = begin + given;
+    const auto entries = reinterpret_cast<const unsigned char *>(
+        StatsGetPerfEntries(header));
+    const auto counts =
+        reinterpret_cast<const unsigned char *>(StatsGetExitCounts(header));
+    if (header->version != kStatsSnapshotVersion || header->size > given ||
+        entries < begin + sizeof(*header) ||
+        entries + sizeof(StatsPerfEntry) * header->number_of_perf_entries >
+            end ||
+        counts < begin + sizeof(*header) ||
+        counts + sizeof(StatsU64) * header->number_of_exit_reasons > end) {
+      std::printf("iteration %d: accepted a snapshot beyond the buffer\n", i);
+      ok = false;
+    }
+  }
+  std::printf("%d of %d corrupted snapshots accepted\n", accepted, iterations);
+  return ok;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  if (argc > 3) {
+    std::fprintf(stderr, "Usage: %s [seed] [iterations]\n", argv[0]);
+    return 1;
+  }
+  const auto seed = (argc > 1) ? std::strtoull(argv[1], nullptr, 0) : 1;
+  const auto iterations = (argc > 2) ? std::atoi(argv[2]) : 100000;
+
+  auto ok = CheckCases();
+  ok &= CheckCorruption(seed, iterations);
+  std::printf("%s (seed %llu)\n", ok ? "PASSED" : "FAILED", seed);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+#include "stdafx.h"
+#include "IOCTL.h"
+#include "..\HyperPlatform\HyperPlatform\exit_trace_format.h"
+#include <vector>
+
+// How many records are copied from a ring at once
+static const ExitTraceU32 kReadBatchSize = 512;
+
+// How long to wait between polls of the rings in milliseconds
+static const DWORD kPollIntervalMs = 10;
+
+//-------------------------------------------------------------------------------------------------------//
+// Copies records written since the last poll into the capture file
+static BOOL DrainExitTraceRings(
+	const ExitTraceHeader* header,
+	std::vector<ExitTraceU64>& cursors,
+	std::vector<ExitTraceU64>& lost,
+	std::vector<ExitTraceRecord>& records,
+	std::vector<ExitTraceCaptureEntry>& entries,
+	HANDLE file)
+{
+	for (ExitTraceU32 processor = 0; processor < header->number_of_processors; processor++)
+	{
+		const auto ring = ExitTraceGetRing(header, processor);
+		for (;;)
+		{
+			const auto lost_before = lost[processor];
+			const auto count = ExitTraceReadRing(header, ring, &cursors[processor],
+				records.data(), kReadBatchSize, &lost[processor]);
+			if (!count)
+			{
+				break;
+			}
+
+			// Records lost before this batch are attributed to its first entry
+			for (ExitTraceU32 i = 0; i < count; i++)
+			{
+				auto& entry = entries[i];
+				entry.processor = processor;
+				entry.lost = (i == 0) ? static_cast<ExitTraceU32>(lost[processor] - lost_before) : 0;
+				entry.record = records[i];
+			}
+
+			DWORD written = 0;
+			const auto size = static_cast<DWORD>(sizeof(ExitTraceCaptureEntry) * count);
+			if (!WriteFile(file, entries.data(), size, &written, NULL) || written != size)
+			{
+				return FALSE;
+			}
+		}
+	}
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Maps the VM-exit trace rings of the driver and saves records written for
+// duration_ms milliseconds into path. The rings are read directly from the
+// mapped region, so no I/O request is issued while capturing.
+//
+// The device handle is kept open during the capture, as the driver unmaps the
+// rings when the handle is cleaned up.
+EXTERN_C BOOLEAN __stdcall CaptureExitTrace(PCSTR path, DWORD duration_ms)
+{
+	HANDLE device = CreateFileA("\\\\.\\NoTruth", GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (device == INVALID_HANDLE_VALUE)
+	{
+		OutputDebugStringA("CaptureExitTrace: cannot open the device \r\n");
+		return FALSE;
+	}
+
+	ULONG64 address = 0;
+	DWORD returned = 0;
+	if (!DeviceIoControl(device, IOCTL_TRACE_MAP, NULL, 0, &address, sizeof(address), &returned, NULL) ||
+		returned != sizeof(address))
+	{
+		OutputDebugStringA("CaptureExitTrace: IOCTL_TRACE_MAP failed \r\n");
+		CloseHandle(device);
+		return FALSE;
+	}
+
+	BOOLEAN result = FALSE;
+	const auto header = reinterpret_cast<const ExitTraceHeader*>(static_cast<ULONG_PTR>(address));
+	HANDLE file = INVALID_HANDLE_VALUE;
+	if (header->magic != kExitTraceMagic || header->version != kExitTraceVersion)
+	{
+		OutputDebugStringA("CaptureExitTrace: unsupported trace format \r\n");
+		goto Exit;
+	}
+
+	file = CreateFileA(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		OutputDebugStringA("CaptureExitTrace: cannot create the file \r\n");
+		goto Exit;
+	}
+
+	{
+		ExitTraceCaptureHeader capture = {};
+		capture.magic = kExitTraceCaptureMagic;
+		capture.version = kExitTraceVersion;
+		capture.number_of_processors = header->number_of_processors;
+		DWORD written = 0;
+		if (!WriteFile(file, &capture, sizeof(capture), &written, NULL) || written != sizeof(capture))
+		{
+			goto Exit;
+		}
+
+		// Start from the current position; older records are not of interest
+		std::vector<ExitTraceU64> cursors(header->number_of_processors);
+		std::vector<ExitTraceU64> lost(header->number_of_processors);
+		for (ExitTraceU32 processor = 0; processor < header->number_of_processors; processor++)
+		{
+			cursors[processor] = ExitTraceGetRing(header, processor)->head;
+		}
+		std::vector<ExitTraceRecord> records(kReadBatchSize);
+		std::vector<ExitTraceCaptureEntry> entries(kReadBatchSize);
+
+		const auto start = GetTickCount64();
+		do
+		{
+			Sleep(kPollIntervalMs);
+			if (!DrainExitTraceRings(header, cursors, lost, records, entries, file))
+			{
+				goto Exit;
+			}
+		} while (GetTickCount64() - start < duration_ms);
+	}
+	result = TRUE;
+
+Exit:
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(file);
+	}
+	DeviceIoControl(device, IOCTL_TRACE_UNMAP, NULL, 0, NULL, 0, &returned, NULL);
+	CloseHandle(device);
+	return result;
+}
@@ -1,10 +1,11 @@
  
 #include "stdafx.h"
 #include "Hook.h" 
+#include "LengthDecoder.h"
 #include <dos.h>   // definitions for _disable, _enable  
 #pragma intrinsic(_disable)  
 #pragma intrinsic(_enable)  
-#define RtlFreeMemory(pObj)			VirtualFree(pObj, 0 , MEM_RELEASE); 
+#include <vector>
 
 typedef struct _PLATFORM_DESC 
 {
@@ -27,34 +28,82 @@ BOOLEAN IsX64()
 }
 
 //----------------------------------------------------------------------------------//
+// A capstone handle opened once per thread, and closed when the thread exits
+class Disassembler
+{
+public:
+	Disassembler()
+	{
+		m_handle = 0;
+		m_instruction = nullptr;
+		const auto mode = IsX64() ? CS_MODE_64 : CS_MODE_32;
+		if (cs_open(CS_ARCH_X86, mode, &m_handle) == CS_ERR_OK)
+		{
+			m_instruction = cs_malloc(m_handle);
+		}
+	}
+	~Disassembler()
+	{
+		if (m_instruction)
+		{
+			cs_free(m_instruction, 1);
+		}
+		if (m_handle)
+		{
+			cs_close(&m_handle);
+		}
+	}
+
+	// Disassembles at most 15 bytes to get an instruction size
+	SIZE_T GetInstructionSize(void* address)
+	{
+		if (!m_instruction)
+		{
+			return 0;
+		}
+		auto code = static_cast<const uint8_t*>(address);
+		size_t size = kMaxInstructionLength;
+		auto ip = reinterpret_cast<uint64_t>(address);
+		if (!cs_disasm_iter(m_handle, &code, &size, &ip, m_instruction))
+		{
+			return 0;
+		}
+		return m_instruction->size;
+	}
+
+private:
+	csh m_handle;
+	cs_insn* m_instruction;
+};
+
+//----------------------------------------------------------------------------------//
+// Returns a size of an instruction at address, or 0 when it is not valid. The
+// table-driven decoder handles most instructions, and capstone handles the rest.
+// Debug builds also check the decoder against capstone.
 EXTERN_C
 	SIZE_T
 	GetInstructionSize(
 		void* address
 	)
 {
-	// Disassemble at most 15 bytes to get an instruction size
-	csh handle = {};
-	const auto mode = IsX64() ? CS_MODE_64 : CS_MODE_32;
-	if (cs_open(CS_ARCH_X86, mode, &handle) != CS_ERR_OK)
+	static thread_local Disassembler disassembler;
+
+	const auto size = DecodeInstructionLength(
+		static_cast<const unsigned char*>(address), kMaxInstructionLength, IsX64() != FALSE);
+	if (!size)
 	{
-		return 0;
+		return disassembler.GetInstructionSize(address);
 	}
-
-	static const auto kLongestInstSize = 15;
-	cs_insn* instructions = nullptr;
-	const auto count =
-		cs_disasm(handle, reinterpret_cast<uint8_t*>(address), kLongestInstSize,
-			reinterpret_cast<uint64_t>(address), 1, &instructions);
-	if (count == 0) {
-		cs_close(&handle);
-		return 0;
+#ifdef _DEBUG
+	const auto expected = disassembler.GetInstructionSize(address);
+	if (size != expected)
+	{
+		CString err;
+		err.Format(L"Length mismatch at %p: %Iu (capstone: %Iu) \r\n", address, size, expected);
+		OutputDebugString(err);
+		return expected;
 	}
-
-	// Get a size of the first instruction
-	const auto size = instructions[0].size;
-	cs_free(instructions, count);
-	cs_close(&handle);
+#endif
 	return size;
 }
 //-------------------------------------------------------------------------//
@@ -86,76 +135,336 @@ EXTERN_C
 }
 
 
+//-------------------------------------------------------------------------//
+// Trampolines are carved out of chunks reserved near hooked code so that a
+// hook can be a 5-byte jmp rel32, and a hook costs a slot instead of a 64 KB
+// allocation granule
+
+// A size of a trampoline slot. Fits a relay to a handler, stolen instructions
+// and a jump back with either form of a jump.
+static const SIZE_T kTrampolineSlotSize = 64;
+
+// A size of memory reserved at once for slots
+static const SIZE_T kTrampolineChunkSize = 64 * 1024;
+
+// A size of jmp rel32
+static const SIZE_T kRel32JumpSize = 5;
+
+struct TrampolineChunk
+{
+	PUCHAR Base;
+	SIZE_T UsedSize;
+};
+
+static std::vector<TrampolineChunk> g_TrampolineChunks;
+static SRWLOCK g_TrampolineLock = SRWLOCK_INIT;
+
+//-------------------------------------------------------------------------//
+// Returns true when jmp rel32 at from can reach to
+static BOOLEAN IsReachableByRel32(const void* from, const void* to)
+{
+	const auto distance = reinterpret_cast<LONGLONG>(to) -
+		(reinterpret_cast<LONGLONG>(from) + static_cast<LONGLONG>(kRel32JumpSize));
+	return distance >= MINLONG && distance <= MAXLONG;
+}
+
+//-------------------------------------------------------------------------//
+// Writes jmp rel32 at from that jumps to to
+static void WriteRel32Jump(PUCHAR from, const void* to)
+{
+	const auto distance = static_cast<LONG>(reinterpret_cast<LONGLONG>(to) -
+		(reinterpret_cast<LONGLONG>(from) + static_cast<LONGLONG>(kRel32JumpSize)));
+	from[0] = 0xe9;
+	RtlCopyMemory(from + 1, &distance, sizeof(distance));
+}
+
+//-------------------------------------------------------------------------//
+// Tries to allocate a chunk at a free region containing address
+static PUCHAR TryAllocateChunkAt(ULONG_PTR address)
+{
+	return static_cast<PUCHAR>(VirtualAlloc(reinterpret_cast<void*>(address),
+		kTrampolineChunkSize, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE));
+}
+
+//-------------------------------------------------------------------------//
+// Allocates a chunk that jmp rel32 at and around target can reach, looking
+// for the nearest free region below and then above target. Returns NULL when
+// there is no such region.
+static PUCHAR AllocateChunkNear(const void* target)
+{
+	SYSTEM_INFO info = {};
+	GetSystemInfo(&info);
+	const auto granularity = static_cast<ULONG_PTR>(info.dwAllocationGranularity);
+	const auto minimum = reinterpret_cast<ULONG_PTR>(info.lpMinimumApplicationAddress);
+	const auto maximum = reinterpret_cast<ULONG_PTR>(info.lpMaximumApplicationAddress);
+
+	// Leaves room for the chunk and code around target within the reach
+	const auto center = reinterpret_cast<ULONG_PTR>(target);
+	const ULONG_PTR reach = MAXLONG - 2 * kTrampolineChunkSize;
+	const auto lowest = (center > minimum + reach) ? center - reach : minimum;
+	const auto highest = (center < maximum - reach) ? center + reach : maximum;
+
+	MEMORY_BASIC_INFORMATION mbi = {};
+	for (auto address = center & ~(granularity - 1); address >= lowest && address > granularity;)
+	{
+		if (!VirtualQuery(reinterpret_cast<void*>(address), &mbi, sizeof(mbi)))
+		{
+			break;
+		}
+		const auto base = reinterpret_cast<ULONG_PTR>(mbi.BaseAddress);
+		if (mbi.State == MEM_FREE && base + mbi.RegionSize >= kTrampolineChunkSize)
+		{
+			const auto candidate = (base + mbi.RegionSize - kTrampolineChunkSize) & ~(granularity - 1);
+			if (candidate >= base && candidate >= lowest)
+			{
+				if (const auto chunk = TryAllocateChunkAt(min(candidate, address)))
+				{
+					return chunk;
+				}
+			}
+		}
+		if (base <= lowest)
+		{
+			break;
+		}
+		address = (base - 1) & ~(granularity - 1);
+	}
+
+	for (auto address = (center + granularity - 1) & ~(granularity - 1); address + kTrampolineChunkSize <= highest;)
+	{
+		if (!VirtualQuery(reinterpret_cast<void*>(address), &mbi, sizeof(mbi)))
+		{
+			break;
+		}
+		const auto end = reinterpret_cast<ULONG_PTR>(mbi.BaseAddress) + mbi.RegionSize;
+		if (mbi.State == MEM_FREE && address + kTrampolineChunkSize <= end)
+		{
+			if (const auto chunk = TryAllocateChunkAt(address))
+			{
+				return chunk;
+			}
+		}
+		address = (end + granularity - 1) & ~(granularity - 1);
+	}
+	return NULL;
+}
+
+//-------------------------------------------------------------------------//
+// Returns a trampoline slot, preferring one that jmp rel32 at target can
+// reach. Slots are never freed as hooks are never removed.
+static PUCHAR AllocateTrampolineSlot(const void* target)
+{
+	AcquireSRWLockExclusive(&g_TrampolineLock);
+
+	TrampolineChunk* found = NULL;
+	TrampolineChunk* fallback = NULL;
+	for (auto& chunk : g_TrampolineChunks)
+	{
+		if (chunk.UsedSize + kTrampolineSlotSize > kTrampolineChunkSize)
+		{
+			continue;
+		}
+		if (IsReachableByRel32(target, chunk.Base + chunk.UsedSize))
+		{
+			found = &chunk;
+			break;
+		}
+		fallback = &chunk;
+	}
+
+	if (!found)
+	{
+		auto base = AllocateChunkNear(target);
+		if (base)
+		{
+			g_TrampolineChunks.push_back({ base, 0 });
+			found = &g_TrampolineChunks.back();
+		}
+		else if (fallback)
+		{
+			found = fallback;
+		}
+		else if ((base = static_cast<PUCHAR>(VirtualAlloc(NULL, kTrampolineChunkSize,
+			MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READWRITE))) != NULL)
+		{
+			g_TrampolineChunks.push_back({ base, 0 });
+			found = &g_TrampolineChunks.back();
+		}
+	}
+
+	PUCHAR slot = NULL;
+	if (found)
+	{
+		slot = found->Base + found->UsedSize;
+		found->UsedSize += kTrampolineSlotSize;
+	}
+	ReleaseSRWLockExclusive(&g_TrampolineLock);
+	return slot;
+}
+
+//-------------------------------------------------------------------------//
+// Returns a size of whole instructions at address covering at least size
+// bytes, or 0 when any of them cannot be decoded
+static SIZE_T GetStolenSize(PVOID address, SIZE_T size)
+{
+	SIZE_T stolenSize = 0;
+	while (stolenSize < size)
+	{
+		const auto instSize = GetInstructionSize(static_cast<PUCHAR>(address) + stolenSize);
+		if (!instSize)
+		{
+			return 0;
+		}
+		stolenSize += instSize;
+	}
+	return stolenSize;
+}
+
 //------------------------------------------//
+// Builds a trampoline for hooking HookAddress to HookHandler, and bytes to
+// overwrite HookAddress with into Patch. HookAddress is not modified. When a
+// trampoline slot is within 2 GB of HookAddress, the hook is jmp rel32 to a
+// relay in the slot, and otherwise it is TrampolineCode jumping to HookHandler
+// directly. The slot then holds instructions overwritten by the hook followed
+// by a jump back, which HookObject->JmpToOrg points to.
 EXTERN_C
-BOOLEAN 
-__stdcall
-SetupInlineHook_X64(
-	_Inout_ PHOOKOBJ* HookObject,
+BOOLEAN
+PrepareInlineHook(
+	_Out_ PHOOKOBJ* HookObject,
 	_In_ PVOID HookAddress,
-	_In_ PVOID HookHandler)
-{	
-	int				InstSize = 0;
-	BOOLEAN			ret = FALSE;
+	_In_ PVOID HookHandler,
+	_Out_ PHOOKPATCH Patch)
+{
+	SIZE_T			InstSize = 0;
+	SIZE_T			PatchSize = 0;
 	PHOOKOBJ		pObj = NULL;
-	PLATFORMDESC	desc = {};
-	ULONG			oldProtect = 0; 
+	PUCHAR			slot = NULL;
+	PUCHAR			jmpToOrg = NULL;
+	PUCHAR			jmpBack = NULL;
 	TrampolineCode	trampolineCode = { 0 };
 
 	if (!HookAddress || !HookHandler)
 	{
 		return FALSE;
 	}
-	pObj = (PHOOKOBJ)VirtualAlloc(NULL, sizeof(HOOKOBJ), MEM_COMMIT, PAGE_EXECUTE_READWRITE); 
-	if (!pObj)
+
+	// Decode a minimum first so that a slot is not taken for undecodable code
+	InstSize = GetStolenSize(HookAddress, kRel32JumpSize);
+	if (!InstSize)
 	{
 		return FALSE;
-	} 
+	}
 
-	while (InstSize < 15)
+	slot = AllocateTrampolineSlot(HookAddress);
+	if (!slot)
 	{
-		InstSize += GetInstructionSize(HookAddress);
-	} 
-	if (!InstSize)
+		return FALSE;
+	}
+	const auto isNear = IsReachableByRel32(HookAddress, slot);
+	PatchSize = isNear ? kRel32JumpSize : sizeof(TrampolineCode);
+	InstSize = GetStolenSize(HookAddress, PatchSize);
+	if (!InstSize || InstSize > sizeof(Patch->Bytes))
 	{
-		RtlFreeMemory(pObj);
 		return FALSE;
 	}
 
-	pObj->JmpToOrg = VirtualAlloc(NULL, InstSize + sizeof(TrampolineCode), MEM_COMMIT, PAGE_EXECUTE_READWRITE);
-	if (!pObj->JmpToOrg)
+	pObj = static_cast<PHOOKOBJ>(HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(HOOKOBJ)));
+	if (!pObj)
 	{
-		RtlFreeMemory(pObj);
 		return FALSE;
 	}
-	
-	trampolineCode = MakeTrampolineCode((PUCHAR)HookAddress + InstSize);
-	
-	RtlCopyMemory(pObj->JmpToOrg, HookAddress, InstSize);
-	RtlCopyMemory((PUCHAR)pObj->JmpToOrg + InstSize, &trampolineCode, sizeof(TrampolineCode));
+	pObj->JmpToHandler = MakeTrampolineCode(HookHandler);
 
-	VirtualProtect(HookAddress, 4096, PAGE_EXECUTE_READWRITE, &oldProtect);
+	// A slot is [relay to HookHandler (near only)][stolen instructions][jump back]
+	jmpToOrg = isNear ? slot + sizeof(TrampolineCode) : slot;
+	if (isNear)
+	{
+		RtlCopyMemory(slot, &pObj->JmpToHandler, sizeof(TrampolineCode));
+	}
+	RtlCopyMemory(jmpToOrg, HookAddress, InstSize);
+	jmpBack = jmpToOrg + InstSize;
+	if (IsReachableByRel32(jmpBack, (PUCHAR)HookAddress + InstSize))
+	{
+		WriteRel32Jump(jmpBack, (PUCHAR)HookAddress + InstSize);
+	}
+	else
+	{
+		trampolineCode = MakeTrampolineCode((PUCHAR)HookAddress + InstSize);
+		RtlCopyMemory(jmpBack, &trampolineCode, sizeof(TrampolineCode));
+	}
+	FlushInstructionCache(GetCurrentProcess(), slot, kTrampolineSlotSize);
+	pObj->JmpToOrg = jmpToOrg;
+	pObj->HookAddress = HookAddress;
 
-	// Set hook
-	trampolineCode = MakeTrampolineCode(HookHandler);
- 
-//	CHAR breakpoint = 0xCC;
-	RtlCopyMemory(HookAddress, &trampolineCode, InstSize);
-//	RtlCopyMemory(HookAddress, &breakpoint , InstSize);
+	// The hook, followed by nops padding the rest of the last instruction
+	Patch->Address = static_cast<PUCHAR>(HookAddress);
+	Patch->Size = InstSize;
+	if (isNear)
+	{
+		WriteRel32Jump(Patch->Bytes, slot);
+	}
+	else
+	{
+		RtlCopyMemory(Patch->Bytes, &pObj->JmpToHandler, sizeof(TrampolineCode));
+	}
+	memset(Patch->Bytes + PatchSize, 0x90, InstSize - PatchSize);
 
-	if (InstSize > 15)
+	*HookObject = pObj;
+	return TRUE;
+}
+
+//------------------------------------------//
+// Frees a hook object prepared but not installed. Its trampoline slot is not
+// reused.
+EXTERN_C
+void
+DiscardInlineHook(
+	_In_ PHOOKOBJ HookObject)
+{
+	HeapFree(GetProcessHeap(), 0, HookObject);
+}
+
+//------------------------------------------//
+// Writes Patch. The caller makes the code writable and flushes the instruction
+// cache.
+EXTERN_C
+void
+ApplyInlineHookPatch(
+	_In_ const HOOKPATCH* Patch)
+{
+	RtlCopyMemory(Patch->Address, Patch->Bytes, Patch->Size);
+}
+
+//------------------------------------------//
+// Hooks HookAddress to HookHandler
+EXTERN_C
+BOOLEAN 
+__stdcall
+SetupInlineHook_X64(
+	_Inout_ PHOOKOBJ* HookObject,
+	_In_ PVOID HookAddress,
+	_In_ PVOID HookHandler)
+{	
+	PHOOKOBJ		pObj = NULL;
+	HOOKPATCH		patch = {};
+	ULONG			oldProtect = 0; 
+
+	if (!PrepareInlineHook(&pObj, HookAddress, HookHandler, &patch))
 	{
-		memcpy(HookAddress, (PUCHAR)0x90, InstSize - 15);
-		OutputDebugString(L"Over 15 inst len \r\n");
+		return FALSE;
 	}
 
-	VirtualProtect(HookAddress, 4096, oldProtect, &oldProtect);
+	VirtualProtect(HookAddress, 4096, PAGE_EXECUTE_READWRITE, &oldProtect);
 
-	pObj->HookAddress = HookAddress;
+	// Set hook
+	ApplyInlineHookPatch(&patch);
+
+	VirtualProtect(HookAddress, 4096, oldProtect, &oldProtect);
+	FlushInstructionCache(GetCurrentProcess(), HookAddress, patch.Size);
 
 	*HookObject = pObj;
 
 	OutputDebugString(L"Finish hook \r\n");
 
-	return ret;
-} 
\ No newline at end of file
+	return TRUE;
+}
@@ -32,6 +32,29 @@ typedef struct _HOOK_OBJ
 #endif
 }HOOKOBJ, *PHOOKOBJ;
 
+// Bytes written over hooked code, prepared before any of them is written
+typedef struct _HOOK_PATCH
+{
+	PUCHAR				Address;
+	SIZE_T				Size;
+	UCHAR				Bytes[32];
+}HOOKPATCH, *PHOOKPATCH;
+
+EXTERN_C
+BOOLEAN PrepareInlineHook(
+	_Out_ PHOOKOBJ* HookObject,
+	_In_ PVOID HookAddress,
+	_In_ PVOID HookHandler,
+	_Out_ PHOOKPATCH Patch);
+
+EXTERN_C
+void DiscardInlineHook(
+	_In_ PHOOKOBJ HookObject);
+
+EXTERN_C
+void ApplyInlineHookPatch(
+	_In_ const HOOKPATCH* Patch);
+
 EXTERN_C
 BOOLEAN SetupInlineHook_X64(
 	_Inout_ PHOOKOBJ* HookObject,
@@ -0,0 +1,289 @@
+#include "stdafx.h"
+#include "IOCTL.h"
+#include "cDrvCtrl.h"
+#include "Hook.h"
+#include <winternl.h>
+#include <vector>
+#include <algorithm>
+#include <new>
+
+#define TRANSACTION_PAGE_SIZE		0x1000
+#define TRANSACTION_PAGE_ALIGN(Va)	((ULONG_PTR)(Va) & ~(ULONG_PTR)(TRANSACTION_PAGE_SIZE - 1))
+
+// A hook added to a transaction
+struct HookRequest
+{
+	PHOOKOBJ*	HookObject;
+	PVOID		HookAddress;
+	PVOID		HookHandler;
+};
+
+// Hooks installed together by CommitHookTransaction()
+struct HookTransaction
+{
+	std::vector<HookRequest> Requests;
+};
+
+// Defined in VTxRing3Dlg.cpp
+BOOL WipeCopyOnWrite(PVOID Address, SIZE_T Length);
+
+// A range whose protection is changed to write hooks
+struct ProtectedRange
+{
+	ULONG_PTR	Base;
+	SIZE_T		Size;
+	ULONG		OldProtect;
+};
+
+//-------------------------------------------------------------------------------------------------------//
+// Returns runs of consecutive pages that patches overlap with
+static std::vector<HIDE_BULK_ENTRY> GetPatchedPageRuns(const std::vector<HOOKPATCH>& patches)
+{
+	std::vector<ULONG_PTR> pages;
+	for (const auto& patch : patches)
+	{
+		const auto last = TRANSACTION_PAGE_ALIGN(patch.Address + patch.Size - 1);
+		for (auto page = TRANSACTION_PAGE_ALIGN(patch.Address); page <= last; page += TRANSACTION_PAGE_SIZE)
+		{
+			pages.push_back(page);
+		}
+	}
+	std::sort(pages.begin(), pages.end());
+	pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+
+	std::vector<HIDE_BULK_ENTRY> runs;
+	for (const auto page : pages)
+	{
+		if (!runs.empty() && runs.back().Address + runs.back().Length == page)
+		{
+			runs.back().Length += TRANSACTION_PAGE_SIZE;
+			continue;
+		}
+		runs.push_back({ GetCurrentProcessId(), page, TRANSACTION_PAGE_SIZE, HIDE_FLAG_SKIP_PRIVATE });
+	}
+	return runs;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Hides runs with a single IOCTL_HIDE_ADD_BULK, and fills statuses for each run
+static BOOL HidePageRunsOnce(cDrvCtrl& session, std::vector<HIDE_BULK_ENTRY>& runs, std::vector<NTSTATUS>* statuses)
+{
+	DWORD returned = 0;
+	statuses->assign(runs.size(), -1);
+	const auto statusesSize = static_cast<DWORD>(statuses->size() * sizeof(NTSTATUS));
+	if (!session.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD_BULK,
+		runs.data(), static_cast<DWORD>(runs.size() * sizeof(HIDE_BULK_ENTRY)),
+		statuses->data(), statusesSize, &returned) || returned != statusesSize)
+	{
+		OutputDebugStringA("IOCTL_HIDE_ADD_BULK Failed \r\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Hides all runs with a single IOCTL_HIDE_ADD_BULK, and then starts hiding once.
+// Runs with read-only pages the driver cannot make private on Windows 7 are
+// made private here and hidden with another request.
+static BOOL HidePageRuns(std::vector<HIDE_BULK_ENTRY>& runs)
+{
+	cDrvCtrl session;
+	DWORD returned = 0;
+	std::vector<NTSTATUS> statuses;
+	if (!HidePageRunsOnce(session, runs, &statuses))
+	{
+		return FALSE;
+	}
+
+	std::vector<HIDE_BULK_ENTRY> retries;
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		if (statuses[i] == HIDE_STATUS_NOT_SUPPORTED &&
+			WipeCopyOnWrite(reinterpret_cast<PVOID>(runs[i].Address), static_cast<SIZE_T>(runs[i].Length)))
+		{
+			retries.push_back(runs[i]);
+		}
+		else if (statuses[i] < 0)
+		{
+			OutputDebugStringA("IOCTL_HIDE_ADD_BULK Failed on some pages \r\n");
+			return FALSE;
+		}
+	}
+	if (!retries.empty() && !HidePageRunsOnce(session, retries, &statuses))
+	{
+		return FALSE;
+	}
+	if (!retries.empty() && std::any_of(statuses.cbegin(), statuses.cend(), [](NTSTATUS status) { return status < 0; }))
+	{
+		OutputDebugStringA("IOCTL_HIDE_ADD_BULK Failed on some pages \r\n");
+		return FALSE;
+	}
+	if (!session.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_START, NULL, 0, NULL, 0, &returned))
+	{
+		OutputDebugStringA("IOCTL_HIDE_START Failed \r\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Makes runs writable. Each run is split where its protection changes so that
+// the original protection of every page can be restored.
+static BOOL UnprotectPageRuns(const std::vector<HIDE_BULK_ENTRY>& runs, std::vector<ProtectedRange>* ranges)
+{
+	for (const auto& run : runs)
+	{
+		const auto end = static_cast<ULONG_PTR>(run.Address + run.Length);
+		for (auto base = static_cast<ULONG_PTR>(run.Address); base < end;)
+		{
+			MEMORY_BASIC_INFORMATION mbi = {};
+			if (!VirtualQuery(reinterpret_cast<void*>(base), &mbi, sizeof(mbi)))
+			{
+				return FALSE;
+			}
+			const auto regionEnd = reinterpret_cast<ULONG_PTR>(mbi.BaseAddress) + mbi.RegionSize;
+			ProtectedRange range = { base, min(regionEnd, end) - base, 0 };
+			if (!VirtualProtect(reinterpret_cast<void*>(range.Base), range.Size, PAGE_EXECUTE_READWRITE, &range.OldProtect))
+			{
+				return FALSE;
+			}
+			ranges->push_back(range);
+			base += range.Size;
+		}
+	}
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+static void RestorePageRuns(const std::vector<ProtectedRange>& ranges)
+{
+	for (const auto& range : ranges)
+	{
+		ULONG oldProtect = 0;
+		VirtualProtect(reinterpret_cast<void*>(range.Base), range.Size, range.OldProtect, &oldProtect);
+		FlushInstructionCache(GetCurrentProcess(), reinterpret_cast<void*>(range.Base), range.Size);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Returns true when any patches overlap. They would overwrite each other's
+// instructions copied into trampolines.
+static BOOL ArePatchesOverlapping(std::vector<HOOKPATCH> patches)
+{
+	std::sort(patches.begin(), patches.end(), [](const HOOKPATCH& lhs, const HOOKPATCH& rhs) {
+		return lhs.Address < rhs.Address;
+	});
+	for (size_t i = 1; i < patches.size(); i++)
+	{
+		if (patches[i - 1].Address + patches[i - 1].Size > patches[i].Address)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Prepares, hides and writes all hooks of a transaction. Objects receives hook
+// objects prepared so far even on failure.
+static BOOL InstallHooks(const HookTransaction& transaction, std::vector<PHOOKOBJ>* objects)
+{
+	std::vector<HOOKPATCH> patches;
+	for (const auto& request : transaction.Requests)
+	{
+		PHOOKOBJ object = NULL;
+		HOOKPATCH patch = {};
+		if (!PrepareInlineHook(&object, request.HookAddress, request.HookHandler, &patch))
+		{
+			OutputDebugStringA("PrepareInlineHook Failed \r\n");
+			return FALSE;
+		}
+		objects->push_back(object);
+		patches.push_back(patch);
+	}
+	if (ArePatchesOverlapping(patches))
+	{
+		OutputDebugStringA("Hooks overlap \r\n");
+		return FALSE;
+	}
+
+	auto runs = GetPatchedPageRuns(patches);
+	if (!runs.empty() && !HidePageRuns(runs))
+	{
+		return FALSE;
+	}
+
+	std::vector<ProtectedRange> ranges;
+	const auto unprotected = UnprotectPageRuns(runs, &ranges);
+	if (unprotected)
+	{
+		for (const auto& patch : patches)
+		{
+			ApplyInlineHookPatch(&patch);
+		}
+	}
+	else
+	{
+		OutputDebugStringA("VirtualProtect Failed \r\n");
+	}
+	RestorePageRuns(ranges);
+	return unprotected;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Starts a transaction to install many hooks at once. Returns NULL on failure.
+EXTERN_C PVOID __stdcall BeginHookTransaction()
+{
+	return new (std::nothrow) HookTransaction();
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Adds a hook to a transaction. HookObject receives a hook object when the
+// transaction is committed.
+EXTERN_C BOOLEAN __stdcall AddHookToTransaction(PVOID Transaction, PHOOKOBJ* HookObject, PVOID HookAddress, PVOID HookHandler)
+{
+	if (!Transaction || !HookObject || !HookAddress || !HookHandler)
+	{
+		return FALSE;
+	}
+	static_cast<HookTransaction*>(Transaction)->Requests.push_back({ HookObject, HookAddress, HookHandler });
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Discards a transaction without installing any of its hooks
+EXTERN_C void __stdcall AbortHookTransaction(PVOID Transaction)
+{
+	delete static_cast<HookTransaction*>(Transaction);
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Installs all hooks of a transaction, and frees the transaction. Trampolines
+// are built first, and then all pages to be patched are hidden with a single
+// IOCTL_HIDE_ADD_BULK and IOCTL_HIDE_START. Protection is changed once per
+// range of pages rather than per hook. No hook is installed when any of them
+// cannot be prepared or when hiding fails.
+EXTERN_C BOOLEAN __stdcall CommitHookTransaction(PVOID Transaction)
+{
+	const auto transaction = static_cast<HookTransaction*>(Transaction);
+	if (!transaction)
+	{
+		return FALSE;
+	}
+
+	std::vector<PHOOKOBJ> objects;
+	const auto succeeded = InstallHooks(*transaction, &objects);
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		if (succeeded)
+		{
+			*transaction->Requests[i].HookObject = objects[i];
+		}
+		else
+		{
+			DiscardInlineHook(objects[i]);
+		}
+	}
+	delete transaction;
+	return succeeded ? TRUE : FALSE;
+}
@@ -10,4 +10,53 @@
 
 #define IOCTL_HIDE_ADD				CTL_CODE_HIDE(1)			//ʼ
 #define IOCTL_HIDE_START			CTL_CODE_HIDE(2)			//ʼ
-#define IOCTL_HIDE_STOP				CTL_CODE_HIDE(3)			//ʼ
\ No newline at end of file
+#define IOCTL_HIDE_STOP				CTL_CODE_HIDE(3)			//ʼ
+#define IOCTL_TRACE_MAP				CTL_CODE_HIDE(4)			//Maps VM-exit trace rings
+#define IOCTL_TRACE_UNMAP			CTL_CODE_HIDE(5)			//Unmaps VM-exit trace rings
+#define IOCTL_STATS_SNAPSHOT		CTL_CODE_HIDE(6)			//Takes a statistics snapshot
+#define IOCTL_HIDE_ADD_BULK			CTL_CODE_HIDE(7)			//Hides HIDE_BULK_ENTRY[], returns NTSTATUS[]
+#define IOCTL_HIDE_POLICY_LOAD		CTL_CODE_HIDE(8)			//Replaces a policy with HIDE_POLICY_ENTRY[]
+#define IOCTL_PING					CTL_CODE_HIDE(9)			//Does nothing; measures a round trip
+
+// Pages are made private to the process before they are hidden so that other
+// processes sharing them are not affected. This flag skips pages that are
+// already private instead of writing to them again. It is given as
+// TRANSFERIOCTL::HiddenType for IOCTL_HIDE_ADD.
+//
+// Windows 7 does not export ZwProtectVirtualMemory, so the driver cannot make
+// a read-only page private there. Such a page fails with STATUS_NOT_SUPPORTED
+// unless the caller has already made it private, e.g. by writing to it with
+// WriteProcessMemory(), in which case the request can be retried.
+#define HIDE_FLAG_SKIP_PRIVATE		0x1
+
+// STATUS_NOT_SUPPORTED, which <windows.h> does not define
+#define HIDE_STATUS_NOT_SUPPORTED	((LONG)0xC00000BBL)
+
+// An entry of IOCTL_HIDE_ADD_BULK. All pages overlapping with
+// [Address, Address + Length) of the process are hidden.
+typedef struct _HIDE_BULK_ENTRY
+{
+	ULONG64 ProcID;
+	ULONG64 Address;
+	ULONG64 Length;
+	ULONG64 Flags;		//HIDE_FLAG_*
+}HIDE_BULK_ENTRY, *PHIDE_BULK_ENTRY;
+
+// Kinds of a range of HIDE_POLICY_ENTRY
+#define HIDE_POLICY_SECTION			0		//The whole section named Name
+#define HIDE_POLICY_EXPORT			1		//[export Name + Offset, + Length)
+#define HIDE_POLICY_RANGE			2		//[module base + Offset, + Length)
+
+// An entry of IOCTL_HIDE_POLICY_LOAD. When a module named ModuleName is loaded
+// into a process named ImageName, the range of the module is hidden before
+// any code of the module runs. Not supported before Windows 8.
+typedef struct _HIDE_POLICY_ENTRY
+{
+	CHAR	ImageName[16];		//As PsGetProcessImageFileName(), e.g. "notepad.exe"
+	WCHAR	ModuleName[64];		//A file name, e.g. L"ntdll.dll"
+	CHAR	Name[64];			//A section or export name
+	ULONG64	Kind;				//HIDE_POLICY_*
+	ULONG64	Offset;
+	ULONG64	Length;
+	ULONG64	Flags;				//HIDE_FLAG_*
+}HIDE_POLICY_ENTRY, *PHIDE_POLICY_ENTRY;
\ No newline at end of file
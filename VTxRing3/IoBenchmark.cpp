@@ -0,0 +1,122 @@
+#include "stdafx.h"
+#include "IOCTL.h"
+#include "cDrvCtrl.h"
+#include <stdio.h>
+
+//-------------------------------------------------------------------------------------------------------//
+// Returns requests per second for the interval measured by QueryPerformanceCounter()
+static double GetRequestsPerSecond(DWORD requests, LONGLONG start, LONGLONG end)
+{
+	LARGE_INTEGER frequency = {};
+	QueryPerformanceFrequency(&frequency);
+	return (end > start) ? requests * static_cast<double>(frequency.QuadPart) / (end - start) : 0.0;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+static LONGLONG GetCounter()
+{
+	LARGE_INTEGER counter = {};
+	QueryPerformanceCounter(&counter);
+	return counter.QuadPart;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Issues IOCTL_PING opening and closing the device for each request
+static BOOL BenchmarkOpenPerRequest(DWORD requests, double* rate)
+{
+	const auto start = GetCounter();
+	for (DWORD i = 0; i < requests; i++)
+	{
+		HANDLE device = CreateFileA("\\\\.\\NoTruth", GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+		if (device == INVALID_HANDLE_VALUE)
+		{
+			return FALSE;
+		}
+		DWORD returned = 0;
+		const auto succeeded = DeviceIoControl(device, IOCTL_PING, NULL, 0, NULL, 0, &returned, NULL);
+		CloseHandle(device);
+		if (!succeeded)
+		{
+			return FALSE;
+		}
+	}
+	*rate = GetRequestsPerSecond(requests, start, GetCounter());
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Issues IOCTL_PING one by one through a session
+static BOOL BenchmarkSession(cDrvCtrl& session, DWORD requests, double* rate)
+{
+	const auto start = GetCounter();
+	for (DWORD i = 0; i < requests; i++)
+	{
+		DWORD returned = 0;
+		if (!session.IoControl("\\\\.\\NoTruth", IOCTL_PING, NULL, 0, NULL, 0, &returned))
+		{
+			return FALSE;
+		}
+	}
+	*rate = GetRequestsPerSecond(requests, start, GetCounter());
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Issues IOCTL_PING through a session keeping up to depth requests outstanding
+static BOOL BenchmarkPipeline(cDrvCtrl& session, DWORD requests, DWORD depth, double* rate)
+{
+	DWORD issued = 0;
+	DWORD completed = 0;
+	const auto start = GetCounter();
+	while (completed < requests)
+	{
+		while (issued < requests && session.GetPendingCount() < depth)
+		{
+			if (!session.IoControlAsync(IOCTL_PING, NULL, 0, NULL, 0, issued))
+			{
+				return FALSE;
+			}
+			issued++;
+		}
+
+		DWORD error = ERROR_SUCCESS;
+		if (!session.WaitIoControl(NULL, NULL, &error, INFINITE) || error != ERROR_SUCCESS)
+		{
+			return FALSE;
+		}
+		completed++;
+	}
+	*rate = GetRequestsPerSecond(requests, start, GetCounter());
+	return TRUE;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Measures how many requests per second reach the driver when the device is
+// opened for each request as cDrvCtrl used to, when it is kept open by a
+// session, and when up to depth requests are outstanding. IOCTL_PING is used
+// so that the cost of the round trip itself is measured.
+EXTERN_C BOOLEAN __stdcall BenchmarkIoControl(DWORD requests, DWORD depth)
+{
+	if (!requests || !depth)
+	{
+		return FALSE;
+	}
+
+	cDrvCtrl session;
+	double open_rate = 0.0;
+	double session_rate = 0.0;
+	double pipeline_rate = 0.0;
+	if (!BenchmarkOpenPerRequest(requests, &open_rate) ||
+		!BenchmarkSession(session, requests, &session_rate) ||
+		!BenchmarkPipeline(session, requests, depth, &pipeline_rate))
+	{
+		printf("BenchmarkIoControl: IOCTL_PING failed (%lu) \r\n", GetLastError());
+		return FALSE;
+	}
+
+	printf("%-32s %14s \r\n", "IOCTL_PING", "Requests/s");
+	printf("%-32s %14.0f \r\n", "Open per request", open_rate);
+	printf("%-32s %14.0f \r\n", "Session", session_rate);
+	printf("Session, %-5lu outstanding      %14.0f \r\n", depth, pipeline_rate);
+	return TRUE;
+}
@@ -0,0 +1,390 @@
+#include "LengthDecoder.h"
+
+// Properties of an opcode relevant to its length
+enum : unsigned short
+{
+	N = 0x0000,		// No operand bytes
+	M = 0x0001,		// ModR/M (and SIB and displacement)
+	B = 0x0002,		// imm8
+	W = 0x0004,		// imm16
+	Z = 0x0008,		// imm16 or imm32 by an operand size
+	V = 0x0010,		// imm16, imm32 or imm64 by an operand size
+	O = 0x0020,		// moffs by an address size
+	F = 0x0040,		// ptr16:16 or ptr16:32
+	R = 0x0080,		// rel16 or rel32; vendors disagree with 66 in 64-bit
+	G = 0x0100,		// The immediate only exists when ModR/M.reg is 0 or 1
+	C = 0x0200,		// ModR/M always specifies registers (mov cr/dr)
+	L = 0x0400,		// Invalid in 64-bit mode
+	X = 0x0800,		// Invalid or not handled; needs a disassembler
+};
+
+// Opcodes without the 0F escape. Prefixes, REX, VEX, EVEX and XOP are handled
+// before this table is looked up.
+static const unsigned short kOneByteTable[256] =
+{
+	//0    1    2    3    4    5    6    7    8    9    A    B    C    D    E    F
+	M,   M,   M,   M,   B,   Z,   L,   L,   M,   M,   M,   M,   B,   Z,   L,   X,		// 0
+	M,   M,   M,   M,   B,   Z,   L,   L,   M,   M,   M,   M,   B,   Z,   L,   L,		// 1
+	M,   M,   M,   M,   B,   Z,   X,   L,   M,   M,   M,   M,   B,   Z,   X,   L,		// 2
+	M,   M,   M,   M,   B,   Z,   X,   L,   M,   M,   M,   M,   B,   Z,   X,   L,		// 3
+	N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,		// 4
+	N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   N,		// 5
+	L,   L,   M|L, M,   X,   X,   X,   X,   Z,   M|Z, B,   M|B, N,   N,   N,   N,		// 6
+	B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,   B,		// 7
+	M|B, M|Z, M|B|L, M|B, M, M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 8
+	N,   N,   N,   N,   N,   N,   N,   N,   N,   N,   F|L, N,   N,   N,   N,   N,		// 9
+	O,   O,   O,   O,   N,   N,   N,   N,   B,   Z,   N,   N,   N,   N,   N,   N,		// A
+	B,   B,   B,   B,   B,   B,   B,   B,   V,   V,   V,   V,   V,   V,   V,   V,		// B
+	M|B, M|B, W,   N,   M|L, M|L, M|B, M|Z, W|B, N,   W,   N,   N,   B,   L,   N,		// C
+	M,   M,   M,   M,   B|L, B|L, X,   N,   M,   M,   M,   M,   M,   M,   M,   M,		// D
+	B,   B,   B,   B,   B,   B,   B,   B,   R,   R,   F|L, B,   N,   N,   N,   N,		// E
+	X,   N,   X,   X,   N,   N,   M|G|B, M|G|Z, N, N, N,   N,   N,   N,   M,   M,		// F
+};
+
+// Opcodes following 0F. 0F 38 and 0F 3A are handled separately.
+static const unsigned short kTwoByteTable[256] =
+{
+	//0    1    2    3    4    5    6    7    8    9    A    B    C    D    E    F
+	M,   M,   M,   M,   X,   N,   N,   N,   N,   N,   X,   N,   X,   M,   N,   M|B,	// 0
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 1
+	C,   C,   C,   C,   X,   X,   X,   X,   M,   M,   M,   M,   M,   M,   M,   M,		// 2
+	N,   N,   N,   N,   N,   N,   X,   N,   X,   X,   X,   X,   X,   X,   X,   X,		// 3
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 4
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 5
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 6
+	M|B, M|B, M|B, M|B, M,   M,   M,   N,   M,   M,   X,   X,   M,   M,   M,   M,		// 7
+	R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,   R,		// 8
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// 9
+	N,   N,   N,   M,   M|B, M,   X,   X,   N,   N,   N,   M,   M|B, M,   M,   M,		// A
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   X,   M|B, M,   M,   M,   M,   M,		// B
+	M,   M,   M|B, M,   M|B, M|B, M|B, M,   N,   N,   N,   N,   N,   N,   N,   N,		// C
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// D
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,		// E
+	M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   M,   X,		// F
+};
+
+// Decoding state shared by helpers
+struct DecodeContext
+{
+	const unsigned char* code;
+	size_t size;
+	size_t offset;
+	bool is_64bit;
+	bool operand_size_prefix;
+	bool address_size_prefix;
+	bool rep_prefix;
+	bool repne_prefix;
+	bool rex_w;
+};
+
+//-------------------------------------------------------------------------------------------------------//
+static bool IsLegacyPrefix(unsigned char byte)
+{
+	switch (byte)
+	{
+	case 0x26: case 0x2e: case 0x36: case 0x3e: case 0x64: case 0x65:
+	case 0x66: case 0x67: case 0xf0: case 0xf2: case 0xf3:
+		return true;
+	default:
+		return false;
+	}
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Skips ModR/M and following SIB and displacement
+static bool SkipModrm(DecodeContext* context, bool registers_only)
+{
+	if (context->offset >= context->size)
+	{
+		return false;
+	}
+	const auto modrm = context->code[context->offset++];
+	const auto mod = modrm >> 6;
+	const auto rm = modrm & 7;
+	if (mod == 3 || registers_only)
+	{
+		return true;
+	}
+
+	size_t displacement = 0;
+	if (!context->is_64bit && context->address_size_prefix)
+	{
+		// 16-bit addressing has no SIB
+		if (mod == 0 && rm == 6)
+		{
+			displacement = 2;
+		}
+		else
+		{
+			displacement = (mod == 1) ? 1 : (mod == 2) ? 2 : 0;
+		}
+	}
+	else
+	{
+		if (rm == 4)
+		{
+			if (context->offset >= context->size)
+			{
+				return false;
+			}
+			const auto sib = context->code[context->offset++];
+			if (mod == 0 && (sib & 7) == 5)
+			{
+				displacement = 4;
+			}
+		}
+		else if (mod == 0 && rm == 5)
+		{
+			displacement = 4;
+		}
+		if (mod == 1)
+		{
+			displacement = 1;
+		}
+		else if (mod == 2)
+		{
+			displacement = 4;
+		}
+	}
+	context->offset += displacement;
+	return true;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Decodes an instruction with VEX, EVEX or XOP whose payload is payload_size
+// bytes and whose opcode map is map
+static size_t DecodeExtendedOpcode(DecodeContext* context, size_t payload_size, unsigned map, bool is_xop)
+{
+	context->offset += payload_size;
+	if (context->offset >= context->size)
+	{
+		return 0;
+	}
+	const auto opcode = context->code[context->offset++];
+
+	size_t immediate = 0;
+	if (is_xop)
+	{
+		if (map == 8)
+		{
+			immediate = 1;
+		}
+		else if (map == 0xa)
+		{
+			immediate = 4;
+		}
+		else if (map != 9)
+		{
+			return 0;
+		}
+	}
+	else if (map == 1)
+	{
+		// vzeroupper and vzeroall have no ModR/M. EVEX has a 3-byte payload.
+		if (opcode == 0x77 && payload_size < 3)
+		{
+			return context->offset;
+		}
+		immediate = (kTwoByteTable[opcode] & B) ? 1 : 0;
+	}
+	else if (map == 3)
+	{
+		immediate = 1;
+	}
+	else if (map != 2)
+	{
+		return 0;
+	}
+
+	if (!SkipModrm(context, false))
+	{
+		return 0;
+	}
+	context->offset += immediate;
+	return (context->offset <= context->size) ? context->offset : 0;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+// Returns a size of an immediate operand specified by flags
+static size_t GetImmediateSize(const DecodeContext* context, unsigned short flags, unsigned char modrm)
+{
+	const size_t operand_size = context->rex_w ? 8 : context->operand_size_prefix ? 2 : 4;
+	size_t size = 0;
+	if (flags & G)
+	{
+		// Only test (F6 /0, F7 /0 and /1) has an immediate in the group
+		if (((modrm >> 3) & 7) > 1)
+		{
+			return 0;
+		}
+	}
+	if (flags & B)
+	{
+		size += 1;
+	}
+	if (flags & W)
+	{
+		size += 2;
+	}
+	if (flags & (Z | R))
+	{
+		size += (operand_size == 2) ? 2 : 4;
+	}
+	if (flags & V)
+	{
+		size += operand_size;
+	}
+	if (flags & O)
+	{
+		size += context->is_64bit
+			? (context->address_size_prefix ? 4 : 8)
+			: (context->address_size_prefix ? 2 : 4);
+	}
+	if (flags & F)
+	{
+		size += context->operand_size_prefix ? 4 : 6;
+	}
+	return size;
+}
+
+//-------------------------------------------------------------------------------------------------------//
+size_t DecodeInstructionLength(
+	const unsigned char* code,
+	size_t size,
+	bool is_64bit)
+{
+	DecodeContext context = {};
+	context.code = code;
+	context.size = (size < kMaxInstructionLength) ? size : kMaxInstructionLength;
+	context.is_64bit = is_64bit;
+
+	// Legacy prefixes and REX. REX is ignored unless it immediately precedes
+	// an opcode.
+	unsigned char rex = 0;
+	for (;; context.offset++)
+	{
+		if (context.offset >= context.size)
+		{
+			return 0;
+		}
+		const auto byte = code[context.offset];
+		if (IsLegacyPrefix(byte))
+		{
+			context.operand_size_prefix |= (byte == 0x66);
+			context.address_size_prefix |= (byte == 0x67);
+			context.rep_prefix |= (byte == 0xf3);
+			context.repne_prefix |= (byte == 0xf2);
+			rex = 0;
+		}
+		else if (is_64bit && (byte & 0xf0) == 0x40)
+		{
+			rex = byte;
+		}
+		else
+		{
+			break;
+		}
+	}
+	context.rex_w = (rex & 8) != 0;
+
+	const auto opcode = code[context.offset++];
+	const auto has_next = context.offset < context.size;
+	const unsigned char next = has_next ? code[context.offset] : 0;
+
+	// Disassemblers disagree on whether fwait belongs to a following x87
+	// instruction, e.g. fstsw
+	if (opcode == 0x9b && has_next && (next & 0xf8) == 0xd8)
+	{
+		return 0;
+	}
+
+	// VEX, EVEX and XOP. Outside 64-bit mode, C4, C5 and 62 are LES, LDS and
+	// BOUND unless the next byte looks like a register operand.
+	const auto extended = is_64bit || (next & 0xc0) == 0xc0;
+	if (opcode == 0xc5 && extended)
+	{
+		return DecodeExtendedOpcode(&context, 1, 1, false);
+	}
+	if (opcode == 0xc4 && extended)
+	{
+		return has_next ? DecodeExtendedOpcode(&context, 2, next & 0x1f, false) : 0;
+	}
+	if (opcode == 0x62 && extended)
+	{
+		return has_next ? DecodeExtendedOpcode(&context, 3, next & 0x07, false) : 0;
+	}
+	if (opcode == 0x8f && has_next && (next & 0x38))
+	{
+		const auto map = next & 0x1f;
+		return (map >= 8) ? DecodeExtendedOpcode(&context, 2, map, true) : 0;
+	}
+
+	unsigned short flags = 0;
+	if (opcode != 0x0f)
+	{
+		flags = kOneByteTable[opcode];
+	}
+	else
+	{
+		if (!has_next)
+		{
+			return 0;
+		}
+		const auto second = code[context.offset++];
+		if (second == 0x38)
+		{
+			flags = M;
+			context.offset++;
+		}
+		else if (second == 0x3a)
+		{
+			flags = M | B;
+			context.offset++;
+		}
+		else
+		{
+			flags = kTwoByteTable[second];
+
+			// popcnt needs F3, and 66 and F2 turn vmread and vmwrite into
+			// AMD-only instructions
+			if ((second == 0xb8 && !context.rep_prefix) ||
+				((second == 0x78 || second == 0x79) &&
+				(context.operand_size_prefix || context.repne_prefix)))
+			{
+				return 0;
+			}
+		}
+		if (context.offset > context.size)
+		{
+			return 0;
+		}
+	}
+
+	if ((flags & X) || (is_64bit && (flags & L)))
+	{
+		return 0;
+	}
+
+	// Intel ignores 66 on near branches in 64-bit mode but AMD does not
+	if (is_64bit && (flags & R) && context.operand_size_prefix)
+	{
+		return 0;
+	}
+
+	unsigned char modrm = 0;
+	if (flags & (M | C))
+	{
+		if (context.offset >= context.size)
+		{
+			return 0;
+		}
+		modrm = code[context.offset];
+		if (!SkipModrm(&context, (flags & C) != 0))
+		{
+			return 0;
+		}
+	}
+
+	context.offset += GetImmediateSize(&context, flags, modrm);
+	return (context.offset <= context.size) ? context.offset : 0;
+}
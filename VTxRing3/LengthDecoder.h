@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+
+// The longest instruction allowed on x86
+static const size_t kMaxInstructionLength = 15;
+
+// Returns a length of an instruction at code, or 0 when the decoder cannot tell
+// it, e.g. it is invalid, truncated at size or depends on a vendor. Callers are
+// expected to fall back to a disassembler in that case. Only reads code and
+// does not depend on Windows so that it can be tested anywhere.
+size_t DecodeInstructionLength(
+	const unsigned char* code,
+	size_t size,
+	bool is_64bit);
@@ -264,59 +264,56 @@ DWORD FindProcessId(WCHAR*processname)
 }
 cDrvCtrl drv;
 //--------------------------------------------------------------------------------------------------------------------//
+// Makes pages in [Address, Address + Length) private to this process by writing to them. The driver
+// does it by itself except for read-only pages on Windows 7, which it fails with STATUS_NOT_SUPPORTED.
 BOOL WipeCopyOnWrite(
-	_In_ HANDLE				 handle, 
-	_In_ TRANSFERIOCTL TransferData
+	_In_ PVOID				Address, 
+	_In_ SIZE_T				 Length
 )
 {
-	BOOL				ret = FALSE;
 	CString						err;
 	UCHAR			 	  value = 0;
 	ULONG			 oldProtect = 0;
 
-	do {
+	const auto start = (ULONG_PTR)PAGE_ALIGN(Address);
+	const auto end = (ULONG_PTR)Address + Length;
+	for (auto page = start; page < end; page += PAGE_SIZE)
+	{
 		// Start Wipe
-		if (!VirtualProtectEx(handle, (LPVOID)TransferData.Address, sizeof(value), PAGE_EXECUTE_WRITECOPY, &oldProtect))
+		if (!VirtualProtect((LPVOID)page, sizeof(value), PAGE_EXECUTE_WRITECOPY, &oldProtect))
 		{
 			err.Format(L"VirtualProtect1 - LastError: %d \r\n", GetLastError());
 			OutputDebugString(err);
-			break;
+			return FALSE;
 		}
 		//Read an original value
-		if (!ReadProcessMemory(handle, (LPVOID)TransferData.Address, &value, sizeof(value), NULL))
+		if (!ReadProcessMemory(GetCurrentProcess(), (LPVOID)page, &value, sizeof(value), NULL))
 		{
 			err.Format(L"ReadProcessMemory - LastError: %d \r\n", GetLastError());
 			OutputDebugString(err);
-			break;
+			VirtualProtect((LPVOID)page, sizeof(value), oldProtect, &oldProtect);
+			return FALSE;
 		}
 
 		//Wipe a Copy on Write, write a value, System will create a page for me
-		if (!WriteProcessMemory(handle, (PVOID)TransferData.Address, &value, 1, NULL))
+		if (!WriteProcessMemory(GetCurrentProcess(), (PVOID)page, &value, sizeof(value), NULL))
 		{
 			err.Format(L"WriteProcessMemory  - LastError: %d \r\n", GetLastError()); 
 			OutputDebugString(err);
-			VirtualProtectEx(handle, (LPVOID)TransferData.Address, sizeof(value), oldProtect, NULL);
-			break;
+			VirtualProtect((LPVOID)page, sizeof(value), oldProtect, &oldProtect);
+			return FALSE;
 		}
 
 		// Stop Wipe
-		if (!VirtualProtectEx(handle, (LPVOID)TransferData.Address, sizeof(value), oldProtect, &oldProtect))
+		if (!VirtualProtect((LPVOID)page, sizeof(value), oldProtect, &oldProtect))
 		{ 
-			err.Format(L"VirtualProtectEx  - LastError: %d \r\n", GetLastError());
+			err.Format(L"VirtualProtect2 - LastError: %d \r\n", GetLastError());
 			OutputDebugString(err);
-			break; 
+			return FALSE; 
 		}
-
-		err.Format(L"[NOTEPAD]ProcID: %x Address1: %X oldValue : %X \r\n", TransferData.ProcID, TransferData.Address, value);
-		OutputDebugString(err);
-
-		ret = TRUE;
-
-	} while (false);
-
-	return ret;
+	}
+	return TRUE;
 }
-
 //--------------------------------------------------------------------------------------------// 
 template <typename T>
 static T  FindOrignal(T handler , HOOKOBJ* g_HookObj)
@@ -370,37 +367,26 @@ ULONG DumpExecptionCode(ULONG exception)
 
 
 //----------------------------------------------//
-DWORD WINAPI ExecuteThread(PVOID Param)
+// Calls the hooked function once; the handler runs when the hook is in place
+static void CheckExecute()
 {
-	ULONG  Hash;
-	while (1)
-	{ 
-		__try {
-			g_NtCreateThread(0, 0, 0, 0, 0, 0, 0, 0);
-		}
-		__except (DumpExecptionCode(GetExceptionCode()))
-		{
+	__try {
+		g_NtCreateThread(0, 0, 0, 0, 0, 0, 0, 0);
+		OutputDebugStringA("Execute: OK \r\n");
+	}
+	__except (DumpExecptionCode(GetExceptionCode()))
+	{
 
-		}
-		Sleep(1000);
 	}
-	return 0;
 }
 //----------------------------------------------//
-DWORD WINAPI CheckSumThread(PVOID Param)
+// Reads the hooked function once; it should still read unpatched bytes
+static void CheckSum()
 {
-	CString str; 
-	ULONG  Hash;
- 
-	while (1)
-	{
-		ULONG value = 0;
-		value = *(PULONG)g_NtCreateThread;
-		str.Format(L"value: %x \r\n", value); 
-		OutputDebugString(str);
-		Sleep(1000);
-	}
-	return 0;
+	CString str;
+	ULONG value = *(PULONG)g_NtCreateThread;
+	str.Format(L"value: %x \r\n", value);
+	OutputDebugString(str);
 }
 //--------------------------------------------------------------------------------------------//
 BOOLEAN InitHiddenSystem()
@@ -445,7 +431,7 @@ BOOLEAN AddNodeToHiddenSystem(ULONG64 HookAddress)
 	TRANSFERIOCTL	   transferData2 = 
 	{ 
 		GetCurrentProcessId() ,
-		0 , 
+		HIDE_FLAG_SKIP_PRIVATE , 
 		(ULONG64)HookAddress
 	};
 
@@ -460,28 +446,71 @@ BOOLEAN AddNodeToHiddenSystem(ULONG64 HookAddress)
 		return TRUE;
 	} 
 
-	//Wipe the COW
-	if (!WipeCopyOnWrite(GetCurrentProcess(), transferData2))
+	// Add a new hidden node into kernel, each page per node. The driver makes
+	// the page private to this process before hiding it, except for a read-only
+	// page on Windows 7, which is made private here and retried.
+	if (!drv.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD, &transferData2, sizeof(TRANSFERIOCTL), NULL, 0, &RetBytes) &&
+		(GetLastError() != ERROR_NOT_SUPPORTED ||
+		 !WipeCopyOnWrite((PVOID)HookAddress, 1) ||
+		 !drv.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD, &transferData2, sizeof(TRANSFERIOCTL), NULL, 0, &RetBytes)))
 	{
 		drv.Stop(SERVICE_NAME);
 		drv.Remove(SERVICE_NAME);
-		OutputDebugStringA("Wiped Copy-On-Write Failed \r\n"); 
+		OutputDebugStringA("IOCTL_HIDE_ADD Failed \r\n"); 
 		return FALSE;
 	}
 
-	// Add a new hidden node into kernel, each page per node.
-	if (!drv.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD, &transferData2, sizeof(TRANSFERIOCTL), NULL, 0, &RetBytes))
+	g_PageBaseVector.push_back(PAGE_ALIGN(transferData2.Address));
+
+	return TRUE;
+} 
+//--------------------------------------------------------------------------------------------//
+// Hides all pages in [Address, Address + Length) of this process, e.g. a whole module, with a
+// single IOCTL_HIDE_ADD_BULK instead of one IOCTL_HIDE_ADD per page.
+EXTERN_C BOOLEAN __stdcall HideRange(PVOID Address, SIZE_T Length)
+{
+	ULONG					RetBytes = 0;
+	NTSTATUS				 status = -1;
+	HIDE_BULK_ENTRY			  entry = 
+	{
+		GetCurrentProcessId() , 
+		(ULONG64)Address , 
+		(ULONG64)Length , 
+		HIDE_FLAG_SKIP_PRIVATE
+	};
+
+	if (!Address || !Length)
 	{
-		drv.Stop(SERVICE_NAME);
-		drv.Remove(SERVICE_NAME);
-		OutputDebugStringA("IOCTL_HIDE_ADD Failed \r\n"); 
 		return FALSE;
 	}
 
-	g_PageBaseVector.push_back(PAGE_ALIGN(transferData2.Address));
+	const auto start = (ULONG_PTR)PAGE_ALIGN(Address);
+	const auto end = (ULONG_PTR)Address + Length;
 
+	// One entry covers the whole range; the driver returns a status per entry
+	// and makes pages private to this process before hiding them, except for
+	// read-only pages on Windows 7, which are made private here and retried.
+	if (drv.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD_BULK, &entry, sizeof(entry), &status, sizeof(status), &RetBytes) &&
+		RetBytes == sizeof(status) && status == HIDE_STATUS_NOT_SUPPORTED &&
+		WipeCopyOnWrite(Address, Length))
+	{
+		drv.IoControl("\\\\.\\NoTruth", IOCTL_HIDE_ADD_BULK, &entry, sizeof(entry), &status, sizeof(status), &RetBytes);
+	}
+	if (RetBytes != sizeof(status) || status < 0)
+	{
+		OutputDebugStringA("IOCTL_HIDE_ADD_BULK Failed \r\n");
+		return FALSE;
+	}
+
+	for (auto page = start; page < end; page += PAGE_SIZE)
+	{
+		if (std::find(g_PageBaseVector.cbegin(), g_PageBaseVector.cend(), (PVOID)page) == g_PageBaseVector.cend())
+		{
+			g_PageBaseVector.push_back((PVOID)page);
+		}
+	}
 	return TRUE;
-} 
+}
 void __stdcall HelloWorld()
 {
 	printf("InitHiddenSystem Failed \r\n");
@@ -519,11 +548,10 @@ void CVTxRing3Dlg::OnBnClickedOk()
 
 	SetupInlineHook_X64(&g_HookObj, g_NtCreateThread, MyNtCreateThread);
 
-	for (int i = 0; i < 10; i++)
-	{
-		CreateThread(0, 0, (LPTHREAD_START_ROUTINE)CheckSumThread, 0, 0, 0);
-		CreateThread(0, 0, (LPTHREAD_START_ROUTINE)ExecuteThread, 0, 0, 0);
-	}
+	// A single pass only checks that the hook works while it is hidden.
+	// Use HideBench to measure access latencies of hidden pages.
+	CheckSum();
+	CheckExecute();
 }
 
 //-------------------------------------------------------------------------------------------------------//
@@ -169,6 +169,8 @@ BOOL cDrvCtrl::Start(
 BOOL cDrvCtrl::Stop(
 	_In_ PCHAR pServiceName)
 {
+	// The driver cannot be unloaded while the device is open
+	Close();
 	if (!StopService(pServiceName))
 	{
 		LOG_LAST_ERROR();
@@ -190,25 +192,153 @@ BOOL cDrvCtrl::Remove(
 } 
 
 //----------------------------------------------------------------------------------//
+// Opens the device for overlapped I/O and associates it with a completion port.
+// Does nothing when the device is already open.
+BOOL cDrvCtrl::Open(
+	_In_ PCHAR SymbolicName)
+{
+	if (m_hDriver != INVALID_HANDLE_VALUE)
+	{
+		if (strcmp(m_szSymbolicName, SymbolicName) == 0)
+		{
+			return TRUE;
+		}
+		Close();
+	}
+
+	m_hDriver = CreateFileA(SymbolicName, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, 0);
+	if (m_hDriver == INVALID_HANDLE_VALUE)
+	{
+		LOG_LAST_ERROR();
+		return FALSE;
+	}
+
+	m_hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_hPort = CreateIoCompletionPort(m_hDriver, NULL, 0, 1);
+	if (!m_hEvent || !m_hPort)
+	{
+		LOG_LAST_ERROR();
+		Close();
+		return FALSE;
+	}
+
+	strcpy_s(m_szSymbolicName, SymbolicName);
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------------//
+// Cancels outstanding requests and closes the device
+void cDrvCtrl::Close()
+{
+	if (m_hDriver != INVALID_HANDLE_VALUE && m_dwPending)
+	{
+		// Requests are freed once their completions are dequeued
+		CancelIoEx(m_hDriver, NULL);
+		while (m_dwPending && WaitIoControl(NULL, NULL, NULL, INFINITE))
+		{
+		}
+	}
+
+	if (m_hPort)
+	{
+		CloseHandle(m_hPort);
+		m_hPort = NULL;
+	}
+	if (m_hEvent)
+	{
+		CloseHandle(m_hEvent);
+		m_hEvent = NULL;
+	}
+	if (m_hDriver != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(m_hDriver);
+		m_hDriver = INVALID_HANDLE_VALUE;
+	}
+	m_dwPending = 0;
+	m_szSymbolicName[0] = '\0';
+}
+
+//----------------------------------------------------------------------------------//
+// Issues a request and waits for it. The device is opened on the first call and
+// reused afterwards.
 BOOL cDrvCtrl::IoControl(PCHAR SymbolicNames, DWORD dwIoCode, PVOID InBuff, DWORD InBuffLen, PVOID OutBuff, DWORD OutBuffLen, DWORD *RealRetBytes)
 {
-	DWORD dw;
+	DWORD dw = 0;
 	BOOL   b;
-	HANDLE hDriver = CreateFileA(SymbolicNames, GENERIC_READ | GENERIC_WRITE, 0, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
-	if(!hDriver)
+	if (!Open(SymbolicNames))
 	{ 
 		return FALSE;
 	}
 
-	b = DeviceIoControl(hDriver, dwIoCode, InBuff, InBuffLen, OutBuff, OutBuffLen, &dw, NULL);
+	// The low-order bit of the event keeps the completion off the port, so that
+	// it is not taken as one of requests issued by IoControlAsync()
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = (HANDLE)((ULONG_PTR)m_hEvent | 1);
+	b = DeviceIoControl(m_hDriver, dwIoCode, InBuff, InBuffLen, OutBuff, OutBuffLen, NULL, &overlapped);
+	if (b || GetLastError() == ERROR_IO_PENDING)
+	{
+		b = GetOverlappedResult(m_hDriver, &overlapped, &dw, TRUE);
+	}
 
 	if (RealRetBytes)
 		*RealRetBytes = dw;
 
-	CloseHandle(hDriver);
 	return b;
 }
 
+//----------------------------------------------------------------------------------//
+// Issues a request without waiting for it. Buffers must be valid until its
+// completion is returned by WaitIoControl() with Context.
+BOOL cDrvCtrl::IoControlAsync(DWORD dwIoCode, PVOID InBuff, DWORD InBuffLen, PVOID OutBuff, DWORD OutBuffLen, ULONG_PTR Context)
+{
+	if (m_hDriver == INVALID_HANDLE_VALUE)
+	{
+		SetLastError(ERROR_INVALID_HANDLE);
+		return FALSE;
+	}
+
+	const auto request = new DrvRequest();
+	request->Context = Context;
+
+	// A request failed without being pending is not queued to the port
+	if (!DeviceIoControl(m_hDriver, dwIoCode, InBuff, InBuffLen, OutBuff, OutBuffLen, NULL, &request->Overlapped) &&
+		GetLastError() != ERROR_IO_PENDING)
+	{
+		delete request;
+		return FALSE;
+	}
+
+	m_dwPending++;
+	return TRUE;
+}
+
+//----------------------------------------------------------------------------------//
+// Waits for completion of any request issued by IoControlAsync(). Returns FALSE
+// on timeout; otherwise, Error receives a result of the request.
+BOOL cDrvCtrl::WaitIoControl(ULONG_PTR *Context, DWORD *RealRetBytes, DWORD *Error, DWORD Timeout)
+{
+	DWORD		 bytes = 0;
+	ULONG_PTR		key = 0;
+	LPOVERLAPPED overlapped = NULL;
+	const auto succeeded = GetQueuedCompletionStatus(m_hPort, &bytes, &key, &overlapped, Timeout);
+	if (!overlapped)
+	{
+		return FALSE;
+	}
+
+	const auto request = CONTAINING_RECORD(overlapped, DrvRequest, Overlapped);
+	m_dwPending--;
+	if (Context)
+		*Context = request->Context;
+	if (RealRetBytes)
+		*RealRetBytes = bytes;
+	if (Error)
+		*Error = (succeeded) ? ERROR_SUCCESS : GetLastError();
+
+	delete request;
+	return TRUE;
+}
+
 DWORD cDrvCtrl::CTL_CODE_GEN(DWORD lngFunction)
 {
 	return (FILE_DEVICE_UNKNOWN * 65536) | (FILE_ANY_ACCESS * 16384) | (lngFunction * 4) | METHOD_BUFFERED;
@@ -1,5 +1,16 @@
 #include "Windows.h"
 #include <winsvc.h>
+
+// An overlapped request issued by cDrvCtrl::IoControlAsync()
+struct DrvRequest
+{
+	OVERLAPPED Overlapped;
+	ULONG_PTR  Context;
+};
+
+// A session to a driver. The device is opened once and kept open until Close()
+// or Stop(), and requests can be issued without waiting for each of them.
+// A session is not thread-safe.
 class cDrvCtrl
 {
 public:
@@ -11,12 +22,16 @@ public:
 		m_hSCManager = NULL;
 		m_hService = NULL;
 		m_hDriver = INVALID_HANDLE_VALUE;
+		m_hEvent = NULL;
+		m_hPort = NULL;
+		m_dwPending = 0;
+		m_szSymbolicName[0] = '\0';
 	}
 	~cDrvCtrl()
 	{
+		Close();
 		CloseServiceHandle(m_hService);
 		CloseServiceHandle(m_hSCManager);
-		CloseHandle(m_hDriver);
 	}
 public:
 	DWORD m_dwLastError;
@@ -24,6 +39,10 @@ public:
 	PWCHAR m_pServiceName;
 	PCHAR m_pDisplayName;
 	HANDLE m_hDriver;
+	HANDLE m_hEvent;
+	HANDLE m_hPort;
+	DWORD m_dwPending;
+	CHAR m_szSymbolicName[MAX_PATH];
 	SC_HANDLE m_hSCManager;
 	SC_HANDLE m_hService;
 public:
@@ -31,7 +50,12 @@ public:
 	BOOL Start(PCHAR pSysPath);
 	BOOL Stop(PCHAR pSysPath);
 	BOOL Remove(PCHAR pSysPath);
+	BOOL Open(PCHAR SymbolicName);
+	void Close();
 	BOOL IoControl(PCHAR SymbolicName, DWORD dwIoCode, PVOID InBuff, DWORD InBuffLen, PVOID OutBuff, DWORD OutBuffLen, DWORD *RealRetBytes);
+	BOOL IoControlAsync(DWORD dwIoCode, PVOID InBuff, DWORD InBuffLen, PVOID OutBuff, DWORD OutBuffLen, ULONG_PTR Context);
+	BOOL WaitIoControl(ULONG_PTR *Context, DWORD *RealRetBytes, DWORD *Error, DWORD Timeout);
+	DWORD GetPendingCount() const { return m_dwPending; }
 private:
 	DWORD CTL_CODE_GEN(DWORD lngFunction);
 protected: